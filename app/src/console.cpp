@@ -91,11 +91,21 @@ static const wxCmdLineEntryDesc cmdLineDesc[] =
     { wxCMD_LINE_OPTION, "p", "sunshape", "Enable sunshape (=1)", wxCMD_LINE_VAL_NUMBER},
     { wxCMD_LINE_OPTION, "e", "error", "Enable optical error (=1)", wxCMD_LINE_VAL_NUMBER},
     { wxCMD_LINE_OPTION, "t", "tower", "Run as power tower (=1)", wxCMD_LINE_VAL_NUMBER},
-    { wxCMD_LINE_OPTION, "o", "out", "File to write ray data", wxCMD_LINE_VAL_STRING},
+    { wxCMD_LINE_OPTION, "q", "sobol", "Sample sun rays from scrambled Sobol points (=0)", wxCMD_LINE_VAL_NUMBER},
+    { wxCMD_LINE_OPTION, "j", "stratify", "Sample sun rays stratified over the field zones (=0)", wxCMD_LINE_VAL_NUMBER},
+    { wxCMD_LINE_OPTION, "w", "weighted", "Trace weighted rays that carry power through every interaction (=0)", wxCMD_LINE_VAL_NUMBER},
+    { wxCMD_LINE_OPTION, "v", "converge", "Trace batches of rays until the intercept factor and the absorbed power of the reported elements are within this relative error (=0, off)", wxCMD_LINE_VAL_DOUBLE},
+    { wxCMD_LINE_OPTION, "b", "budget", "Time budget in seconds for -v (=0, none)", wxCMD_LINE_VAL_DOUBLE},
+    { wxCMD_LINE_OPTION, "o", "out", "File to write ray data (.csv, .stcol or .parquet)", wxCMD_LINE_VAL_STRING},
     { wxCMD_LINE_OPTION, "x", "nbinx", "Number of flux bins in X", wxCMD_LINE_VAL_NUMBER},
     { wxCMD_LINE_OPTION, "y", "nbiny", "Number of flux bins in Y", wxCMD_LINE_VAL_NUMBER},
     { wxCMD_LINE_OPTION, "z", "final", "Report final rays only (=1)", wxCMD_LINE_VAL_NUMBER},
     { wxCMD_LINE_OPTION, "d", "dni", "DNI [kW/m2] (=1)", wxCMD_LINE_VAL_NUMBER},
+    { wxCMD_LINE_OPTION, "k", "keep", "Ray data to keep: all, final, elements, none (=all)", wxCMD_LINE_VAL_STRING},
+    { wxCMD_LINE_OPTION, "a", "shard", "Trace only rays a to b-1 of the run, given as a:b, and write a partial result (-o file.stshard)", wxCMD_LINE_VAL_STRING},
+    { wxCMD_LINE_OPTION, "g", "merge", "Merge the partial results matching a file pattern instead of tracing", wxCMD_LINE_VAL_STRING},
+    { wxCMD_LINE_OPTION, "u", "save-stage1", "Save the rays leaving stage 1 to replay files for -l", wxCMD_LINE_VAL_STRING},
+    { wxCMD_LINE_OPTION, "l", "replay-stage1", "Trace stage 2 onwards from the replay files saved with -u", wxCMD_LINE_VAL_STRING},
 
     { wxCMD_LINE_PARAM, 0, 0, "Stage.element number(s) for data reporting", wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_MULTIPLE},
     { wxCMD_LINE_NONE }
@@ -116,6 +126,11 @@ int main(int argc, char **argv)
     wxString fname = ""; //"C:/Users/mwagner/Documents/NREL/projects/SolTrace-git/app/deploy/x64/A1.stinput";
     wxString fnout = ""; //trace.out";
     wxString fnsum = "";
+    wxString keep = "all";
+    wxString shard = "";
+    wxString merge = "";
+    wxString replay_save = "";
+    wxString replay_from = "";
     long rays = (int)1e4;
     long maxrays = 100*rays;
     long threads = 16;
@@ -123,6 +138,11 @@ int main(int argc, char **argv)
     long l_sunshape = 1;
     long l_error = 1;
     long l_tower = 1;
+    long l_sobol = 0;
+    long l_stratify = 0;
+    long l_weighted = 0;
+    double converge = 0.;
+    double budget = 0.;
     long l_nbinx=20;
     long l_nbiny=20;
     long l_final = 1;
@@ -145,7 +165,26 @@ int main(int argc, char **argv)
             "$ soltrace_cmd -f \"C:\\Another\\project with\\spaces.stinput\" -o \"C:\\Another\\project with\\output.csv\" 1.1\n"
             ".. this can be interpreted as \"run soltrace file spaces.stinput, and output\n"
             "a ray data file 'output.csv' at the specified paths, and save data for stage\n"
-            " 1 element 1.\""
+            " 1 element 1.\"\n\n"
+            "A large run can be split over several processes or machines:\n"
+            "$ soltrace_cmd -f MyProject.stinput -r 1000000 -s 42 -a 0:500000 -o part1.stshard\n"
+            "$ soltrace_cmd -f MyProject.stinput -r 1000000 -s 42 -a 500000:1000000 -o part2.stshard\n"
+            "$ soltrace_cmd -f MyProject.stinput -g \"part*.stshard\" -o output.csv 2.1\n"
+            ".. each of the first two traces half of the rays, and the last merges the\n"
+            "partial results and reports on them as if they came from a single run.\n"
+            "All shards of a run need the same project, options and seed.\n\n"
+            "Changes to the later stages can be traced without the first one:\n"
+            "$ soltrace_cmd -f Field.stinput -r 1000000 -u field.streplay\n"
+            "$ soltrace_cmd -f Receiver2.stinput -l field.streplay 2.1\n"
+            ".. the first saves the rays leaving stage 1 (one file per thread), and\n"
+            "the second traces only stage 2 onwards from them.  The number of threads\n"
+            "and rays comes from the replay files, and stage 1 must be the same in\n"
+            "both projects.\n\n"
+            "A trace can run until its results have converged:\n"
+            "$ soltrace_cmd -f MyProject.stinput -r 10000 -v 0.001 -b 600 2.1\n"
+            ".. traces batches of 10,000 rays until the intercept factor and the\n"
+            "power absorbed on stage 2 element 1 are known to 0.1% (one standard\n"
+            "error), or for at most 10 minutes, and reports what it reached."
             );
 
         return 0;
@@ -168,10 +207,20 @@ int main(int argc, char **argv)
     parser.Found("p", &l_sunshape);
     parser.Found("e", &l_error);
     parser.Found("t", &l_tower);
+    parser.Found("q", &l_sobol);
+    parser.Found("j", &l_stratify);
+    parser.Found("w", &l_weighted);
+    parser.Found("v", &converge);
+    parser.Found("b", &budget);
     parser.Found("x", &l_nbinx);
     parser.Found("y", &l_nbiny);
     parser.Found("z", &l_final);
     parser.Found("d", &dni);
+    parser.Found("k", &keep);
+    parser.Found("a", &shard);
+    parser.Found("g", &merge);
+    parser.Found("u", &replay_save);
+    parser.Found("l", &replay_from);
 
             
     if( parser.Found("o", &fnout) )
@@ -213,6 +262,12 @@ int main(int argc, char **argv)
     project.Read( fp_in );
     
     fclose(fp_in); 
+
+    // relative surface file names are found next to the input file, or in the current folder
+    wxFileName input( fname );
+    input.MakeAbsolute();
+    project.SearchDirs.Add( input.GetPath() );
+    project.SearchDirs.Add( wxGetCwd() );
     
     //type conversion
     int seed = (int)l_seed;
@@ -222,75 +277,200 @@ int main(int argc, char **argv)
     int nbinx = (int)l_nbinx;
     int nbiny = (int)l_nbiny;
     bool final = l_final == 1L;
+    project.RaySampling = l_sobol == 1L ? ST_SAMPLE_SOBOL : ST_SAMPLE_RANDOM;
+    if( l_stratify == 1L )
+    {
+        if( l_sobol == 1L )
+        {
+            wxPrintf("\nSobol (-q) and stratified (-j) sampling can't be combined.");
+            return 0;
+        }
+        project.RaySampling = ST_SAMPLE_STRATIFIED;
+    }
+    project.RayWeighted = l_weighted == 1L;
+
+    // records that are not needed for the output are never stored by the trace
+    keep.MakeLower();
+    if( keep == "final" )
+        project.RayRetention = ST_RETAIN_FINAL;
+    else if( keep == "none" )
+        project.RayRetention = ST_RETAIN_NONE;
+    else if( keep == "elements" )
+    {
+        project.RayRetention = ST_RETAIN_SELECTED;
+        for( size_t i=0; i<parser.GetParamCount(); i++)
+        {
+            wxArrayString dat = wxSplit(parser.GetParam(i), '.');
+            if( dat.size() == 2 )
+                project.RetainSelection.push_back( std::make_pair( std::atoi(dat[0].c_str()), std::atoi(dat[1].c_str()) ) );
+        }
+    }
+    else if( keep != "all" )
+    {
+        wxPrintf("\nInvalid ray data retention '%s', expecting all, final, elements, or none.", keep.c_str());
+        return 0;
+    }
+
+    // a shard traces part of the rays of a run, from a stream of its own
+    long shard_first = 0, shard_last = rays;
+    if( !shard.IsEmpty() )
+    {
+        if( !shard.BeforeFirst(':').ToLong(&shard_first) || !shard.AfterFirst(':').ToLong(&shard_last)
+            || shard_first < 0 || shard_last <= shard_first || shard_last > rays )
+        {
+            wxPrintf("\nInvalid shard '%s', expecting a:b with 0 <= a < b <= rays.", shard.c_str());
+            return 0;
+        }
+
+        if( seed < 1 )
+        {
+            wxPrintf("\nA shard needs a fixed seed (-s), the same for all shards of the run.");
+            return 0;
+        }
+
+        if( !fnout.Lower().EndsWith(".stshard") )
+        {
+            wxPrintf("\nA shard needs a partial result file to write (-o file.stshard).");
+            return 0;
+        }
+    }
+
+    if( !replay_from.IsEmpty() && ( !shard.IsEmpty() || !merge.IsEmpty() ) )
+    {
+        wxPrintf("\nA stage 1 replay (-l) can't be combined with shards or merging.");
+        return 0;
+    }
+
+    // a converged run decides on its number of rays while tracing
+    if( converge < 0 || budget < 0 )
+    {
+        wxPrintf("\nInvalid convergence tolerance or time budget, expecting positive numbers.");
+        return 0;
+    }
+
+    if( converge > 0 )
+    {
+        if( !shard.IsEmpty() || !merge.IsEmpty() || !replay_from.IsEmpty() || !replay_save.IsEmpty() )
+        {
+            wxPrintf("\nA converged trace (-v) can't be combined with shards, merging or stage 1 replays.");
+            return 0;
+        }
+
+        project.ConvergeTolerance = converge;
+        project.ConvergeSeconds = budget;
+        project.ConvergeMetrics = ST_CONVERGE_INTERCEPT;
+        for( size_t i=0; i<parser.GetParamCount(); i++)
+        {
+            wxArrayString dat = wxSplit(parser.GetParam(i), '.');
+            if( dat.size() == 2 )
+                project.ConvergeElements.push_back( std::make_pair( std::atoi(dat[0].c_str()), std::atoi(dat[1].c_str()) ) );
+        }
+        if( project.ConvergeElements.size() > 0 )
+            project.ConvergeMetrics |= ST_CONVERGE_ABSORBED;
+        if( project.FluxTargets.size() > 0 )
+            project.ConvergeMetrics |= ST_CONVERGE_PEAK_FLUX;
+    }
+
+    // the options of the whole run, which all of its shards have in common
+    wxString settings = wxString::Format("rays=%ld;maxrays=%ld;seed=%d;sunshape=%d;opterr=%d;powertower=%d;sampling=%d;weighted=%d;retention=%d,%d",
+        rays, maxrays, seed, sunshape ? 1 : 0, error ? 1 : 0, tower ? 1 : 0, project.RaySampling,
+        project.RayWeighted ? 1 : 0, project.RayRetention, project.RaySampleEvery );
+    for( size_t i=0; i<project.RetainSelection.size(); i++ )
+        settings += wxString::Format(",%d.%d", project.RetainSelection[i].first, project.RetainSelection[i].second );
+    if( converge > 0 )
+        settings += wxString::Format(";converge=%lg,%lg", converge, budget);
 
     wxArrayString ref_errors;
+    std::vector< std::pair<int,int> > ranges;
+    int msec = 0;
+
+    if( !merge.IsEmpty() )
+    {
+        wxArrayString files;
+        wxString dir = wxPathOnly(merge);
+        wxDir::GetAllFiles( dir.IsEmpty() ? wxString(".") : dir, &files, wxFileNameFromPath(merge), wxDIR_FILES );
+        files.Sort();
 
-    //run the simulation here
-    int msec = RunTraceMultiThreaded( &project, 
-            (int)rays,
-			(int)maxrays,
-			threads,
-			&seed,
-			sunshape,
-			error,
-            tower,
-			ref_errors,
-            true);
+        wxPrintf("\nMerging %d partial results...", (int)files.size());
+        if( !project.MergeShards( files, &settings, &ranges, ref_errors ) )
+        {
+            wxPrintf( "\n" + wxJoin( ref_errors, '\n' ) );
+            return 0;
+        }
+
+        long covered = 0;
+        for( size_t i=0; i<ranges.size(); i++ )
+            covered += ranges[i].second - ranges[i].first;
+        wxPrintf("\nMerged %ld rays in %d ranges, %d sun rays.", covered, (int)ranges.size(), project.Results.SunRayCount);
+    }
+    else
+    {
+        //run the simulation here
+        int shard_seed = ShardSeed( seed, (int)shard_first );
+        msec = RunTraceMultiThreaded( &project, 
+                (int)(shard_last - shard_first),
+			    (int)maxrays,
+			    threads,
+			    &shard_seed,
+			    sunshape,
+			    error,
+                tower,
+			    ref_errors,
+                true,
+                replay_save,
+                replay_from);
+
+        // number the rays of a shard within the whole run
+        RayData &rd = project.Results;
+        if( shard_first > 0 )
+        {
+            for( size_t i=0; i<rd.Length; i++ )
+                rd.RayNumbers[i] += (int)shard_first;
+            rd.InvalidateIndex();
+        }
+
+        ranges.push_back( std::make_pair( (int)shard_first, (int)shard_last ) );
+
+        // the errors are one standard error, reported at 95% confidence
+        if( msec >= 0 && project.ConvergeBatches > 0 )
+        {
+            wxPrintf("\nTraced %d batches, %d sun rays.", project.ConvergeBatches, project.Results.SunRayCount);
+            static const char *names[3] = { "Intercept factor", "Absorbed power fraction", "Peak flux bin fraction" };
+            static const int metrics[3] = { ST_CONVERGE_INTERCEPT, ST_CONVERGE_ABSORBED, ST_CONVERGE_PEAK_FLUX };
+            for( int k=0; k<3; k++ )
+                if( project.ConvergeMetrics & metrics[k] )
+                    wxPrintf("\n%s %lg +/- %.3lg%% (95%% confidence)%s", names[k], project.ConvergeValue[k],
+                        196.0*project.ConvergeError[k], project.ConvergeError[k] <= converge ? "" : ", not converged" );
+        }
+    }
 
 
     //------------------------------------------------------------------------------
     if(! fnout.IsEmpty() )
     {
-        FILE *fp_out = fopen( fnout.c_str(), "w" );
-	    if ( !fp_out )
-	    {
-		    wxPrintf("Could not open file for writing:\n%s\n", fnout);
-		    return 0;
-	    }
-
         //create output
         if ( msec < 0 )
 		    wxPrintf( wxJoin( ref_errors, '\n' ) );
 
-        // by default, all ray data is in stage coordinates
+        // the format follows the file extension: .stshard for a partial
+        // result that can be merged later, .stcol, .parquet, or csv
 	    RayData &rd = project.Results;
-	
-	    int nwrite = rd.PrepareExport( RayData::COORD_GLOBAL, 0 );
-	
-	    // progress update every 0.5 %
-	    int nupdate = nwrite / 200;
-	    size_t nwr = 0;
-	    size_t bytes = 0;
-	
-	    double Pos[3], Cos[3];
-	    int Elm, Stg, Ray;
-
-	    fputs( "Pos X,Pos Y,Pos Z,Cos X,Cos Y,Cos Z,Element,Stage,Ray Number\n", fp_out );
-	    while( rd.GetNextExport( project, Pos, Cos, Elm, Stg, Ray ) )
-	    {
-
-		    int nb = fprintf( fp_out, "%lg,%lg,%lg,%lg,%lg,%lg,%d,%d,%d\n",
-			    Pos[0], Pos[1], Pos[2],
-			    Cos[0], Cos[1], Cos[2],
-			    Elm, Stg, Ray );
-
-		    if ( nb < 0 ) break; // file error, disk space issue?
-
-		    bytes += nb;
-		    nwr++;
-	    }
-
-	    if ( ferror( fp_out ) )
-		    wxPrintf(wxString("An error occurred exporting the CSV data file: ") + strerror(errno));
-    
-        fclose(fp_out);
+        if ( fnout.Lower().EndsWith(".stshard") )
+        {
+            if ( !project.WriteShard( fnout, settings, ranges ) )
+		        wxPrintf(wxString("An error occurred writing the partial result file: ") + strerror(errno));
+        }
+	    else if ( !rd.WriteExport( project, fnout, RayData::ExportFormat( fnout ), RayData::COORD_GLOBAL, 0 ) )
+		    wxPrintf(wxString("An error occurred exporting the ray data file: ") + strerror(errno));
     }
 
     //------------------------------------------------------------------------------
     size_t nelout = parser.GetParamCount();
     wxPrintf( "\nReporting %d elements...", (int)nelout );
     
-    std::vector<int> e_list;
+    // bin all of the requested elements together in one pass over the ray data
+    wxArrayString e_names;
+    std::vector<FluxRequest> e_list;
     for( size_t i=0; i<nelout; i++)
     {
         wxString pdat = parser.GetParam(i);
@@ -300,17 +480,34 @@ int main(int argc, char **argv)
             wxPrintf("\nInvalid stage.element argument number %d. Expecting two integers separated by period (e.g., 5.10), got %s.", (int)i+1, pdat.c_str());
             continue;
         }
-        int st = std::atoi(dat[0].c_str());
-        int el = std::atoi(dat[1].c_str());
 
-        ElementStatistics es(project);
-        double minx,miny,maxx,maxy;
-        if(! es.Compute(st, el, nbinx, nbiny, true, final, dni, minx, miny, maxx, maxy) )
+        FluxRequest req;
+        req.StageIdx = std::atoi(dat[0].c_str());
+        req.ElementIdx = std::atoi(dat[1].c_str());
+        req.NBinsX = nbinx;
+        req.NBinsY = nbiny;
+        req.AutoScale = true;
+        req.FinalOnly = final;
+        e_list.push_back( req );
+        e_names.Add( pdat );
+    }
+
+    std::vector<ElementStatistics> e_stats;
+    ElementStatistics::ComputeMany( project, e_list, dni, e_stats );
+
+    for( size_t i=0; i<e_list.size(); i++)
+    {
+        wxString pdat = e_names[i];
+        if(! e_list[i].Ok )
         {
             wxPrintf("\nError in flux map plot parameters for st/el %s", pdat.c_str());
             continue;
         }
 
+        ElementStatistics &es = e_stats[i];
+        double minx = e_list[i].MinX, maxx = e_list[i].MaxX;
+        double miny = e_list[i].MinY, maxy = e_list[i].MaxY;
+
 	    RayData &rd = project.Results;
 
         //open a new file for writing
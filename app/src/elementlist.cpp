@@ -63,7 +63,7 @@ wxString ElementItem::Label( Project &prj )
 		if (!e->Comment.IsEmpty()) name += e->Comment;
 		else name += wxString("Surf.'") + e->SurfaceIndex + wxString("'");
 
-		name += wxString::Format(" (%d hits)", e->RayHits);
+		name += wxString::Format(" (%lu hits)", (unsigned long)e->RayHits);
 		return name;
 	}
 	else
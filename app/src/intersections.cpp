@@ -68,6 +68,8 @@
 #include <wx/busyinfo.h>
 #include <wx/vlbox.h>
 #include <wx/renderer.h>
+#include <wx/thread.h>
+#include <wx/utils.h>
 
 #include <wex/numeric.h>
 
@@ -84,6 +86,12 @@ IntersectionViewer::IntersectionViewer( wxWindow *parent, Project &prj )
 	m_showAxes = true;
 	m_showTicks = true;
 	m_vertexListValid = false;
+	m_pointsCoordSys = -1;
+	m_drawReduced = false;
+
+	Bind( wxEVT_LEFT_UP, &IntersectionViewer::OnMouseUp, this );
+	Bind( wxEVT_MIDDLE_UP, &IntersectionViewer::OnMouseUp, this );
+	Bind( wxEVT_RIGHT_UP, &IntersectionViewer::OnMouseUp, this );
 
 	m_coordSys = RayData::COORD_GLOBAL;
 	m_pointColors = 0;
@@ -163,11 +171,221 @@ struct point_info
 	}
 };
 
+// level of detail for the point cloud
+static const size_t LOD_MIN_POINTS = 200000;
+static const size_t LOD_INTERACTIVE_POINTS = 1000000;
+static const double LOD_POINTS_PER_PIXEL = 4.0;
+
 struct ray_segment {
 	wxGLPoint3D point;
 	wxColour color;
 };
 
+class TransformThread : public wxThread
+{
+	Project &m_prj;
+	int m_coordSys;
+	size_t m_start, m_end;
+	float *m_points;
+
+public:
+	TransformThread( Project &prj, int coords, size_t start, size_t end, float *points )
+		: wxThread( wxTHREAD_JOINABLE ), m_prj( prj )
+	{
+		m_coordSys = coords;
+		m_start = start;
+		m_end = end;
+		m_points = points;
+	}
+
+	static void TransformRange( Project &prj, int coords, size_t start, size_t end, float *points )
+	{
+		double Pos[3], Cos[3];
+		int Elm, Stg, Ray;
+		for( size_t i=start;i<end;i++ )
+		{
+			prj.Results.Transform( prj, coords, i, Pos, Cos, Elm, Stg, Ray );
+			points[3*i] = (float)Pos[0];
+			points[3*i+1] = (float)Pos[1];
+			points[3*i+2] = (float)Pos[2];
+		}
+	}
+
+	virtual ExitCode Entry()
+	{
+		TransformRange( m_prj, m_coordSys, m_start, m_end, m_points );
+		return 0;
+	}
+};
+
+bool IntersectionViewer::TransformPoints()
+{
+	RayData &R = m_prj.Results;
+	if ( m_points.size() == 3*R.Length && m_pointsCoordSys == m_coordSys )
+		return true;
+
+	try {
+		m_points.resize( 3*R.Length );
+	} catch( std::exception &e )
+	{
+		wxMessageBox("Exception during generation of 3D intersection points: " + wxString(e.what()));
+		m_points.clear();
+		return false;
+	}
+	
+	// split the records over the cpus, each thread fills its own range
+	size_t nthreads = wxThread::GetCPUCount();
+	if ( nthreads < 1 || R.Length < 100000 ) nthreads = 1;
+
+	std::vector<TransformThread*> threads;
+	for( size_t t=0;t<nthreads;t++ )
+	{
+		size_t start = R.Length*t/nthreads, end = R.Length*(t+1)/nthreads;
+		TransformThread *thread = nthreads > 1
+			? new TransformThread( m_prj, m_coordSys, start, end, &m_points[0] ) : 0;
+		if ( thread && thread->Run() == wxTHREAD_NO_ERROR )
+			threads.push_back( thread );
+		else
+		{
+			// do the work here if the thread couldn't start
+			delete thread;
+			TransformThread::TransformRange( m_prj, m_coordSys, start, end, &m_points[0] );
+		}
+	}
+
+	for( size_t t=0;t<threads.size();t++ )
+	{
+		threads[t]->Wait();
+		delete threads[t];
+	}
+
+	m_pointsCoordSys = m_coordSys;
+	return true;
+}
+
+void IntersectionViewer::SortLevelOfDetail()
+{
+	// reorder the points so that any leading part of the arrays is a stratified
+	// subsample of the whole cloud with the same density: bin them on a coarse
+	// grid and spread the points of every cell evenly over the arrays, with a
+	// scattered offset per cell, so a leading fraction f of the arrays holds
+	// about f of the points of every cell.  cells are also visited in a
+	// scattered order so that a partly drawn range has no spatial bias
+	size_t n = m_drawPoints.size()/3;
+	if ( n < 2 ) return;
+
+	const size_t G = 64, ncells = G*G*G, stride = 40503; // odd, so it visits every cell
+	float span[3] = { m_max.x-m_min.x, m_max.y-m_min.y, m_max.z-m_min.z };
+	float lo[3] = { m_min.x, m_min.y, m_min.z };
+
+	std::vector<unsigned int> cell( n );
+	std::vector<size_t> cellStart( ncells+1, 0 );
+	for( size_t i=0;i<n;i++ )
+	{
+		size_t c = 0;
+		for( int d=2;d>=0;d-- )
+		{
+			size_t ic = span[d] > 0 ? (size_t)( (m_drawPoints[3*i+d]-lo[d])/span[d]*G ) : 0;
+			c = c*G + std::min( ic, G-1 );
+		}
+		cell[i] = (unsigned int)c;
+		cellStart[c+1]++;
+	}
+
+	for( size_t c=0;c<ncells;c++ )
+		cellStart[c+1] += cellStart[c];
+
+	std::vector<size_t> byCell( n );
+	std::vector<size_t> next( cellStart.begin(), cellStart.end()-1 );
+	for( size_t i=0;i<n;i++ )
+		byCell[ next[cell[i]]++ ] = i;
+
+	const size_t NSLOTS = 4096;
+	std::vector<size_t> slotStart( NSLOTS+1, 0 );
+	for( size_t c=0;c<ncells;c++ )
+	{
+		size_t count = cellStart[c+1]-cellStart[c];
+		for( size_t r=0;r<count;r++ )
+			slotStart[ (r*NSLOTS + (c*stride)%NSLOTS)/count + 1 ]++;
+	}
+
+	for( size_t k=0;k<NSLOTS;k++ )
+		slotStart[k+1] += slotStart[k];
+
+	std::vector<size_t> order( n );
+	for( size_t k=0;k<ncells;k++ )
+	{
+		size_t c = (k*stride) % ncells;
+		size_t count = cellStart[c+1]-cellStart[c];
+		for( size_t r=0;r<count;r++ )
+			order[ slotStart[ (r*NSLOTS + (c*stride)%NSLOTS)/count ]++ ] = byCell[ cellStart[c]+r ];
+	}
+
+	std::vector<float> points( 3*n );
+	std::vector<unsigned char> colors( 3*n );
+	for( size_t i=0;i<n;i++ )
+	{
+		for( size_t d=0;d<3;d++ )
+		{
+			points[3*i+d] = m_drawPoints[3*order[i]+d];
+			colors[3*i+d] = m_drawColors[3*order[i]+d];
+		}
+	}
+
+	m_drawPoints.swap( points );
+	m_drawColors.swap( colors );
+}
+
+size_t IntersectionViewer::PointBudget()
+{
+	size_t n = m_drawPoints.size()/3;
+
+	// estimate the screen area covered by the cloud from its bounding box
+	GLdouble mv[16], pr[16];
+	GLint vp[4];
+	glGetDoublev( GL_MODELVIEW_MATRIX, mv );
+	glGetDoublev( GL_PROJECTION_MATRIX, pr );
+	glGetIntegerv( GL_VIEWPORT, vp );
+
+	double xmin = 1e99, xmax = -1e99, ymin = 1e99, ymax = -1e99;
+	for( int corner=0;corner<8;corner++ )
+	{
+		double v[4] = { corner&1 ? m_max.x : m_min.x,
+			corner&2 ? m_max.y : m_min.y,
+			corner&4 ? m_max.z : m_min.z, 1.0 };
+		double e[4], c[4];
+		for( int r=0;r<4;r++ )
+			e[r] = mv[r]*v[0] + mv[4+r]*v[1] + mv[8+r]*v[2] + mv[12+r]*v[3];
+		for( int r=0;r<4;r++ )
+			c[r] = pr[r]*e[0] + pr[4+r]*e[1] + pr[8+r]*e[2] + pr[12+r]*e[3];
+
+		if ( c[3] <= 0 ) return n; // the camera is inside the cloud
+
+		double x = (c[0]/c[3]+1)*0.5*vp[2], y = (c[1]/c[3]+1)*0.5*vp[3];
+		xmin = std::min( xmin, x ); xmax = std::max( xmax, x );
+		ymin = std::min( ymin, y ); ymax = std::max( ymax, y );
+	}
+
+	// a few points per pixel already look solid, more are only drawn when
+	// the view is close in.  while the mouse is dragging the view the
+	// count is capped so that it follows smoothly
+	double budget = std::max( (double)LOD_MIN_POINTS, LOD_POINTS_PER_PIXEL*(xmax-xmin)*(ymax-ymin) );
+	wxMouseState ms = wxGetMouseState();
+	if ( ms.LeftIsDown() || ms.MiddleIsDown() || ms.RightIsDown() )
+		budget = std::min( budget, (double)LOD_INTERACTIVE_POINTS );
+
+	return budget < (double)n ? (size_t)budget : n;
+}
+
+void IntersectionViewer::OnMouseUp( wxMouseEvent &evt )
+{
+	// draw the full density again once the view stops moving
+	if ( m_drawReduced )
+		Refresh( false );
+
+	evt.Skip();
+}
+
 void IntersectionViewer::RebuildGeometry( ElementListBox *lb )
 {
 	wxBusyInfo info("Building 3D intersection point view...", this);
@@ -180,6 +398,8 @@ void IntersectionViewer::RebuildGeometry( ElementListBox *lb )
 	RayData &R = m_prj.Results;
 	size_t len = R.Length;
 	if ( len == 0 ) return;
+
+	if ( !TransformPoints() ) return;
 			
 	// create new GL call list
 	if ( !m_vertexListValid )
@@ -188,126 +408,103 @@ void IntersectionViewer::RebuildGeometry( ElementListBox *lb )
 		m_vertexListValid = true;
 	}
 	
-	// recreate the vertex call list
-	glNewList( m_vertexListId, GL_COMPILE );	
-	
-	glColor3f( 0, 0, 0 );
-	glBegin( GL_POINTS );
-
 	m_nplotted = 0;
 	m_centroid[0] = m_centroid[1] = m_centroid[2] = 0.0;
+	m_drawPoints.clear();
+	m_drawColors.clear();
 
-	// store the last point for the ray line plots
-	std::vector< std::vector<ray_segment> > rays;
-	if ( m_rayNumbers.size() > 0 )
-		rays.resize( m_rayNumbers.size(), std::vector<ray_segment>() ); 
-
-	int last_stage = -1;
-	int last_elem = -1;
-	wxColour cur_color( *wxBLACK );
-	wxColour last_color( *wxWHITE );
 	m_min = wxGLPoint3D( 1e31f, 1e31f, 1e31f );
 	m_max = wxGLPoint3D( -1e31f, -1e31f, -1e31f );
 	
 	// make list of all points to draw
+	wxColour cur_color( *wxBLACK );
 	for( size_t i=0;i<len;i++ )
 	{
 		int istage = R.StageMap[i]-1;
 		int ielem = abs(R.ElementMap[i])-1;
-		bool absorbed = ( R.ElementMap[i] < 0 );
 
-		bool selected = (lb && lb->IsSelected( istage, ielem ));
-		
-		if ( R.Transform( m_prj, m_coordSys, i, Pos, Cos, Elm, Stg, Ray ) )
-		{
-			if ( selected )
-			{
-				if ( m_pointColors == 1 )
-					cur_color = m_colorList[ ((size_t)istage) % m_colorList.size() ];
-				else if ( m_pointColors == 2 )
-					cur_color = m_colorList[ ((size_t)ielem) % m_colorList.size() ];
-				else
-					cur_color = *wxBLACK;
+		if ( !lb || !lb->IsSelected( istage, ielem ) )
+			continue;
 
-				if ( cur_color != last_color )
-					Color( cur_color );
+		if ( m_pointColors == 1 )
+			cur_color = m_colorList[ ((size_t)istage) % m_colorList.size() ];
+		else if ( m_pointColors == 2 )
+			cur_color = m_colorList[ ((size_t)ielem) % m_colorList.size() ];
+		else
+			cur_color = *wxBLACK;
+
+		const float *P = &m_points[3*i];
+		m_drawPoints.push_back( P[0] );
+		m_drawPoints.push_back( P[1] );
+		m_drawPoints.push_back( P[2] );
+		m_drawColors.push_back( cur_color.Red() );
+		m_drawColors.push_back( cur_color.Green() );
+		m_drawColors.push_back( cur_color.Blue() );
+
+		if ( P[0] < m_min.x ) m_min.x = P[0];
+		if ( P[0] > m_max.x ) m_max.x = P[0];
+
+		if ( P[1] < m_min.y ) m_min.y = P[1];
+		if ( P[1] > m_max.y ) m_max.y = P[1];
+
+		if ( P[2] < m_min.z ) m_min.z = P[2];
+		if ( P[2] > m_max.z ) m_max.z = P[2];
+
+		m_centroid[0] += P[0];
+		m_centroid[1] += P[1];
+		m_centroid[2] += P[2];
+		m_nplotted++;
+	}
 
-				glVertex3f( (float)Pos[0], (float)Pos[1], (float)Pos[2] );
+	SortLevelOfDetail();
 
-				if ( ((float)Pos[0]) < m_min.x ) m_min.x = (float)Pos[0];
-				if ( ((float)Pos[0]) > m_max.x ) m_max.x = (float)Pos[0];
-		
-				if ( ((float)Pos[1]) < m_min.y ) m_min.y = (float)Pos[1];
-				if ( ((float)Pos[1]) > m_max.y ) m_max.y = (float)Pos[1];
-			
-				if ( ((float)Pos[2]) < m_min.z ) m_min.z = (float)Pos[2];
-				if ( ((float)Pos[2]) > m_max.z ) m_max.z = (float)Pos[2];
-			
-				m_centroid[0] += Pos[0];
-				m_centroid[1] += Pos[1];
-				m_centroid[2] += Pos[2];
-				m_nplotted++;
-				
-				last_stage = istage;
-				last_elem = ielem;
-				last_color = cur_color;
-			}
+	// the call list only holds the ray paths, the points are drawn from the arrays
+	glNewList( m_vertexListId, GL_COMPILE );	
 
-			if ( m_rayNumbers.size() > 0 
-				&& ( Elm != 0
-					|| (Elm == 0 && m_includeMissedRays) ) )
+	// ray paths are looked up by ray number, so only their own records are visited
+	for( size_t k=0;k<m_rayNumbers.size();k++ )
+	{
+		size_t count = 0;
+		const size_t *records = R.GetRayRecords( m_rayNumbers[k], &count );
+
+		std::vector<ray_segment> rays;
+		for( size_t j=0;j<count;j++ )
+		{
+			R.Transform( m_prj, m_coordSys, records[j], Pos, Cos, Elm, Stg, Ray );
+			if ( Elm == 0 && !m_includeMissedRays )
+				continue;
+
+			if ( rays.size() == 0 )
 			{
-				for( size_t k=0;k<m_rayNumbers.size();k++ )
-				{
-					if ( m_rayNumbers[k] == Ray ) 
-					{
-						if ( rays[k].size() == 0 )
-						{
-							ray_segment rs;
-							rs.point.x = (float)(Pos[0] - Cos[0]*20.0);
-							rs.point.y = (float)(Pos[1] - Cos[1]*20.0);
-							rs.point.z = (float)(Pos[2] - Cos[2]*20.0);
-							rs.color = Elm==0 ? *wxRED : wxColour(255,192,0);
-							rays[k].push_back( rs );
-						}
-
-						wxGLPoint3D P( Pos[0], Pos[1], Pos[2] );
-						if ( 0 == Elm )
-						{
-							P.x += (float)(Cos[0]*5.0);
-							P.y += (float)(Cos[1]*5.0);
-							P.z += (float)(Cos[2]*5.0);
-						}
-
-						ray_segment R;
-						R.point = P;
-						R.color = Elm==0 ? *wxRED : wxColour(255,192,0);
-						rays[k].push_back( R );
-					}
-				}
+				ray_segment rs;
+				rs.point.x = (float)(Pos[0] - Cos[0]*20.0);
+				rs.point.y = (float)(Pos[1] - Cos[1]*20.0);
+				rs.point.z = (float)(Pos[2] - Cos[2]*20.0);
+				rs.color = Elm==0 ? *wxRED : wxColour(255,192,0);
+				rays.push_back( rs );
 			}
-		}
-	}
 
-	glEnd(); // POINTS
+			wxGLPoint3D P( Pos[0], Pos[1], Pos[2] );
+			if ( 0 == Elm )
+			{
+				P.x += (float)(Cos[0]*5.0);
+				P.y += (float)(Cos[1]*5.0);
+				P.z += (float)(Cos[2]*5.0);
+			}
 
+			ray_segment rs;
+			rs.point = P;
+			rs.color = Elm==0 ? *wxRED : wxColour(255,192,0);
+			rays.push_back( rs );
+		}
 
-	if ( rays.size() > 0 )
-	{
-		for( size_t k=0;k<rays.size();k++ )
+		for( size_t j=0;j+1<rays.size();j++ )
 		{
-			const std::vector<ray_segment> &R = rays[k];
-			if ( R.size() > 0 )
-			{
-				for( size_t j=0;j<R.size()-1;j++ )
-				{
-					Color( R[j+1].color );
-					glBegin( GL_LINES );
-						glVertex3f( R[j].point.x, R[j].point.y, R[j].point.z );
-						glVertex3f( R[j+1].point.x, R[j+1].point.y, R[j+1].point.z );
-					glEnd();
-				}
-			}
+			Color( rays[j+1].color );
+			glBegin( GL_LINES );
+				glVertex3f( rays[j].point.x, rays[j].point.y, rays[j].point.z );
+				glVertex3f( rays[j+1].point.x, rays[j+1].point.y, rays[j+1].point.z );
+			glEnd();
 		}
 	}
 
@@ -327,6 +524,22 @@ void IntersectionViewer::OnRender()
 	if ( m_vertexListValid )
 	{
 		glEnable( GL_DEPTH_TEST );
+
+		m_drawReduced = false;
+		if ( m_drawPoints.size() > 0 )
+		{
+			size_t n = PointBudget();
+			m_drawReduced = ( n < m_drawPoints.size()/3 );
+
+			glEnableClientState( GL_VERTEX_ARRAY );
+			glEnableClientState( GL_COLOR_ARRAY );
+			glVertexPointer( 3, GL_FLOAT, 0, &m_drawPoints[0] );
+			glColorPointer( 3, GL_UNSIGNED_BYTE, 0, &m_drawColors[0] );
+			glDrawArrays( GL_POINTS, 0, (GLsizei)n );
+			glDisableClientState( GL_COLOR_ARRAY );
+			glDisableClientState( GL_VERTEX_ARRAY );
+		}
+
 		glCallList( m_vertexListId );
 
 		if ( m_showAxes )
@@ -507,6 +720,7 @@ IntersectionForm::~IntersectionForm()
 
 void IntersectionForm::UpdateView()
 {
+	m_3d->InvalidatePoints();
 	PopulateStages();
 	PopulateElements();
 	UpdatePlot();
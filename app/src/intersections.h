@@ -87,13 +87,30 @@ public:
 
 	void RebuildGeometry( ElementListBox *lb );
 
+	// drops the cached point coordinates, call when the results change
+	void InvalidatePoints() { m_points.clear(); }
+
 private:
 	virtual void OnRender();
+	bool TransformPoints();
+	void SortLevelOfDetail();
+	size_t PointBudget();
+	void OnMouseUp( wxMouseEvent & );
 	
 	Project &m_prj;
 
+	// every intersection point transformed to m_pointsCoordSys
+	std::vector<float> m_points;
+	int m_pointsCoordSys;
+
 	GLuint m_vertexListId;
 	bool m_vertexListValid;
+
+	// points of the selected elements, ordered so that any leading part is a
+	// spatially stratified subsample of the whole cloud
+	std::vector<float> m_drawPoints;
+	std::vector<unsigned char> m_drawColors;
+	bool m_drawReduced;
 	wxGLPoint3D m_min, m_max;
 
 	int m_coordSys, m_pointColors;
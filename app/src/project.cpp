@@ -50,9 +50,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stapi.h>
 #include <math.h>
 
+#include <algorithm>
+#include <set>
+#include <string>
+
 #ifndef M_PI
 	#define M_PI 3.141592653589793238462643
 #endif
@@ -60,6 +65,10 @@
 #include <wx/tokenzr.h>
 #include <wx/arrstr.h>
 #include <wx/wxcrt.h>
+#include <wx/filename.h>
+#include <wx/thread.h>
+#include <wx/mstream.h>
+#include <wx/zstream.h>
 
 #include "project.h"
 
@@ -564,9 +573,32 @@ bool Stage::Read(FILE *fp)
 	return ok;
 }
 
+FluxTarget::FluxTarget()
+{
+	StageIdx = ElementIdx = 0;
+	NBinsX = NBinsY = 0;
+	MinX = MaxX = MinY = MaxY = 0.0;
+	FinalOnly = false;
+
+	Valid = false;
+	RayCount = 0;
+	CentroidSum[0] = CentroidSum[1] = CentroidSum[2] = 0.0;
+	CentroidCount = 0;
+}
+
 Project::Project()
 {
-	/* nothing to do */
+	RayRetention = ST_RETAIN_ALL;
+	RaySampleEvery = 1;
+	RaySampling = ST_SAMPLE_RANDOM;
+	RayWeighted = false;
+	RouletteWeight = 0.1;
+	ConvergeMetrics = ST_CONVERGE_INTERCEPT;
+	ConvergeTolerance = 0;
+	ConvergeSeconds = 0;
+	ConvergeBatches = 0;
+	for (int i=0;i<3;i++)
+		ConvergeValue[i] = ConvergeError[i] = 0;
 }
 
 Project::~Project()
@@ -610,6 +642,78 @@ void Project::ClearStages()
 	for (size_t i=0;i<StageList.size();i++)
 		delete StageList[i];
 	StageList.clear();
+	FluxTargets.clear();
+	RetainSelection.clear();
+}
+
+FluxTarget *Project::FindFluxTarget( int stageIdx, int elementIdx,
+		int nbinsx, int nbinsy, double minx, double maxx,
+		double miny, double maxy, bool finalonly )
+{
+	for (size_t i=0;i<FluxTargets.size();i++)
+	{
+		FluxTarget &ft = FluxTargets[i];
+		if ( ft.Valid
+			&& ft.StageIdx == stageIdx && ft.ElementIdx == elementIdx
+			&& ft.NBinsX == nbinsx && ft.NBinsY == nbinsy
+			&& ft.MinX == minx && ft.MaxX == maxx
+			&& ft.MinY == miny && ft.MaxY == maxy
+			&& ft.FinalOnly == finalonly )
+			return &ft;
+	}
+
+	return NULL;
+}
+
+bool Project::ReadFluxTargetsFromContextList( const std::vector<st_context_t> &list )
+{
+	for (size_t i=0;i<FluxTargets.size();i++)
+	{
+		FluxTarget &ft = FluxTargets[i];
+		ft.Valid = false;
+		ft.RayCount = 0;
+		ft.CentroidSum[0] = ft.CentroidSum[1] = ft.CentroidSum[2] = 0.0;
+		ft.CentroidCount = 0;
+
+		if ( ft.NBinsX < 1 || ft.NBinsY < 1 )
+			continue;
+
+		ft.Grid.resize( ft.NBinsX, ft.NBinsY );
+		ft.Grid.fill( 0.0 );
+		ft.Hits.resize( ft.NBinsX, ft.NBinsY );
+		ft.Hits.fill( 0.0 );
+
+		std::vector<double> grid( ft.NBinsX*ft.NBinsY, 0.0 ), hits( grid.size(), 0.0 );
+
+		// each trace thread bins into its own context, so sum them up here
+		for (size_t j=0;j<list.size();j++)
+		{
+			int nbinned, ncentroid;
+			double csum[3];
+			if ( (size_t)::st_num_flux_targets( list[j] ) != FluxTargets.size()
+				|| ::st_flux_target_grid( list[j], i, &grid[0] ) < 0
+				|| ::st_flux_target_hits( list[j], i, &hits[0] ) < 0
+				|| ::st_flux_target_stats( list[j], i, &nbinned, csum, &ncentroid ) < 0 )
+				return false;
+
+			for (int ix=0;ix<ft.NBinsX;ix++)
+				for (int iy=0;iy<ft.NBinsY;iy++)
+				{
+					ft.Grid.at(ix,iy) += grid[ix*ft.NBinsY+iy];
+					ft.Hits.at(ix,iy) += hits[ix*ft.NBinsY+iy];
+				}
+
+			ft.RayCount += nbinned;
+			ft.CentroidSum[0] += csum[0];
+			ft.CentroidSum[1] += csum[1];
+			ft.CentroidSum[2] += csum[2];
+			ft.CentroidCount += ncentroid;
+		}
+
+		ft.Valid = true;
+	}
+
+	return true;
 }
 
 bool Project::Write(FILE *fp)
@@ -632,6 +736,79 @@ bool Project::Write(FILE *fp)
 	return true;
 }
 
+wxString Project::LocateFile( const wxString &file )
+{
+	if ( wxFileName( file ).IsAbsolute() )
+		return wxFileExists( file ) ? file : wxString();
+
+	for ( size_t i=0;i<SearchDirs.size();i++ )
+	{
+		wxString path = SearchDirs[i] + "/" + file;
+		if ( wxFileExists( path ) )
+			return path;
+	}
+
+	return wxEmptyString;
+}
+
+// 64-bit FNV-1a over the rest of a file
+static void HashFile( FILE *fp, unsigned long long &hash )
+{
+	char buf[65536];
+	size_t n;
+	while ( (n = fread( buf, 1, sizeof(buf), fp )) > 0 )
+		for ( size_t i=0;i<n;i++ )
+			hash = (hash ^ (unsigned char)buf[i]) * 1099511628211ULL;
+}
+
+wxString Project::ContentHash( const wxString &settings )
+{
+	// the project is hashed in its file format, which covers everything
+	// that goes into a trace
+	wxString tmp = wxFileName::CreateTempFileName( "st" );
+	FILE *fp = tmp.IsEmpty() ? 0 : fopen( tmp.c_str(), "w+b" );
+	if ( !fp ) return wxEmptyString;
+
+	Write( fp );
+	rewind( fp );
+
+	unsigned long long hash = 14695981039346656037ULL;
+	HashFile( fp, hash );
+
+	fclose( fp );
+	wxRemoveFile( tmp );
+
+	// except for the surface files, which it only names.  each is hashed
+	// once in the order it is first used, and one that can't be found adds
+	// nothing since the trace fails on it anyway
+	std::set<wxString> files;
+	for ( size_t i=0;i<StageList.size();i++ )
+	{
+		for ( size_t j=0;j<StageList[i]->ElementList.size();j++ )
+		{
+			Element *e = StageList[i]->ElementList[j];
+			if ( e->SurfaceFile.IsEmpty() )
+				continue;
+
+			wxString path = LocateFile( e->SurfaceFile );
+			if ( path.IsEmpty() || !files.insert( path ).second )
+				continue;
+
+			if ( FILE *sf = fopen( path.c_str(), "rb" ) )
+			{
+				HashFile( sf, hash );
+				fclose( sf );
+			}
+		}
+	}
+
+	std::string text = settings.ToStdString();
+	for ( size_t i=0;i<text.size();i++ )
+		hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+
+	return wxString::Format( "%016llx", hash );
+}
+
 bool Project::Read(FILE *fp)
 {
 	if (!fp) return false;
@@ -710,12 +887,19 @@ RayData::RayData()
 	Xi = Yi = Zi = 0;
 	Xc = Yc = Zc = 0;
 	ElementMap = StageMap = RayNumbers = 0;
+	Weights = Absorbed = 0;
 	Length = 0;
 	SunXMin=SunXMax=SunYMin=SunYMax=0.0;
 	SunRayCount = 0;
 
 	m_index = 0;
 	m_expStage = m_expCoords = 0;
+	m_expRecords = 0;
+	m_expCount = 0;
+
+	m_elementIndexValid = false;
+	m_rayIndexValid = false;
+	m_hasWeights = -1;
 }
 
 RayData::~RayData()
@@ -725,7 +909,14 @@ RayData::~RayData()
 
 bool RayData::AllocMemory(size_t npoints)
 {
-	if (npoints <= 0) return false;
+	InvalidateIndex();
+
+	// a trace that keeps no records still has its sun and element counts
+	if (npoints == 0)
+	{
+		FreeMemory();
+		return true;
+	}
 
 	if (npoints < Length)
 	{
@@ -748,6 +939,9 @@ bool RayData::AllocMemory(size_t npoints)
 		StageMap = new int[npoints];
 		RayNumbers = new int[npoints];
 
+		Weights = new double[npoints];
+		Absorbed = new double[npoints];
+
 		Length = npoints;
 		return true;
 	}
@@ -769,18 +963,173 @@ void RayData::FreeMemory()
 	if (ElementMap) delete [] ElementMap;
 	if (StageMap) delete [] StageMap;
 	if (RayNumbers) delete [] RayNumbers;
+	if (Weights) delete [] Weights;
+	if (Absorbed) delete [] Absorbed;
 
 	Xi=Yi=Zi = 0;
 	Xc=Yc=Zc = 0;
 	ElementMap = 0;
 	StageMap = 0;
 	RayNumbers = 0;
+	Weights = Absorbed = 0;
 
 	Length = 0;
 
 	SunXMin=SunXMax=SunYMin=SunYMax=0.0;
 	SunRayCount = 0;
 
+	InvalidateIndex();
+}
+
+void RayData::InvalidateIndex()
+{
+	m_elementIndexValid = false;
+	m_stageKey.clear();
+	m_keyStart.clear();
+	m_elementRecords.clear();
+	m_stageRecords.clear();
+
+	m_rayIndexValid = false;
+	m_rayKeys.clear();
+	m_rayRecords.clear();
+
+	m_hasWeights = -1;
+
+	m_expRecords = 0;
+	m_expCount = 0;
+}
+
+void RayData::BuildElementIndex()
+{
+	// counting sort of the record indices by stage, then element
+	m_stageKey.clear();
+	m_keyStart.clear();
+	m_elementRecords.clear();
+
+	std::vector<size_t> maxelem;
+	for (size_t i=0;i<Length;i++)
+	{
+		if (StageMap[i] < 1) continue;
+		size_t stage = StageMap[i], elem = abs(ElementMap[i]);
+		if (stage >= maxelem.size()) maxelem.resize( stage+1, 0 );
+		if (elem > maxelem[stage]) maxelem[stage] = elem;
+	}
+
+	m_stageKey.resize( maxelem.size()+1, 0 );
+	for (size_t i=1;i<maxelem.size();i++)
+		m_stageKey[i+1] = m_stageKey[i] + maxelem[i] + 1;
+
+	size_t nkeys = m_stageKey.back();
+	m_keyStart.assign( nkeys+1, 0 );
+	for (size_t i=0;i<Length;i++)
+		if (StageMap[i] >= 1)
+			m_keyStart[ m_stageKey[StageMap[i]] + abs(ElementMap[i]) + 1 ]++;
+
+	for (size_t k=0;k<nkeys;k++)
+		m_keyStart[k+1] += m_keyStart[k];
+
+	m_elementRecords.resize( m_keyStart[nkeys] );
+	m_stageRecords.resize( m_keyStart[nkeys] );
+	std::vector<size_t> next( m_keyStart.begin(), m_keyStart.end()-1 );
+	std::vector<size_t> stagenext( m_stageKey.size(), 0 );
+	for (size_t i=1;i+1<m_stageKey.size();i++)
+		stagenext[i] = m_keyStart[ m_stageKey[i] ];
+
+	for (size_t i=0;i<Length;i++)
+	{
+		if (StageMap[i] >= 1)
+		{
+			m_elementRecords[ next[ m_stageKey[StageMap[i]] + abs(ElementMap[i]) ]++ ] = i;
+			m_stageRecords[ stagenext[ StageMap[i] ]++ ] = i;
+		}
+	}
+
+	m_elementIndexValid = true;
+}
+
+// orders record indices by ray number, then record
+struct RayNumberOrder
+{
+	const int *RayNumbers;
+	bool operator()( size_t a, size_t b ) const
+	{
+		return RayNumbers[a] < RayNumbers[b] || ( RayNumbers[a] == RayNumbers[b] && a < b );
+	}
+};
+
+void RayData::BuildRayIndex()
+{
+	// the record indices sorted by ray number, next to their ray numbers for
+	// a binary search.  the ray numbers of a large trace are sparse, so this
+	// takes memory for the records only
+	m_rayKeys.clear();
+	m_rayRecords.clear();
+
+	for (size_t i=0;i<Length;i++)
+		if (RayNumbers[i] > 0)
+			m_rayRecords.push_back( i );
+
+	RayNumberOrder order = { RayNumbers };
+	std::sort( m_rayRecords.begin(), m_rayRecords.end(), order );
+
+	m_rayKeys.resize( m_rayRecords.size() );
+	for (size_t k=0;k<m_rayRecords.size();k++)
+		m_rayKeys[k] = RayNumbers[ m_rayRecords[k] ];
+
+	m_rayIndexValid = true;
+}
+
+const size_t *RayData::GetRecords( int stage, int element, size_t *count )
+{
+	*count = 0;
+	if (!m_elementIndexValid)
+		BuildElementIndex();
+
+	if (stage < 1 || (size_t)stage+1 >= m_stageKey.size())
+		return 0;
+
+	if (element < 0)
+	{
+		// the elements of a stage are next to each other
+		size_t k0 = m_stageKey[stage], k1 = m_stageKey[stage+1];
+		*count = m_keyStart[k1] - m_keyStart[k0];
+		return *count > 0 ? &m_stageRecords[ m_keyStart[k0] ] : 0;
+	}
+
+	size_t k0 = m_stageKey[stage] + element;
+	if (k0+1 > m_stageKey[stage+1])
+		return 0;
+
+	*count = m_keyStart[k0+1] - m_keyStart[k0];
+	return *count > 0 ? &m_elementRecords[ m_keyStart[k0] ] : 0;
+}
+
+bool RayData::HasWeights()
+{
+	if (m_hasWeights < 0)
+	{
+		m_hasWeights = 0;
+		for (size_t i=0;i<Length && m_hasWeights == 0;i++)
+			if (Weights[i] != 1.0)
+				m_hasWeights = 1;
+	}
+
+	return m_hasWeights != 0;
+}
+
+const size_t *RayData::GetRayRecords( int raynum, size_t *count )
+{
+	*count = 0;
+	if (!m_rayIndexValid)
+		BuildRayIndex();
+
+	if (raynum < 1)
+		return 0;
+
+	std::pair< std::vector<int>::const_iterator, std::vector<int>::const_iterator > r
+		= std::equal_range( m_rayKeys.begin(), m_rayKeys.end(), raynum );
+	*count = r.second - r.first;
+	return *count > 0 ? &m_rayRecords[ r.first - m_rayKeys.begin() ] : 0;
 }
 
 bool RayData::ReadResultsFromContextList(const std::vector<st_context_t> &list)
@@ -789,15 +1138,18 @@ bool RayData::ReadResultsFromContextList(const std::vector<st_context_t> &list)
 
 	size_t i, j, npoints = 0;
 	for (i=0;i<list.size();i++)
-		npoints += ::st_num_intersections( list[i] );
-
-	if (npoints < 0)
-		return false;
+	{
+		int n = ::st_num_intersections( list[i] );
+		if (n < 0)
+			return false;
+		npoints += n;
+	}
 
+	// no records is a valid result, the sun stats are read all the same
 	if (!AllocMemory( npoints ))
 		return false;
 
-	double *xi, *yi, *zi, *xc, *yc, *zc;
+	double *xi, *yi, *zi, *xc, *yc, *zc, *wt, *ab;
 	int *em, *sm, *rn;
 
 	xi = Xi;
@@ -809,6 +1161,8 @@ bool RayData::ReadResultsFromContextList(const std::vector<st_context_t> &list)
 	em = ElementMap;
 	sm = StageMap;
 	rn = RayNumbers;
+	wt = Weights;
+	ab = Absorbed;
 
 	int max_raynum = 0;
 
@@ -836,6 +1190,8 @@ bool RayData::ReadResultsFromContextList(const std::vector<st_context_t> &list)
 		::st_elementmap( list[i], em );
 		::st_stagemap( list[i], sm );
 		::st_raynumbers( list[i], rn );
+		::st_weights( list[i], wt );
+		::st_absorbed( list[i], ab );
 
 		size_t segment_len = ::st_num_intersections( list[i] );
 
@@ -860,158 +1216,1277 @@ bool RayData::ReadResultsFromContextList(const std::vector<st_context_t> &list)
 		em = em + segment_len;
 		sm = sm + segment_len;
 		rn = rn + segment_len;
+		wt = wt + segment_len;
+		ab = ab + segment_len;
 	}
 
 	return true;
 }
 
-bool RayData::WriteDataFile(const wxString &file)
+// runs fn( data, i ) for i = 0..n-1, each on its own thread.  the first item
+// is done on the calling thread, as is any item whose thread can't be started
+class ParallelThread : public wxThread
 {
-	FILE *fp = fopen( file.c_str(), "wb" );
-	if (!fp) return false;
+	void (*m_fn)( void *data, size_t i );
+	void *m_data;
+	size_t m_item;
 
-	double buf[9];
-	buf[0] = SunXMin;
-	buf[1] = SunXMax;
-	buf[2] = SunYMin;
-	buf[3] = SunYMax;
-	buf[4] = SunRayCount;
-	buf[5] = Length;
+public:
+	ParallelThread( void (*fn)( void *data, size_t i ), void *data, size_t item )
+		: wxThread( wxTHREAD_JOINABLE )
+	{
+		m_fn = fn;
+		m_data = data;
+		m_item = item;
+	}
 
-	fwrite( (void*)buf, sizeof(double), 6,fp );
+	virtual ExitCode Entry()
+	{
+		(*m_fn)( m_data, m_item );
+		return 0;
+	}
+};
 
-	for (size_t i=0;i<Length;i++)
+static void RunParallel( void (*fn)( void *data, size_t i ), void *data, size_t n )
+{
+	std::vector<ParallelThread*> threads;
+	for ( size_t i=1;i<n;i++ )
 	{
-		buf[0] = Xi[i];
-		buf[1] = Yi[i];
-		buf[2] = Zi[i];
-		buf[3] = Xc[i];
-		buf[4] = Yc[i];
-		buf[5] = Zc[i];
-		buf[6] = StageMap[i];
-		buf[7] = ElementMap[i];
-		buf[8] = RayNumbers[i];
+		ParallelThread *thread = new ParallelThread( fn, data, i );
+		if ( thread->Run() == wxTHREAD_NO_ERROR )
+			threads.push_back( thread );
+		else
+		{
+			delete thread;
+			(*fn)( data, i );
+		}
+	}
 
-		fwrite( (void*)buf, sizeof(double), 9, fp );
+	if ( n > 0 )
+		(*fn)( data, 0 );
+
+	for ( size_t i=0;i<threads.size();i++ )
+	{
+		threads[i]->Wait();
+		delete threads[i];
 	}
+}
 
-	fclose(fp);
+static bool SeekFile( FILE *fp, long long pos, int whence )
+{
+#ifdef _WIN32
+	return _fseeki64( fp, (__int64)pos, whence ) == 0;
+#else
+	return fseeko( fp, (off_t)pos, whence ) == 0;
+#endif
+}
 
-	return true;
+static long long TellFile( FILE *fp )
+{
+#ifdef _WIN32
+	return (long long)_ftelli64( fp );
+#else
+	return (long long)ftello( fp );
+#endif
 }
 
-bool RayData::ReadDataFile(const wxString &file)
+// compressed ray data files hold blocks of records that are deflated
+// independently, so that they can be decoded in parallel and located from
+// the table of block offsets at the end of the file.  before compression
+// the bytes of the doubles are grouped by significance, the ray numbers
+// are delta coded and the stage and element maps are run-length coded.
+// the offsets are file positions, so the data can follow other content
+// in a file as long as nothing comes after it
+static const char RayFileMagic[8] = { 'S', 'T', 'R', 'A', 'Y', 'Z', '0', '1' };
+static const size_t RayFileBlockSize = 65536;
+
+struct RayFileBlock
 {
-	FILE *fp = fopen( file.c_str(), "rb" );
-	if (!fp) return false;
+	size_t Start, Count;
+	std::string Packed;
+	bool Ok;
+};
 
-	double buf[9];
-	FreeMemory();
+struct RayFileJob
+{
+	RayData *rd;
+	RayFileBlock *blocks;
+};
 
-	fread(buf, sizeof(double), 6, fp);
-	SunXMin = buf[0];
-	SunXMax = buf[1];
-	SunYMin = buf[2];
-	SunYMax = buf[3];
-	SunRayCount = (int) buf[4];
-	int NPoints = (int) buf[5];
+static void ShuffleBytes( std::string &out, const void *values, size_t count, size_t size )
+{
+	const unsigned char *p = (const unsigned char*)values;
+	size_t start = out.size();
+	out.resize( start + count*size );
+	for ( size_t b=0;b<size;b++ )
+		for ( size_t i=0;i<count;i++ )
+			out[start + b*count + i] = (char)p[i*size + b];
+}
+
+static void UnshuffleBytes( const unsigned char *in, void *values, size_t count, size_t size )
+{
+	unsigned char *p = (unsigned char*)values;
+	for ( size_t b=0;b<size;b++ )
+		for ( size_t i=0;i<count;i++ )
+			p[i*size + b] = in[b*count + i];
+}
 
-	if (!AllocMemory(NPoints))
+static void RunLengthEncode( std::vector<int> &runs, const int *values, size_t count )
+{
+	runs.clear();
+	for ( size_t i=0;i<count;i++ )
 	{
-		fclose(fp);
-		return false;
+		if ( runs.size() > 0 && runs[runs.size()-2] == values[i] )
+			runs.back()++;
+		else
+		{
+			runs.push_back( values[i] );
+			runs.push_back( 1 );
+		}
 	}
+}
 
-	for (int i=0;i<NPoints;i++)
+static bool RunLengthDecode( const int *runs, size_t nruns, int *values, size_t count )
+{
+	size_t n = 0;
+	for ( size_t r=0;r<nruns;r++ )
 	{
-		fread(buf,sizeof(double),9,fp);
-		Xi[i] = buf[0];
-		Yi[i] = buf[1];
-		Zi[i] = buf[2];
-		Xc[i] = buf[3];
-		Yc[i] = buf[4];
-		Zc[i] = buf[5];
-		StageMap[i] = (int)buf[6];
-		ElementMap[i] = (int)buf[7];
-		RayNumbers[i] = (int)buf[8];
+		if ( runs[2*r+1] < 0 || n + runs[2*r+1] > count ) return false;
+		for ( int k=0;k<runs[2*r+1];k++ )
+			values[n++] = runs[2*r];
 	}
-
-	fclose(fp);
-
-	return true;
-
+	return n == count;
 }
 
-bool RayData::ReadResultsFromContext(st_context_t spcxt)
+static void EncodeRayFileBlock( void *data, size_t i )
 {
-	int npoints = ::st_num_intersections(spcxt);
-	if (npoints < 0)
-		return false;
+	RayFileJob *job = (RayFileJob*)data;
+	RayData &rd = *job->rd;
+	RayFileBlock &b = job->blocks[i];
+
+	std::vector<int> stageRuns, elementRuns, deltas( b.Count );
+	RunLengthEncode( stageRuns, rd.StageMap + b.Start, b.Count );
+	RunLengthEncode( elementRuns, rd.ElementMap + b.Start, b.Count );
+	for ( size_t j=0;j<b.Count;j++ )
+		deltas[j] = rd.RayNumbers[b.Start+j] - ( j > 0 ? rd.RayNumbers[b.Start+j-1] : 0 );
+
+	unsigned int counts[3] = { (unsigned int)b.Count,
+		(unsigned int)stageRuns.size()/2, (unsigned int)elementRuns.size()/2 };
+
+	std::string raw( (const char*)counts, sizeof(counts) );
+	ShuffleBytes( raw, rd.Xi + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Yi + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Zi + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Xc + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Yc + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Zc + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Weights + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, rd.Absorbed + b.Start, b.Count, sizeof(double) );
+	ShuffleBytes( raw, &deltas[0], b.Count, sizeof(int) );
+	if ( b.Count > 0 )
+	{
+		raw.append( (const char*)&stageRuns[0], stageRuns.size()*sizeof(int) );
+		raw.append( (const char*)&elementRuns[0], elementRuns.size()*sizeof(int) );
+	}
 
-	if (!AllocMemory(npoints))
-		return false;
-	
-	::st_locations( spcxt, Xi, Yi, Zi );
-	::st_cosines( spcxt, Xc, Yc, Zc );
-	::st_elementmap( spcxt, ElementMap );
-	::st_stagemap( spcxt, StageMap );
-	::st_raynumbers( spcxt, RayNumbers );
+	wxMemoryOutputStream mem;
+	{
+		wxZlibOutputStream zlib( mem, wxZ_BEST_SPEED, wxZLIB_NO_HEADER );
+		zlib.Write( raw.c_str(), raw.size() );
+		zlib.Close();
+	}
 
-	::st_sun_stats( spcxt, &SunXMin, &SunXMax, &SunYMin, &SunYMax, &SunRayCount );
-	return true;
+	// block header: raw and packed sizes
+	unsigned int sizes[2] = { (unsigned int)raw.size(), (unsigned int)mem.GetSize() };
+	b.Packed.assign( (const char*)sizes, sizeof(sizes) );
+	b.Packed.resize( sizeof(sizes) + sizes[1] );
+	mem.CopyTo( &b.Packed[sizeof(sizes)], sizes[1] );
+	b.Ok = true;
 }
 
-size_t RayData::PrepareExport( int coords, int istage )
+// checks a block header against the record count of the block and the
+// bytes the block takes up in the file, before anything is inflated.  the
+// raw size follows from the count, with 1 to count runs in each map, and
+// deflate can't expand the packed data more than 1032 to 1
+static bool CheckRayFileBlock( const unsigned int sizes[2], size_t count, unsigned long long space )
 {
-	m_index = 0;
-	m_expCoords = coords;
-	m_expStage = istage;
+	unsigned long long fixed = 3*sizeof(unsigned int) + (unsigned long long)count*(8*sizeof(double) + sizeof(int));
+	return count > 0
+		&& space == 2*sizeof(unsigned int) + (unsigned long long)sizes[1]
+		&& sizes[0] >= fixed + 4*sizeof(int)
+		&& sizes[0] <= fixed + 4*(unsigned long long)count*sizeof(int)
+		&& sizes[0] <= 1032ULL*sizes[1];
+}
 
-	size_t nwrite = 0;
-	if ( istage == 0 ) nwrite = Length;
-	else
+static void DecodeRayFileBlock( void *data, size_t i )
+{
+	RayFileJob *job = (RayFileJob*)data;
+	RayData &rd = *job->rd;
+	RayFileBlock &b = job->blocks[i];
+	b.Ok = false;
+
+	unsigned int sizes[2];
+	if ( b.Packed.size() < sizeof(sizes) ) return;
+	memcpy( sizes, b.Packed.c_str(), sizeof(sizes) );
+	if ( b.Packed.size() != sizeof(sizes) + sizes[1] ) return;
+
+	std::string raw( sizes[0], 0 );
+	wxMemoryInputStream mem( b.Packed.c_str() + sizeof(sizes), sizes[1] );
+	wxZlibInputStream zlib( mem, wxZLIB_NO_HEADER );
+	if ( sizes[0] > 0 )
+		zlib.Read( &raw[0], sizes[0] );
+	if ( zlib.LastRead() != sizes[0] )
+		return;
+
+	unsigned int counts[3];
+	if ( raw.size() < sizeof(counts) ) return;
+	memcpy( counts, raw.c_str(), sizeof(counts) );
+	if ( counts[0] != b.Count || counts[1] > b.Count || counts[2] > b.Count
+		|| raw.size() != sizeof(counts) + b.Count*(8*sizeof(double) + sizeof(int)) + 2*((size_t)counts[1] + counts[2])*sizeof(int) )
+		return;
+
+	const unsigned char *p = (const unsigned char*)raw.c_str() + sizeof(counts);
+	double *columns[8] = { rd.Xi, rd.Yi, rd.Zi, rd.Xc, rd.Yc, rd.Zc, rd.Weights, rd.Absorbed };
+	for ( size_t k=0;k<8;k++ )
 	{
-		for( size_t i=0;i<Length;i++ )
-			if ( istage == StageMap[i] )
-				nwrite++;
+		UnshuffleBytes( p, columns[k] + b.Start, b.Count, sizeof(double) );
+		p += b.Count*sizeof(double);
 	}
 
-	return nwrite;
+	UnshuffleBytes( p, rd.RayNumbers + b.Start, b.Count, sizeof(int) );
+	p += b.Count*sizeof(int);
+	for ( size_t j=1;j<b.Count;j++ )
+		rd.RayNumbers[b.Start+j] += rd.RayNumbers[b.Start+j-1];
+
+	std::vector<int> runs( 2*(counts[1] + counts[2]) );
+	if ( runs.size() > 0 )
+		memcpy( &runs[0], p, runs.size()*sizeof(int) );
+
+	const int *r = runs.size() > 0 ? &runs[0] : 0;
+	b.Ok = RunLengthDecode( r, counts[1], rd.StageMap + b.Start, b.Count )
+		&& RunLengthDecode( r + 2*counts[1], counts[2], rd.ElementMap + b.Start, b.Count );
 }
 
-bool RayData::GetNextExport( Project &prj, double Pos[3], double Cos[3], 
-	int &Elm, int &Stg, int &Ray )
+bool RayData::WriteCompressedFile( FILE *fp )
 {
-	if ( m_index >= Length )
-		return false;
+	long long start = TellFile( fp );
+	if ( start < 0 ) return false;
+
+	fwrite( RayFileMagic, 1, sizeof(RayFileMagic), fp );
+
+	double sun[4] = { SunXMin, SunXMax, SunYMin, SunYMax };
+	int rays = SunRayCount;
+	unsigned int blocksize = (unsigned int)RayFileBlockSize;
+	unsigned long long length = Length;
+	fwrite( sun, sizeof(double), 4, fp );
+	fwrite( &rays, sizeof(int), 1, fp );
+	fwrite( &blocksize, sizeof(unsigned int), 1, fp );
+	fwrite( &length, sizeof(unsigned long long), 1, fp );
+	unsigned long long offset = start + sizeof(RayFileMagic) + 4*sizeof(double) 
+		+ sizeof(int) + sizeof(unsigned int) + sizeof(unsigned long long);
+
+	// blocks are compressed on all cpus, then written in order
+	size_t nthreads = wxThread::GetCPUCount();
+	if ( nthreads < 1 ) nthreads = 1;
+	std::vector<RayFileBlock> blocks( nthreads );
+	std::vector<unsigned long long> offsets;
 
-	if ( m_expStage > 0 )
+	bool ok = true;
+	size_t nwritten = 0;
+	while ( ok && nwritten < Length )
 	{
-		while( m_index < Length && m_expStage != StageMap[m_index] )
-			m_index++;
+		size_t nblocks = 0;
+		for ( size_t t=0;t<nthreads && nwritten < Length;t++ )
+		{
+			blocks[t].Start = nwritten;
+			blocks[t].Count = std::min( RayFileBlockSize, Length - nwritten );
+			nwritten += blocks[t].Count;
+			nblocks++;
+		}
 
-		if ( m_index >= Length )
-			return false;
+		RayFileJob job = { this, &blocks[0] };
+		RunParallel( EncodeRayFileBlock, &job, nblocks );
+
+		for ( size_t t=0;ok && t<nblocks;t++ )
+		{
+			offsets.push_back( offset );
+			offset += blocks[t].Packed.size();
+			ok = fwrite( blocks[t].Packed.c_str(), 1, blocks[t].Packed.size(), fp ) == blocks[t].Packed.size();
+		}
 	}
 
-	bool ok = Transform( prj, m_expCoords, m_index, Pos, Cos, Elm, Stg, Ray );
-	
-	m_index++;
+	unsigned long long nblocks = offsets.size();
+	if ( nblocks > 0 )
+		fwrite( &offsets[0], sizeof(unsigned long long), offsets.size(), fp );
+	fwrite( &nblocks, sizeof(unsigned long long), 1, fp );
+	fwrite( RayFileMagic, 1, sizeof(RayFileMagic), fp );
 
-	return ok;
+	return ok && !ferror( fp );
 }
 
-bool RayData::Transform( Project &prj, int coord, size_t idx, double Pos[3], double Cos[3], 
-	int &Elm, int &Stg, int &Ray )
+bool RayData::ReadCompressedFile( FILE *fp )
 {
+	double sun[4];
+	int rays;
+	unsigned int blocksize;
+	unsigned long long length, nblocks;
+	char magic[8];
+	if ( fread( magic, 1, sizeof(magic), fp ) != sizeof(magic) )
+		return false;
 
-	if ( idx >= Length ) return false;
+	if ( memcmp( magic, RayFileMagic, sizeof(magic) ) != 0 )
+		return false;
 
-	double origin[3], posin[3], cosin[3];
+	if ( fread( sun, sizeof(double), 4, fp ) != 4
+		|| fread( &rays, sizeof(int), 1, fp ) != 1
+		|| fread( &blocksize, sizeof(unsigned int), 1, fp ) != 1
+		|| fread( &length, sizeof(unsigned long long), 1, fp ) != 1 
+		|| blocksize == 0 )
+		return false;
 
-	Pos[0] = posin[0] = Xi[idx];
-	Pos[1] = posin[1] = Yi[idx];
-	Pos[2] = posin[2] = Zi[idx];
+	// the blocks follow the header back to back and the table of offsets
+	// follows them, so everything is checked against the size of the file
+	// before the records are allocated
+	long long start = TellFile( fp ), end = -1;
+	if ( start < 0 || !SeekFile( fp, 0, SEEK_END ) || ( end = TellFile( fp ) ) < 0 
+		|| end - start < (long long)(sizeof(unsigned long long) + sizeof(magic)) )
+		return false;
+
+	if ( !SeekFile( fp, -(long long)(sizeof(unsigned long long) + sizeof(magic)), SEEK_END )
+		|| fread( &nblocks, sizeof(unsigned long long), 1, fp ) != 1
+		|| fread( magic, 1, sizeof(magic), fp ) != sizeof(magic)
+		|| memcmp( magic, RayFileMagic, sizeof(magic) ) != 0
+		|| nblocks != length/blocksize + ( length%blocksize != 0 ? 1 : 0 )
+		|| nblocks > (unsigned long long)(end - start)/(sizeof(unsigned long long) + 2*sizeof(unsigned int)) )
+		return false;
+
+	long long table = end - (long long)((nblocks+1)*sizeof(unsigned long long) + sizeof(magic));
+	std::vector<unsigned long long> offsets( nblocks );
+	if ( nblocks == 0 && table != start )
+		return false;
+
+	if ( nblocks > 0 
+		&& ( !SeekFile( fp, table, SEEK_SET )
+			|| fread( &offsets[0], sizeof(unsigned long long), nblocks, fp ) != nblocks ) )
+		return false;
+
+	std::vector<unsigned int> packed( nblocks );
+	for ( size_t k=0;k<nblocks;k++ )
+	{
+		unsigned long long next = k+1 < nblocks ? offsets[k+1] : (unsigned long long)table;
+		unsigned int sizes[2];
+		if ( offsets[k] != ( k > 0 ? offsets[k-1] + 2*sizeof(unsigned int) + packed[k-1] : (unsigned long long)start )
+			|| next < offsets[k]
+			|| !SeekFile( fp, (long long)offsets[k], SEEK_SET )
+			|| fread( sizes, sizeof(unsigned int), 2, fp ) != 2
+			|| !CheckRayFileBlock( sizes, (size_t)std::min( (unsigned long long)blocksize, length - k*blocksize ), next - offsets[k] ) )
+			return false;
+
+		packed[k] = sizes[1];
+	}
+
+	if ( length == 0 )
+		FreeMemory();
+	else if ( !AllocMemory( length ) )
+		return false;
+
+	SunXMin = sun[0];
+	SunXMax = sun[1];
+	SunYMin = sun[2];
+	SunYMax = sun[3];
+	SunRayCount = rays;
+
+	// blocks are read in order, then decoded on all cpus
+	size_t nthreads = wxThread::GetCPUCount();
+	if ( nthreads < 1 ) nthreads = 1;
+	std::vector<RayFileBlock> blocks( nthreads );
+
+	for ( size_t next=0;next<nblocks; )
+	{
+		size_t n = 0;
+		for ( ;n<nthreads && next<nblocks;n++,next++ )
+		{
+			RayFileBlock &b = blocks[n];
+			b.Start = next*blocksize;
+			b.Count = std::min( (size_t)blocksize, Length - b.Start );
+
+			b.Packed.resize( 2*sizeof(unsigned int) + packed[next] );
+			if ( !SeekFile( fp, (long long)offsets[next], SEEK_SET )
+				|| fread( &b.Packed[0], 1, b.Packed.size(), fp ) != b.Packed.size() )
+				return false;
+		}
+
+		RayFileJob job = { this, &blocks[0] };
+		RunParallel( DecodeRayFileBlock, &job, n );
+
+		for ( size_t t=0;t<n;t++ )
+			if ( !blocks[t].Ok )
+				return false;
+	}
+
+	return true;
+}
+
+bool RayData::WriteDataFile(const wxString &file, bool compress)
+{
+	// the plain format has nowhere to keep the weights
+	if ( !compress && HasWeights() )
+		return false;
+
+	FILE *fp = fopen( file.c_str(), "wb" );
+	if (!fp) return false;
+
+	if ( compress )
+	{
+		bool ok = WriteCompressedFile( fp );
+		fclose( fp );
+		return ok;
+	}
+
+	double buf[9];
+	buf[0] = SunXMin;
+	buf[1] = SunXMax;
+	buf[2] = SunYMin;
+	buf[3] = SunYMax;
+	buf[4] = SunRayCount;
+	buf[5] = Length;
+
+	fwrite( (void*)buf, sizeof(double), 6,fp );
+
+	for (size_t i=0;i<Length;i++)
+	{
+		buf[0] = Xi[i];
+		buf[1] = Yi[i];
+		buf[2] = Zi[i];
+		buf[3] = Xc[i];
+		buf[4] = Yc[i];
+		buf[5] = Zc[i];
+		buf[6] = StageMap[i];
+		buf[7] = ElementMap[i];
+		buf[8] = RayNumbers[i];
+
+		fwrite( (void*)buf, sizeof(double), 9, fp );
+	}
+
+	fclose(fp);
+
+	return true;
+}
+
+bool RayData::ReadDataFile(const wxString &file)
+{
+	FILE *fp = fopen( file.c_str(), "rb" );
+	if (!fp) return false;
+
+	double buf[9];
+	FreeMemory();
+
+	// compressed files are recognized by their leading magic number
+	char magic[8];
+	if ( fread( magic, 1, sizeof(magic), fp ) == sizeof(magic)
+		&& memcmp( magic, RayFileMagic, sizeof(magic) ) == 0 )
+	{
+		rewind( fp );
+		bool ok = ReadCompressedFile( fp );
+		if ( !ok ) FreeMemory();
+		fclose( fp );
+		return ok;
+	}
+
+	rewind( fp );
+	int NPoints = 0;
+	if ( fread(buf, sizeof(double), 6, fp) != 6
+		|| (NPoints = (int) buf[5]) < 0
+		|| !AllocMemory(NPoints) )
+	{
+		fclose(fp);
+		return false;
+	}
+
+	// the allocation clears the sun stats, so they are set after it
+	SunXMin = buf[0];
+	SunXMax = buf[1];
+	SunYMin = buf[2];
+	SunYMax = buf[3];
+	SunRayCount = (int) buf[4];
+
+	for (int i=0;i<NPoints;i++)
+	{
+		fread(buf,sizeof(double),9,fp);
+		Xi[i] = buf[0];
+		Yi[i] = buf[1];
+		Zi[i] = buf[2];
+		Xc[i] = buf[3];
+		Yc[i] = buf[4];
+		Zc[i] = buf[5];
+		StageMap[i] = (int)buf[6];
+		ElementMap[i] = (int)buf[7];
+		RayNumbers[i] = (int)buf[8];
+		Weights[i] = 1.0;
+		Absorbed[i] = ElementMap[i] < 0 ? 1.0 : 0.0;
+	}
+
+	fclose(fp);
+
+	return true;
+
+}
+
+// shard files are a text header, one item per line, followed by the ray
+// data in the compressed format
+static const char *ShardMagic = "# SOLTRACE SHARD 1";
+
+static bool ReadShardLine( FILE *fp, wxString &line )
+{
+	std::string text;
+	int c;
+	while ( (c = fgetc( fp )) != EOF && c != '\n' )
+		text += (char)c;
+
+	line = wxString( text.c_str() );
+	return c != EOF || !text.empty();
+}
+
+bool Project::WriteShard( const wxString &file, const wxString &settings,
+	const std::vector< std::pair<int,int> > &ranges )
+{
+	FILE *fp = fopen( file.c_str(), "wb" );
+	if ( !fp ) return false;
+
+	fprintf( fp, "%s\n", ShardMagic );
+	fprintf( fp, "hash %s\n", (const char*)ContentHash( settings ).c_str() );
+	fprintf( fp, "settings %s\n", (const char*)settings.c_str() );
+	for ( size_t i=0;i<ranges.size();i++ )
+		fprintf( fp, "range %d %d\n", ranges[i].first, ranges[i].second );
+
+	fprintf( fp, "sun %d %.17lg %.17lg %.17lg %.17lg\n", Results.SunRayCount,
+		Results.SunXMin, Results.SunXMax, Results.SunYMin, Results.SunYMax );
+
+	for ( size_t j=0;j<StageList.size();j++ )
+	{
+		Stage *stage = StageList[j];
+		fprintf( fp, "stage %d %lu\n", (int)j+1, (unsigned long)stage->RayHits );
+		for ( size_t i=0;i<stage->ElementList.size();i++ )
+			fprintf( fp, "element %d %d %lu %lu\n", (int)j+1, (int)i+1,
+				(unsigned long)stage->ElementList[i]->RayHits, (unsigned long)stage->ElementList[i]->FinalRayHits );
+	}
+
+	for ( size_t n=0;n<FluxTargets.size();n++ )
+	{
+		FluxTarget &ft = FluxTargets[n];
+		if ( !ft.Valid ) continue;
+
+		fprintf( fp, "flux %d %d %d %d %.17lg %.17lg %.17lg %d", (int)n, ft.NBinsX, ft.NBinsY, (int)ft.RayCount,
+			ft.CentroidSum[0], ft.CentroidSum[1], ft.CentroidSum[2], (int)ft.CentroidCount );
+		for ( int ix=0;ix<ft.NBinsX;ix++ )
+			for ( int iy=0;iy<ft.NBinsY;iy++ )
+				fprintf( fp, " %.17lg", ft.Grid.at(ix,iy) );
+		for ( int ix=0;ix<ft.NBinsX;ix++ )
+			for ( int iy=0;iy<ft.NBinsY;iy++ )
+				fprintf( fp, " %.17lg", ft.Hits.at(ix,iy) );
+		fprintf( fp, "\n" );
+	}
+
+	fprintf( fp, "rays %d\n", (int)Results.Length );
+
+	bool ok = Results.Length == 0 || Results.WriteCompressedFile( fp );
+	ok = ( fclose( fp ) == 0 ) && ok;
+	return ok;
+}
+
+struct ShardInfo
+{
+	wxString File;
+	int First; // start of the first range, for ordering the records
+	size_t Records;
+	long long RayPos;
+};
+
+static bool ShardOrder( const ShardInfo &a, const ShardInfo &b )
+{
+	return a.First < b.First;
+}
+
+bool Project::MergeShards( const wxArrayString &files, wxString *settings,
+	std::vector< std::pair<int,int> > *ranges, wxArrayString &errors )
+{
+	Results.FreeMemory();
+	Results.SunRayCount = 0;
+
+	for ( size_t j=0;j<StageList.size();j++ )
+	{
+		Stage *stage = StageList[j];
+		stage->RayHits = 0;
+		for ( size_t i=0;i<stage->ElementList.size();i++ )
+			stage->ElementList[i]->RayHits = stage->ElementList[i]->FinalRayHits = 0;
+	}
+
+	for ( size_t n=0;n<FluxTargets.size();n++ )
+	{
+		FluxTarget &ft = FluxTargets[n];
+		ft.Valid = false;
+		ft.RayCount = ft.CentroidCount = 0;
+		ft.CentroidSum[0] = ft.CentroidSum[1] = ft.CentroidSum[2] = 0.0;
+		if ( ft.NBinsX > 0 && ft.NBinsY > 0 )
+		{
+			ft.Grid.resize( ft.NBinsX, ft.NBinsY );
+			ft.Grid.fill( 0.0 );
+			ft.Hits.resize( ft.NBinsX, ft.NBinsY );
+			ft.Hits.fill( 0.0 );
+		}
+	}
+
+	if ( files.size() == 0 )
+	{
+		errors.Add( "no partial results to merge" );
+		return false;
+	}
+
+	// the headers are summed up first, so that the ray data can be read
+	// straight into one allocation afterwards
+	wxString hash, text;
+	std::vector<ShardInfo> shards;
+	std::vector< std::pair<int,int> > covered;
+	size_t total = 0;
+
+	for ( size_t k=0;k<files.size();k++ )
+	{
+		FILE *fp = fopen( files[k].c_str(), "rb" );
+		if ( !fp )
+		{
+			errors.Add( "could not open " + files[k] );
+			return false;
+		}
+
+		ShardInfo info;
+		info.File = files[k];
+		info.First = -1;
+		info.Records = 0;
+		info.RayPos = -1;
+
+		wxString line;
+		bool ok = ReadShardLine( fp, line ) && line == ShardMagic;
+		while ( ok && info.RayPos < 0 && ReadShardLine( fp, line ) )
+		{
+			wxString key = line.BeforeFirst(' ');
+			wxArrayString v = wxSplit( line.AfterFirst(' '), ' ' );
+			if ( key == "hash" )
+			{
+				if ( k == 0 ) hash = line.AfterFirst(' ');
+				ok = line.AfterFirst(' ') == hash;
+				if ( !ok ) errors.Add( files[k] + " was traced with other inputs than " + files[0] );
+			}
+			else if ( key == "settings" )
+			{
+				if ( k == 0 ) text = line.AfterFirst(' ');
+			}
+			else if ( key == "range" && v.size() == 2 )
+			{
+				std::pair<int,int> r( atoi( v[0].c_str() ), atoi( v[1].c_str() ) );
+				covered.push_back( r );
+				if ( info.First < 0 || r.first < info.First )
+					info.First = r.first;
+			}
+			else if ( key == "sun" && v.size() == 5 )
+			{
+				double xmin = atof( v[1].c_str() ), xmax = atof( v[2].c_str() );
+				double ymin = atof( v[3].c_str() ), ymax = atof( v[4].c_str() );
+				if ( k == 0 || xmin < Results.SunXMin ) Results.SunXMin = xmin;
+				if ( k == 0 || xmax > Results.SunXMax ) Results.SunXMax = xmax;
+				if ( k == 0 || ymin < Results.SunYMin ) Results.SunYMin = ymin;
+				if ( k == 0 || ymax > Results.SunYMax ) Results.SunYMax = ymax;
+				Results.SunRayCount += atoi( v[0].c_str() );
+			}
+			else if ( key == "stage" && v.size() == 2 )
+			{
+				Stage *stage = GetStage( atoi( v[0].c_str() ) - 1 );
+				if ( stage ) stage->RayHits += strtoul( v[1].c_str(), 0, 10 );
+			}
+			else if ( key == "element" && v.size() == 4 )
+			{
+				Element *e = GetElement( atoi( v[0].c_str() ) - 1, atoi( v[1].c_str() ) - 1 );
+				if ( e )
+				{
+					e->RayHits += strtoul( v[2].c_str(), 0, 10 );
+					e->FinalRayHits += strtoul( v[3].c_str(), 0, 10 );
+				}
+			}
+			else if ( key == "flux" && v.size() >= 8 )
+			{
+				size_t n = (size_t)atoi( v[0].c_str() );
+				int nx = atoi( v[1].c_str() ), ny = atoi( v[2].c_str() );
+				ok = n < FluxTargets.size() && nx == FluxTargets[n].NBinsX && ny == FluxTargets[n].NBinsY
+					&& v.size() == 8 + 2*(size_t)(nx*ny);
+				if ( !ok )
+				{
+					errors.Add( files[k] + " has flux maps that don't match the project" );
+					break;
+				}
+
+				FluxTarget &ft = FluxTargets[n];
+				ft.Valid = true;
+				ft.RayCount += atoi( v[3].c_str() );
+				for ( int c=0;c<3;c++ )
+					ft.CentroidSum[c] += atof( v[4+c].c_str() );
+				ft.CentroidCount += atoi( v[7].c_str() );
+				// the hit counts follow the grid
+				size_t hits = 8 + (size_t)(nx*ny);
+				for ( int ix=0;ix<nx;ix++ )
+					for ( int iy=0;iy<ny;iy++ )
+					{
+						ft.Grid.at(ix,iy) += atof( v[8+ix*ny+iy].c_str() );
+						ft.Hits.at(ix,iy) += atof( v[hits+ix*ny+iy].c_str() );
+					}
+			}
+			else if ( key == "rays" && v.size() == 1 )
+			{
+				info.Records = (size_t)atol( v[0].c_str() );
+				info.RayPos = TellFile( fp );
+			}
+		}
+
+		fclose( fp );
+
+		if ( ok && (info.RayPos < 0 || info.First < 0) )
+		{
+			errors.Add( files[k] + " is not a complete partial result file" );
+			ok = false;
+		}
+
+		if ( !ok )
+			return false;
+
+		total += info.Records;
+		shards.push_back( info );
+	}
+
+	if ( hash != ContentHash( text ) )
+	{
+		errors.Add( "the partial results were traced from a different project" );
+		return false;
+	}
+
+	if ( settings )
+		*settings = text;
+
+	// every ray may only be traced once
+	std::sort( covered.begin(), covered.end() );
+	for ( size_t i=1;i<covered.size();i++ )
+	{
+		if ( covered[i].first < covered[i-1].second )
+		{
+			errors.Add( wxString::Format( "ray ranges [%d,%d) and [%d,%d) overlap",
+				covered[i-1].first, covered[i-1].second, covered[i].first, covered[i].second ) );
+			return false;
+		}
+	}
+
+	// and all rays of the run have to be there, the ray count is part of
+	// the settings shared by the shards
+	long rays = -1;
+	wxArrayString opts = wxSplit( text, ';' );
+	for ( size_t i=0;i<opts.size();i++ )
+		if ( opts[i].BeforeFirst('=') == "rays" && !opts[i].AfterFirst('=').ToLong( &rays ) )
+			rays = -1;
+
+	if ( rays < 0 )
+	{
+		errors.Add( "the partial results don't record the number of rays of the run" );
+		return false;
+	}
+
+	wxArrayString gaps;
+	long next = 0;
+	for ( size_t i=0;i<covered.size();i++ )
+	{
+		if ( covered[i].first > next )
+			gaps.Add( wxString::Format( "[%ld,%d)", next, covered[i].first ) );
+		next = std::max( next, (long)covered[i].second );
+	}
+	if ( next < rays )
+		gaps.Add( wxString::Format( "[%ld,%ld)", next, rays ) );
+
+	if ( gaps.size() > 0 || next > rays )
+	{
+		if ( gaps.size() > 0 )
+			errors.Add( wxString::Format( "the partial results don't cover all %ld rays of the run, missing ray ranges ", rays ) 
+				+ wxJoin( gaps, ' ' ) );
+		else
+			errors.Add( wxString::Format( "the partial results cover rays beyond the %ld rays of the run", rays ) );
+		return false;
+	}
+
+	if ( ranges )
+		*ranges = covered;
+
+	std::sort( shards.begin(), shards.end(), ShardOrder );
+
+	if ( total > 0 && !Results.AllocMemory( total ) )
+	{
+		errors.Add( "Allocation error merging partial results" );
+		return false;
+	}
+
+	size_t pos = 0;
+	for ( size_t k=0;k<shards.size();k++ )
+	{
+		if ( shards[k].Records == 0 )
+			continue;
+
+		RayData part;
+		FILE *fp = fopen( shards[k].File.c_str(), "rb" );
+		bool ok = fp != 0
+			&& SeekFile( fp, shards[k].RayPos, SEEK_SET )
+			&& part.ReadCompressedFile( fp )
+			&& part.Length == shards[k].Records;
+		if ( fp ) fclose( fp );
+
+		if ( !ok )
+		{
+			errors.Add( "could not read the ray data in " + shards[k].File );
+			Results.FreeMemory();
+			return false;
+		}
+
+		size_t n = part.Length;
+		memcpy( Results.Xi + pos, part.Xi, n*sizeof(double) );
+		memcpy( Results.Yi + pos, part.Yi, n*sizeof(double) );
+		memcpy( Results.Zi + pos, part.Zi, n*sizeof(double) );
+		memcpy( Results.Xc + pos, part.Xc, n*sizeof(double) );
+		memcpy( Results.Yc + pos, part.Yc, n*sizeof(double) );
+		memcpy( Results.Zc + pos, part.Zc, n*sizeof(double) );
+		memcpy( Results.ElementMap + pos, part.ElementMap, n*sizeof(int) );
+		memcpy( Results.StageMap + pos, part.StageMap, n*sizeof(int) );
+		memcpy( Results.RayNumbers + pos, part.RayNumbers, n*sizeof(int) );
+		memcpy( Results.Weights + pos, part.Weights, n*sizeof(double) );
+		memcpy( Results.Absorbed + pos, part.Absorbed, n*sizeof(double) );
+		pos += n;
+	}
+
+	return true;
+}
+
+bool RayData::ReadResultsFromContext(st_context_t spcxt)
+{
+	int npoints = ::st_num_intersections(spcxt);
+	if (npoints < 0)
+		return false;
+
+	if (!AllocMemory(npoints))
+		return false;
+	
+	::st_locations( spcxt, Xi, Yi, Zi );
+	::st_cosines( spcxt, Xc, Yc, Zc );
+	::st_elementmap( spcxt, ElementMap );
+	::st_stagemap( spcxt, StageMap );
+	::st_raynumbers( spcxt, RayNumbers );
+	::st_weights( spcxt, Weights );
+	::st_absorbed( spcxt, Absorbed );
+
+	::st_sun_stats( spcxt, &SunXMin, &SunXMax, &SunYMin, &SunYMax, &SunRayCount );
+	return true;
+}
+
+size_t RayData::PrepareExport( int coords, int istage )
+{
+	m_index = 0;
+	m_expCoords = coords;
+	m_expStage = istage;
+
+	m_expRecords = 0;
+	m_expCount = Length;
+	if ( istage > 0 )
+		m_expRecords = GetRecords( istage, -1, &m_expCount );
+
+	return m_expCount;
+}
+
+bool RayData::GetNextExport( Project &prj, double Pos[3], double Cos[3], 
+	int &Elm, int &Stg, int &Ray )
+{
+	if ( m_index >= m_expCount )
+		return false;
+
+	size_t idx = m_expRecords != 0 ? m_expRecords[m_index] : m_index;
+
+	bool ok = Transform( prj, m_expCoords, idx, Pos, Cos, Elm, Stg, Ray );
+	
+	m_index++;
+
+	return ok;
+}
+
+// compact protocol encoder for the thrift structures of a parquet file
+class ThriftWriter
+{
+	std::string &m_out;
+	std::vector<int> m_lastField;
+
+public:
+	ThriftWriter( std::string &out ) : m_out( out ) { m_lastField.push_back( 0 ); }
+
+	void Varint( unsigned long long v )
+	{
+		while ( v >= 0x80 )
+		{
+			m_out += (char)( (v & 0x7f) | 0x80 );
+			v >>= 7;
+		}
+		m_out += (char)v;
+	}
+	void Zigzag( long long v ) { Varint( ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63) ); }
+	void Bytes( const std::string &s ) { Varint( s.size() ); m_out += s; }
+
+	void Field( int id, int type )
+	{
+		int delta = id - m_lastField.back();
+		if ( delta > 0 && delta <= 15 )
+			m_out += (char)( (delta << 4) | type );
+		else
+		{
+			m_out += (char)type;
+			Zigzag( id );
+		}
+		m_lastField.back() = id;
+	}
+
+	void ListHeader( int type, size_t n )
+	{
+		if ( n < 15 )
+			m_out += (char)( (n << 4) | type );
+		else
+		{
+			m_out += (char)( 0xf0 | type );
+			Varint( n );
+		}
+	}
+
+	enum { I32 = 5, I64 = 6, BINARY = 8, LIST = 9, STRUCT = 12 };
+
+	void FieldI32( int id, int v ) { Field( id, I32 ); Zigzag( v ); }
+	void FieldI64( int id, long long v ) { Field( id, I64 ); Zigzag( v ); }
+	void FieldString( int id, const std::string &s ) { Field( id, BINARY ); Bytes( s ); }
+	void FieldList( int id, int type, size_t n ) { Field( id, LIST ); ListHeader( type, n ); }
+	void BeginStruct( int id ) { Field( id, STRUCT ); m_lastField.push_back( 0 ); }
+	void BeginElement() { m_lastField.push_back( 0 ); }
+	void End() { m_out += (char)0; m_lastField.pop_back(); }
+};
+
+static const int NExportColumns = 10;
+static const char *ExportColumnNames[NExportColumns] = { "pos_x", "pos_y", "pos_z", 
+	"cos_x", "cos_y", "cos_z", "element", "stage", "ray_number", "weight" };
+
+static bool ExportColumnDouble( int col ) { return col < 6 || col == 9; }
+static size_t ExportColumnSize( int col ) { return ExportColumnDouble( col ) ? sizeof(double) : sizeof(int); }
+
+// one block of the exported records, transformed and encoded
+struct ExportBlock
+{
+	size_t Start, Count;
+	std::string Data[NExportColumns]; // the text for csv, otherwise one column each
+
+	void Encode( Project &prj, int format, int coords, const size_t *records, bool weights )
+	{
+		RayData &rd = prj.Results;
+		double Pos[3], Cos[3];
+		int Elm, Stg, Ray;
+		char buf[256];
+
+		for ( int k=0;k<NExportColumns;k++ )
+			Data[k].clear();
+
+		if ( format == RayData::EXPORT_CSV )
+		{
+			Data[0].reserve( Count*96 );
+			for ( size_t i=0;i<Count;i++ )
+			{
+				size_t idx = records != 0 ? records[Start+i] : Start+i;
+				rd.Transform( prj, coords, idx, Pos, Cos, Elm, Stg, Ray );
+				int nb = sprintf( buf, "%lg,%lg,%lg,%lg,%lg,%lg,%d,%d,%d",
+					Pos[0], Pos[1], Pos[2],
+					Cos[0], Cos[1], Cos[2],
+					Elm, Stg, Ray );
+				if ( weights )
+					nb += sprintf( buf+nb, ",%lg", rd.Weights[idx] );
+				buf[nb++] = '\n';
+				Data[0].append( buf, nb );
+			}
+			return;
+		}
+
+		if ( format == RayData::EXPORT_PARQUET )
+		{
+			// each column of a block is one data page of a row group
+			for ( int k=0;k<NExportColumns;k++ )
+			{
+				int size = (int)(Count*ExportColumnSize(k));
+				ThriftWriter t( Data[k] );
+				t.FieldI32( 1, 0 ); // DATA_PAGE
+				t.FieldI32( 2, size );
+				t.FieldI32( 3, size );
+				t.BeginStruct( 5 );
+				t.FieldI32( 1, (int)Count );
+				t.FieldI32( 2, 0 ); // PLAIN
+				t.FieldI32( 3, 3 ); // RLE, required columns have no levels
+				t.FieldI32( 4, 3 );
+				t.End();
+				t.End();
+			}
+		}
+
+		// the values are written in the host byte order, which is
+		// little-endian on all of the supported platforms
+		char *col[NExportColumns];
+		for ( int k=0;k<NExportColumns;k++ )
+		{
+			size_t header = Data[k].size();
+			Data[k].resize( header + Count*ExportColumnSize(k) );
+			col[k] = &Data[k][header];
+		}
+
+		for ( size_t i=0;i<Count;i++ )
+		{
+			size_t idx = records != 0 ? records[Start+i] : Start+i;
+			rd.Transform( prj, coords, idx, Pos, Cos, Elm, Stg, Ray );
+			memcpy( col[0] + i*sizeof(double), &Pos[0], sizeof(double) );
+			memcpy( col[1] + i*sizeof(double), &Pos[1], sizeof(double) );
+			memcpy( col[2] + i*sizeof(double), &Pos[2], sizeof(double) );
+			memcpy( col[3] + i*sizeof(double), &Cos[0], sizeof(double) );
+			memcpy( col[4] + i*sizeof(double), &Cos[1], sizeof(double) );
+			memcpy( col[5] + i*sizeof(double), &Cos[2], sizeof(double) );
+			memcpy( col[6] + i*sizeof(int), &Elm, sizeof(int) );
+			memcpy( col[7] + i*sizeof(int), &Stg, sizeof(int) );
+			memcpy( col[8] + i*sizeof(int), &Ray, sizeof(int) );
+			memcpy( col[9] + i*sizeof(double), rd.Weights + idx, sizeof(double) );
+		}
+	}
+};
+
+struct ExportJob
+{
+	ExportBlock *blocks;
+	Project *prj;
+	int format, coords;
+	const size_t *records;
+	bool weights; // csv files only have a weight column for weighted traces
+};
+
+static void EncodeExportBlock( void *data, size_t i )
+{
+	ExportJob *job = (ExportJob*)data;
+	job->blocks[i].Encode( *job->prj, job->format, job->coords, job->records, job->weights );
+}
+
+int RayData::ExportFormat( const wxString &file )
+{
+	wxString ext = file.AfterLast('.').Lower();
+	if ( ext == "parquet" )
+		return EXPORT_PARQUET;
+	else if ( ext == "stcol" )
+		return EXPORT_COLUMNS;
+	else
+		return EXPORT_CSV;
+}
+
+bool RayData::WriteExport( Project &prj, const wxString &file, int format, int coords, int istage,
+	bool (*progress)( size_t nwritten, size_t ntotal, void *data ), void *data )
+{
+	FILE *fp = fopen( file.c_str(), "wb" );
+	if ( !fp ) return false;
+
+	size_t count = Length;
+	const size_t *records = 0;
+	if ( istage > 0 )
+		records = GetRecords( istage, -1, &count );
+
+	bool weights = HasWeights();
+
+	// offsets of the columns in a column file, after a json header that is
+	// padded to a multiple of 64 bytes
+	unsigned long long offset[NExportColumns];
+	if ( format == EXPORT_CSV )
+	{
+		fputs( weights ? "Pos X,Pos Y,Pos Z,Cos X,Cos Y,Cos Z,Element,Stage,Ray Number,Weight\n"
+			: "Pos X,Pos Y,Pos Z,Cos X,Cos Y,Cos Z,Element,Stage,Ray Number\n", fp );
+	}
+	else if ( format == EXPORT_COLUMNS )
+	{
+		const char *cs = coords == COORD_ELEMENT ? "element" : ( coords == COORD_STAGE ? "stage" : "global" );
+
+		// the header has to be long enough for the offsets that depend on it
+		std::string text;
+		size_t header = 64;
+		for (;;)
+		{
+			wxString json = wxString::Format( "{\"format\":\"soltrace-columns\",\"version\":1,\"rows\":%llu,"
+				"\"coordinates\":\"%s\",\"stage\":%d,\"byte_order\":\"little\",\"columns\":[",
+				(unsigned long long)count, cs, istage );
+			for ( int k=0;k<NExportColumns;k++ )
+			{
+				offset[k] = k == 0 ? header : offset[k-1] + (unsigned long long)count*ExportColumnSize(k-1);
+				json += wxString::Format( "%s{\"name\":\"%s\",\"type\":\"%s\",\"offset\":%llu}", 
+					k > 0 ? "," : "", ExportColumnNames[k], ExportColumnDouble( k ) ? "float64" : "int32", offset[k] );
+			}
+			json += "]}";
+
+			text = json.ToStdString();
+			if ( text.size() < header )
+				break;
+
+			header = (text.size()/64 + 1)*64;
+		}
+
+		text.resize( header-1, ' ' );
+		text += '\n';
+		fwrite( text.c_str(), 1, text.size(), fp );
+	}
+	else
+		fwrite( "PAR1", 1, 4, fp );
+
+	// blocks of records are encoded on all cpus, then written in order
+	size_t block = format == EXPORT_CSV ? 65536 : 131072;
+	size_t nthreads = wxThread::GetCPUCount();
+	if ( nthreads < 1 ) nthreads = 1;
+	std::vector<ExportBlock> blocks( nthreads );
+
+	// parquet row groups, described in the footer at the end
+	std::vector<size_t> groupRows;
+	std::vector<unsigned long long> pageOffsets, pageSizes;
+	unsigned long long fileOffset = 4;
+
+	bool ok = true, canceled = false;
+	size_t nwritten = 0;
+	while ( ok && nwritten < count )
+	{
+		size_t nblocks = 0;
+		for ( size_t t=0;t<nthreads && nwritten + t*block < count;t++ )
+		{
+			blocks[t].Start = nwritten + t*block;
+			blocks[t].Count = std::min( block, count - blocks[t].Start );
+			nblocks++;
+		}
+
+		ExportJob job = { &blocks[0], &prj, format, coords, records, weights };
+		RunParallel( EncodeExportBlock, &job, nblocks );
+
+		for ( size_t t=0;ok && t<nblocks;t++ )
+		{
+			ExportBlock &b = blocks[t];
+			if ( format == EXPORT_CSV )
+				ok = fwrite( b.Data[0].c_str(), 1, b.Data[0].size(), fp ) == b.Data[0].size();
+			else if ( format == EXPORT_COLUMNS )
+			{
+				for ( int k=0;ok && k<NExportColumns;k++ )
+					ok = SeekFile( fp, (long long)( offset[k] + (unsigned long long)b.Start*ExportColumnSize(k) ), SEEK_SET )
+						&& fwrite( b.Data[k].c_str(), 1, b.Data[k].size(), fp ) == b.Data[k].size();
+			}
+			else
+			{
+				groupRows.push_back( b.Count );
+				for ( int k=0;ok && k<NExportColumns;k++ )
+				{
+					pageOffsets.push_back( fileOffset );
+					pageSizes.push_back( b.Data[k].size() );
+					fileOffset += b.Data[k].size();
+					ok = fwrite( b.Data[k].c_str(), 1, b.Data[k].size(), fp ) == b.Data[k].size();
+				}
+			}
+
+			nwritten += b.Count;
+		}
+
+		if ( ok && progress != 0 && !(*progress)( nwritten, count, data ) )
+		{
+			canceled = true;
+			break;
+		}
+	}
+
+	if ( ok && !canceled && format == EXPORT_PARQUET )
+	{
+		std::string footer;
+		ThriftWriter t( footer );
+		t.FieldI32( 1, 1 ); // version
+		t.FieldList( 2, ThriftWriter::STRUCT, NExportColumns+1 );
+		t.BeginElement();
+		t.FieldString( 4, "schema" );
+		t.FieldI32( 5, NExportColumns );
+		t.End();
+		for ( int k=0;k<NExportColumns;k++ )
+		{
+			t.BeginElement();
+			t.FieldI32( 1, ExportColumnDouble( k ) ? 5 : 1 ); // DOUBLE or INT32
+			t.FieldI32( 3, 0 ); // REQUIRED
+			t.FieldString( 4, ExportColumnNames[k] );
+			t.End();
+		}
+		t.FieldI64( 3, (long long)nwritten );
+		t.FieldList( 4, ThriftWriter::STRUCT, groupRows.size() );
+		for ( size_t g=0;g<groupRows.size();g++ )
+		{
+			unsigned long long total = 0;
+			t.BeginElement();
+			t.FieldList( 1, ThriftWriter::STRUCT, NExportColumns );
+			for ( int k=0;k<NExportColumns;k++ )
+			{
+				unsigned long long off = pageOffsets[NExportColumns*g+k], size = pageSizes[NExportColumns*g+k];
+				total += size;
+
+				t.BeginElement();
+				t.FieldI64( 2, (long long)off );
+				t.BeginStruct( 3 );
+				t.FieldI32( 1, ExportColumnDouble( k ) ? 5 : 1 );
+				t.FieldList( 2, ThriftWriter::I32, 1 );
+				t.Zigzag( 0 ); // PLAIN
+				t.FieldList( 3, ThriftWriter::BINARY, 1 );
+				t.Bytes( ExportColumnNames[k] );
+				t.FieldI32( 4, 0 ); // UNCOMPRESSED
+				t.FieldI64( 5, (long long)groupRows[g] );
+				t.FieldI64( 6, (long long)size );
+				t.FieldI64( 7, (long long)size );
+				t.FieldI64( 9, (long long)off );
+				t.End();
+				t.End();
+			}
+			t.FieldI64( 2, (long long)total );
+			t.FieldI64( 3, (long long)groupRows[g] );
+			t.End();
+		}
+		t.FieldString( 6, "SolTrace" );
+		t.End();
+
+		unsigned int len = (unsigned int)footer.size();
+		ok = fwrite( footer.c_str(), 1, footer.size(), fp ) == footer.size()
+			&& fwrite( &len, 4, 1, fp ) == 1
+			&& fwrite( "PAR1", 1, 4, fp ) == 4;
+	}
+
+	if ( ferror( fp ) ) ok = false;
+	fclose( fp );
+
+	// a partial file is not left behind
+	if ( !ok || canceled )
+	{
+		int err = errno;
+		wxRemoveFile( file );
+		errno = err;
+		return false;
+	}
+
+	return true;
+}
+
+bool RayData::Transform( Project &prj, int coord, size_t idx, double Pos[3], double Cos[3], 
+	int &Elm, int &Stg, int &Ray )
+{
+
+	if ( idx >= Length ) return false;
+
+	double origin[3], posin[3], cosin[3];
+
+	Pos[0] = posin[0] = Xi[idx];
+	Pos[1] = posin[1] = Yi[idx];
+	Pos[2] = posin[2] = Zi[idx];
 
 	Cos[0] = cosin[0] = Xc[idx];
 	Cos[1] = cosin[1] = Yc[idx];
@@ -1078,6 +2553,7 @@ void ElementStatistics::ResetData()
 	xValues.clear();
 	yValues.clear();
 	fluxGrid.clear();
+	hitGrid.clear();
 
 	binszx = binszy = 0.0;
 	PowerPerRay = 0.0;
@@ -1089,6 +2565,16 @@ void ElementStatistics::ResetData()
 	NumberOfRays = 0;
 }
 
+FluxRequest::FluxRequest()
+{
+	StageIdx = ElementIdx = 0;
+	NBinsX = NBinsY = 0;
+	AutoScale = true;
+	FinalOnly = false;
+	MinX = MaxX = MinY = MaxY = 0.0;
+	Ok = false;
+}
+
 bool ElementStatistics::Compute(
 		int stageIdx, int elementIdx,
 		int nbinsx, int nbinsy,
@@ -1096,8 +2582,189 @@ bool ElementStatistics::Compute(
 		double dni,
 		double &minx, double &miny,
 		double &maxx, double &maxy )
+{
+	std::vector<FluxRequest> req(1);
+	req[0].StageIdx = stageIdx;
+	req[0].ElementIdx = elementIdx;
+	req[0].NBinsX = nbinsx;
+	req[0].NBinsY = nbinsy;
+	req[0].AutoScale = autoscale;
+	req[0].FinalOnly = finalonly;
+	req[0].MinX = minx;
+	req[0].MaxX = maxx;
+	req[0].MinY = miny;
+	req[0].MaxY = maxy;
+
+	std::vector<ElementRecords> elements;
+	std::vector<int> slots;
+	FindRecords( m_prj, req, elements, slots );
+
+	bool ok = Compute( req[0], dni, slots[0] >= 0 ? &elements[slots[0]] : 0 );
+
+	minx = req[0].MinX;
+	maxx = req[0].MaxX;
+	miny = req[0].MinY;
+	maxy = req[0].MaxY;
+
+	return ok;
+}
+
+// the requests on one element, which share its records
+struct FluxRequestGroup
+{
+	int Slot;
+	std::vector<size_t> Requests;
+};
+
+struct ElementStatistics::ComputeJob
+{
+	std::vector<FluxRequestGroup> *groups;
+	std::vector<FluxRequest> *requests;
+	std::vector<ElementRecords> *elements;
+	std::vector<ElementStatistics> *stats;
+	double dni;
+	size_t nthreads;
+};
+
+void ElementStatistics::ComputeGroups( void *data, size_t t )
+{
+	ComputeJob *job = (ComputeJob*)data;
+	for ( size_t g=t;g<job->groups->size();g+=job->nthreads )
+	{
+		FluxRequestGroup &group = (*job->groups)[g];
+		const ElementRecords *recs = group.Slot >= 0 ? &(*job->elements)[group.Slot] : 0;
+		for ( size_t k=0;k<group.Requests.size();k++ )
+		{
+			size_t i = group.Requests[k];
+			(*job->stats)[i].Compute( (*job->requests)[i], job->dni, recs );
+		}
+	}
+}
+
+size_t ElementStatistics::ComputeMany( Project &prj,
+		std::vector<FluxRequest> &requests, double dni,
+		std::vector<ElementStatistics> &stats )
+{
+	// the ray data index is built here, before the threads read it
+	std::vector<ElementRecords> elements;
+	std::vector<int> slots;
+	FindRecords( prj, requests, elements, slots );
+
+	stats.clear();
+	stats.reserve( requests.size() );
+	for (size_t i=0;i<requests.size();i++)
+		stats.push_back( ElementStatistics( prj ) );
+
+	// the elements are binned on all cpus, each request only writes its own
+	// statistics and the project and ray data are only read
+	std::vector<FluxRequestGroup> groups( elements.size() );
+	for (size_t k=0;k<elements.size();k++)
+		groups[k].Slot = (int)k;
+	for (size_t i=0;i<requests.size();i++)
+	{
+		if ( slots[i] >= 0 )
+			groups[ slots[i] ].Requests.push_back( i );
+		else
+		{
+			groups.push_back( FluxRequestGroup() );
+			groups.back().Slot = -1;
+			groups.back().Requests.push_back( i );
+		}
+	}
+
+	size_t nthreads = wxThread::GetCPUCount();
+	if ( nthreads < 1 ) nthreads = 1;
+	if ( nthreads > groups.size() ) nthreads = groups.size();
+
+	ComputeJob job = { &groups, &requests, &elements, &stats, dni, nthreads };
+	RunParallel( ComputeGroups, &job, nthreads );
+
+	size_t nok = 0;
+	for (size_t i=0;i<requests.size();i++)
+		if ( requests[i].Ok )
+			nok++;
+
+	return nok;
+}
+
+void ElementStatistics::FindRecords( Project &prj,
+		const std::vector<FluxRequest> &requests,
+		std::vector<ElementRecords> &elements,
+		std::vector<int> &slots )
+{
+	// each requested element gets one slot with the records that the
+	// ray data index lists for it, so only the relevant records are touched
+	std::vector< std::vector<int> > table( prj.StageList.size() );
+	for (size_t i=0;i<table.size();i++)
+		table[i].assign( prj.StageList[i]->ElementList.size(), -1 );
+
+	elements.clear();
+	slots.assign( requests.size(), -1 );
+
+	RayData *rd = &prj.Results;
+
+	for (size_t n=0;n<requests.size();n++)
+	{
+		const FluxRequest &r = requests[n];
+		if ( r.StageIdx < 0 || r.StageIdx >= (int)table.size()
+			|| r.ElementIdx < 0 || r.ElementIdx >= (int)table[r.StageIdx].size() )
+			continue;
+
+		// a flux map binned during the trace doesn't need the ray data
+		if ( !r.AutoScale && prj.FindFluxTarget( r.StageIdx, r.ElementIdx,
+				r.NBinsX, r.NBinsY, r.MinX, r.MaxX, r.MinY, r.MaxY, r.FinalOnly ) )
+			continue;
+
+		int &slot = table[r.StageIdx][r.ElementIdx];
+		slots[n] = slot;
+		if ( slot >= 0 )
+			continue;
+
+		slots[n] = slot = (int)elements.size();
+		elements.push_back( ElementRecords() );
+		ElementRecords &recs = elements.back();
+		recs.Elm = prj.StageList[r.StageIdx]->ElementList[r.ElementIdx];
+		recs.Count = 0;
+		recs.Records = rd->GetRecords( r.StageIdx+1, r.ElementIdx+1, &recs.Count );
+	}
+}
+
+void ElementStatistics::ElementRecords::ToElement( const RayData &rd, size_t j, double pos[3] ) const
+{
+	// convert from stage to element coordinate system, the ray data is
+	// untranslated in stage coordinates
+	size_t i = Records[j];
+	double Origin[3], PosStage[3], CosStage[3], CosElement[3];
+
+	Origin[0] = Elm->X;
+	Origin[1] = Elm->Y;
+	Origin[2] = Elm->Z;
+	PosStage[0] = rd.Xi[i];
+	PosStage[1] = rd.Yi[i];
+	PosStage[2] = rd.Zi[i];
+	CosStage[0] = rd.Xc[i];
+	CosStage[1] = rd.Yc[i];
+	CosStage[2] = rd.Zc[i];
+
+	::st_transform_to_local( PosStage, CosStage,
+		Origin, Elm->RRefToLoc,
+		pos, CosElement );
+}
+
+bool ElementStatistics::ElementRecords::IsLast( const RayData &rd, size_t j ) const
+{
+	// the records of a ray on the element are next to each other
+	return j+1 >= Count || rd.RayNumbers[ Records[j+1] ] != rd.RayNumbers[ Records[j] ];
+}
+
+bool ElementStatistics::Compute( FluxRequest &req, double dni, const ElementRecords *recs )
 {
 	ResetData();
+	req.Ok = false;
+
+	int stageIdx = req.StageIdx, elementIdx = req.ElementIdx;
+	int nbinsx = req.NBinsX, nbinsy = req.NBinsY;
+	double &minx = req.MinX, &maxx = req.MaxX, &miny = req.MinY, &maxy = req.MaxY;
 
 	if (stageIdx < 0 || stageIdx >= m_prj.StageList.size()
 		|| elementIdx < 0 || elementIdx >= m_prj.StageList[stageIdx]->ElementList.size())
@@ -1112,42 +2779,29 @@ bool ElementStatistics::Compute(
 		return false;
 	}
 
+	// use a flux map binned during the trace if one was set up for this grid
+	FluxTarget *ft = req.AutoScale ? 0 : m_prj.FindFluxTarget( stageIdx, elementIdx,
+		nbinsx, nbinsy, minx, maxx, miny, maxy, req.FinalOnly );
+
 	RayData *rd = &m_prj.Results;
-	if ( autoscale )
+	if ( req.AutoScale )
 	{
 		minx = miny = 1e199;
 		maxx = maxy = -1e199;
-		double Origin[3], PosStage[3], CosStage[3], PosElement[3], CosElement[3];
 
-		// automatically size the min/max x
-		for (size_t i=0;i<rd->Length;i++)
+		// automatically size the min/max x, in a pass of its own since the
+		// bins are only known once all points are
+		double pos[3];
+		for (size_t j=0;recs != 0 && j<recs->Count;j++)
 		{
-			if (abs(rd->ElementMap[i]) == elementIdx+1
-				&& rd->StageMap[i] == stageIdx+1)
-			{
-				// convert from stage to element coordinate system
-				PosStage[0] = rd->Xi[i];
-				PosStage[1] = rd->Yi[i];
-				PosStage[2] = rd->Zi[i];
-				CosStage[0] = rd->Xc[i];
-				CosStage[1] = rd->Yc[i];
-				CosStage[2] = rd->Zc[i];
-				Origin[0] = elm->X;
-				Origin[1] = elm->Y;
-				Origin[2] = elm->Z;
-
-				::st_transform_to_local( PosStage, CosStage,
-					Origin, elm->RRefToLoc,
-					PosElement, CosElement );
-
-				double x = PosElement[0];
-				double y = PosElement[1];
-
-				if (x < minx) minx = x;
-				if (x > maxx) maxx = x;
-				if (y < miny) miny = y;
-				if (y > maxy) maxy = y;
-			}
+			recs->ToElement( *rd, j, pos );
+			double x = pos[0];
+			double y = pos[1];
+
+			if (x < minx) minx = x;
+			if (x > maxx) maxx = x;
+			if (y < miny) miny = y;
+			if (y > maxy) maxy = y;
 		}
 	}
 
@@ -1174,15 +2828,14 @@ bool ElementStatistics::Compute(
 	xValues.resize(nbinsx);
 	yValues.resize(nbinsy);
 	fluxGrid.resize(nbinsx, nbinsy);
+	hitGrid.resize(nbinsx, nbinsy);
 
-	double zval = 0;
-	BinRaysXY(elm,
-			  stageIdx,
-			  elementIdx,
-		finalonly,  // final rays only (i.e. only absorbed ones)
-		Radius,
-		minx, miny,
-		zval, NumberOfRays); // 'out' variables
+	if ( ft != 0 )
+		CopyFluxTarget( *ft, minx, miny );
+	else
+		BinPoints( recs, tolower(elm->SurfaceIndex)=='t',
+			req.FinalOnly,  // final rays only (i.e. only absorbed ones)
+			minx, miny );
 
 	double SumFlux, SumFlux2;
 	PeakFlux=SumFlux=SumFlux2=0;
@@ -1209,13 +2862,13 @@ bool ElementStatistics::Compute(
 			if (z>PeakFlux)
 			{
 				PeakFlux = z;
-				NRaysInPeakFluxBin = (int)fluxGrid.at(r,c);
+				NRaysInPeakFluxBin = (int)hitGrid.at(r,c);
 			}
 
 			if (z<MinFlux)
 			{
 				MinFlux = z;
-				NRaysInMinFluxBin = (int)fluxGrid.at(r,c);
+				NRaysInMinFluxBin = (int)hitGrid.at(r,c);
 			}
 		}
 	}
@@ -1224,141 +2877,104 @@ bool ElementStatistics::Compute(
 	SigmaFlux = sqrt( (nbinsx*nbinsy*SumFlux2-SumFlux*SumFlux)/(nbinsx*nbinsy*nbinsx*nbinsy) );
 	Uniformity = SigmaFlux/AveFlux;
 	PeakFluxUncertainty = 100/sqrt((double)NRaysInPeakFluxBin);
-	AveFluxUncertainty = 100/sqrt((double)rd->Length);
+	AveFluxUncertainty = 100/sqrt((double)(rd->Length > 0 ? rd->Length : NumberOfRays));
 
+	req.Ok = true;
 	return true;
 }
 
-void ElementStatistics::BinRaysXY( Element *elm,
-								  int stageIdx,
-								  int elementIdx,
+// index of the bin (lo+i*sz, lo+(i+1)*sz] that holds v, -1 if below the
+// first bin.  the estimate is corrected against the bin edges so that
+// round off gives the same answer as stepping through the edges one by one
+static inline int BinIndex( double v, double lo, double sz, int nbins )
+{
+	if ( !(v > lo) )
+		return -1;
+
+	double f = (v - lo)/sz;
+	if ( f > nbins + 1 )
+		return nbins;
+
+	int i = (int)ceil( f ) - 1;
+	while ( i >= 0 && lo + i*sz >= v )
+		i--;
+	while ( lo + (i+1)*sz < v )
+		i++;
+
+	return i;
+}
+
+void ElementStatistics::BinPoints( const ElementRecords *recs,
+							  bool iscylinder,
 							  bool AbsorbedOnly,
-							  double Radius,
 							  double xmin,
-							  double ymin,
-							  double &ZVal,
-							  size_t &RayCount)
-{
-	 /*
-  Input -   SurfaceType = 1 Plane
-						  2 Cylinder
-			Radius = Radius of cylinder if SurfaceType = 2
-			NumberOfRays = Total Number of Rays traced from sun
-			iNumBinsX( or Y) = Number of bins in X and Y directions
-			BinSizeX( or Y)  = Size of rectangular bin in X and Y directions
-			XMin and YMin = minimum values for data grid
-  Output -  fluxGrid = Data grid containing tallied raycounts within each bin
-			ZVal = Z value of plane for planar surfaces or Radius of cylinder for cylindrical surfaces
-			raycountf = total number of rays which intersected the plane or the cylinder}
-
-*/
-	RayData *rd = &m_prj.Results; // untranslated in stage coordinates
-	int i;
-	double x, y, z;
-	int GridIncrementX, GridIncrementY;
-	std::vector<int> ElementIndexArray;
-
-	//PosStage, CosStage, PosElement, CosElement: T1DArray;
-	RayCount = 0;
+							  double ymin )
+{
+	/*
+	Tallies the last intersection of each ray with the element into fluxGrid,
+	or for absorbed flux every intersection with the power it left there, which
+	is the whole ray where it was absorbed and a share of it for weighted rays.
+	Cylinders are unrolled around the axis, with Radius = 1/CurvOfRev.
+	NumberOfRays gets the number of rays that fell inside the grid.
+	*/
+
+	NumberOfRays = 0;
 	size_t NotBinned = 0;
 
 	size_t npoints = 0;
 	Centroid[0] = Centroid[1] = Centroid[2] = 0.0;
 
 	fluxGrid.fill( 0.0 );
+	hitGrid.fill( 0.0 );
 
-	// pre collect element indexes of interest
-	for (i=0;i<(int)rd->Length;i++)
-		if (abs(rd->ElementMap[i]) == elementIdx+1 && rd->StageMap[i] == stageIdx+1)
-			ElementIndexArray.push_back( i );
-
-	double Origin[3], PosStage[3], CosStage[3], PosElement[3], CosElement[3];
-
-	Origin[0] = elm->X;
-	Origin[1] = elm->Y;
-	Origin[2] = elm->Z;
+	int nbinsx = (int)fluxGrid.nrows();
+	int nbinsy = (int)fluxGrid.ncols();
 
-	bool iscylinder = (tolower(elm->SurfaceIndex)=='t');
-
-	for (size_t j=0;j<ElementIndexArray.size();j++)
+	const RayData &rd = m_prj.Results;
+	double pos[3];
+	for (size_t j=0;recs != 0 && j<recs->Count;j++)
 	{
-
-		if (j==ElementIndexArray.size()-1
-			|| rd->RayNumbers[ ElementIndexArray[j] ] != rd->RayNumbers[ ElementIndexArray[j+1] ])
+		size_t i = recs->Records[j];
+		double power = AbsorbedOnly ? rd.Absorbed[i] : rd.Weights[i];
+		if ( AbsorbedOnly ? !(power > 0) : !recs->IsLast( rd, j ) )
+			continue;
+
+		recs->ToElement( rd, j, pos );
+		double x = pos[0];
+		double y = pos[1];
+		double z = pos[2];
+
+		Centroid[0] += x;
+		Centroid[1] += y;
+		Centroid[2] += z;
+		npoints++;
+
+		if (iscylinder)
 		{
-			i = ElementIndexArray[j];
-
-			if (AbsorbedOnly && rd->ElementMap[i] >= 0)
-				continue; //if accounting for absorbed rays only, (not all final ray intersections, only absorbed)
-
-			PosStage[0] = rd->Xi[i]; //convert to element coordinate system
-			PosStage[1] = rd->Yi[i];
-			PosStage[2] = rd->Zi[i];
-			CosStage[0] = rd->Xc[i];
-			CosStage[1] = rd->Yc[i];
-			CosStage[2] = rd->Zc[i];
-
-			::st_transform_to_local( PosStage, CosStage,
-									 Origin, elm->RRefToLoc,
-									 PosElement, CosElement );
-
-			x = PosElement[0];
-			y = PosElement[1];
-			z = PosElement[2];
-
-			Centroid[0] += x;
-			Centroid[1] += y;
-			Centroid[2] += z;
-			npoints++;
-
-			if (iscylinder)
+			if (z<=Radius)
+				x = Radius*asin(x/Radius);
+			else if (z > Radius)
 			{
-				ZVal = Radius;
-				if (z<=Radius)
-					x = Radius*asin(x/Radius);
-				else if (z > Radius)
-				{
-					if (x < 0) x = -(M_PI*Radius/2.0 + Radius*acos(fabs(x)/Radius));
-					if (x >= 0) x = M_PI*Radius/2.0 + Radius*acos(x/Radius);
-				}
+				if (x < 0) x = -(M_PI*Radius/2.0 + Radius*acos(fabs(x)/Radius));
+				if (x >= 0) x = M_PI*Radius/2.0 + Radius*acos(x/Radius);
 			}
-			else
-			{
-				ZVal = z; //offload z position of flux surface
-			}
-
-			GridIncrementX = -1; //initialize grid increment counters
-			GridIncrementY = -1;
-
-			//determine which bin the ray falls into
-			while ((xmin + (GridIncrementX+1)*binszx) < x)
-				GridIncrementX++;
+		}
 
-			while ((ymin + (GridIncrementY+1)*binszy) < y)
-				GridIncrementY++;
+		int GridIncrementX = BinIndex( x, xmin, binszx, nbinsx );
+		int GridIncrementY = BinIndex( y, ymin, binszy, nbinsy );
 
-			if (GridIncrementX >= 0 && GridIncrementX < (int)fluxGrid.nrows()
-				&& GridIncrementY >= 0 && GridIncrementY < (int)fluxGrid.ncols() )
-			{
-				fluxGrid.at(GridIncrementX,GridIncrementY) += 1;//if ray falls inside a bin, increment count for that bin
-				RayCount++;  //increment ray intersection counter
-			}
-			else
-			{
-				NotBinned++;
-			//	qDebug("Not binned: [%d %d],  x=%lg, y=%lg", GridIncrementX, GridIncrementY, x, y);
-			}
+		if (GridIncrementX >= 0 && GridIncrementX < nbinsx
+			&& GridIncrementY >= 0 && GridIncrementY < nbinsy )
+		{
+			fluxGrid.at(GridIncrementX,GridIncrementY) += power;//if ray falls inside a bin, add its power (1 unless weighted) to that bin
+			hitGrid.at(GridIncrementX,GridIncrementY) += 1;
+			NumberOfRays++;  //increment ray intersection counter
 		}
+		else
+			NotBinned++;
 	}
 
-	//qDebug("BinRaysXY: RayCount=%u NotBinned=%u", RayCount, NotBinned);
-
-	//calculate midpoints of bins
-	for (i=0;i<xValues.size();i++)
-		xValues[i] = xmin + binszx/2.0 + i*binszx;
-
-	for (i=0;i<yValues.size();i++)
-		yValues[yValues.size()-i-1] = ymin + binszy/2.0 + i*binszy;
+	CalcBinMidpoints( xmin, ymin );
 
 	if (npoints > 0)
 	{
@@ -1368,3 +2984,29 @@ void ElementStatistics::BinRaysXY( Element *elm,
 	}
 }
 
+void ElementStatistics::CalcBinMidpoints( double xmin, double ymin )
+{
+	for (size_t i=0;i<xValues.size();i++)
+		xValues[i] = xmin + binszx/2.0 + i*binszx;
+
+	for (size_t i=0;i<yValues.size();i++)
+		yValues[yValues.size()-i-1] = ymin + binszy/2.0 + i*binszy;
+}
+
+void ElementStatistics::CopyFluxTarget( const FluxTarget &ft, double xmin, double ymin )
+{
+	fluxGrid = ft.Grid;
+	hitGrid = ft.Hits;
+	NumberOfRays = ft.RayCount;
+
+	CalcBinMidpoints( xmin, ymin );
+
+	Centroid[0] = Centroid[1] = Centroid[2] = 0.0;
+	if ( ft.CentroidCount > 0 )
+	{
+		Centroid[0] = ft.CentroidSum[0] / ft.CentroidCount;
+		Centroid[1] = ft.CentroidSum[1] / ft.CentroidCount;
+		Centroid[2] = ft.CentroidSum[2] / ft.CentroidCount;
+	}
+}
+
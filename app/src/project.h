@@ -152,8 +152,8 @@ public:
 	// initialized when system is simulated
 	void RecomputeTransforms();
 
-	int RayHits;
-        int FinalRayHits;
+	st_uint_t RayHits;
+        st_uint_t FinalRayHits;
 	double Euler[3];
 	double RRefToLoc[3][3];
 	double RLocToRef[3][3];
@@ -184,7 +184,7 @@ public:
 	// initialized when system is simulated
 	void RecomputeTransforms();
 
-	int RayHits;
+	st_uint_t RayHits;
 	double Euler[3];
 	double RRefToLoc[3][3];
 	double RLocToRef[3][3];
@@ -200,7 +200,7 @@ public:
 
 	enum { COORD_GLOBAL, COORD_STAGE, COORD_ELEMENT };
 
-	bool AllocMemory(size_t nintersect);
+	bool AllocMemory(size_t nintersect); // 0 is an empty result, not an error
 	void FreeMemory();
 
 	bool ReadResultsFromContext(st_context_t spcxt);
@@ -209,23 +209,86 @@ public:
 	size_t PrepareExport( int coords, int istage = 0 );
 	bool GetNextExport( Project &prj, double Pos[3], double Cos[3], 
 		int &Elm, int &Stg, int &Ray );	
+
+	// bulk export of a stage (0 = all stages), with blocks of records
+	// transformed and encoded on all cpus.  the column file is a json header
+	// line followed by whole little-endian columns, the parquet file has
+	// plain uncompressed columns.  progress may return false to cancel.
+	// returns false on a file error or cancel, and the partial file is removed
+	enum { EXPORT_CSV, EXPORT_COLUMNS, EXPORT_PARQUET };
+	static int ExportFormat( const wxString &file ); // from the extension: .stcol, .parquet or csv
+	bool WriteExport( Project &prj, const wxString &file, int format, int coords, int istage = 0,
+		bool (*progress)( size_t nwritten, size_t ntotal, void *data ) = 0, void *data = 0 );
 	bool Transform( Project &prj, int coords, size_t idx, double Pos[3], double Cos[3], 
 		int &Elm, int &Stg, int &Ray );
 		
-	bool WriteDataFile( const wxString &file );
+	// the compressed format is recognized when reading.  the plain format
+	// has no weights, so the results of a weighted trace can only be written
+	// compressed, and plain files read back with weights of 1
+	bool WriteDataFile( const wxString &file, bool compress = false );
 	bool ReadDataFile( const wxString &file );
+	// compressed ray data at the current position of an open file, for
+	// files that embed it.  it must be the last thing in the file
+	bool WriteCompressedFile( FILE *fp );
+	bool ReadCompressedFile( FILE *fp );
+
+	// record indices for one element (stage and element numbers are 1-based,
+	// element 0 are the misses), for a whole stage (element < 0), or for one
+	// ray number, each in record order.  the indices are built on first use
+	// and must be invalidated by anything that changes the data arrays
+	const size_t *GetRecords( int stage, int element, size_t *count );
+	const size_t *GetRayRecords( int raynum, size_t *count );
+	void InvalidateIndex();
 	
 	size_t Length;
 	double *Xi, *Yi, *Zi;
 	double *Xc, *Yc, *Zc;
 	int *ElementMap, *RayNumbers, *StageMap;
+	double *Weights; // power carried by each ray, 1 unless the trace was weighted
+	double *Absorbed; // power each ray left on the element, its weight if it was absorbed
+	bool HasWeights(); // any weight other than 1, i.e. the results of a weighted trace
 	double SunXMin, SunXMax, SunYMin, SunYMax;
 	int SunRayCount;
 
 private:
+	void BuildElementIndex();
+	void BuildRayIndex();
+
 	int m_expStage, m_expCoords;
 	size_t m_index;
+	const size_t *m_expRecords;
+	size_t m_expCount;
+
+	bool m_elementIndexValid;
+	std::vector<size_t> m_stageKey; // first key of each stage, key = m_stageKey[stage] + |element|
+	std::vector<size_t> m_keyStart; // start of each key's records in m_elementRecords
+	std::vector<size_t> m_elementRecords;
+	std::vector<size_t> m_stageRecords; // same ranges as m_elementRecords, but each stage in record order
+
+	int m_hasWeights; // -1 until HasWeights looked
+	bool m_rayIndexValid;
+	std::vector<int> m_rayKeys; // ray numbers of m_rayRecords, in ascending order
+	std::vector<size_t> m_rayRecords;
+};
 
+class FluxTarget
+{
+public:
+	FluxTarget();
+
+	int StageIdx, ElementIdx;
+	int NBinsX, NBinsY;
+	double MinX, MaxX, MinY, MaxY;
+	bool FinalOnly;
+
+	// accumulated by the trace contexts.  the grid holds the power of the
+	// rays in each bin and hits their number
+	bool Valid;
+	HPM2D Grid;
+	HPM2D Hits;
+	size_t RayCount;
+	double CentroidSum[3];
+	size_t CentroidCount;
 };
 
 class Project
@@ -242,12 +305,91 @@ public:
 	bool Write(FILE *fp);
 	bool Read(FILE *fp);
 
+	// flux maps binned by the core while tracing, so that
+	// they do not depend on the stored ray data
+	FluxTarget *FindFluxTarget( int stageIdx, int elementIdx,
+		int nbinsx, int nbinsy, double minx, double maxx,
+		double miny, double maxy, bool finalonly );
+	bool ReadFluxTargetsFromContextList( const std::vector<st_context_t> &list );
+
 	SunShape Sun;
 	std::vector<Optical*> OpticsList;
 	std::vector<Stage*> StageList;
 
 	RayData Results;
 
+	// set up by scripts for the session, like their tallies, which are not
+	// saved with the results
+	std::vector<FluxTarget> FluxTargets;
+
+	// which intersection records the trace keeps, see st_ray_retention.
+	// selection is a list of 0-based (stage, element) pairs, element < 0 for the whole stage
+	int RayRetention;
+	int RaySampleEvery;
+	std::vector< std::pair<int,int> > RetainSelection;
+
+	// how the trace samples the sun rays, see st_sim_sampling
+	int RaySampling;
+
+	// rays that carry power through every interaction, see st_sim_weighted
+	bool RayWeighted;
+	double RouletteWeight;
+
+	// traces that run until the results have converged, see st_sim_run_converged.
+	// tolerance 0 traces the fixed number of rays.  elements are 0-based
+	// (stage, element) pairs for ST_CONVERGE_ABSORBED
+	int ConvergeMetrics;
+	double ConvergeTolerance;
+	double ConvergeSeconds;
+	std::vector< std::pair<int,int> > ConvergeElements;
+
+	// what the last converged trace reached over all of its threads,
+	// in the order of the ST_CONVERGE_* flags
+	int ConvergeBatches;
+	double ConvergeValue[3];
+	double ConvergeError[3];
+
+	// folders that relative file names in the project (surface files) are
+	// looked up in, in order.  LocateFile gives the path of the file, or an
+	// empty string if it isn't found
+	wxArrayString SearchDirs;
+	wxString LocateFile( const wxString &file );
+
+	// hash of the sun, optics and geometry, and of the surface files they
+	// refer to, together with a trace settings string, used to tell whether
+	// saved results still fit the project
+	wxString ContentHash( const wxString &settings );
+
+	// inputs of the current results, empty if there are none.  the run is
+	// new for every trace, so results saved with the project are written
+	// again after each trace even when its inputs and seed are the same
+	wxString ResultsSettings;
+	wxString ResultsHash;
+	wxString ResultsRun;
+
+	// partial results of a trace split into ray ranges [first,last), which
+	// can be traced by separate processes and merged afterwards.  the ray
+	// numbers in a shard already include the offset of its range, and the
+	// settings are those of the whole trace, so all shards of one trace
+	// carry the same content hash.  merging fails unless the ranges cover
+	// every ray of the trace exactly once
+	bool WriteShard( const wxString &file, const wxString &settings,
+		const std::vector< std::pair<int,int> > &ranges );
+	bool MergeShards( const wxArrayString &files, wxString *settings,
+		std::vector< std::pair<int,int> > *ranges, wxArrayString &errors );
+};
+
+// flux map requested from ElementStatistics::ComputeMany
+struct FluxRequest
+{
+	FluxRequest();
+
+	int StageIdx, ElementIdx;
+	int NBinsX, NBinsY;
+	bool AutoScale, FinalOnly;
+	double MinX, MaxX, MinY, MaxY; // updated with the bounds actually used
+
+	bool Ok; // output
 };
 
 class ElementStatistics
@@ -255,6 +397,14 @@ class ElementStatistics
 public:
 	ElementStatistics( Project &prj );
 
+	// computes the statistics of all the requested flux maps, visiting only
+	// the records of the requested elements, and binning the elements on all
+	// cpus.  stats[i] holds the result for requests[i].  returns the number
+	// of requests computed successfully
+	static size_t ComputeMany( Project &prj,
+			std::vector<FluxRequest> &requests, double dni,
+			std::vector<ElementStatistics> &stats );
+
 	bool Compute(
 			int stageIdx, int elementIdx,
 			int nbinsx, int nbinsy,
@@ -265,6 +415,7 @@ public:
 
 
 	HPM2D fluxGrid;
+	HPM2D hitGrid; // number of rays in each bin of fluxGrid, which holds their power
 	std::vector<double> xValues, yValues;
 	double binszx, binszy;
 	double PowerPerRay;
@@ -278,16 +429,35 @@ public:
 	size_t NumberOfRays;
 
 private:
+	// the records of one element in the ray data, read in element coordinates
+	// while binning so that no copy of the points is kept
+	struct ElementRecords
+	{
+		const size_t *Records;
+		size_t Count;
+		Element *Elm;
+
+		void ToElement( const RayData &rd, size_t j, double pos[3] ) const;
+		bool IsLast( const RayData &rd, size_t j ) const; // last intersection of the ray with the element
+	};
+
+	static void FindRecords( Project &prj,
+			const std::vector<FluxRequest> &requests,
+			std::vector<ElementRecords> &elements,
+			std::vector<int> &slots );
+
+	bool Compute( FluxRequest &r, double dni, const ElementRecords *recs );
+	struct ComputeJob; // the groups of requests on one element, for ComputeMany
+	static void ComputeGroups( void *data, size_t t );
+
 	void ResetData();
-	void BinRaysXY( Element *elm,
-					int stageIdx,
-					int elementIdx,
+	void CopyFluxTarget( const FluxTarget &ft, double xmin, double ymin );
+	void CalcBinMidpoints( double xmin, double ymin );
+	void BinPoints( const ElementRecords *recs,
+					bool iscylinder,
 					bool AbsorbedOnly,
-					double Radius,
 					double xmin,
-					double ymin,
-					double &ZVal,
-					size_t &RayCount);
+					double ymin );
 	Project &m_prj;
 };
 
@@ -63,9 +63,10 @@ class RayDataTable : public wxGridTableBase
 	Project *m_prj;
 	std::vector<size_t> m_indices;
 	int m_coordSys;
+	int m_ncols; // the weight column is only shown for weighted traces
 
 public:
-	static const int NCOLS = 9;
+	static const int NCOLS = 10;
 
 	RayDataTable( Project *prj = 0, int stage = -1, int coords = RayData::COORD_GLOBAL )
 	{
@@ -74,15 +75,18 @@ public:
 		m_prj = prj;
 		m_indices.clear();
 		m_coordSys = coords;
+		m_ncols = NCOLS-1;
 
 		if ( !m_prj ) return;
 
 		RayData &r = m_prj->Results;
+		if ( r.HasWeights() )
+			m_ncols = NCOLS;
 
-		size_t nindices = 0;
-		for (size_t i = 0; i < r.Length; i++ )
-			if (stage < 0 || stage == r.StageMap[i]-1)
-				nindices++;
+		size_t nindices = r.Length;
+		const size_t *records = 0;
+		if ( stage >= 0 )
+			records = r.GetRecords( stage+1, -1, &nindices );
 
 		try {
 			m_indices.resize( nindices );
@@ -93,10 +97,8 @@ public:
 			return;
 		}
 
-		size_t j=0;
-		for (size_t i=0; i < r.Length; i++)
-			if (stage < 0 || stage == r.StageMap[i]-1)
-				m_indices[j++] = i;
+		for (size_t i=0; i < nindices; i++)
+			m_indices[i] = records != 0 ? records[i] : i;
 	}
 
 	virtual ~RayDataTable()
@@ -112,7 +114,7 @@ public:
 
 	int GetNumberCols()
 	{
-		return NCOLS;
+		return m_ncols;
 	}
 
 	bool IsEmptyCell( int WXUNUSED(row), int WXUNUSED(col) )
@@ -179,6 +181,7 @@ public:
 		case 6: val.Printf("%d", m_prj->Results.ElementMap[i] ); break;
 		case 7: val.Printf("%d", m_prj->Results.StageMap[i] ); break;
 		case 8: val.Printf("%d", m_prj->Results.RayNumbers[i] ); break;
+		case 9: val.Printf("%lg", m_prj->Results.Weights[i] ); break;
 		}
 		
 		return val;
@@ -202,6 +205,7 @@ public:
 		case 6: return "Element";
 		case 7: return "Stage";
 		case 8: return "Ray";
+		case 9: return "Weight";
 		default:
 			return wxEmptyString;
 		}
@@ -242,7 +246,7 @@ RayDataForm::RayDataForm( wxWindow *parent, Project &prj )
 	tool_sizer->Add( new wxStaticText( this, wxID_ANY, "Stage:" ), 0, wxLEFT|wxALIGN_CENTER_VERTICAL, 10 );
 	tool_sizer->Add( m_stage, 0, wxLEFT|wxRIGHT|wxALIGN_CENTER_VERTICAL, 5 );
 	tool_sizer->Add( new wxButton(this, wxID_COPY, "Copy to clipboard"), 0, wxALL|wxEXPAND, 2);
-	tool_sizer->Add( new wxButton(this, wxID_SAVE, "Save as CSV..."), 0, wxALL|wxEXPAND, 2);
+	tool_sizer->Add( new wxButton(this, wxID_SAVE, "Save data..."), 0, wxALL|wxEXPAND, 2);
 	tool_sizer->AddStretchSpacer();
 
 	m_grid = new wxExtGridCtrl( this, wxID_ANY );
@@ -285,7 +289,7 @@ void RayDataForm::UpdateDataDisplay()
 
 	m_grid->SetTable( new RayDataTable( &m_prj, istage-1, coord ), true );
 	
-	for (int i=0;i<RayDataTable::NCOLS;i++)
+	for (int i=0;i<m_grid->GetNumberCols();i++)
 	{
 		m_grid->SetColMinimalWidth(i, 100);
 		m_grid->SetColSize(i, 100);
@@ -337,22 +341,29 @@ void RayDataForm::CopyDataToClipboard()
 	}
 }
 
-void RayDataForm::SaveDataAsCSV()
+struct ExportProgressData
 {
-	wxFileDialog dlg( this, "Save ray data as CSV", wxEmptyString, 
-		"raydata.csv", "CSV Files (*.csv)|*.csv", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
+	wxProgressDialog *dialog;
+	wxString path;
+};
 
-	if (dlg.ShowModal() != wxID_OK)
-		return;
+static bool ExportProgress( size_t nwritten, size_t ntotal, void *data )
+{
+	ExportProgressData *pd = (ExportProgressData*)data;
+	return pd->dialog->Update( (int)( 100*((double)nwritten)/((double)ntotal) ), 
+		"Writing data to " + pd->path + wxString::Format(" (%d of %d rays)", (int)nwritten, (int)ntotal ) );
+}
 
-	FILE *fp = fopen( dlg.GetPath().c_str(), "w" );
-	if ( !fp )
-	{
-		wxMessageBox("Could not open file for writing:\n\n" + dlg.GetPath());
+void RayDataForm::SaveData()
+{
+	wxFileDialog dlg( this, "Save ray data", wxEmptyString, 
+		"raydata.csv", "CSV Files (*.csv)|*.csv|Column Files (*.stcol)|*.stcol|Parquet Files (*.parquet)|*.parquet", 
+		wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
+
+	if (dlg.ShowModal() != wxID_OK)
 		return;
-	}
 	
-	wxProgressDialog pd( "CSV data file export", "Preparing...", 100, 
+	wxProgressDialog pd( "Ray data file export", "Preparing...", 100, 
 		this, wxPD_APP_MODAL|wxPD_REMAINING_TIME|wxPD_SMOOTH|wxPD_CAN_ABORT|wxPD_AUTO_HIDE );
 #ifdef __WXMSW__
 	pd.SetIcon( wxICON( appicon ) );
@@ -361,46 +372,15 @@ void RayDataForm::SaveDataAsCSV()
 
 	wxYield();
 
+	// the filter indices follow RayData::EXPORT_CSV, EXPORT_COLUMNS, EXPORT_PARQUET
+	ExportProgressData data;
+	data.dialog = &pd;
+	data.path = dlg.GetPath();
 
-	// by default, all ray data is in stage coordinates
-	RayData &rd = m_prj.Results;
-	
-	int nwrite = rd.PrepareExport( m_coords->GetSelection(), m_stage->GetSelection() );
-	
-	// progress update every 0.5 %
-	int nupdate = nwrite / 200;
-	size_t nwr = 0;
-	size_t bytes = 0;
-	
-	double Pos[3], Cos[3];
-	int Elm, Stg, Ray;
-
-	fputs( "Pos X,Pos Y,Pos Z,Cos X,Cos Y,Cos Z,Element,Stage,Ray Number\n", fp );
-	while( rd.GetNextExport( m_prj, Pos, Cos, Elm, Stg, Ray ) )
-	{
-		if ( nwr % nupdate == 0 )
-		{
-			bool proceed = pd.Update( (int)( 100*((double)nwr)/((double)nwrite) ), 
-					"Writing data to " + dlg.GetPath() + wxString::Format(" (%.2lf MB)", bytes*0.000001 ) );
-			if( !proceed )
-				break;
-		}
-
-		int nb = fprintf( fp, "%lg,%lg,%lg,%lg,%lg,%lg,%d,%d,%d\n",
-			Pos[0], Pos[1], Pos[2],
-			Cos[0], Cos[1], Cos[2],
-			Elm, Stg, Ray );
-
-		if ( nb < 0 ) break; // file error, disk space issue?
-
-		bytes += nb;
-		nwr++;
-	}
-
-	if ( ferror( fp ) )
-		wxMessageBox(wxString("An error occurred exporting the CSV data file: ") + strerror(errno));
-
-	fclose( fp );
+	if ( !m_prj.Results.WriteExport( m_prj, dlg.GetPath(), dlg.GetFilterIndex(), 
+			m_coords->GetSelection(), m_stage->GetSelection(), ExportProgress, &data ) 
+		&& !pd.WasCancelled() )
+		wxMessageBox(wxString("An error occurred exporting the ray data file: ") + strerror(errno));
 }
 
 void RayDataForm::OnCommand( wxCommandEvent &evt )
@@ -413,7 +393,7 @@ void RayDataForm::OnCommand( wxCommandEvent &evt )
 		break;
 
 	case wxID_SAVE:
-		SaveDataAsCSV();
+		SaveData();
 		break;
 
 	case wxID_COPY:
@@ -70,7 +70,7 @@ private:
 	wxChoice *m_coords, *m_stage;
 
 	void CopyDataToClipboard();
-	void SaveDataAsCSV();
+	void SaveData();
 
 	void OnCommand( wxCommandEvent & );
 
@@ -327,7 +327,7 @@ static void _nintersect( lk::invoke_t &cxt )
 
 static void _raydata( lk::invoke_t &cxt )
 {
-	LK_DOC( "raydata", "Returns the ray data as a 9 item array in stage coordinates [X,Y,Z,CosX,CosY,CosZ,Element,Stage,RayNum] for the specified intersection number. Use nintersect to get the number of intersections.", "(integer:index):array");
+	LK_DOC( "raydata", "Returns the ray data as a 9 item array in stage coordinates [X,Y,Z,CosX,CosY,CosZ,Element,Stage,RayNum] for the specified intersection number, with the ray weight as a 10th item for a weighted trace. Use nintersect to get the number of intersections.", "(integer:index):array");
 	Project &prj = MainWindow::Instance().GetProject();
 	size_t idx = cxt.arg(0).as_unsigned();
 	if (idx <= prj.Results.Length)
@@ -344,6 +344,8 @@ static void _raydata( lk::invoke_t &cxt )
 		r.vec_append( prj.Results.ElementMap[idx] );
 		r.vec_append( prj.Results.StageMap[idx] );
 		r.vec_append( prj.Results.RayNumbers[idx] );
+		if ( prj.Results.HasWeights() )
+			r.vec_append( prj.Results.Weights[idx] );
 	}
 	else
 		cxt.result().nullify();
@@ -1068,6 +1070,80 @@ static void _elementstats( lk::invoke_t &cxt )
 
 }
 
+static void _addfluxtarget( lk::invoke_t &cxt )
+{
+	LK_DOC("addfluxtarget", "Requests a flux map on an element to be binned while tracing, so that elementstats with the same grid and bounds does not require the ray data.  Returns the target index.", "(integer:stage index, integer:element index, integer:x bins, integer:y bins, double:minx, double:maxx, double:miny, double:maxy [, boolean:final rays only]):integer");
+
+	FluxTarget ft;
+	ft.StageIdx = cxt.arg(0).as_integer();
+	ft.ElementIdx = cxt.arg(1).as_integer();
+	ft.NBinsX = cxt.arg(2).as_integer();
+	ft.NBinsY = cxt.arg(3).as_integer();
+	ft.MinX = cxt.arg(4).as_number();
+	ft.MaxX = cxt.arg(5).as_number();
+	ft.MinY = cxt.arg(6).as_number();
+	ft.MaxY = cxt.arg(7).as_number();
+	if (cxt.arg_count() > 8)
+		ft.FinalOnly = cxt.arg(8).as_boolean();
+
+	Project &prj = MainWindow::Instance().GetProject();
+	if ( !prj.GetElement( ft.StageIdx, ft.ElementIdx ) )
+	{
+		cxt.error("invalid stage or element index");
+		return;
+	}
+
+	prj.FluxTargets.push_back( ft );
+	cxt.result().assign( (double)(prj.FluxTargets.size()-1) );
+}
+
+static void _clearfluxtargets( lk::invoke_t &cxt )
+{
+	LK_DOC("clearfluxtargets", "Removes all flux maps requested with addfluxtarget.", "(void):void");
+	MainWindow::Instance().GetProject().FluxTargets.clear();
+}
+
+static void _rayretention( lk::invoke_t &cxt )
+{
+	LK_DOC("rayretention", "Sets which ray intersections are stored by the next trace: 'all', 'final' (absorbed rays only), 'selected' (the given list of [stage index, element index] pairs, element index -1 for a whole stage), 'sampled' (every intersection of one in N rays), or 'none'.  Element ray hit counts are always available.", "(string:mode, [integer:N or array:selection]):void");
+
+	Project &prj = MainWindow::Instance().GetProject();
+	wxString mode = cxt.arg(0).as_string().Lower();
+
+	prj.RetainSelection.clear();
+	prj.RaySampleEvery = 1;
+
+	if (mode == "all") prj.RayRetention = ST_RETAIN_ALL;
+	else if (mode == "final") prj.RayRetention = ST_RETAIN_FINAL;
+	else if (mode == "none") prj.RayRetention = ST_RETAIN_NONE;
+	else if (mode == "sampled")
+	{
+		prj.RayRetention = ST_RETAIN_SAMPLED;
+		if (cxt.arg_count() > 1)
+			prj.RaySampleEvery = cxt.arg(1).as_integer();
+	}
+	else if (mode == "selected")
+	{
+		prj.RayRetention = ST_RETAIN_SELECTED;
+		if (cxt.arg_count() > 1 && cxt.arg(1).type() == lk::vardata_t::VECTOR)
+		{
+			for (size_t i=0;i<cxt.arg(1).length();i++)
+			{
+				lk::vardata_t &item = cxt.arg(1).index(i)->deref();
+				if (item.type() != lk::vardata_t::VECTOR || item.length() != 2)
+				{
+					cxt.error("selection must be a list of [stage, element] pairs");
+					return;
+				}
+				prj.RetainSelection.push_back( std::make_pair(
+					item.index(0)->as_integer(), item.index(1)->as_integer() ) );
+			}
+		}
+	}
+	else
+		cxt.error("invalid ray retention mode: " + mode);
+}
+
 static void _rayhits( lk::invoke_t &cxt )
 {
 	LK_DOC("rayhits", "Returns the number of ray hits on an element.", "(integer:stage index, integer:element index, [boolean: final only]):integer");
@@ -1083,8 +1159,19 @@ static void _rayhits( lk::invoke_t &cxt )
 
 static void _writerayfile( lk::invoke_t &cxt )
 {
-	LK_DOC("writerayfile", "Writes a binary ray data file with the current trace results", "(string:file):boolean");
-	cxt.result().assign( MainWindow::Instance().GetProject().Results.WriteDataFile( cxt.arg(0).as_string() ) ? 1.0 : 0.0 );
+	LK_DOC("writerayfile", "Writes a binary ray data file with the current trace results, optionally compressed. The results of a weighted trace can only be written compressed", "(string:file, [boolean:compress]):boolean");
+	bool compress = cxt.arg_count() > 1 && cxt.arg(1).as_boolean();
+	cxt.result().assign( MainWindow::Instance().GetProject().Results.WriteDataFile( cxt.arg(0).as_string(), compress ) ? 1.0 : 0.0 );
+}
+
+static void _readrayfile( lk::invoke_t &cxt )
+{
+	LK_DOC("readrayfile", "Reads a binary ray data file, compressed or not, into the current trace results", "(string:file):boolean");
+	Project &prj = MainWindow::Instance().GetProject();
+	prj.ResultsSettings.Clear();
+	prj.ResultsHash.Clear();
+	prj.ResultsRun.Clear();
+	cxt.result().assign( prj.Results.ReadDataFile( cxt.arg(0).as_string() ) ? 1.0 : 0.0 );
 }
 
 static lk::fcall_t *soltrace_functions()
@@ -1105,6 +1192,7 @@ static lk::fcall_t *soltrace_functions()
 		_open_project,
 		_clear_project,
 		_writerayfile,
+		_readrayfile,
 		_trace,
 		_traceopt,
 		_nintersect,
@@ -1129,6 +1217,9 @@ static lk::fcall_t *soltrace_functions()
 		_nelements,
 		_elementopt,
 		_elementstats,
+		_addfluxtarget,
+		_clearfluxtargets,
+		_rayretention,
 		_rayhits,
 		0 };
 
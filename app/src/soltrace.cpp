@@ -312,6 +312,16 @@ wxString MainWindow::GetWorkDir()
 	return m_traceForm->GetWorkDir();
 }
 
+// relative surface file names are looked up next to the project file
+// first, then in the working folder
+wxArrayString MainWindow::GetSearchDirs()
+{
+	wxArrayString dirs;
+	dirs.Add( wxFileName( m_fileName ).GetPath() );
+	dirs.Add( GetWorkDir() );
+	return dirs;
+}
+
 wxString MainWindow::GetAppDataDir()
 {
 	static wxString path;
@@ -342,6 +352,13 @@ bool MainWindow::LoadProject( const wxString &file, bool quiet )
 
 	fclose(fp);
 
+	m_project.Results.FreeMemory();
+	m_project.ResultsSettings.Clear();
+	m_project.ResultsHash.Clear();
+	m_project.ResultsRun.Clear();
+	if ( ok && LoadResults( file ) < 0 && !quiet )
+		wxMessageBox( "The trace results saved with this project no longer match its inputs. Re-run the trace to update them." );
+
 	UpdateAllInputForms();
 	UpdateResults();
 
@@ -370,12 +387,90 @@ bool MainWindow::SaveProject( const wxString &file, bool quiet )
 	m_project.Write( fp );
 	fclose(fp);
 
+	SaveResults( file );
+
 	m_fileName = file;
 	SetModified( false );
 
 	return true;
 }
 		
+// trace results are kept next to the project file: the ray data in a
+// compressed .strays file and the hash and trace settings it was computed
+// from, and the run it came from, in a .stresults file.  the tallies of
+// flux targets are left out, as the targets only last for the session
+bool MainWindow::SaveResults( const wxString &file )
+{
+	Project &prj = m_project;
+	prj.SearchDirs = GetSearchDirs();
+	if ( prj.Results.Length == 0 || prj.ResultsHash.IsEmpty() || prj.ResultsRun.IsEmpty()
+		|| prj.ContentHash( prj.ResultsSettings ) != prj.ResultsHash )
+		return false;
+
+	// the ray data doesn't change between saves of the same run, so only
+	// write it once
+	wxString hash, settings, run;
+	if ( ReadResultsInfo( file + ".stresults", &hash, &settings, &run )
+		&& hash == prj.ResultsHash && run == prj.ResultsRun && wxFileExists( file + ".strays" ) )
+		return true;
+
+	if ( !prj.Results.WriteDataFile( file + ".strays", true ) )
+		return false;
+
+	FILE *fp = fopen( (file + ".stresults").c_str(), "w" );
+	if ( !fp ) return false;
+	fprintf( fp, "%s\n%s\n%s\n", (const char*)prj.ResultsHash.c_str(), (const char*)prj.ResultsSettings.c_str(),
+		(const char*)prj.ResultsRun.c_str() );
+	fclose( fp );
+	return true;
+}
+
+bool MainWindow::ReadResultsInfo( const wxString &file, wxString *hash, wxString *settings, wxString *run )
+{
+	FILE *fp = fopen( file.c_str(), "r" );
+	if ( !fp ) return false;
+
+	// a file that can't be read holds no cached results
+	char buf[1024];
+	bool ok = fgets( buf, sizeof(buf), fp ) != 0;
+	if ( ok ) *hash = wxString( buf ).Trim();
+	ok = ok && fgets( buf, sizeof(buf), fp ) != 0;
+	if ( ok ) *settings = wxString( buf ).Trim();
+	ok = ok && fgets( buf, sizeof(buf), fp ) != 0;
+	if ( ok ) *run = wxString( buf ).Trim();
+	fclose( fp );
+
+	if ( !ok || hash->IsEmpty() || run->IsEmpty() )
+	{
+		hash->Clear();
+		settings->Clear();
+		run->Clear();
+		return false;
+	}
+	return true;
+}
+
+int MainWindow::LoadResults( const wxString &file )
+{
+	Project &prj = m_project;
+	prj.SearchDirs = GetSearchDirs();
+	wxString hash, settings, run;
+	if ( !ReadResultsInfo( file + ".stresults", &hash, &settings, &run ) )
+		return 0;
+
+	if ( prj.ContentHash( settings ) != hash )
+		return -1;
+
+	if ( !prj.Results.ReadDataFile( file + ".strays" ) )
+		return 0;
+
+	prj.ResultsSettings = settings;
+	prj.ResultsHash = hash;
+	prj.ResultsRun = run;
+	m_traceForm->SetSettings( settings );
+	return 1;
+}
+
 void MainWindow::Save()
 {
 	if ( m_fileName.IsEmpty() )
@@ -422,6 +517,9 @@ bool MainWindow::CloseProject( bool force )
 	m_project.ClearOptics();
 	m_project.ClearStages();	
 	m_project.Results.FreeMemory();
+	m_project.ResultsSettings.Clear();
+	m_project.ResultsHash.Clear();
+	m_project.ResultsRun.Clear();
 
 	m_fileName.Clear();
 	SetModified( false );
@@ -81,6 +81,12 @@ public:
 	bool LoadProject( const wxString &file, bool quiet = false );
 	bool SaveProject( const wxString &file, bool quiet = false );
 
+	// results of the last trace, saved next to the project file.  loading
+	// returns 1 if they were read, 0 if there are none, and -1 if they
+	// no longer match the project
+	bool SaveResults( const wxString &file );
+	int LoadResults( const wxString &file );
+
 	void Save();
 	void SaveAs();
 	bool CloseProject( bool force = false );
@@ -90,6 +96,7 @@ public:
 
 	wxString GetFileName() { return m_fileName; }
 	wxString GetWorkDir();
+	wxArrayString GetSearchDirs();
 	wxString GetAppDataDir();
 	
 	void UpdateFrameTitle();
@@ -106,6 +113,7 @@ public:
 	IntersectionForm *GetIntersectionForm() { return m_intersectionForm; }
 	
 protected:
+	bool ReadResultsInfo( const wxString &file, wxString *hash, wxString *settings, wxString *run );
 	void OnClose( wxCloseEvent & );
 	void OnCommand( wxCommandEvent & );
 	void OnCaseTabChange( wxCommandEvent & );
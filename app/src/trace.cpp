@@ -98,6 +98,13 @@ TraceForm::TraceForm( wxWindow *parent, Project &prj )
 	flxsizer->Add( new wxStaticText( sizer1->GetStaticBox(), wxID_ANY, "Seed value (-1 for random)"), 0, wxALL|wxALIGN_CENTER_VERTICAL|wxALIGN_RIGHT, 3 );
 	flxsizer->Add( m_seed = new wxNumericCtrl( sizer1->GetStaticBox(), wxID_ANY, 123, wxNUMERIC_INTEGER ), 0, wxALL, 0 );
 
+	flxsizer->Add( new wxStaticText( sizer1->GetStaticBox(), wxID_ANY, "Trace batches until relative error (0 for fixed rays)"), 0, wxALL|wxALIGN_CENTER_VERTICAL|wxALIGN_RIGHT, 3 );
+	flxsizer->Add( m_convergeTol = new wxNumericCtrl( sizer1->GetStaticBox(), wxID_ANY, 0.0, wxNUMERIC_REAL ), 0, wxALL, 0 );
+
+	flxsizer->Add( new wxStaticText( sizer1->GetStaticBox(), wxID_ANY, "Time budget for batches (0 for none)"), 0, wxALL|wxALIGN_CENTER_VERTICAL|wxALIGN_RIGHT, 3 );
+	flxsizer->Add( m_convergeSeconds = new wxNumericCtrl( sizer1->GetStaticBox(), wxID_ANY, 0.0, wxNUMERIC_REAL ), 0, wxALL, 0 );
+	m_convergeSeconds->SetFormat( 1, false, wxEmptyString, " sec" );
+
 	flxsizer->Add( m_inclSunShape = new wxCheckBox( sizer1->GetStaticBox(), wxID_ANY, "Include sun shape" ), 0, wxALL|wxALIGN_CENTER_VERTICAL, 3 );
 	flxsizer->AddStretchSpacer();
 	flxsizer->Add( m_inclOpticalErrors = new wxCheckBox( sizer1->GetStaticBox(), wxID_ANY, "Include optical errors" ), 0, wxALL|wxALIGN_CENTER_VERTICAL, 3 );
@@ -105,6 +112,18 @@ TraceForm::TraceForm( wxWindow *parent, Project &prj )
 	flxsizer->Add( m_asPowerTower      = new wxCheckBox( sizer1->GetStaticBox(), wxID_ANY, "Point-focus system" ), 0, wxALL|wxALIGN_CENTER_VERTICAL, 3 );
 	flxsizer->AddStretchSpacer();
 
+	// in the order of the ST_SAMPLE_* modes
+	wxArrayString sampling;
+	sampling.Add( "Random" );
+	sampling.Add( "Low-discrepancy (Sobol)" );
+	sampling.Add( "Stratified over the field" );
+	flxsizer->Add( new wxStaticText( sizer1->GetStaticBox(), wxID_ANY, "Sun ray sampling"), 0, wxALL|wxALIGN_CENTER_VERTICAL|wxALIGN_RIGHT, 3 );
+	flxsizer->Add( m_sampling = new wxChoice( sizer1->GetStaticBox(), wxID_ANY, wxDefaultPosition, wxDefaultSize, sampling ), 0, wxALL, 0 );
+	m_sampling->SetSelection( ST_SAMPLE_RANDOM );
+
+	flxsizer->Add( m_weighted = new wxCheckBox( sizer1->GetStaticBox(), wxID_ANY, "Weighted rays" ), 0, wxALL|wxALIGN_CENTER_VERTICAL, 3 );
+	flxsizer->AddStretchSpacer();
+
 	sizer1->Add( flxsizer, 0, wxALL, 5 );
 
 	wxStaticBoxSizer *sizer2 = new wxStaticBoxSizer( wxHORIZONTAL, this, "Working folder" );
@@ -138,6 +157,12 @@ TraceForm::TraceForm( wxWindow *parent, Project &prj )
 	m_lastSeed->SetEditable( false );
 	m_lastSeed->SetBackgroundColour( cback );
 
+	lstsizer->Add( new wxStaticText( vsizer2->GetStaticBox(), wxID_ANY, "Intercept factor error, 95% confidence"), 0, wxALL|wxALIGN_CENTER_VERTICAL|wxALIGN_RIGHT, 3 );
+	lstsizer->Add( m_lastError = new wxNumericCtrl( vsizer2->GetStaticBox(), wxID_ANY ), 0, wxALL, 0 );
+	m_lastError->SetFormat( 3, false, "+/- ", " %" );
+	m_lastError->SetEditable( false );
+	m_lastError->SetBackgroundColour( cback );
+
 	vsizer2->Add( lstsizer, 0, wxALIGN_RIGHT|wxALL, 10 );
 
 
@@ -184,6 +209,55 @@ wxString TraceForm::GetWorkDir()
 	return m_workDir->GetValue();
 }
 
+wxString TraceForm::GetSettings()
+{
+	// the seed is the one used by the last trace, so the results can be repeated
+	wxString text = wxString::Format( "rays=%u;maxrays=%u;seed=%d;sunshape=%d;opterr=%d;powertower=%d;sampling=%d;weighted=%d;retention=%d,%d",
+		(unsigned int)m_numRays->AsUnsigned(), (unsigned int)m_numMaxSunRays->AsUnsigned(), m_lastSeedVal,
+		m_inclSunShape->GetValue() ? 1 : 0, m_inclOpticalErrors->GetValue() ? 1 : 0,
+		m_asPowerTower->GetValue() ? 1 : 0, m_sampling->GetSelection(), m_weighted->GetValue() ? 1 : 0,
+		m_prj.RayRetention, m_prj.RaySampleEvery );
+
+	for ( size_t i=0;i<m_prj.RetainSelection.size();i++ )
+		text += wxString::Format( ",%d.%d", m_prj.RetainSelection[i].first, m_prj.RetainSelection[i].second );
+
+	if ( m_convergeTol->Value() > 0 )
+		text += wxString::Format( ";converge=%lg,%lg", m_convergeTol->Value(), m_convergeSeconds->Value() );
+
+	return text;
+}
+
+void TraceForm::SetSettings( const wxString &text )
+{
+	wxArrayString list = wxSplit( text, ';' );
+	for ( size_t i=0;i<list.size();i++ )
+	{
+		wxString key = list[i].BeforeFirst('=');
+		if ( key == "converge" )
+		{
+			double tol = 0, seconds = 0;
+			list[i].AfterFirst('=').BeforeFirst(',').ToDouble( &tol );
+			list[i].AfterFirst(',').ToDouble( &seconds );
+			m_convergeTol->SetValue( tol );
+			m_convergeSeconds->SetValue( seconds );
+			continue;
+		}
+
+		long value = 0;
+		if ( !list[i].AfterFirst('=').ToLong( &value ) )
+			continue;
+
+		if ( key == "rays" ) m_numRays->SetValue( (size_t)value );
+		else if ( key == "maxrays" ) m_numMaxSunRays->SetValue( (size_t)value );
+		else if ( key == "seed" ) m_seed->SetValue( (int)value );
+		else if ( key == "sunshape" ) m_inclSunShape->SetValue( value != 0 );
+		else if ( key == "opterr" ) m_inclOpticalErrors->SetValue( value != 0 );
+		else if ( key == "powertower" ) m_asPowerTower->SetValue( value != 0 );
+		else if ( key == "weighted" ) m_weighted->SetValue( value != 0 );
+		else if ( key == "sampling" && value >= 0 && value < (long)m_sampling->GetCount() ) m_sampling->SetSelection( (int)value );
+	}
+}
+
 void TraceForm::OnCommand( wxCommandEvent &evt )
 {
 	switch( evt.GetId() )
@@ -225,6 +299,19 @@ static wxArrayString s_err;
 
 	ref_errors.clear();
 
+	m_prj.SearchDirs = MainWindow::Instance().GetSearchDirs();
+	m_prj.RaySampling = m_sampling->GetSelection();
+	m_prj.RayWeighted = m_weighted->GetValue();
+
+	// the intercept factor decides, and the peak flux too if the
+	// project has flux maps binned during the trace
+	m_prj.ConvergeTolerance = m_convergeTol->Value();
+	m_prj.ConvergeSeconds = m_convergeSeconds->Value();
+	m_prj.ConvergeMetrics = ST_CONVERGE_INTERCEPT;
+	if ( m_prj.FluxTargets.size() > 0 )
+		m_prj.ConvergeMetrics |= ST_CONVERGE_PEAK_FLUX;
+	m_prj.ConvergeElements.clear();
+
 	int msec = RunTraceMultiThreaded( &m_prj, m_numRays->AsInteger(),
 			m_numMaxSunRays->AsInteger(),
 			m_numCpus->AsInteger(),
@@ -237,8 +324,21 @@ static wxArrayString s_err;
 	if ( msec < 0 )
 		wxShowTextMessageDialog( wxJoin( ref_errors, '\n' ) );
 
+	// remember what the results were traced from, so that they can be saved
+	// with the project and reloaded while the inputs stay the same
+	m_prj.ResultsSettings.Clear();
+	m_prj.ResultsHash.Clear();
+	m_prj.ResultsRun.Clear();
+	if ( msec >= 0 )
+	{
+		m_prj.ResultsSettings = GetSettings();
+		m_prj.ResultsHash = m_prj.ContentHash( m_prj.ResultsSettings );
+		m_prj.ResultsRun = wxString::Format( "%d.", m_lastSeedVal ) + wxGetUTCTimeMillis().ToString();
+	}
+
 	m_elapsedTime->SetValue( msec*0.001 );
 	m_lastSeed->SetValue( m_lastSeedVal );
+	m_lastError->SetValue( m_prj.ConvergeBatches > 0 ? 196.0*m_prj.ConvergeError[0] : 0.0 );
 
 	MainWindow::Instance().UpdateResults();
 	return msec;
@@ -431,21 +531,12 @@ static int LoadSystemIntoContext( Project *System, st_context_t spcxt, wxArraySt
 			st_element_surface( spcxt, ns, idx, e->SurfaceIndex );
 			if (!e->SurfaceFile.IsEmpty())
 			{
-				wxString sf( e->SurfaceFile );				
-				wxFileName fn( sf );
-				if (!fn.IsAbsolute())
+				wxString sf = System->LocateFile( e->SurfaceFile );
+				if (sf.IsEmpty())
 				{
-					sf = wxFileName( MainWindow::Instance().GetFileName() ).GetPath() + "/" + e->SurfaceFile;
-					if (!wxFileExists(sf))
-					{
-						sf = MainWindow::Instance().GetWorkDir() + "/" + e->SurfaceFile;
-						if (!wxFileExists(sf))
-						{
-							errs.Add( "Could not locate surface file: " + e->SurfaceFile );
-							errflag = -4;
-							break;
-						}
-					}
+					errs.Add( "Could not locate surface file: " + e->SurfaceFile );
+					errflag = -4;
+					break;
 				}
 
 				if ( st_element_surface_file( spcxt, ns, idx, (const char*)sf.c_str() ) < 0)
@@ -468,6 +559,48 @@ static int LoadSystemIntoContext( Project *System, st_context_t spcxt, wxArraySt
 
 	}
 
+	st_clear_flux_targets(spcxt);
+	for (size_t i=0;i<System->FluxTargets.size();i++)
+	{
+		FluxTarget &ft = System->FluxTargets[i];
+		if ( st_add_flux_target( spcxt, ft.StageIdx, ft.ElementIdx,
+				ft.NBinsX, ft.NBinsY, ft.MinX, ft.MaxX, ft.MinY, ft.MaxY,
+				ft.FinalOnly?1:0 ) < 0 )
+		{
+			errs.Add( wxString::Format("Invalid flux target %d", (int)i+1) );
+			errflag = -5;
+		}
+	}
+
+	st_sim_sampling(spcxt, System->RaySampling);
+	if ( st_sim_weighted(spcxt, System->RayWeighted?1:0, System->RouletteWeight) < 0 )
+	{
+		errs.Add( wxString::Format("Invalid roulette weight %lg", System->RouletteWeight) );
+		errflag = -8;
+	}
+	st_ray_retention(spcxt, System->RayRetention, System->RaySampleEvery);
+	st_clear_ray_selection(spcxt);
+	for (size_t i=0;i<System->RetainSelection.size();i++)
+	{
+		if ( st_select_rays( spcxt, System->RetainSelection[i].first, System->RetainSelection[i].second ) < 0 )
+		{
+			errs.Add( wxString::Format("Invalid ray data selection: stage %d element %d",
+				System->RetainSelection[i].first, System->RetainSelection[i].second) );
+			errflag = -6;
+		}
+	}
+
+	st_clear_converge_elements(spcxt);
+	for (size_t i=0;i<System->ConvergeElements.size();i++)
+	{
+		if ( st_converge_element( spcxt, System->ConvergeElements[i].first, System->ConvergeElements[i].second ) < 0 )
+		{
+			errs.Add( wxString::Format("Invalid convergence element: stage %d element %d",
+				System->ConvergeElements[i].first, System->ConvergeElements[i].second) );
+			errflag = -7;
+		}
+	}
+
 	return errflag;
 }
 
@@ -488,33 +621,48 @@ static bool first_validate = true;
 
 
 
-void CountRayHitsPerElement( Project *System)
+int ShardSeed( int seed, int first )
 {
+	if ( first == 0 )
+		return seed;
+
+	// mix the range into the seed, so that each shard starts its threads
+	// on generator streams unrelated to those of the other shards
+	unsigned int h = (unsigned int)seed ^ 0x9e3779b9u;
+	h ^= (unsigned int)first + 0x7f4a7c15u + (h << 6) + (h >> 2);
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return (int)(h % 2147483646u) + 1;
+}
+
+void CountRayHitsPerElement( Project *System, const std::vector<st_context_t> &list )
+{
+	// the core counts hits on each element as it traces, so just
+	// sum up the counts from each thread's context
 	for (size_t j=0;j<System->StageList.size();j++)
 	{
-		System->StageList[j]->RayHits = 0.0;
-		for (size_t i=0;i<System->StageList[j]->ElementList.size();i++)
+		Stage *stage = System->StageList[j];
+		stage->RayHits = 0;
+		for (size_t i=0;i<stage->ElementList.size();i++)
 		{
-			System->StageList[j]->ElementList[i]->RayHits = 0;
-			System->StageList[j]->ElementList[i]->FinalRayHits = 0;
-		}
-	}
-
-	for (size_t i=0;i<System->Results.Length;i++)
-	{
-		int stage_num = System->Results.StageMap[i] - 1;
-		int element_num = abs(System->Results.ElementMap[i]) - 1;
+			Element *e = stage->ElementList[i];
+			e->RayHits = 0;
+			e->FinalRayHits = 0;
 
+			for (size_t n=0;n<list.size();n++)
+			{
+				st_uint_t hits = 0, absorbed = 0;
+				if ( ::st_element_counts( list[n], j, i, &hits, &absorbed, 0 ) < 0 )
+					continue;
 
-		if (stage_num >= 0 && stage_num < (int)System->StageList.size()
-			&& element_num >= 0 && element_num < (int)System->StageList[stage_num]->ElementList.size() )
-		{
-			System->StageList[stage_num]->ElementList[element_num]->RayHits++;
-			System->StageList[stage_num]->RayHits++;
+				e->RayHits += hits;
+				e->FinalRayHits += absorbed;
+			}
 
-			// count up final ray hits
-			if (System->Results.ElementMap[i] < 0)
-				System->StageList[stage_num]->ElementList[element_num]->FinalRayHits++;
+			stage->RayHits += e->RayHits;
 		}
 	}
 }
@@ -540,10 +688,12 @@ private:
 	int m_iThread;
 	int m_seedVal;
 	int m_resultCode;
+	wxString m_replayFile;
+	bool m_converge;
 
 	wxMutex m_statusLock;
 public:
-	TraceThread( st_context_t spcxt, int ithread, int seed, bool aspowertower )
+	TraceThread( st_context_t spcxt, int ithread, int seed, bool aspowertower, const wxString &replay, bool converge )
 		: wxThread( wxTHREAD_JOINABLE ), m_cancelFlag( false )
 	{
 		m_iThread = ithread;
@@ -551,6 +701,8 @@ public:
 		m_seedVal = seed;
 		m_resultCode = -1;
         m_asPowerTower = aspowertower;
+		m_replayFile = replay;
+		m_converge = converge;
 
 		m_nTraceTotal = m_nTraced = m_nToTrace = m_curStage = m_nStages = 0;
 	}
@@ -604,10 +756,21 @@ public:
 	
 	virtual ExitCode Entry()
 	{
-		m_resultCode = ::st_sim_run( m_contextId, 
-			(unsigned int) m_seedVal,
-            m_asPowerTower,
-			trace_callback_multi_thread, this );
+		if ( !m_replayFile.IsEmpty() )
+			m_resultCode = ::st_sim_replay( m_contextId,
+				(unsigned int) m_seedVal,
+				(const char*)m_replayFile.c_str(),
+				trace_callback_multi_thread, this );
+		else if ( m_converge )
+			m_resultCode = ::st_sim_run_converged( m_contextId,
+				(unsigned int) m_seedVal,
+				m_asPowerTower,
+				trace_callback_multi_thread, this );
+		else
+			m_resultCode = ::st_sim_run( m_contextId, 
+				(unsigned int) m_seedVal,
+				m_asPowerTower,
+				trace_callback_multi_thread, this );
 
 		return 0;
 	}
@@ -621,9 +784,15 @@ int trace_callback_multi_thread(st_uint_t ntracedtotal, st_uint_t ntraced, st_ui
 	return t->isTraceCanceled() ? 0 : 1; // if it was canceled, stop processing by return 0
 }
 
+wxString ReplayPartFile( const wxString &file, int ithread )
+{
+	return file + wxString::Format( ".%d", ithread+1 );
+}
+
 int RunTraceMultiThreaded( Project *System, int nrays, int nmaxrays,
 						  int nmaxthreads, int *seed, bool sunshape, bool opterrs, bool aspowertower,
-						  wxArrayString &errors, bool is_cmd )
+						  wxArrayString &errors, bool is_cmd,
+						  const wxString &replay_save, const wxString &replay_from )
 {
 	if (nmaxthreads < 1)
 	{
@@ -636,6 +805,20 @@ int RunTraceMultiThreaded( Project *System, int nrays, int nmaxrays,
 	size_t ncpus = wxThread::GetCPUCount();
 	if (nmaxthreads >= 1 && ncpus > (size_t)nmaxthreads) ncpus = (size_t)nmaxthreads;
 
+	// a replay traces each saved part again on a thread of its own
+	if ( !replay_from.IsEmpty() )
+	{
+		ncpus = 0;
+		while ( wxFileExists( ReplayPartFile( replay_from, (int)ncpus ) ) )
+			ncpus++;
+
+		if ( ncpus == 0 )
+		{
+			errors.Add( "no stage 1 replay files found for " + replay_from );
+			return -888;
+		}
+	}
+
     wxThreadProgressDialog *tpd = 0;
 
     if( is_cmd )
@@ -656,6 +839,11 @@ int RunTraceMultiThreaded( Project *System, int nrays, int nmaxrays,
 
 	int SeedVal = *seed;
 
+	// each thread converges on its own, to a tolerance that the
+	// average of all of them meets
+	bool converge = System->ConvergeTolerance > 0 && replay_from.IsEmpty();
+	System->ConvergeBatches = 0;
+
 	for (i=0;i<ncpus && ok==true; i++)
 	{
 		st_context_t spcxt = ::st_create_context();
@@ -675,7 +863,19 @@ int RunTraceMultiThreaded( Project *System, int nrays, int nmaxrays,
 		::st_sim_params( spcxt, rays_this_thread, nmaxrays );
 		SeedVal += i*123;
 
-		ThreadList.push_back( new TraceThread( spcxt, i, SeedVal, aspowertower ) );
+		if ( !replay_save.IsEmpty() )
+			::st_sim_replay_file( spcxt, (const char*)ReplayPartFile( replay_save, (int)i ).c_str() );
+
+		if ( converge && ::st_sim_converge( spcxt, System->ConvergeMetrics,
+				System->ConvergeTolerance*sqrt( (double)ncpus ), System->ConvergeSeconds, 0 ) < 0 )
+		{
+			for ( int j=0;j<st_num_messages(spcxt);j++ )
+				errors.Add( st_message(spcxt, j) );
+			ok = false;
+		}
+
+		ThreadList.push_back( new TraceThread( spcxt, i, SeedVal, aspowertower,
+			replay_from.IsEmpty() ? wxString() : ReplayPartFile( replay_from, (int)i ), converge ) );
 	}
 
 	if (!ok)
@@ -782,7 +982,38 @@ int RunTraceMultiThreaded( Project *System, int nrays, int nmaxrays,
 			errors_found = true;
 		}
 
-		CountRayHitsPerElement( System );
+		if (!System->ReadFluxTargetsFromContextList( ContextList ))
+		{
+			errors.Add( "Error reading flux maps from trace context - (mt)" );
+			errors_found = true;
+		}
+
+		CountRayHitsPerElement( System, ContextList );
+
+		// the threads' metrics are independent estimates, so their
+		// average has the combined standard error of all of them
+		if ( converge )
+		{
+			static const int metrics[3] = { ST_CONVERGE_INTERCEPT, ST_CONVERGE_ABSORBED, ST_CONVERGE_PEAK_FLUX };
+			for ( int k=0;k<3;k++ )
+			{
+				double sum = 0, var = 0;
+				int batches = 0;
+				for (i=0;i<ContextList.size();i++)
+				{
+					double value = 0, err = 0;
+					batches += ::st_sim_convergence( ContextList[i], metrics[k], &value, &err );
+					sum += value;
+					if ( value != 0 )
+						var += (err*value)*(err*value);
+				}
+
+				double n = (double)ContextList.size();
+				System->ConvergeBatches = batches;
+				System->ConvergeValue[k] = sum/n;
+				System->ConvergeError[k] = sum != 0 ? sqrt(var)/fabs(sum) : 0;
+			}
+		}
 	}
 	else
 		System->Results.FreeMemory();
@@ -62,7 +62,16 @@ class wxCheckBox;
 
 int RunTraceMultiThreaded( Project *System, int nrays, int nmaxrays,
 						int nmaxthreads, int *seed, bool sunshape, bool opterrs, bool aspowertower,
-						wxArrayString &errors, bool is_cmd=false );
+						wxArrayString &errors, bool is_cmd=false,
+						const wxString &replay_save = wxEmptyString,
+						const wxString &replay_from = wxEmptyString );
+
+// the first stage of each trace thread is saved to a replay file of its own,
+// so a run with 'replay_save' set can be replayed with as many threads
+wxString ReplayPartFile( const wxString &file, int ithread );
+
+// seed for the shard of a trace that starts at ray 'first', see Project::WriteShard
+int ShardSeed( int seed, int first );
 
 class TraceForm : public wxPanel
 {
@@ -78,6 +87,10 @@ public:
 
 	void SetWorkDir( const wxString &path );
 	wxString GetWorkDir();
+
+	// the options that determine the results, as stored with saved results
+	wxString GetSettings();
+	void SetSettings( const wxString &text );
 	
 	bool IsRunning();
 	// returns milliseconds elapsed, or negative number indicating error
@@ -90,11 +103,13 @@ private:
 	void OnCommand( wxCommandEvent &evt );
 
 	wxNumericCtrl *m_numRays, *m_numMaxSunRays, *m_numCpus, *m_seed;
-	wxCheckBox *m_inclSunShape, *m_inclOpticalErrors, *m_asPowerTower;
+	wxNumericCtrl *m_convergeTol, *m_convergeSeconds;
+	wxCheckBox *m_inclSunShape, *m_inclOpticalErrors, *m_asPowerTower, *m_weighted;
+	wxChoice *m_sampling;
 	wxExtTextCtrl *m_workDir;
 
 	int m_lastSeedVal;
-	wxNumericCtrl *m_elapsedTime, *m_lastSeed;
+	wxNumericCtrl *m_elapsedTime, *m_lastSeed, *m_lastError;
 
 	DECLARE_EVENT_TABLE();
 };
@@ -57,6 +57,49 @@
 
 #define sqr(x) (x*x)
 
+double ErrorAngle( char dist, double delop, TSun *Sun, double u )
+{
+/*{Purpose:  Angle (radians) of an error drawn by inverting the radial distribution that the
+           rejection sampling in Errors and SurfaceNormalErrors draws from, so that
+           low-discrepancy points keep their spacing.  u is in [0,1)}*/
+
+	switch(dist)
+	{
+	case 'g':
+	case 'G': // gaussian truncated at three sigma
+		if (delop == 0.0) return 0.0;
+		return delop*sqrt( -2.0*log( 1.0 - u*(1.0 - exp(-4.5)) ) );
+
+	case 'p':
+	case 'P': // pillbox
+		return delop*sqrt(u);
+
+	case 'd':
+	case 'D': // sunshape data, in mrad
+		{
+			const std::vector<double> &cdf = Sun->SunShapeCDF;
+			if (cdf.size() < 2) return 0.0;
+
+			size_t lo = 0, hi = cdf.size()-1;
+			while ( hi - lo > 1 )
+			{
+				size_t mid = (lo + hi)/2;
+				if ( cdf[mid] <= u ) lo = mid;
+				else hi = mid;
+			}
+
+			double f = cdf[hi] > cdf[lo] ? (u - cdf[lo])/(cdf[hi] - cdf[lo]) : 0.0;
+			return Sun->MaxAngle*(lo + f)/(cdf.size()-1)/1000.0;
+		}
+
+	case 'f':
+	case 'F': // gray diffuse
+		return asin(sqrt(u));
+	}
+
+	return 0.0;
+}
+
 void Errors (
 			MTRand &myrng,
 			double CosIn[3],
@@ -65,7 +108,8 @@ void Errors (
 			TElement *Element,
 			TOpticalProperties *OptProperties, 
 			double CosOut[3],
-			double DFXYZ[3] ) 
+			double DFXYZ[3],
+			const double *u ) 
 {
 /*{Purpose:  To add error terms to the perturbed ray at the surface in question
 
@@ -82,6 +126,8 @@ void Errors (
                    Element = Element data record
                    DFXYZ   = surface normal vector at interaction point
 
+                   u       = low-discrepancy point in [0,1)^2 used for theta and phi instead of random numbers, or null
+
            Output - CosOut  = Output direction cosine vector of ray after error terms have been included
                    }*/
 	double Origin[3] = {0.0, 0.0, 0.0};
@@ -137,6 +183,12 @@ Label_9:
 	unsigned int maxcall = 0;
 
 Label_50:
+	if (u)
+	{
+		theta = ErrorAngle(dist, delop, Sun, u[0]);
+		theta2 = theta*theta;
+	}
+	else
 	switch(dist)
 	{
 	case 'g':
@@ -208,7 +260,7 @@ Label_300:
 	theta = sqrt(theta2);
 
 	//phi = atan2(thetay, thetax); //This function appears to  present irregularities that bias results incorrectly for small values of thetay or thetax
-	phi = RANGEN()*2.0*3.1415926535897932385; // Therefore have chosen to randomize phi rather than calculate from randomized theta components
+	phi = (u ? u[1] : RANGEN())*2.0*3.1415926535897932385; // Therefore have chosen to randomize phi rather than calculate from randomized theta components
                                                       //  obtained from the distribution. The two approaches are equivalent save for this issue with
                                                       //  arctan2.      wendelin 01-12-11 
 
@@ -231,6 +283,9 @@ Label_300:
      if ( (Source == 2) && (Element->InteractionType == 2) 
 			&& (DOT(CosOut, DFXYZ) < 0)
 			&& maxcall++ < 50000)
-			goto Label_50;
+	{
+		u = 0; // the point is used up, so draw the next one at random
+		goto Label_50;
+	}
 }
 //End of Procedure--------------------------------------------------------------
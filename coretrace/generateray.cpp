@@ -63,7 +63,8 @@ void GenerateRay(
 			TSun *Sun,
 			double PosRayGlobal[3],
 			double CosRayGlobal[3],
-            double PosRaySun[3]
+            double PosRaySun[3],
+			const double *u
             )
 {
 /*{This procedure generates a randomly located ray in the x-y plane of the sun coordinate system in
@@ -77,6 +78,7 @@ void GenerateRay(
        - Sun = Sun data record of type TSun
        - Origin = Primary Stage origin
        - RLocToRef = transformation matrix from local to reference frame
+       - u = low-discrepancy point in [0,1)^2 used for the position instead of random numbers, or null
  Output
        - PosRayGlobal = Position of ray in Global coordinate system
        - CosRayGlobal = Direction cosines of ray in Global coordinate system} */
@@ -140,8 +142,8 @@ void GenerateRay(
         XRaySun := Xcm + XRaySun;  //adjust location of generated rays about element center of mass
         YRaySun := Ycm + YRaySun;}*/
 
-		XRaySun = Sun->MinXSun + (Sun->MaxXSun - Sun->MinXSun)*RANGEN();     //uses a rectangular region of interest about the primary
-		YRaySun = Sun->MinYSun + (Sun->MaxYSun - Sun->MinYSun)*RANGEN();     //stage. Added 09/26/05
+		XRaySun = Sun->MinXSun + (Sun->MaxXSun - Sun->MinXSun)*(u ? u[0] : RANGEN());     //uses a rectangular region of interest about the primary
+		YRaySun = Sun->MinYSun + (Sun->MaxYSun - Sun->MinYSun)*(u ? u[1] : RANGEN());     //stage. Added 09/26/05
 		
 		
 		//{Offload ray location and direction cosines into sun array}
@@ -160,61 +162,3 @@ void GenerateRay(
 	}
 }
 //End of Procedure--------------------------------------------------------------
-
-
-bool LoadExistingStage0Ray(
-    int index,
-    std::vector<std::vector< double > > *raydat,
-	double PosRayGlobal[3],
-    double CosRayGlobal[3],
-    st_uint_t &ElementNum,
-    st_uint_t &RayNum
-    )
-{
-    /* 
-    Load an existing saved ray entering stage 0
-    */
-
-    std::vector<double> *theray = &raydat->at(index);
-    
-    if(theray->size() != 8)
-        return false;
-
-    for(int i=0; i<3; i++)
-    {
-        PosRayGlobal[i] = theray->at(i);
-        CosRayGlobal[i] = theray->at(i+3);
-    }
-    ElementNum = (st_uint_t)theray->at(6);
-    RayNum = (st_uint_t)theray->at(7);
-
-    return true;
-}
-
-bool LoadExistingStage1Ray(
-    int index,
-    std::vector<std::vector< double > > *raydat,
-	double PosRayGlobal[3],
-    double CosRayGlobal[3],
-    int &raynum
-    )
-{
-    /* 
-    Load an existing saved ray leaving stage 1
-    */
-
-    std::vector<double> *theray = &raydat->at(index);
-    
-    if(theray->size() != 7)
-        return false;
-
-    for(int i=0; i<3; i++)
-    {
-        PosRayGlobal[i] = theray->at(i);
-        CosRayGlobal[i] = theray->at(i+3);
-    }
-    raynum = (int)theray->at(6);
-
-    return true;
-}
-
@@ -53,6 +53,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <algorithm>
 
 #include "types.h"
 #include "procs.h"
@@ -149,6 +150,144 @@ static bool CheckInputs( TSystem *sys )
 }
 
 
+// extent of the aperture in element x and y, as checked against the hit
+// point after intersecting.  the cylinder ('l' with A=B=0) and torus ('a'
+// with A=B=0) contours leave x, or x and y, unbounded
+static void ApertureBounds( TElement *elm )
+{
+	double xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+	bool bx = true, by = true;
+
+	switch( elm->ShapeIndex )
+	{
+	case 'c': case 'C':
+	case 'h': case 'H':
+	case 't': case 'T':
+		xmax = ymax = elm->ParameterA/2.0;
+		xmin = ymin = -xmax;
+		break;
+	case 'r': case 'R':
+		xmax = elm->ParameterA/2.0;
+		ymax = elm->ParameterB/2.0;
+		xmin = -xmax;
+		ymin = -ymax;
+		break;
+	case 'a': case 'A':
+		bx = by = !(elm->ParameterA == 0.0 && elm->ParameterB == 0.0);
+		xmax = ymax = elm->ParameterB;
+		xmin = ymin = -xmax;
+		break;
+	case 'l': case 'L':
+		bx = !(elm->ParameterA == 0.0 && elm->ParameterB == 0.0);
+		xmin = elm->ParameterA;
+		xmax = elm->ParameterB;
+		ymax = elm->ParameterC/2.0;
+		ymin = -ymax;
+		break;
+	case 'i': case 'I':
+		xmin = std::min( elm->ParameterA, std::min( elm->ParameterC, elm->ParameterE ) );
+		xmax = std::max( elm->ParameterA, std::max( elm->ParameterC, elm->ParameterE ) );
+		ymin = std::min( elm->ParameterB, std::min( elm->ParameterD, elm->ParameterF ) );
+		ymax = std::max( elm->ParameterB, std::max( elm->ParameterD, elm->ParameterF ) );
+		break;
+	case 'q': case 'Q':
+		xmin = std::min( std::min( elm->ParameterA, elm->ParameterC ), std::min( elm->ParameterE, elm->ParameterG ) );
+		xmax = std::max( std::max( elm->ParameterA, elm->ParameterC ), std::max( elm->ParameterE, elm->ParameterG ) );
+		ymin = std::min( std::min( elm->ParameterB, elm->ParameterD ), std::min( elm->ParameterF, elm->ParameterH ) );
+		ymax = std::max( std::max( elm->ParameterB, elm->ParameterD ), std::max( elm->ParameterF, elm->ParameterH ) );
+		break;
+	default:
+		bx = by = false;
+		break;
+	}
+
+	// padded, so that round-off in the intersection never turns a hit on
+	// the edge into a miss
+	double pad = 1e-6*( 1.0 + std::max( std::max( fabs(xmin), fabs(xmax) ), std::max( fabs(ymin), fabs(ymax) ) ) );
+	elm->Bounded[0] = bx;
+	elm->Bounded[1] = by;
+	elm->BoundMin[0] = xmin - pad;
+	elm->BoundMax[0] = xmax + pad;
+	elm->BoundMin[1] = ymin - pad;
+	elm->BoundMax[1] = ymax + pad;
+}
+
+// least squares paraboloid through a measured or polynomial surface, sampled
+// on a grid over the aperture.  Intersect starts Newton-Raphson from the ray's
+// hit on it instead of from a plane
+static void NewtonSeedFit( TElement *elm )
+{
+	const int n = 9;
+	double A[5][6];
+	int i, j, k, npts = 0;
+
+	elm->NewtonSeed = false;
+	if ( elm->SurfaceType != 4 && elm->SurfaceType != 5
+		&& elm->SurfaceType != 6 && elm->SurfaceType != 8 )
+		return;
+
+	if ( !elm->Bounded[0] || !elm->Bounded[1] )
+		return;
+
+	for (i=0;i<5;i++)
+		for (j=0;j<6;j++)
+			A[i][j] = 0;
+
+	for (i=0;i<n;i++)
+	{
+		for (j=0;j<n;j++)
+		{
+			double Pos[3], DF[3], F;
+			int err = 0;
+			Pos[0] = elm->BoundMin[0] + (elm->BoundMax[0]-elm->BoundMin[0])*(i+0.5)/n;
+			Pos[1] = elm->BoundMin[1] + (elm->BoundMax[1]-elm->BoundMin[1])*(j+0.5)/n;
+			Pos[2] = 0.0;
+			if ( !elm->Aperture.Contains( Pos[0], Pos[1] ) )
+				continue;
+
+			Surface( Pos, elm, &F, DF, &err );
+			if ( err != 0 || F != F )
+				continue;
+
+			// with z=0 the surface equation gives -z of the surface
+			double b[6] = { 1.0, Pos[0], Pos[1], 0.5*Pos[0]*Pos[0], 0.5*Pos[1]*Pos[1], -F };
+			for (k=0;k<5;k++)
+				for (int m=0;m<6;m++)
+					A[k][m] += b[k]*b[m];
+			npts++;
+		}
+	}
+
+	if ( npts < 9 )
+		return;
+
+	// solve the normal equations by elimination with partial pivoting
+	for (k=0;k<5;k++)
+	{
+		int p = k;
+		for (i=k+1;i<5;i++)
+			if ( fabs(A[i][k]) > fabs(A[p][k]) ) p = i;
+
+		if ( fabs(A[p][k]) < 1e-12*(fabs(A[0][0])+1e-300) )
+			return;
+
+		for (j=0;j<6;j++) std::swap( A[k][j], A[p][j] );
+
+		for (i=0;i<5;i++)
+		{
+			if ( i == k ) continue;
+			double f = A[i][k]/A[k][k];
+			for (j=k;j<6;j++)
+				A[i][j] -= f*A[k][j];
+		}
+	}
+
+	for (k=0;k<5;k++)
+		elm->SeedCoef[k] = A[k][5]/A[k][k];
+
+	elm->NewtonSeed = true;
+}
+
 bool InitGeometries(TSystem *sys)
 {
 	for (st_uint_t i=0;i<sys->StageList.size();i++)
@@ -278,12 +417,60 @@ bool InitGeometries(TSystem *sys)
 
 			// calculate distance from aperture plane to element origin
 			AperturePlane( elm );
+			ApertureBounds( elm );
+			elm->Aperture.Setup( elm );
+			NewtonSeedFit( elm );
 		}
 	}
 
 	return CheckInputs( sys );
 }
 
+bool InitFluxTargets(TSystem *sys)
+{
+	for (st_uint_t i=0;i<sys->StageList.size();i++)
+		for (st_uint_t j=0;j<sys->StageList[i]->ElementList.size();j++)
+			sys->StageList[i]->ElementList[j]->FluxTargets.clear();
+
+	for (st_uint_t i=0;i<sys->FluxTargets.size();i++)
+	{
+		TFluxTarget *ft = sys->FluxTargets[i];
+
+		if (ft->StageIdx < 0 || ft->StageIdx >= (int)sys->StageList.size()
+			|| ft->ElementIdx < 0 || ft->ElementIdx >= (int)sys->StageList[ft->StageIdx]->ElementList.size())
+		{
+			sys->errlog("Flux target %d refers to invalid stage %d element %d.", i+1, ft->StageIdx+1, ft->ElementIdx+1);
+			return false;
+		}
+
+		TElement *elm = sys->StageList[ft->StageIdx]->ElementList[ft->ElementIdx];
+
+		ft->Radius = 0.0;
+		if ( (elm->SurfaceIndex == 't' || elm->SurfaceIndex == 'T') && elm->CurvOfRev != 0.0 )
+		{
+			// cylinders are binned over the full unrolled circumference
+			ft->Radius = 1.0/elm->CurvOfRev;
+			ft->MinX = -M_PI*ft->Radius;
+			ft->MaxX = M_PI*ft->Radius;
+		}
+
+		if (ft->NBinsX < 1 || ft->NBinsY < 1
+			|| ft->MaxX <= ft->MinX || ft->MaxY <= ft->MinY)
+		{
+			sys->errlog("Flux target %d has invalid grid dimensions.", i+1);
+			return false;
+		}
+
+		ft->BinSzX = (ft->MaxX - ft->MinX)/ft->NBinsX;
+		ft->BinSzY = (ft->MaxY - ft->MinY)/ft->NBinsY;
+		ft->Reset();
+
+		elm->FluxTargets.push_back( ft );
+	}
+
+	return true;
+}
+
 bool TranslateSurfaceParams( TSystem *sys, TElement *elm, double params[8])
 {
 	switch( elm->SurfaceIndex )
@@ -490,6 +677,8 @@ bool ReadSurfaceFile( const char *file, TElement *elm , TSystem *sys)
 
 		spline( elm->CubicSplineXData, elm->CubicSplineYData,
 			NPoints, x, y, elm->CubicSplineY2Data );
+		SplineCoeffs( elm->CubicSplineXData, elm->CubicSplineYData,
+			elm->CubicSplineY2Data, elm->CubicSplineCoef, &elm->CubicSplineDX );
 
 		if ( ((elm->ShapeIndex != 'a') && (elm->ShapeIndex != 'A') && (elm->ShapeIndex != 'l') && (elm->ShapeIndex != 'L'))
 			|| (elm->ParameterA < elm->CubicSplineXData[0])
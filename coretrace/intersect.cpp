@@ -185,10 +185,11 @@ at intersection point of ray and surface. Path length is also computed.  From Sp
                          = 2 for interpolation error in SURFACE procedure} */
 	int i = 0;
 	double S0 = 0.0, S00 = 0.0, S0A = 0.0;
-	double X1 = 0.0,x = 0.0,y = 0.0,r = 0.0,Y10 = 0.0,Y1A = 0.0,X10 = 0.0,X1A = 0.0;
+	double X1 = 0.0,x = 0.0,y = 0.0,Y10 = 0.0,Y1A = 0.0,X10 = 0.0,X1A = 0.0;
 	double Y1 = 0.0;
 	double SJ = 0.0;
 	double SJ1 = 0.0;
+	double SJPrev = 0.0, FPrev = 0.0;
 	double DFDXYZ = 0.0;
 	double FXYZ = 0.0;
 	int OKFlag = 0;
@@ -197,17 +198,13 @@ at intersection point of ray and surface. Path length is also computed.  From Sp
 	int EFlagcs=0;
 	double OuterRadius = 0.0, InnerRadius = 0.0, R1 = 0.0, R1A = 0.0, R10 = 0.0, Z1 = 0.0, dzdR1 = 0.0;
 	double S0Aperture = 0.0;
-	double Ro = 0.0, Ri = 0.0, XL = 0.0;
 	bool ZAInterceptInsideAperture = false;
-	double Y2 = 0.0,Y3 = 0.0,Y4 = 0.0;
-	double SLOP60 = 0.0, FXY = 0.0;
+	double FXY = 0.0;
 	double PosDum[3] = { 0.0, 0.0, 0.0 };
 	double PosAtZA[3] = { 0.0, 0.0, 0.0 };
 	double PosAtZ0[3] = { 0.0, 0.0, 0.0 };
-	double P1x = 0.0,P1y = 0.0,P2x = 0.0,P2y = 0.0,P3x = 0.0,P3y = 0.0,P4x = 0.0,P4y = 0.0;
 	char ApertureShapeIndex = ' ';
 	double PosInputToCS = 0.0;
-	int in_quad = 0;
 
 	*ErrorFlag = 0;
 	for (i=0;i<3;i++)
@@ -258,318 +255,11 @@ at intersection point of ray and surface. Path length is also computed.  From Sp
 	else
 		S0Aperture = (Element->ZAperture - PosXYZ[2])/(CosKLM[2] + 0.00000000001); //numerical fix? tim wendelin 11-20-06
       
-	x = PosXYZ[0]+CosKLM[0]*S0Aperture;               //x,y and radial position in aperture plane
+	x = PosXYZ[0]+CosKLM[0]*S0Aperture;               //x,y position in aperture plane
 	y = PosXYZ[1]+CosKLM[1]*S0Aperture;
-	r = sqrt(x*x + y*y);
 	
 	//Determine if intersection point of ray with aperture plane falls inside element aperture
-	SLOP60 = 1.7320508075688767; // tan(60.0*(ACOSM1O180));
-
-	ZAInterceptInsideAperture=false;
-
-	switch (Element->ShapeIndex)
-	{
-	case 'c':
-	case 'C': // Circular aperture
-			Ro = Element->ParameterA/2.0;			
-			if (r > Ro) //ray falls outsideside circular aperture
-				ZAInterceptInsideAperture = false;
-			else
-				ZAInterceptInsideAperture = true;
-		break;
-		
-	case 'h':
-	case 'H': //hexagonal aperture
-			Ro = Element->ParameterA/2.0;
-			
-			if (r > Ro) //ray falls outside circular circumference aperture
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			Ri = Ro*cos(30.0*(ACOSM1O180));
-			
-			if (r <= Ri) //ray falls inside inscribed circle
-			{
-				ZAInterceptInsideAperture = true;
-				goto Label_5;
-			}
-			
-			XL = sqrt(Ro*Ro - Ri*Ri); //otherwise break hexagon into 3 sections
-			if (x <= Ro && x > XL)  //1st section
-			{			
-				Y1 = SLOP60*(x-Ro);
-				Y2 = -Y1;
-				if (y >= Y1 && y <= Y2)
-				{
-					ZAInterceptInsideAperture = true;
-					goto Label_5;
-				}
-
-				ZAInterceptInsideAperture = false;					
-				goto Label_5;
-			}
-			
-			if (x <= XL && x >= -XL) //2nd section
-			{
-				if (y >= -Ri && y <= Ri)
-				{
-					ZAInterceptInsideAperture = true;
-					goto Label_5;
-				}
-
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			if (x < -XL && x >= -Ro) //3rd section
-			{
-				Y3 = SLOP60*(x+Ro);
-				Y4 = -Y3;
-				if (y >= Y4 && y <= Y3)
-				{
-					ZAInterceptInsideAperture = true;
-					goto Label_5;
-				}
-				
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-		break;
-
-	case 't':
-	case 'T': //Triangular aperture
-			Ro = Element->ParameterA/2.0;
-			
-			if (r > Ro) //ray falls outside circular circumference aperture
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			Ri = Ro*sin(30.0*(ACOSM1O180));
-			
-			if (r <= Ri)  //ray falls inside inscribed circle
-			{
-				ZAInterceptInsideAperture = true;
-				goto Label_5;
-			}
-			
-			if (x <= Ro && x > 0.0) //1st section
-			{
-				Y1 = -SLOP60*(x-Ri/cos(30.0*(ACOSM1O180)));
-				Y2 = -Ri;
-				if (y <= Y1 && y >= Y2)
-					ZAInterceptInsideAperture = true;
-				else
-					ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			if (x >= -Ro && x <= 0.0) //2nd section
-			{
-				Y3 = SLOP60*(x+Ri/cos(30.0*(ACOSM1O180)));
-				Y4 = -Ri;
-				if (y >= Y4 && y <= Y3)
-					ZAInterceptInsideAperture = true;
-				else
-					ZAInterceptInsideAperture = false;
-					
-				goto Label_5;
-			}
-		break;
-	
-	case 'r':
-	case 'R': // Rectangular aperture
-		
-			if (x > Element->ParameterA/2.0 && x < -Element->ParameterA/2.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-
-			if (y > Element->ParameterB/2.0 && y < -Element->ParameterB/2.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			ZAInterceptInsideAperture = true;
-			goto Label_5;
-			
-		break;
-
-	case 'a':
-	case 'A'://Annulus
-		
-			if (r < Element->ParameterA || r > Element->ParameterB)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			if (x >= 0.0)
-			{
-				if ( (asin(y/r) > Element->ParameterC*(ACOSM1O180)/2.0) 
-						|| (asin(y/r) < -Element->ParameterC*(ACOSM1O180)/2.0) )
-					ZAInterceptInsideAperture = false;
-				else
-					ZAInterceptInsideAperture = true;
-				goto Label_5;
-			}
-			
-			if (x < 0.0)
-			{
-				if ( (y >= 0) && ((acos(y/r)+M_PI/2.0) > Element->ParameterC*(ACOSM1O180)/2.0) )
-				{
-					ZAInterceptInsideAperture = false;
-					goto Label_5;
-				}
-				else if ((y < 0) && ((-acos(-y/r)-M_PI/2.0) < -Element->ParameterC*(ACOSM1O180)/2.0) )
-				{
-					ZAInterceptInsideAperture = false;
-					goto Label_5;
-				}
-			
-				ZAInterceptInsideAperture = true;
-				goto Label_5;
-			}
-			
-		break;
-
-	case 'l':
-	case 'L': //off axis aperture section of line focus trough  or cylinder
-		
-			if (Element->ParameterA == 0.0 && Element->ParameterB == 0.0) goto Label_4; //for cylinder, only need to check for limits on y
-			
-			if (x < Element->ParameterA || x > Element->ParameterB)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-Label_4:
-			if (y < -Element->ParameterC/2.0 || y > Element->ParameterC/2.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			ZAInterceptInsideAperture = true;
-			goto Label_5;
-			
-		break;
-		
-	case 'i':
-	case 'I': //irregular triangle
-			P1x = Element->ParameterA;
-			P1y = Element->ParameterB;
-			P2x = Element->ParameterC;
-			P2y = Element->ParameterD;
-			P3x = Element->ParameterE;
-			P3y = Element->ParameterF;
-
-			if (!intri( P1x, P1y, P2x, P2y, P3x, P3y, x, y ))
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			/*
-			//Side 1
-			Tn = (P2y-P1y)*(P1x-x)-(P2x-P1x)*(P1y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			//side 2
-			Tn = (P3y-P2y)*(P2x-x)-(P3x-P2x)*(P2y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			//side 3
-			Tn = (P1y-P3y)*(P3x-x)-(P1x-P3x)*(P3y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			*/
-			
-			ZAInterceptInsideAperture = true;
-			goto Label_5;
-		break;
-			
-	case 'q':
-	case 'Q'://irregular quadrilateral
-	
-			P1x = Element->ParameterA;
-			P1y = Element->ParameterB;
-			P2x = Element->ParameterC;
-			P2y = Element->ParameterD;
-			P3x = Element->ParameterE;
-			P3y = Element->ParameterF;
-			P4x = Element->ParameterG;
-			P4y = Element->ParameterH;
-
-			in_quad = inquad(P1x, P1y, P2x, P2y, P3x, P3y, P4x, P4y, x, y);
-
-			if (!in_quad)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			/*
-			//Side 1
-			Tn = (P2y-P1y)*(P1x-x)-(P2x-P1x)*(P1y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			//side 2
-			Tn = (P3y-P2y)*(P2x-x)-(P3x-P2x)*(P2y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			//side 3
-			Tn = (P4y-P3y)*(P3x-x)-(P4x-P3x)*(P3y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			}
-			
-			//side 4
-			Tn =  (P1y-P4y)*(P4x-x)-(P1x-P4x)*(P4y-y);
-			if (Tn < 0.0)
-			{
-				ZAInterceptInsideAperture = false;
-				goto Label_5;
-			} */
-			
-			ZAInterceptInsideAperture = true;
-			goto Label_5;
-		break;
-	default:
-		break;
-	} // end switch
-
-
-Label_5:
-//	if (in_quad && !ZAInterceptInsideAperture)
-//		printf("ERROR\n");
+	ZAInterceptInsideAperture = Element->Aperture.Contains(x, y);
 
 	ZStart = 0.0;    //default for all surfacetypes
 
@@ -766,10 +456,9 @@ Label_5:
 				else
 					 PosInputToCS = PosXYZ[0];
 					 
-				if (!splint(Element->CubicSplineXData,
-						Element->CubicSplineYData,
-						Element->CubicSplineY2Data,
-						Element->CubicSplineXData.size(),
+				if (!spleval(Element->CubicSplineXData,
+						Element->CubicSplineCoef,
+						Element->CubicSplineDX,
 						PosInputToCS, &Z1, &dzdR1))
 				{
 					*ErrorFlag = 3;
@@ -852,10 +541,9 @@ Label_5:
 				else
 					 PosInputToCS = PosXYZ[0];
 					 
-				if (!splint(Element->CubicSplineXData,
-						Element->CubicSplineYData,
-						Element->CubicSplineY2Data,
-						Element->CubicSplineXData.size(),
+				if (!spleval(Element->CubicSplineXData,
+						Element->CubicSplineCoef,
+						Element->CubicSplineDX,
 						PosInputToCS,&Z1,&dzdR1))
 				{
 					*ErrorFlag = 3;
@@ -933,11 +621,37 @@ Label_10:
 		S0 = 0.0;
 	else
 		S0 = (ZStart-PosXYZ[2])/(CosKLM[2] + 0.00000000001); //numerical fix? tim wendelin 11-20-06;   //SO is the pathlength from the initial ray position to the Newton-Raphson starting plane
+
+	//for measured and polynomial surfaces, start instead from the hit on the fitted paraboloid
+	//closest to the starting plane.  this is already within the surface waviness of the root
+	if (Element->NewtonSeed)
+	{
+		double *C = Element->SeedCoef;
+		double qa = 0.5*(C[3]*CosKLM[0]*CosKLM[0] + C[4]*CosKLM[1]*CosKLM[1]);
+		double qb = C[1]*CosKLM[0] + C[2]*CosKLM[1] + C[3]*PosXYZ[0]*CosKLM[0] + C[4]*PosXYZ[1]*CosKLM[1] - CosKLM[2];
+		double qc = C[0] + C[1]*PosXYZ[0] + C[2]*PosXYZ[1] + 0.5*(C[3]*PosXYZ[0]*PosXYZ[0] + C[4]*PosXYZ[1]*PosXYZ[1]) - PosXYZ[2];
+		double disc = qb*qb - 4.0*qa*qc;
+
+		if (fabs(qa) <= 1e-12*fabs(qb))
+			S0 = -qc/qb;
+		else if (disc >= 0.0)
+		{
+			double q = -0.5*(qb + (qb < 0.0 ? -sqrt(disc) : sqrt(disc)));
+			double s1 = q/qa;
+			double s2 = (q != 0.0) ? qc/q : s1;
+			S0 = (fabs(s1-S0) <= fabs(s2-S0)) ? s1 : s2;
+		}
+		ZStart = PosXYZ[2] + CosKLM[2]*S0;
+	}
 		
 	X1 = PosXYZ[0] + CosKLM[0]*S0;      // from this we calculate the x,y position on ZStart starting plane
 	Y1 = PosXYZ[1] + CosKLM[1]*S0;
 		 
 	SJ1 = 0.0;
+	SJPrev = 0.0;
+	FPrev = 0.0;
+
+	Element->NewtonCalls++;
 
 	i = 0;
 //Begin the Newton-Raphson Iteration
@@ -949,6 +663,7 @@ Label_10:
 		PosXYZ[2] = ZStart + CosKLM[2]*SJ;
 
 		Surface(PosXYZ, Element, &FXYZ, DFXYZ, &OKFlag);
+		Element->NewtonSteps++;
 		
 		if (OKFlag == 0) goto Label_40;
 		
@@ -958,11 +673,28 @@ Label_10:
 Label_40:
 		DFDXYZ = DOT(DFXYZ, CosKLM);
 		if ( fabs(FXYZ) <= Epsilon*fabs(DFDXYZ) ) goto Label_100;
+
+		//safeguard: a step that left the residual larger than before overshot the root,
+		//so go back halfway towards the previous point.  the previous point is always
+		//the last one evaluated, so a halving is judged against the point it came from
+		if ( i > 1 && fabs(FXYZ) > fabs(FPrev) )
+		{
+			SJ1 = 0.5*(SJPrev + SJ);
+			SJPrev = SJ;
+			FPrev = FXYZ;
+			continue;
+		}
+
+		if (DFDXYZ == 0.0) break;   //ray parallel to the surface, no step possible
 		
+		SJPrev = SJ;
+		FPrev = FXYZ;
 		SJ1 = SJ - FXYZ/DFDXYZ;
 	}
 	*ErrorFlag = 1;   //Failed to converge
 
 Label_100:
+	if (*ErrorFlag == 1)   //misses outside the surface data are not failures
+		Element->NewtonFailures++;
 	*PathLength = S0 + SJ;
 }
@@ -241,9 +241,9 @@ void PolySlope( std::vector<double> &Coeffs, int POrder, double ax, double ay, d
 //end of procedure--------------------------------------------------------------
 
 
-bool splint( std::vector<double> &xa,
-			std::vector<double> &ya,
-			std::vector<double> &y2a,
+bool splint( const std::vector<double> &xa,
+			const std::vector<double> &ya,
+			const std::vector<double> &y2a,
 			int n,
 			double x,
 			double *y,
@@ -284,8 +284,8 @@ bool splint( std::vector<double> &xa,
 
 //end of procedure--------------------------------------------------------------
 
-void spline( std::vector<double> &x, 
-			std::vector<double> &y,
+void spline( const std::vector<double> &x, 
+			const std::vector<double> &y,
 			int n,
 			double yp1, double ypn,
 			std::vector<double> &y2 )
@@ -330,6 +330,82 @@ void spline( std::vector<double> &x,
 }
 //end of procedure--------------------------------------------------------------
 
+void SplineCoeffs( const std::vector<double> &x,
+			const std::vector<double> &y,
+			const std::vector<double> &y2,
+			std::vector<double> &coef,
+			double *dx )
+{
+/*{Expands each segment of the spline from spline() into a cubic in (x - x[k]),
+   coef[4k..4k+3] = c0..c3, so that it is evaluated without the second derivatives.
+   dx is set to the knot spacing if the knots are uniformly spaced, else 0.} */
+	int n = (int)x.size();
+	coef.assign( n > 1 ? 4*(n-1) : 0, 0.0 );
+	*dx = 0.0;
+	if (n < 2) return;
+
+	for (int k=0;k<n-1;k++)
+	{
+		double h = x[k+1]-x[k];
+		if (h == 0.0) continue; // spleval reports the zero width segment
+
+		coef[4*k]   = y[k];
+		coef[4*k+1] = (y[k+1]-y[k])/h - h*(2.0*y2[k]+y2[k+1])/6.0;
+		coef[4*k+2] = y2[k]/2.0;
+		coef[4*k+3] = (y2[k+1]-y2[k])/(6.0*h);
+	}
+
+	double h = (x[n-1]-x[0])/(n-1);
+	for (int k=0;k<n-1;k++)
+		if ( fabs( (x[k+1]-x[k]) - h ) > 1e-9*fabs(h) )
+			return;
+
+	*dx = h;
+}
+//end of procedure--------------------------------------------------------------
+
+bool spleval( const std::vector<double> &xa,
+			const std::vector<double> &coef,
+			double dx,
+			double x,
+			double *y,
+			double *dydx )
+{
+/*{Evaluates the spline expanded by SplineCoeffs and its slope at x.  Uniform knots
+   locate the segment directly, otherwise it is found by bisection as in splint().
+   Outside the data the end segments are extrapolated, also as in splint().} */
+	int n = (int)xa.size();
+	int klo = 0, khi = n-1, k = 0;
+
+	if (n < 2) return false;
+
+	if (dx > 0.0)
+	{
+		double f = (x - xa[0])/dx;
+		klo = (f <= 0.0) ? 0 : ( f >= n-2 ? n-2 : (int)f );
+	}
+	else
+	{
+		while( khi-klo > 1)
+		{
+			k = (khi+klo) / 2;
+			if( xa[k] > x )
+				khi = k;
+			else
+				klo = k;
+		}
+	}
+
+	if (xa[klo+1] == xa[klo]) return false;
+
+	const double *c = &coef[4*klo];
+	double t = x - xa[klo];
+	*y = ((c[3]*t + c[2])*t + c[1])*t + c[0];
+	*dydx = (3.0*c[3]*t + 2.0*c[2])*t + c[1];
+	return true;
+}
+//end of procedure--------------------------------------------------------------
+
 void piksrt(int n, double arr[5] )
 {
 	int i;
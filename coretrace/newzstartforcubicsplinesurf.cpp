@@ -69,7 +69,7 @@ void NewZStartforCubicSplineSurf(
 // Z value of this point becomes the new ZStart plane for the Newton-Raphson interation process.  If EFlag = 0 then success, if EFlag =
 //1, ray heading away from virtual cylinder (or plane). If EFlag = 2, then ray totally misses virtual cylinder (or plane).  These last two should never happen.
 
-	double t1 = 0.0,t2 = 0.0,A = 0.0,B = 0.0,C = 0.0;
+	double t1 = 0.0,t2 = 0.0,A = 0.0,B = 0.0,C = 0.0,D = 0.0;
 	*EFlag = 0;
 	
 	switch (AperShapeIndex)
@@ -81,10 +81,12 @@ void NewZStartforCubicSplineSurf(
 			B = 2.0*(PosLoc[0]*CosLoc[0] + PosLoc[1]*CosLoc[1]);
 			C = PosLoc[0]*PosLoc[0] + PosLoc[1]*PosLoc[1] - CRadius*CRadius ;
 						
-			if (B*B > 4.0*A*C)
+			D = B*B - 4.0*A*C;
+			if (D > 0.0)
 			{
-				t1 = (-B + sqrt(B*B-4.0*A*C))/(2.0*A);
-				t2 = (-B - sqrt(B*B-4.0*A*C))/(2.0*A);
+				D = sqrt(D);
+				t1 = (-B + D)/(2.0*A);
+				t2 = (-B - D)/(2.0*A);
 				if (t2 > 0)    //initial ray location outside surface
 				{
 					*NewZStart = PosLoc[2] + t2*CosLoc[2];
@@ -124,23 +124,8 @@ void GenerateRay(
 			TSun *Sun,
 			double PosRayGlobal[3],
 			double CosRayGlobal[3],
-            double PosRaySun[3]
-            );
-
-bool LoadExistingStage0Ray(
-            int index,
-            std::vector<std::vector< double> > *raydat,
-			double PosRayGlobal[3],
-            double CosRayGlobal[3],
-            st_uint_t &ElementNum,
-            st_uint_t &RayNum );
-
-bool LoadExistingStage1Ray(
-            int index,
-            std::vector<std::vector< double> > *raydat,
-			double PosRayGlobal[3],
-            double CosRayGlobal[3],
-            int &raynum);
+            double PosRaySun[3],
+			const double *u = 0 ); // low-discrepancy point for the position, if sampling them
 
 bool SunToPrimaryStage(
 				TSystem *System,
@@ -159,12 +144,16 @@ void Errors(
 			TElement *Element,
 			TOpticalProperties *OptProperties,
 			double CosOut[3],
-			double DFXYZ[3] );
+			double DFXYZ[3],
+			const double *u = 0 ); // low-discrepancy point for the angles, if sampling them
+
+double ErrorAngle( char dist, double delop, TSun *Sun, double u );
 
 
 void SurfaceNormalErrors( MTRand &myrng, double CosIn[3],
 						 TOpticalProperties *OptProperties,
-						 double CosOut[3] )  throw(nanexcept);
+						 double CosOut[3],
+						 const double *u = 0 )  throw(nanexcept);
 
 void DetermineElementIntersectionNew(
 			TElement *Element,
@@ -215,19 +204,32 @@ void EvalPoly(double ax, double ay, std::vector<double> &Coeffs, int POrder, dou
 
 void PolySlope( std::vector<double> &Coeffs, int POrder, double ax, double ay, double *dzdx, double *dzdy);
 
-bool splint( std::vector<double> &xa,
-			std::vector<double> &ya,
-			std::vector<double> &y2a,
+bool splint( const std::vector<double> &xa,
+			const std::vector<double> &ya,
+			const std::vector<double> &y2a,
 			int n,
 			double x,
 			double *y,
 			double *dydx );
                          
-void spline( std::vector<double> &x, 
-			std::vector<double> &y,
+void spline( const std::vector<double> &x, 
+			const std::vector<double> &y,
 			int n,
 			double yp1, double ypn,
 			std::vector<double> &y2 );
+
+void SplineCoeffs( const std::vector<double> &x,
+			const std::vector<double> &y,
+			const std::vector<double> &y2,
+			std::vector<double> &coef,
+			double *dx );
+
+bool spleval( const std::vector<double> &xa,
+			const std::vector<double> &coef,
+			double dx,
+			double x,
+			double *y,
+			double *dydx );
 			
 void piksrt(int n, double arr[5] );
 
@@ -247,9 +249,9 @@ void FEInterpNew(double Xray, double Yray, double Density,
 			HPM2D &FEData, int NumFEPoints,
 			double *zr);
 			
-void Root_432(int order, double Coeffs[5][5], double RealRoots[5], double *ImRoot1, double *ImRoot2);
 
 bool InitGeometries(TSystem *sys);
+bool InitFluxTargets(TSystem *sys);
 bool TranslateSurfaceParams( TElement *elm, double params[8]);
 bool ReadSurfaceFile( const char *file, TElement *elm );
 
@@ -280,9 +282,8 @@ bool Trace(TSystem *System, unsigned int seed,
            bool AsPowerTower,
 		   int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data),
 		   void *cbdata,
-           std::vector<std::vector< double > > *stage0data = 0,
-           std::vector<std::vector< double > > *stage1in = 0,
-           bool save_stage_data = false);
+           const char *resume_file = 0,
+           const char *replay_file = 0);
 
 bool DumpSystem(const char *file, TSystem *sys);
 
@@ -97,19 +97,752 @@ inline void CopyVec3( double dest[3], double src[3] )
 
 #define ZeroVec(x) x[0]=x[1]=x[2]=0.0
 
+static inline void CountRayRecord( TStage *Stage, int element )
+{
+	st_uint_t k = abs(element);
+	if (k == 0)
+		Stage->MissCount++;
+	else if (k <= Stage->ElementList.size())
+	{
+		TElement *e = Stage->ElementList[k-1];
+		e->HitCount++;
+		if (element < 0)
+			e->AbsorbedCount++;
+	}
+}
+
+static inline bool RetainRayRecord( TSystem *System, TStage *Stage, TRayData::ray_t *ray )
+{
+	switch( System->sim_retention )
+	{
+	case ST_RETAIN_FINAL:
+		return ray->element < 0 || ray->absorbed > 0;
+	case ST_RETAIN_SELECTED:
+		{
+			st_uint_t k = abs(ray->element);
+			return Stage->RetainRays
+				|| ( k > 0 && k <= Stage->ElementList.size() && Stage->ElementList[k-1]->RetainRays );
+		}
+	case ST_RETAIN_SAMPLED:
+		return System->sim_retain_every < 2
+			|| (ray->raynum-1) % System->sim_retain_every == 0;
+	case ST_RETAIN_NONE:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static inline bool SaveRayRecord( TSystem *System, TStage *Stage, TRayData::ray_t *ray )
+{
+	if ( !RetainRayRecord( System, Stage, ray ) )
+		return true;
+
+	if ( !Stage->RayData.Append( ray->pos, ray->cos, ray->element, ray->stage, ray->raynum, ray->weight, ray->absorbed ) )
+	{
+		System->errlog("Failed to save ray data at index %d", Stage->RayData.Count());
+		return false;
+	}
+
+	return true;
+}
+
+// cheap test of a ray in stage coordinates against the bounds of an element,
+// before transforming and intersecting.  the ray is clipped to the slabs of
+// the bounded axes, and if nothing of it is left it can't hit the element
+static inline bool RayMayHitElement( TElement *Element, double PosStage[3], double CosStage[3] )
+{
+	double tmin = 0.0, tmax = 1e99;
+	for (int k=0;k<2;k++)
+	{
+		if ( !Element->Bounded[k] )
+			continue;
+
+		double *axis = Element->RRefToLoc[k];
+		double p = axis[0]*(PosStage[0] - Element->Origin[0])
+			+ axis[1]*(PosStage[1] - Element->Origin[1])
+			+ axis[2]*(PosStage[2] - Element->Origin[2]);
+		double d = axis[0]*CosStage[0] + axis[1]*CosStage[1] + axis[2]*CosStage[2];
+
+		if ( fabs(d) < 1e-12 )
+		{
+			// parallel to the slab, so it stays inside or outside
+			if ( p < Element->BoundMin[k] || p > Element->BoundMax[k] )
+				return false;
+			continue;
+		}
+
+		double t0 = (Element->BoundMin[k] - p)/d;
+		double t1 = (Element->BoundMax[k] - p)/d;
+		if ( t0 > t1 ) std::swap( t0, t1 );
+		if ( t0 > tmin ) tmin = t0;
+		if ( t1 < tmax ) tmax = t1;
+		if ( tmin > tmax )
+			return false;
+	}
+
+	return true;
+}
+
+static inline void TallyFluxTargets( TElement *Element, TRayData::ray_t *ray, double PosElement[3], double absorbed )
+{
+	for (size_t n=0;n<Element->FluxTargets.size();n++)
+		Element->FluxTargets[n]->Tally( ray->raynum, PosElement, ray->weight, absorbed );
+}
+
+// the wavelength of a ray in a spectral trace.  it is hashed (splitmix64)
+// from the seed and the ray number rather than drawn from the generator, so
+// a ray keeps its wavelength through every stage without carrying it along,
+// and traces without a spectrum draw exactly the same numbers as before
+static inline double RayWavelength( const TSpectrum &Spectrum, unsigned int seed, st_uint_t raynum, int *band )
+{
+	unsigned long long z = ((unsigned long long)seed << 32) ^ (unsigned long long)raynum;
+	double u[2];
+	for (int n=0;n<2;n++)
+	{
+		z += 0x9E3779B97F4A7C15ULL;
+		unsigned long long x = z;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		x ^= x >> 31;
+		u[n] = (x >> 11) * (1.0/9007199254740992.0);
+	}
+	return Spectrum.Sample( u[0], u[1], band );
+}
+
+// reflectivity or transmissivity of an optic at a wavelength, interpolated
+// linearly in its spectral table and held at the end values outside it
+static double SpectralProperty( TOpticalProperties *optics, double wavelength, bool reflect )
+{
+	std::vector<TOpticalProperties::specdat> &t = optics->SpectralTable;
+	size_t n = t.size();
+	size_t m = 0;
+	if ( wavelength > t[0].wavelength )
+	{
+		if ( wavelength >= t[n-1].wavelength )
+			m = n-1;
+		else
+		{
+			size_t lo = 0, hi = n-1;
+			while ( hi - lo > 1 )
+			{
+				size_t mid = (lo + hi)/2;
+				if ( t[mid].wavelength <= wavelength ) lo = mid;
+				else hi = mid;
+			}
+			double f = (wavelength - t[lo].wavelength)/(t[hi].wavelength - t[lo].wavelength);
+			return reflect ? t[lo].refl + f*(t[hi].refl - t[lo].refl)
+				: t[lo].trans + f*(t[hi].trans - t[lo].trans);
+		}
+	}
+	return reflect ? t[m].refl : t[m].trans;
+}
+
 class GlobalRay
 {
 public:
 	GlobalRay() {
 		Num = 0;
+		Weight = 1.0;
 		for (int i=0;i<3;i++) Pos[i]=Cos[i]=0.0;
 	}
 
 	double Pos[3];
 	double Cos[3];
 	st_uint_t Num;
+	double Weight;
 };
 
+// position of the trace loop at the start of a ray or a stage.  together
+// with the generator, the counters, the flux maps and the ray data it is
+// everything needed to pick the trace up again
+struct TraceState
+{
+	st_uint_t NumberOfRays;
+	st_uint_t MaxNumberOfRays;
+	int IncludeSunShape;
+	int IncludeErrors;
+	int AsPowerTower;
+
+	st_uint_t Stage;
+	int InStage; // saved at the start of a ray rather than of the stage
+	st_uint_t RayNumber;
+	st_uint_t StageDataArrayIndex;
+	st_uint_t PreviousStageDataArrayIndex;
+	int PreviousStageHasRays;
+	st_uint_t LastRayNumberInPreviousStage;
+	st_uint_t NumIncoming; // rays passed into the stage from the previous one
+	st_uint_t SunRayCount;
+	st_uint_t RaysTracedTotal;
+	unsigned int RunSeed; // keys the wavelengths of the rays, the Sobol scrambling and the first sun stratum
+	int Weighted;
+	double RouletteWeight;
+	int Sampling;
+};
+
+static const char CheckpointMagic[8] = { 'S','T','C','K','P','T','0','1' };
+
+static bool SeekFile( FILE *fp, st_uint_t pos )
+{
+#ifdef _WIN32
+	return _fseeki64( fp, (__int64)pos, SEEK_SET ) == 0;
+#else
+	return fseeko( fp, (off_t)pos, SEEK_SET ) == 0;
+#endif
+}
+
+static bool WriteItems( FILE *fp, const void *p, size_t size, size_t count = 1 )
+{
+	return count == 0 || fwrite( p, size, count, fp ) == count;
+}
+
+static bool ReadItems( FILE *fp, void *p, size_t size, size_t count = 1 )
+{
+	return count == 0 || fread( p, size, count, fp ) == count;
+}
+
+// the flux maps as they are so far.  a hit a target holds back belongs to a
+// finished ray, so it is flushed first
+static bool WriteFluxTargets( FILE *fp, TSystem *System )
+{
+	st_uint_t ntargets = System->FluxTargets.size();
+	bool ok = WriteItems( fp, &ntargets, sizeof(st_uint_t) );
+	for (st_uint_t n=0;ok && n<ntargets;n++)
+	{
+		TFluxTarget *t = System->FluxTargets[n];
+		t->Flush();
+		int bins[2] = { t->NBinsX, t->NBinsY };
+		ok = WriteItems( fp, bins, sizeof(int), 2 )
+			&& WriteItems( fp, t->Grid.data(), sizeof(double), t->Grid.nrows()*t->Grid.ncols() )
+			&& WriteItems( fp, t->Hits.data(), sizeof(double), t->Hits.nrows()*t->Hits.ncols() )
+			&& WriteItems( fp, &t->RayCount, sizeof(st_uint_t) )
+			&& WriteItems( fp, &t->NotBinned, sizeof(st_uint_t) )
+			&& WriteItems( fp, t->CentroidSum, sizeof(double), 3 )
+			&& WriteItems( fp, &t->CentroidCount, sizeof(st_uint_t) );
+	}
+	return ok;
+}
+
+static bool ReadFluxTargets( FILE *fp, TSystem *System )
+{
+	st_uint_t ntargets = 0;
+	bool ok = ReadItems( fp, &ntargets, sizeof(st_uint_t) ) && ntargets == System->FluxTargets.size();
+	for (st_uint_t n=0;ok && n<ntargets;n++)
+	{
+		TFluxTarget *t = System->FluxTargets[n];
+		int bins[2];
+		ok = ReadItems( fp, bins, sizeof(int), 2 )
+			&& bins[0] == t->NBinsX && bins[1] == t->NBinsY
+			&& ReadItems( fp, t->Grid.data(), sizeof(double), t->Grid.nrows()*t->Grid.ncols() )
+			&& ReadItems( fp, t->Hits.data(), sizeof(double), t->Hits.nrows()*t->Hits.ncols() )
+			&& ReadItems( fp, &t->RayCount, sizeof(st_uint_t) )
+			&& ReadItems( fp, &t->NotBinned, sizeof(st_uint_t) )
+			&& ReadItems( fp, t->CentroidSum, sizeof(double), 3 )
+			&& ReadItems( fp, &t->CentroidCount, sizeof(st_uint_t) );
+	}
+	return ok;
+}
+
+// the spectral absorption tallies of an element, one per band of the spectrum
+static bool WriteSpectralCounts( FILE *fp, TElement *Element )
+{
+	st_uint_t nbands = Element->SpectralAbsorbed.size();
+	return WriteItems( fp, &nbands, sizeof(st_uint_t) )
+		&& WriteItems( fp, nbands > 0 ? &Element->SpectralAbsorbed[0] : 0, sizeof(double), nbands );
+}
+
+static bool ReadSpectralCounts( FILE *fp, TElement *Element )
+{
+	st_uint_t nbands = 0;
+	return ReadItems( fp, &nbands, sizeof(st_uint_t) )
+		&& nbands == Element->SpectralAbsorbed.size()
+		&& ReadItems( fp, nbands > 0 ? &Element->SpectralAbsorbed[0] : 0, sizeof(double), nbands );
+}
+
+// checkpoints are written to a state file, which is replaced as a whole each
+// time, and to files that are only ever appended to while a stage is traced:
+//   <file>.rays  ray records, in the order they were saved
+//   <file>.s<n>  rays passed into stage n, written when the stage starts
+//   <file>.o<n>  rays passed on by stage n so far
+// the state file holds how much of each it covers, so anything written after
+// the last checkpoint is ignored.  the files of a stage are removed once the
+// checkpoint at the start of the next one is in place
+class TraceCheckpoint
+{
+public:
+	TraceCheckpoint( TSystem *System, const std::string &file, st_uint_t every )
+		: m_sys(System), m_file(file), m_every(every),
+		m_rayFile(0), m_raysSaved(0),
+		m_stage(-1), m_outFile(0), m_outSaved(0)
+	{
+		m_stageSaved.resize( System->StageList.size(), 0 );
+	}
+
+	~TraceCheckpoint()
+	{
+		if ( m_rayFile ) fclose( m_rayFile );
+		if ( m_outFile ) fclose( m_outFile );
+	}
+
+	st_uint_t Every() { return m_every; }
+
+	bool Write( TraceState &state, MTRand &rng, std::vector<GlobalRay> &rays );
+	bool Read( const std::string &file, TraceState &state, MTRand &rng, std::vector<GlobalRay> &rays );
+	void Remove();
+
+private:
+	std::string StageFile( const std::string &file, char kind, int stage );
+	FILE *OpenAt( const std::string &file, st_uint_t pos, size_t size );
+	bool ReadRays( const std::string &file, std::vector<GlobalRay> &rays, st_uint_t count );
+	bool WriteState( FILE *fp, TraceState &state, MTRand &rng );
+
+	TSystem *m_sys;
+	std::string m_file;
+	st_uint_t m_every;
+
+	FILE *m_rayFile;
+	st_uint_t m_raysSaved;
+	std::vector<st_uint_t> m_stageSaved;
+
+	int m_stage; // stage of the .s and .o files in use, -1 for none yet
+	FILE *m_outFile;
+	st_uint_t m_outSaved;
+};
+
+std::string TraceCheckpoint::StageFile( const std::string &file, char kind, int stage )
+{
+	char ext[32];
+	sprintf( ext, ".%c%d", kind, stage+1 );
+	return file + ext;
+}
+
+// opens a file for writing from record 'pos' onwards, keeping what is before
+FILE *TraceCheckpoint::OpenAt( const std::string &file, st_uint_t pos, size_t size )
+{
+	FILE *fp = fopen( file.c_str(), pos > 0 ? "r+b" : "wb" );
+	if ( fp && !SeekFile( fp, pos * size ) )
+	{
+		fclose( fp );
+		fp = 0;
+	}
+
+	if ( !fp )
+		m_sys->errlog("could not open checkpoint file %s", file.c_str());
+
+	return fp;
+}
+
+bool TraceCheckpoint::ReadRays( const std::string &file, std::vector<GlobalRay> &rays, st_uint_t count )
+{
+	if ( count == 0 )
+		return true;
+
+	FILE *fp = fopen( file.c_str(), "rb" );
+	bool ok = fp != 0 && count <= rays.size() && ReadItems( fp, &rays[0], sizeof(GlobalRay), count );
+	if ( fp ) fclose( fp );
+
+	if ( !ok )
+		m_sys->errlog("checkpoint file %s is missing or incomplete", file.c_str());
+
+	return ok;
+}
+
+bool TraceCheckpoint::Write( TraceState &state, MTRand &rng, std::vector<GlobalRay> &rays )
+{
+	int stage = (int)state.Stage;
+	int laststage = m_stage;
+	if ( stage != m_stage )
+	{
+		if ( m_outFile ) fclose( m_outFile );
+		m_outFile = 0;
+
+		std::string infile = StageFile( m_file, 's', stage );
+		FILE *fp = OpenAt( infile, 0, sizeof(GlobalRay) );
+		if ( !fp )
+			return false;
+
+		bool ok = WriteItems( fp, state.NumIncoming > 0 ? &rays[0] : 0, sizeof(GlobalRay), state.NumIncoming );
+		ok = ( fclose( fp ) == 0 ) && ok;
+		if ( !ok )
+		{
+			m_sys->errlog("failed to write checkpoint file %s", infile.c_str());
+			return false;
+		}
+
+		m_stage = stage;
+		m_outSaved = 0;
+	}
+
+	if ( !m_outFile
+		&& (m_outFile = OpenAt( StageFile( m_file, 'o', stage ), m_outSaved, sizeof(GlobalRay) )) == 0 )
+		return false;
+
+	if ( !m_rayFile
+		&& (m_rayFile = OpenAt( m_file + ".rays", m_raysSaved, sizeof(TRayData::ray_t) )) == 0 )
+		return false;
+
+	// rays passed on so far fill the front of the array, ahead of the
+	// incoming rays still to be traced
+	st_uint_t nout = state.InStage ? state.PreviousStageDataArrayIndex : 0;
+	bool ok = true;
+	if ( nout > m_outSaved )
+		ok = WriteItems( m_outFile, &rays[m_outSaved], sizeof(GlobalRay), nout - m_outSaved );
+	m_outSaved = nout;
+
+	for (st_uint_t i=0;ok && i<m_sys->StageList.size();i++)
+	{
+		TRayData &data = m_sys->StageList[i]->RayData;
+		st_uint_t count = data.Count();
+		for (st_uint_t k=m_stageSaved[i];ok && k<count;k++)
+			ok = WriteItems( m_rayFile, data.Index(k,false), sizeof(TRayData::ray_t) );
+		m_raysSaved += count - m_stageSaved[i];
+		m_stageSaved[i] = count;
+	}
+
+	ok = ok && fflush( m_outFile ) == 0 && fflush( m_rayFile ) == 0;
+	if ( !ok )
+	{
+		m_sys->errlog("failed to write checkpoint data for %s", m_file.c_str());
+		return false;
+	}
+
+	// the data is in place before the state that refers to it
+	std::string tmp = m_file + ".tmp";
+	FILE *fp = fopen( tmp.c_str(), "wb" );
+	if ( !fp )
+	{
+		m_sys->errlog("could not open checkpoint file %s", tmp.c_str());
+		return false;
+	}
+
+	ok = WriteState( fp, state, rng );
+	ok = ( fclose( fp ) == 0 ) && ok;
+	if ( !ok )
+	{
+		m_sys->errlog("failed to write checkpoint %s", tmp.c_str());
+		remove( tmp.c_str() );
+		return false;
+	}
+
+#ifdef _WIN32
+	remove( m_file.c_str() );
+#endif
+	if ( rename( tmp.c_str(), m_file.c_str() ) != 0 )
+	{
+		m_sys->errlog("could not replace checkpoint %s", m_file.c_str());
+		return false;
+	}
+
+	if ( laststage >= 0 && laststage != stage )
+	{
+		remove( StageFile( m_file, 's', laststage ).c_str() );
+		remove( StageFile( m_file, 'o', laststage ).c_str() );
+	}
+
+	return true;
+}
+
+bool TraceCheckpoint::WriteState( FILE *fp, TraceState &state, MTRand &rng )
+{
+	unsigned int sizes[3] = { sizeof(TraceState), sizeof(TRayData::ray_t), sizeof(GlobalRay) };
+	MTRand::uint32 rngstate[MTRand::SAVE];
+	rng.save( rngstate );
+
+	bool ok = WriteItems( fp, CheckpointMagic, 8 )
+		&& WriteItems( fp, sizes, sizeof(unsigned int), 3 )
+		&& WriteItems( fp, &state, sizeof(TraceState) )
+		&& WriteItems( fp, &m_every, sizeof(st_uint_t) )
+		&& WriteItems( fp, rngstate, sizeof(MTRand::uint32), MTRand::SAVE );
+
+	st_uint_t nstages = m_sys->StageList.size();
+	ok = ok && WriteItems( fp, &nstages, sizeof(st_uint_t) );
+	for (st_uint_t i=0;ok && i<nstages;i++)
+	{
+		TStage *stage = m_sys->StageList[i];
+		st_uint_t nelem = stage->ElementList.size();
+		ok = WriteItems( fp, &nelem, sizeof(st_uint_t) )
+			&& WriteItems( fp, &stage->MissCount, sizeof(st_uint_t) )
+			&& WriteItems( fp, &m_stageSaved[i], sizeof(st_uint_t) );
+		for (st_uint_t j=0;ok && j<nelem;j++)
+			ok = WriteItems( fp, &stage->ElementList[j]->HitCount, sizeof(st_uint_t) )
+				&& WriteItems( fp, &stage->ElementList[j]->AbsorbedCount, sizeof(st_uint_t) )
+			&& WriteItems( fp, &stage->ElementList[j]->RouletteCount, sizeof(st_uint_t) )
+				&& WriteItems( fp, &stage->ElementList[j]->AbsorbedPower, sizeof(double) )
+				&& WriteSpectralCounts( fp, stage->ElementList[j] );
+	}
+
+	ok = ok && WriteFluxTargets( fp, m_sys );
+
+	return ok && WriteItems( fp, CheckpointMagic, 8 );
+}
+
+bool TraceCheckpoint::Read( const std::string &file, TraceState &state, MTRand &rng, std::vector<GlobalRay> &rays )
+{
+	FILE *fp = fopen( file.c_str(), "rb" );
+	if ( !fp )
+	{
+		m_sys->errlog("could not open checkpoint %s", file.c_str());
+		return false;
+	}
+
+	char magic[8];
+	unsigned int sizes[3];
+	st_uint_t every = 0;
+	MTRand::uint32 rngstate[MTRand::SAVE];
+	bool ok = ReadItems( fp, magic, 8 )
+		&& memcmp( magic, CheckpointMagic, 8 ) == 0
+		&& ReadItems( fp, sizes, sizeof(unsigned int), 3 )
+		&& sizes[0] == sizeof(TraceState)
+		&& sizes[1] == sizeof(TRayData::ray_t)
+		&& sizes[2] == sizeof(GlobalRay)
+		&& ReadItems( fp, &state, sizeof(TraceState) )
+		&& ReadItems( fp, &every, sizeof(st_uint_t) )
+		&& ReadItems( fp, rngstate, sizeof(MTRand::uint32), MTRand::SAVE );
+
+	if ( !ok )
+	{
+		fclose( fp );
+		m_sys->errlog("%s is not a checkpoint written by this version", file.c_str());
+		return false;
+	}
+
+	rng.load( rngstate );
+
+	std::vector<st_uint_t> saved( m_sys->StageList.size(), 0 );
+	st_uint_t nstages = 0;
+	ok = ReadItems( fp, &nstages, sizeof(st_uint_t) ) && nstages == m_sys->StageList.size()
+		&& state.Stage < nstages;
+	for (st_uint_t i=0;ok && i<nstages;i++)
+	{
+		TStage *stage = m_sys->StageList[i];
+		st_uint_t nelem = 0;
+		ok = ReadItems( fp, &nelem, sizeof(st_uint_t) )
+			&& nelem == stage->ElementList.size()
+			&& ReadItems( fp, &stage->MissCount, sizeof(st_uint_t) )
+			&& ReadItems( fp, &saved[i], sizeof(st_uint_t) );
+		for (st_uint_t j=0;ok && j<nelem;j++)
+			ok = ReadItems( fp, &stage->ElementList[j]->HitCount, sizeof(st_uint_t) )
+				&& ReadItems( fp, &stage->ElementList[j]->AbsorbedCount, sizeof(st_uint_t) )
+			&& ReadItems( fp, &stage->ElementList[j]->RouletteCount, sizeof(st_uint_t) )
+				&& ReadItems( fp, &stage->ElementList[j]->AbsorbedPower, sizeof(double) )
+				&& ReadSpectralCounts( fp, stage->ElementList[j] );
+	}
+
+	ok = ok && ReadFluxTargets( fp, m_sys );
+
+	ok = ok && ReadItems( fp, magic, 8 ) && memcmp( magic, CheckpointMagic, 8 ) == 0;
+	fclose( fp );
+
+	if ( !ok )
+	{
+		m_sys->errlog("checkpoint %s is incomplete or was written for a different system", file.c_str());
+		return false;
+	}
+
+	// the rays passed into the stage, overlaid at the front by the ones it
+	// has passed on so far
+	int stage = (int)state.Stage;
+	st_uint_t nout = state.InStage ? state.PreviousStageDataArrayIndex : 0;
+	rays.resize( state.NumberOfRays );
+	if ( !ReadRays( StageFile( file, 's', stage ), rays, state.NumIncoming )
+		|| !ReadRays( StageFile( file, 'o', stage ), rays, nout ) )
+		return false;
+
+	std::string rayfile = file + ".rays";
+	fp = fopen( rayfile.c_str(), "rb" );
+	if ( !fp )
+	{
+		m_sys->errlog("could not open checkpoint file %s", rayfile.c_str());
+		return false;
+	}
+
+	st_uint_t total = 0;
+	for (st_uint_t i=0;i<nstages;i++)
+		total += saved[i];
+
+	TRayData::ray_t r;
+	for (st_uint_t k=0;ok && k<total;k++)
+	{
+		ok = ReadItems( fp, &r, sizeof(TRayData::ray_t) )
+			&& r.stage >= 1 && (st_uint_t)r.stage <= nstages;
+		if ( ok )
+			ok = m_sys->StageList[r.stage-1]->RayData.Append( r.pos, r.cos, r.element, r.stage, r.raynum, r.weight, r.absorbed ) != 0;
+	}
+
+	fclose( fp );
+
+	for (st_uint_t i=0;ok && i<nstages;i++)
+		ok = m_sys->StageList[i]->RayData.Count() == saved[i];
+
+	if ( !ok )
+	{
+		m_sys->errlog("checkpoint ray data %s is incomplete", rayfile.c_str());
+		return false;
+	}
+
+	if ( file == m_file )
+	{
+		// carry on appending to the same files
+		m_every = every;
+		m_stageSaved = saved;
+		m_raysSaved = total;
+		m_stage = stage;
+		m_outSaved = nout;
+	}
+	else
+	{
+		// the next checkpoint starts new files, which need the incoming
+		// rays as they were at the start of the stage
+		std::string infile = StageFile( m_file, 's', stage );
+		FILE *in = fopen( StageFile( file, 's', stage ).c_str(), "rb" );
+		FILE *out = fopen( infile.c_str(), "wb" );
+		char buf[65536];
+		size_t n;
+		ok = in != 0 && out != 0;
+		while ( ok && (n = fread( buf, 1, sizeof(buf), in )) > 0 )
+			ok = fwrite( buf, 1, n, out ) == n;
+		if ( in ) fclose( in );
+		if ( out && fclose( out ) != 0 ) ok = false;
+		if ( !ok )
+		{
+			m_sys->errlog("could not copy checkpoint file to %s", infile.c_str());
+			return false;
+		}
+
+		m_stage = stage;
+		m_outSaved = 0;
+	}
+
+	return true;
+}
+
+void TraceCheckpoint::Remove()
+{
+	if ( m_rayFile ) fclose( m_rayFile );
+	if ( m_outFile ) fclose( m_outFile );
+	m_rayFile = m_outFile = 0;
+	remove( m_file.c_str() );
+	remove( (m_file + ".rays").c_str() );
+	if ( m_stage >= 0 )
+	{
+		remove( StageFile( m_file, 's', m_stage ).c_str() );
+		remove( StageFile( m_file, 'o', m_stage ).c_str() );
+	}
+}
+
+// a replay file holds the first stage of a trace as it was when the second
+// one started: the trace state, the counters of the first stage, the flux
+// maps, the first stage's ray records and the rays it passed on, each as one
+// flat block.  the later stages can be traced again from there
+static const char ReplayMagic[8] = { 'S','T','R','P','L','Y','0','1' };
+
+static bool WriteReplay( TSystem *System, const std::string &file, TraceState &state, std::vector<GlobalRay> &rays )
+{
+	FILE *fp = fopen( file.c_str(), "wb" );
+	if ( !fp )
+	{
+		System->errlog("could not open replay file %s", file.c_str());
+		return false;
+	}
+
+	unsigned int sizes[3] = { sizeof(TraceState), sizeof(TRayData::ray_t), sizeof(GlobalRay) };
+	TStage *stage = System->StageList[0];
+	st_uint_t nelem = stage->ElementList.size();
+	bool ok = WriteItems( fp, ReplayMagic, 8 )
+		&& WriteItems( fp, sizes, sizeof(unsigned int), 3 )
+		&& WriteItems( fp, &state, sizeof(TraceState) )
+		&& WriteItems( fp, &nelem, sizeof(st_uint_t) )
+		&& WriteItems( fp, &stage->MissCount, sizeof(st_uint_t) );
+	for (st_uint_t j=0;ok && j<nelem;j++)
+		ok = WriteItems( fp, &stage->ElementList[j]->HitCount, sizeof(st_uint_t) )
+			&& WriteItems( fp, &stage->ElementList[j]->AbsorbedCount, sizeof(st_uint_t) )
+			&& WriteItems( fp, &stage->ElementList[j]->RouletteCount, sizeof(st_uint_t) )
+			&& WriteItems( fp, &stage->ElementList[j]->AbsorbedPower, sizeof(double) )
+			&& WriteSpectralCounts( fp, stage->ElementList[j] );
+
+	ok = ok && WriteFluxTargets( fp, System );
+
+	TRayData &data = stage->RayData;
+	st_uint_t count = data.Count();
+	ok = ok && WriteItems( fp, &count, sizeof(st_uint_t) );
+	for (st_uint_t k=0;ok && k<count;k++)
+		ok = WriteItems( fp, data.Index(k,false), sizeof(TRayData::ray_t) );
+
+	ok = ok && WriteItems( fp, state.NumIncoming > 0 ? &rays[0] : 0, sizeof(GlobalRay), state.NumIncoming )
+		&& WriteItems( fp, ReplayMagic, 8 );
+
+	ok = ( fclose( fp ) == 0 ) && ok;
+	if ( !ok )
+	{
+		System->errlog("failed to write replay file %s", file.c_str());
+		remove( file.c_str() );
+	}
+
+	return ok;
+}
+
+static bool ReadReplay( TSystem *System, const std::string &file, TraceState &state, std::vector<GlobalRay> &rays )
+{
+	FILE *fp = fopen( file.c_str(), "rb" );
+	if ( !fp )
+	{
+		System->errlog("could not open replay file %s", file.c_str());
+		return false;
+	}
+
+	char magic[8];
+	unsigned int sizes[3];
+	TStage *stage = System->StageList[0];
+	st_uint_t nelem = 0;
+	bool ok = ReadItems( fp, magic, 8 )
+		&& memcmp( magic, ReplayMagic, 8 ) == 0
+		&& ReadItems( fp, sizes, sizeof(unsigned int), 3 )
+		&& sizes[0] == sizeof(TraceState)
+		&& sizes[1] == sizeof(TRayData::ray_t)
+		&& sizes[2] == sizeof(GlobalRay)
+		&& ReadItems( fp, &state, sizeof(TraceState) )
+		&& state.Stage == 1 && state.NumIncoming <= state.NumberOfRays
+		&& ReadItems( fp, &nelem, sizeof(st_uint_t) )
+		&& nelem == stage->ElementList.size()
+		&& ReadItems( fp, &stage->MissCount, sizeof(st_uint_t) );
+	for (st_uint_t j=0;ok && j<nelem;j++)
+		ok = ReadItems( fp, &stage->ElementList[j]->HitCount, sizeof(st_uint_t) )
+			&& ReadItems( fp, &stage->ElementList[j]->AbsorbedCount, sizeof(st_uint_t) )
+			&& ReadItems( fp, &stage->ElementList[j]->RouletteCount, sizeof(st_uint_t) )
+			&& ReadItems( fp, &stage->ElementList[j]->AbsorbedPower, sizeof(double) )
+			&& ReadSpectralCounts( fp, stage->ElementList[j] );
+
+	ok = ok && ReadFluxTargets( fp, System );
+
+	st_uint_t count = 0;
+	ok = ok && ReadItems( fp, &count, sizeof(st_uint_t) );
+
+	// the records are appended in blocks, to keep the reads large
+	std::vector<TRayData::ray_t> block( 4096 );
+	for (st_uint_t k=0;ok && k<count;)
+	{
+		st_uint_t n = std::min( count - k, (st_uint_t)block.size() );
+		ok = ReadItems( fp, &block[0], sizeof(TRayData::ray_t), n );
+		for (st_uint_t r=0;ok && r<n;r++)
+			ok = stage->RayData.Append( block[r].pos, block[r].cos, block[r].element, block[r].stage, block[r].raynum, block[r].weight, block[r].absorbed ) != 0;
+		k += n;
+	}
+
+	if ( ok )
+	{
+		rays.resize( state.NumberOfRays );
+		ok = ReadItems( fp, state.NumIncoming > 0 ? &rays[0] : 0, sizeof(GlobalRay), state.NumIncoming )
+			&& ReadItems( fp, magic, 8 ) && memcmp( magic, ReplayMagic, 8 ) == 0;
+	}
+
+	fclose( fp );
+
+	if ( !ok )
+		System->errlog("%s is not a replay file for the first stage of this system", file.c_str());
+
+	return ok;
+}
+
 //structure to store element address and projected polar coordinate size
 struct eprojdat
 {
@@ -134,6 +867,109 @@ static bool eprojdat_compare(const eprojdat &A, const eprojdat &B)
     return A.d_proj > B.d_proj;
 };
 
+//equal area cell of the sun plane that stratified sampling places one ray in per sweep
+struct SunStratum
+{
+    double x0, y0;
+    double dx, dy;
+    st_opt_element *zone;   //terminal zone of the sun hash with the candidate elements
+};
+
+static bool zone_address_compare(st_opt_element *A, st_opt_element *B)
+{
+    return A->get_address() < B->get_address();
+}
+
+/*
+Divide the zones of the sun hash that have candidate elements into cells of equal area. Rays
+anywhere else in the sun plane can't hit the first stage, so they need not be generated, and
+the zones are visited in the order of their addresses so that consecutive rays look up the
+same or neighboring zones. The zones are split into cells smaller than the elements as far as
+the run still sweeps over all of them several times. Returns the ratio of the sun box area to
+the area of the cells, the number of sun rays each generated ray stands for, or 0 if there
+are no zones.
+*/
+static double BuildSunStrata(st_hash_tree &hash, TSun *Sun, st_uint_t NumberOfRays, vector<SunStratum> &strata)
+{
+    strata.clear();
+
+    vector<st_opt_element*> tnodes, zones;
+    hash.get_terminal_nodes(tnodes);
+
+    double amin = HUGE_VAL;
+    for(size_t i=0; i<tnodes.size(); i++)
+    {
+        st_opt_element *z = tnodes[i];
+        if( z->get_array()->empty() && z->get_neighbor_data()->empty() )
+            continue;
+
+        double *xr = z->get_xr();
+        double *yr = z->get_yr();
+        amin = fmin(amin, (xr[1]-xr[0])*(yr[1]-yr[0]));
+        zones.push_back(z);
+    }
+
+    if( zones.empty() || !(amin > 0.) )
+        return 0.;
+
+    std::sort(zones.begin(), zones.end(), zone_address_compare);
+
+    //zones larger than the smallest one are split into strips of its area along their long side
+    vector<int> nstrips(zones.size());
+    double units = 0.;
+    for(size_t i=0; i<zones.size(); i++)
+    {
+        double *xr = zones[i]->get_xr();
+        double *yr = zones[i]->get_yr();
+        nstrips[i] = std::max( 1, (int)((xr[1]-xr[0])*(yr[1]-yr[0])/amin + 0.5) );
+        units += nstrips[i];
+    }
+
+    //and the strips into ngrid x ngrid cells, so that each cell gets at least 4 rays
+    int ngrid = std::min( 4, std::max( 1, (int)sqrt( NumberOfRays/(4.*units) ) ) );
+
+    double area = 0.;
+    for(size_t i=0; i<zones.size(); i++)
+    {
+        double *xr = zones[i]->get_xr();
+        double *yr = zones[i]->get_yr();
+        double w = xr[1]-xr[0], h = yr[1]-yr[0];
+        int n = nstrips[i];
+
+        for(int k=0; k<n; k++)
+        {
+            double x0 = xr[0], y0 = yr[0], dx = w, dy = h;
+            if( w >= h )
+            {
+                dx = w/n;
+                x0 += k*dx;
+            }
+            else
+            {
+                dy = h/n;
+                y0 += k*dy;
+            }
+
+            for(int iy=0; iy<ngrid; iy++)
+            {
+                for(int ix=0; ix<ngrid; ix++)
+                {
+                    SunStratum s;
+                    s.zone = zones[i];
+                    s.dx = dx/ngrid;
+                    s.dy = dy/ngrid;
+                    s.x0 = x0 + ix*s.dx;
+                    s.y0 = y0 + iy*s.dy;
+                    strata.push_back(s);
+                }
+            }
+        }
+        area += w*h;
+    }
+
+    return (Sun->MaxXSun - Sun->MinXSun)*(Sun->MaxYSun - Sun->MinYSun)/area;
+}
+
 bool Trace(TSystem *System, unsigned int seed,
 		   st_uint_t NumberOfRays, 
 		   st_uint_t MaxNumberOfRays,
@@ -142,25 +978,23 @@ bool Trace(TSystem *System, unsigned int seed,
            bool AsPowerTower,
 		   int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data),
 		   void *cbdata,
-           std::vector< std::vector< double > > *st0data,
-           std::vector< std::vector< double > > *st1in,
-           bool save_st_data)
+           const char *resume_file,
+           const char *replay_file)
 {
     
     bool PT_override = false;        //override speed improvements (use as compiled option for benchmarking old version)
+    bool Replaying = replay_file != 0 && *replay_file != 0;
     
     //don't try to use the element filtering method if: 
     if( System->StageList.size() > 0 
 		&& (System->StageList[0]->ElementList.size() < 10    //the first stage contains only a few elements
-			|| System->StageList.size() == 1)                //there's only one stage
+			|| System->StageList.size() == 1                 //there's only one stage
+			|| Replaying)                                    //the first stage isn't traced
       )
-        PT_override = true;         
-
-    bool load_st_data = st0data != 0 && st1in != 0;
-    if(load_st_data)
     {
-        load_st_data = st0data->size() > 0 && st1in->size() > 0;
+        PT_override = true;         
     }
+
 	bool StageHit = false;
 	st_uint_t LastElementNumber = 0, LastRayNumber = 0;
 	st_uint_t MultipleHitCount = 0;
@@ -190,6 +1024,12 @@ bool Trace(TSystem *System, unsigned int seed,
 	double IncidentAngle = 0.0;
 	double UnitLastDFXYZ[3] = { 0.0, 0.0, 0.0 };
 	int ErrorFlag = 0, InterceptFlag = 0, HitBackSide = 0, LastHitBackSide = 0;
+	double Wavelength = 630.0;
+	int WaveBand = -1;
+	double RayWeight = 1.0, Deposit = 0.0;
+	double SobolPos[2] = { 0.0, 0.0 }, SobolShape[2] = { 0.0, 0.0 }, SobolSlope[2] = { 0.0, 0.0 };
+	double StratumPos[2] = { 0.0, 0.0 };
+	SunStratum *Stratum = 0;
 
 	std::vector<GlobalRay> IncomingRays;
 	st_uint_t StageDataArrayIndex=0;
@@ -212,23 +1052,115 @@ bool Trace(TSystem *System, unsigned int seed,
 		int k = 0;
 		TElement *optelm = 0;
 		TRayData::ray_t *p_ray = 0;
-		TStage *Stage;
+		TRayData::ray_t RayRecord;
+		TStage *Stage = 0;
 
 		System->SunRayCount=0;
 		st_uint_t RayNumber = 1;
+		int SpectrumBands = System->Spectrum.Bins();
+		unsigned int RunSeed = seed;
+		bool Weighted = System->sim_weighted;
+		double RouletteWeight = System->sim_roulette_weight;
+		int Sampling = System->sim_sampling;
+
+		for (st_uint_t i=0;i<System->StageList.size();i++)
+		{
+			TStage *s = System->StageList[i];
+			s->MissCount = 0;
+			s->BoundTests = s->BoundRejects = 0;
+			for (st_uint_t j=0;j<s->ElementList.size();j++)
+			{
+				TElement *e = s->ElementList[j];
+				e->HitCount = e->AbsorbedCount = e->RouletteCount = 0;
+				e->AbsorbedPower = 0;
+				e->NewtonCalls = e->NewtonSteps = e->NewtonFailures = 0;
+				e->SpectralAbsorbed.assign( SpectrumBands, 0 );
+			}
+		}
 		MTRand myrng(seed);
 		st_uint_t RaysTracedTotal = 0;
+		st_uint_t NumIncoming = 0;
+
+		// checkpoints go to the configured file, or when resuming without
+		// one, back to the file the trace was resumed from
+		bool Resuming = resume_file != 0 && *resume_file != 0;
+		std::string CheckpointFile = System->sim_checkpoint_file;
+		st_uint_t CheckpointEvery = System->sim_checkpoint_every;
+		if ( Resuming && CheckpointFile.empty() )
+			CheckpointFile = resume_file;
+
+		// a replayed trace doesn't save its first stage again
+		std::string ReplaySaveFile = Replaying ? std::string() : System->sim_replay_file;
+
+		TraceCheckpoint Checkpoint( System, CheckpointFile, CheckpointEvery );
+		TraceState State;
+		st_uint_t FirstStage = 0;
+		bool ResumeInStage = false;
+		st_uint_t RaysSinceCheckpoint = 0;
+
+		if ( Resuming && Replaying )
+		{
+			System->errlog("a trace can't be resumed and replayed at once");
+			return false;
+		}
 
-        if( load_st_data && st0data->size() < 1)
-        {
-            System->errlog("empty stage 0 data array provided to Trace()");
-            return false;
-        }
-        if( load_st_data && st1in->size() < 1 )
-        {
-            System->errlog("empty stage 1 data array provided to Trace()");
-            return false;
-        }
+		if ( Replaying && System->StageList.size() < 2 )
+		{
+			System->errlog("replaying the first stage needs a system with more than one stage");
+			return false;
+		}
+
+		if ( Resuming )
+		{
+			if ( !Checkpoint.Read( resume_file, State, myrng, IncomingRays ) )
+				return false;
+
+			MaxNumberOfRays = State.MaxNumberOfRays;
+			IncludeSunShape = State.IncludeSunShape != 0;
+			IncludeErrors = State.IncludeErrors != 0;
+			AsPowerTower = State.AsPowerTower != 0;
+			Weighted = State.Weighted != 0;
+			RouletteWeight = State.RouletteWeight;
+			Sampling = State.Sampling;
+		}
+		else if ( Replaying )
+		{
+			// the later stages are traced with the settings of this run, from
+			// the rays the first stage passed on
+			if ( !ReadReplay( System, replay_file, State, IncomingRays ) )
+				return false;
+		}
+
+		if ( Resuming || Replaying )
+		{
+			NumberOfRays = State.NumberOfRays;
+			FirstStage = State.Stage;
+			ResumeInStage = State.InStage != 0;
+			RayNumber = State.RayNumber;
+			StageDataArrayIndex = State.StageDataArrayIndex;
+			PreviousStageDataArrayIndex = State.PreviousStageDataArrayIndex;
+			PreviousStageHasRays = State.PreviousStageHasRays != 0;
+			LastRayNumberInPreviousStage = State.LastRayNumberInPreviousStage;
+			NumIncoming = State.NumIncoming;
+			System->SunRayCount = State.SunRayCount;
+			RaysTracedTotal = State.RaysTracedTotal;
+			RunSeed = State.RunSeed;
+		}
+
+		State.NumberOfRays = NumberOfRays;
+		State.MaxNumberOfRays = MaxNumberOfRays;
+		State.IncludeSunShape = IncludeSunShape ? 1 : 0;
+		State.IncludeErrors = IncludeErrors ? 1 : 0;
+		State.AsPowerTower = AsPowerTower ? 1 : 0;
+		State.RunSeed = RunSeed;
+		State.Weighted = Weighted ? 1 : 0;
+		State.RouletteWeight = RouletteWeight;
+		State.Sampling = Sampling;
+
+		// the sun rays take consecutive points, by their count, which a
+		// checkpoint restores along with the seed
+		bool LowDiscrepancy = Sampling == ST_SAMPLE_SOBOL;
+		TSobolSampler Sobol( RunSeed );
 
 		if (NumberOfRays < 1)
 		{
@@ -270,6 +1202,10 @@ bool Trace(TSystem *System, unsigned int seed,
         */
         st_hash_tree sun_hash;
         st_hash_tree rec_hash;
+        vector<SunStratum> sun_strata;
+        double SunRayScale = 1.0;   //sun rays each generated ray stands for
+        st_uint_t FirstStratum = 0;
+        bool Stratified = false;
         double reccm_helio[3];  //receiver centroid in heliostat field coordinates
         if(! PT_override )
         {
@@ -434,6 +1370,24 @@ bool Trace(TSystem *System, unsigned int seed,
             time("Adding solar mesh neighbors:\t", &fout);
             sun_hash.add_neighborhood_data();
 
+            //sun rays are only generated in the zones with elements
+            if( Sampling == ST_SAMPLE_STRATIFIED && !System->Sun.PointSource )
+            {
+                SunRayScale = BuildSunStrata(sun_hash, &System->Sun, NumberOfRays, sun_strata);
+                Stratified = SunRayScale > 0.;
+                if( !Stratified )
+                    SunRayScale = 1.0;
+                else
+                {
+                    //the sweeps start at a cell picked by the seed, so that the last one, which
+                    //ends wherever enough rays have hit, favors no part of the field
+                    unsigned long long z = ((unsigned long long)RunSeed << 32) + 0x9E3779B97F4A7C15ULL;
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                    FirstStratum = (st_uint_t)( (z ^ (z >> 31)) % sun_strata.size() );
+                }
+            }
+
             if(AsPowerTower)
             {
                 //Set things up for the polar coordinate tree
@@ -519,10 +1473,43 @@ bool Trace(TSystem *System, unsigned int seed,
         //use the callbacks based on elapsed time rather than fixed rays processed. 
 
         clock_t startTime = clock();     //start timer
+        st_uint_t RaysTracedBefore = RaysTracedTotal;  //rays traced before resuming from a checkpoint
         int rays_per_callback_estimate = 50;    //starting rough estimate for how often to check the clock
 
-		for (st_uint_t i=0;i<System->StageList.size();i++)
+		for (st_uint_t i=FirstStage;i<System->StageList.size();i++)
 		{
+			if (i > 0 && !ResumeInStage)
+			{
+				// rays carried over from the previous stage
+				NumIncoming = PreviousStageHasRays ? PreviousStageDataArrayIndex+1 : 0;
+
+				// stratified sun rays count for the whole sun box from here on.  a run
+				// resumed at this boundary restores the count that was already scaled
+				if ( i == 1 && Stratified && !(Resuming && i == FirstStage) )
+					System->SunRayCount = (st_uint_t)( System->SunRayCount*SunRayScale + 0.5 );
+
+				State.Stage = i;
+				State.InStage = 0;
+				State.RayNumber = RayNumber;
+				State.StageDataArrayIndex = StageDataArrayIndex;
+				State.PreviousStageDataArrayIndex = PreviousStageDataArrayIndex;
+				State.PreviousStageHasRays = PreviousStageHasRays ? 1 : 0;
+				State.LastRayNumberInPreviousStage = LastRayNumberInPreviousStage;
+				State.NumIncoming = NumIncoming;
+				State.SunRayCount = System->SunRayCount;
+				State.RaysTracedTotal = RaysTracedTotal;
+
+				if ( i == 1 && !ReplaySaveFile.empty()
+					&& !WriteReplay( System, ReplaySaveFile, State, IncomingRays ) )
+					return false;
+
+				if ( !CheckpointFile.empty() && !(Resuming && i == FirstStage) )
+				{
+					if ( !Checkpoint.Write( State, myrng, IncomingRays ) )
+						return false;
+					RaysSinceCheckpoint = 0;
+				}
+			}
 
 			if (i > 0 && PreviousStageHasRays == false)
 			{
@@ -540,46 +1527,34 @@ bool Trace(TSystem *System, unsigned int seed,
 			StageDataArrayIndex = 0;
 			PreviousStageDataArrayIndex = 0;
 
+			if ( ResumeInStage )
+			{
+				// pick up at the ray the checkpoint was written before
+				StageDataArrayIndex = State.StageDataArrayIndex;
+				PreviousStageDataArrayIndex = State.PreviousStageDataArrayIndex;
+				ResumeInStage = false;
+			}
 
-            //if loading stage 0 data, construct appropriate arrays here
-            if(i==0 && load_st_data)
-            {
-                double rpos[3],rcos[3];
-                //Stage 0 data
-                for(int j=0; j<st0data->size(); j++)   
-                {
-                    
-                    LoadExistingStage0Ray(j, st0data, 
-                        rpos, rcos,
-                        LastElementNumber, LastRayNumber);
-
-
-                    p_ray = Stage->RayData.Append( 
-                        rpos, rcos,
-						LastElementNumber, 1,
-						LastRayNumber );
-
-                }
-
-                //stage 1 data
-                for(int j=0; j<st1in->size(); j++)
-                {
-                    int rnum;
-                    LoadExistingStage1Ray(j, st1in, rpos, rcos, rnum);
-                    CopyVec3(IncomingRays[j].Pos, rpos);
-                    CopyVec3(IncomingRays[j].Cos, rcos);
-                    IncomingRays[j].Num = rnum;
-                }
-
-                PreviousStageHasRays = true;
-                PreviousStageDataArrayIndex = st1in->size()-1;
-                System->SunRayCount = LastRayNumber;
-                goto Label_EndStageLoop;
-            }
-            
-
-            
 Label_StartRayLoop:
+			if ( !CheckpointFile.empty() && Checkpoint.Every() > 0 && RaysSinceCheckpoint >= Checkpoint.Every() )
+			{
+				// every ray before this one is finished, so the loop can be
+				// entered again here
+				State.Stage = i;
+				State.InStage = 1;
+				State.RayNumber = RayNumber;
+				State.StageDataArrayIndex = StageDataArrayIndex;
+				State.PreviousStageDataArrayIndex = PreviousStageDataArrayIndex;
+				State.PreviousStageHasRays = PreviousStageHasRays ? 1 : 0;
+				State.LastRayNumberInPreviousStage = LastRayNumberInPreviousStage;
+				State.NumIncoming = NumIncoming;
+				State.SunRayCount = System->SunRayCount;
+				State.RaysTracedTotal = RaysTracedTotal;
+				if ( !Checkpoint.Write( State, myrng, IncomingRays ) )
+					return false;
+				RaysSinceCheckpoint = 0;
+			}
+
 			MultipleHitCount = 0;
             sunint_elements.clear();
 
@@ -591,10 +1566,26 @@ Label_StartRayLoop:
                 // we are in the first stage, so 
 				// generate a new sun ray in global coords
                 double PosRaySun[3];
+				if ( LowDiscrepancy )
+				{
+					Sobol.Point( System->SunRayCount, 0, SobolPos );
+					Sobol.Point( System->SunRayCount, 1, SobolShape );
+					Sobol.Point( System->SunRayCount, 2, SobolSlope );
+				}
+				else if ( Stratified )
+				{
+					// sweep over the cells by the sun ray count, jittered within each,
+					// given to GenerateRay as a position within the sun box
+					Stratum = &sun_strata[ (FirstStratum + System->SunRayCount) % sun_strata.size() ];
+					StratumPos[0] = (Stratum->x0 + Stratum->dx*myrng() - System->Sun.MinXSun)/(System->Sun.MaxXSun - System->Sun.MinXSun);
+					StratumPos[1] = (Stratum->y0 + Stratum->dy*myrng() - System->Sun.MinYSun)/(System->Sun.MaxYSun - System->Sun.MinYSun);
+				}
 				GenerateRay(myrng, PosSunStage, Stage->Origin,
 							Stage->RLocToRef, &System->Sun,
-							PosRayGlob, CosRayGlob, PosRaySun);
+							PosRayGlob, CosRayGlob, PosRaySun,
+							LowDiscrepancy ? SobolPos : Stratified ? StratumPos : 0);
 				    System->SunRayCount++;
+				RayWeight = 1.0;
 
 
 				if (System->SunRayCount > MaxNumberOfRays)
@@ -606,7 +1597,16 @@ Label_StartRayLoop:
                 /* 
                 Find the list of elements that could potentially interact with this ray. If empty, continue
                 */
-                if(! PT_override) //AsPowerTower)
+                if( Stratified )
+                {
+                    // the cell's zone has the candidates, without looking it up
+                    vector<void*> *zd = Stratum->zone->get_array();
+                    sunint_elements.insert( sunint_elements.end(), zd->begin(), zd->end() );
+                    zd = Stratum->zone->get_neighbor_data();
+                    sunint_elements.insert( sunint_elements.end(), zd->begin(), zd->end() );
+                    has_elements = !sunint_elements.empty();
+                }
+                else if(! PT_override) //AsPowerTower)
                     has_elements = sun_hash.get_all_data_at_loc( sunint_elements, PosRaySun[0], PosRaySun[1] );
 
 			}
@@ -617,6 +1617,7 @@ Label_StartRayLoop:
                 RayNumber = IncomingRays[StageDataArrayIndex].Num;
 				CopyVec3( PosRayGlob, IncomingRays[StageDataArrayIndex].Pos );
 				CopyVec3( CosRayGlob, IncomingRays[StageDataArrayIndex].Cos );
+				RayWeight = IncomingRays[StageDataArrayIndex].Weight;
 				StageDataArrayIndex++;
 				
 			}
@@ -627,14 +1628,16 @@ Label_StartRayLoop:
 				PosRayStage, CosRayStage);
 
 
+			RaysSinceCheckpoint++;
+
 			// CheckForCancelAndUpdateProgressBar
 			if (callback != 0
 				&& RaysTracedTotal++ % rays_per_callback_estimate == 0)
 			{
-                if( RaysTracedTotal > 1 )
+                if( RaysTracedTotal > RaysTracedBefore + 1 )
                 {
                     //update how often to call this
-                    double msec_per_ray = 1000.*( clock() - startTime ) / CLOCKS_PER_SEC / (double)(RaysTracedTotal > 0 ? RaysTracedTotal : 1);
+                    double msec_per_ray = 1000.*( clock() - startTime ) / CLOCKS_PER_SEC / (double)(RaysTracedTotal - RaysTracedBefore);
                     //set the new callback estimate to be about 50 ms
                     rays_per_callback_estimate = (int)( 200. / msec_per_ray );
                     //limit to something reasonable
@@ -645,7 +1648,11 @@ Label_StartRayLoop:
 				if ( ! (*callback)( RaysTracedTotal, RayNumber,
 									LastRayNumberInPreviousStage, i+1,
 									System->StageList.size(), cbdata ))
+				{
+					if ( i == 0 && Stratified )
+						System->SunRayCount = (st_uint_t)( System->SunRayCount*SunRayScale + 0.5 );
 					return true;
+				}
 			}
             
             in_multi_hit_loop = false;
@@ -716,6 +1723,13 @@ Label_MultiHitLoop:
 				if (!Element->Enabled)
 					continue;
 
+				Stage->BoundTests++;
+				if ( !RayMayHitElement( Element, PosRayStage, CosRayStage ) )
+				{
+					Stage->BoundRejects++;
+					continue;
+				}
+
 				//  {Transform ray to element[j] coord system of Stage[i]}
 				TransformToLocal( PosRayStage, CosRayStage,
 								  Element->Origin, Element->RRefToLoc,
@@ -786,6 +1800,7 @@ Label_StageHitLogic:
 						CopyVec3( IncomingRays[PreviousStageDataArrayIndex].Pos, PosRayGlob );
 						CopyVec3( IncomingRays[PreviousStageDataArrayIndex].Cos, CosRayGlob );
 						IncomingRays[PreviousStageDataArrayIndex].Num = RayNumber;
+						IncomingRays[PreviousStageDataArrayIndex].Weight = RayWeight;
 
 						if (RayNumber == NumberOfRays)
 							goto Label_EndStageLoop;
@@ -806,6 +1821,7 @@ Label_StageHitLogic:
 						CopyVec3( IncomingRays[PreviousStageDataArrayIndex].Pos, PosRayGlob );
 						CopyVec3( IncomingRays[PreviousStageDataArrayIndex].Cos, CosRayGlob );
 						IncomingRays[PreviousStageDataArrayIndex].Num = RayNumber;
+						IncomingRays[PreviousStageDataArrayIndex].Weight = RayWeight;
 
 						if (RayNumber == LastRayNumberInPreviousStage)
 							goto Label_EndStageLoop;
@@ -826,20 +1842,24 @@ Label_FlagMiss:
 				}
 			} // end of not stagehit logic
 
-			p_ray = Stage->RayData.Append( LastPosRaySurfStage,
-								  LastCosRaySurfStage,
-								  LastElementNumber,
-								  i+1,
-								  LastRayNumber );
+			// the record is saved once the outcome of this intersection is
+			// known, so that the retention policy can skip unwanted records
+			p_ray = &RayRecord;
+			CopyVec3( p_ray->pos, LastPosRaySurfStage );
+			CopyVec3( p_ray->cos, LastCosRaySurfStage );
+			p_ray->element = LastElementNumber;
+			p_ray->stage = i+1;
+			p_ray->raynum = LastRayNumber;
+			p_ray->weight = (float)RayWeight;
+			p_ray->absorbed = 0;
 
-			if (!p_ray)
-			{
-				System->errlog("Failed to save ray data at index %d", Stage->RayData.Count()-1);
-				return false;
-			}
+			CountRayRecord( Stage, LastElementNumber );
 
 			if (LastElementNumber == 0) // {If missed all elements}
 			{
+				if ( !SaveRayRecord( System, Stage, p_ray ) )
+					return false;
+
 				if (RayNumber == LastRayNumberInPreviousStage)
 				{
 					if ( !Stage->TraceThrough )
@@ -861,6 +1881,7 @@ Label_FlagMiss:
 			}
 
 			MultipleHitCount++;
+			Deposit = 0;
 
 			if ( Stage->Virtual )
 			{
@@ -882,11 +1903,17 @@ Label_FlagMiss:
 				optics = &optelm->Optics->Front;
 
 
+			if ( SpectrumBands > 0 )
+				Wavelength = RayWavelength( System->Spectrum, RunSeed, RayNumber, &WaveBand );
+
 			double TestValue;
 			switch(optelm->InteractionType )
 			{
 			case 1: // refraction
-				TestValue = optics->Transmissivity; 
+				if ( SpectrumBands > 0 && !optics->SpectralTable.empty() )
+					TestValue = SpectralProperty( optics, Wavelength, false );
+				else
+					TestValue = optics->Transmissivity; 
 				break;
 			case 2: // reflection
 
@@ -913,6 +1940,8 @@ Label_FlagMiss:
 							TestValue = (optics->ReflectivityTable[m].refl + optics->ReflectivityTable[m-1].refl)/2.0;
 					}
 				}
+				else if ( SpectrumBands > 0 && !optics->SpectralTable.empty() )
+					TestValue = SpectralProperty( optics, Wavelength, true );
 				else
 					TestValue = optics->Reflectivity;
 				break;
@@ -922,11 +1951,52 @@ Label_FlagMiss:
 			}
 
 
+			bool Absorbed, Ended;
+			if ( Weighted )
+			{
+				// the ray carries on with the reflected or transmitted share of
+				// its weight, and once that is small it ends here unless it
+				// wins the roulette.  the survivors make up for the rest.  only
+				// a ray that keeps nothing is absorbed, one that loses the
+				// roulette just ends
+				Deposit = RayWeight*(1.0 - TestValue);
+				RayWeight *= TestValue;
+				Absorbed = Ended = !(RayWeight > 0);
+				if ( !Ended && RayWeight < RouletteWeight )
+				{
+					if ( RayWeight > RouletteWeight*myrng() )
+						RayWeight = RouletteWeight;
+					else
+					{
+						Ended = true;
+						optelm->RouletteCount++;
+					}
+				}
+			}
+			else
+			{
 		//  {Apply MonteCarlo probability of absorption. Limited for now, but can make more complex later on if desired}
-			if (TestValue <= myrng())
+				Absorbed = Ended = TestValue <= myrng();
+				Deposit = Absorbed ? RayWeight : 0.0;
+			}
+
+			p_ray->absorbed = (float)Deposit;
+			optelm->AbsorbedPower += Deposit;
+			if ( SpectrumBands > 0 )
+				optelm->SpectralAbsorbed[ WaveBand ] += Deposit;
+
+			if (Ended)
 			{
 				// ray was fully absorbed, so indicate by negating the element number
-				p_ray->element = 0 - p_ray->element;
+				if (Absorbed)
+				{
+					p_ray->element = 0 - p_ray->element;
+					optelm->AbsorbedCount++;
+				}
+				TallyFluxTargets( optelm, p_ray, LastPosRaySurfElement, Deposit );
+
+				if ( !SaveRayRecord( System, Stage, p_ray ) )
+					return false;
 
 				if (RayNumber == LastRayNumberInPreviousStage)
 				{
@@ -954,6 +2024,10 @@ Label_FlagMiss:
 
 Label_TransformBackToGlobal:
 			k = abs( p_ray->element ) - 1;
+			TallyFluxTargets( Stage->ElementList[k], p_ray, LastPosRaySurfElement, Deposit );
+
+			if ( !SaveRayRecord( System, Stage, p_ray ) )
+				return false;
 
 			if ( !Stage->Virtual )
 			{
@@ -963,7 +2037,8 @@ Label_TransformBackToGlobal:
 					//only apply sunshape error once for primary stage
 					CopyVec3(CosIn, LastCosRaySurfElement);
 					Errors(myrng, CosIn, 1, &System->Sun,
-						   Stage->ElementList[k], optics, CosOut, LastDFXYZ);  //sun shape
+						   Stage->ElementList[k], optics, CosOut, LastDFXYZ,
+						   LowDiscrepancy ? SobolShape : 0);  //sun shape
 					CopyVec3(LastCosRaySurfElement, CosOut);
 				}
 
@@ -974,12 +2049,13 @@ Label_TransformBackToGlobal:
 				if( IncludeErrors )
 				{
 					CopyVec3( CosIn, CosRayOutElement );
-					SurfaceNormalErrors(myrng, LastDFXYZ, optics, CosOut);  //surface normal errors
+					SurfaceNormalErrors(myrng, LastDFXYZ, optics, CosOut,
+						LowDiscrepancy && i == 0 && MultipleHitCount == 1 ? SobolSlope : 0);  //surface normal errors
 					CopyVec3( LastDFXYZ, CosOut );
 				}
 
 				Interaction( myrng, LastPosRaySurfElement, LastCosRaySurfElement, LastDFXYZ,
-					Stage->ElementList[k]->InteractionType, optics, 630.0, 
+					Stage->ElementList[k]->InteractionType, optics, Wavelength, 
 					PosRayOutElement, CosRayOutElement, &ErrorFlag);
 
 				// {Apply specularity optical error to PERTURBED (i.e. after interaction) ray at intersection point}
@@ -1013,42 +2089,9 @@ Label_TransformBackToGlobal:
 
 Label_EndStageLoop:
 
-			if(i==0 && save_st_data)
-            {
-                //if flagged save the stage 0 incoming rays data
-                TRayData *raydat = &Stage->RayData;
-                st_uint_t nray0 = raydat->Count();
-        
-                for(st_uint_t ii=0; ii<nray0; ii++)
-                {
-                    TRayData::ray_t *rr = raydat->Index(ii,false);
-
-                    std::vector<double> ray(8);
-                    for(int j=0; j<3; j++)
-                        ray[j] = rr->pos[j];
-                    for(int j=0; j<3; j++)
-                        ray[j+3] = rr->cos[j];
-                    ray[6] = rr->element;
-                    ray[7] = rr->raynum;
-                    st0data->push_back(ray);
-                }
-            }
-
-            if(i==1 && save_st_data)
-            {
-                //if flagged, save the stage 1 incoming rays data to the data structure passed into the algorithm
-                for(int ir=0; ir<StageDataArrayIndex; ir++)
-                {
-                    st1in->push_back(std::vector<double>(7));
-                    for(int jr=0; jr<3; jr++)
-                    {
-                        st1in->back().at(jr) = IncomingRays[ir].Pos[jr];
-                        st1in->back().at(jr+3) = IncomingRays[ir].Cos[jr];
-                    }
-                    st1in->back().at(6) = IncomingRays[ir].Num;
-                }
-            }
-            
+			for (size_t n=0;n<System->FluxTargets.size();n++)
+				if (System->FluxTargets[n]->StageIdx == (int)i)
+					System->FluxTargets[n]->Flush();
 
             if (!PreviousStageHasRays)
 			{
@@ -1075,6 +2118,10 @@ Label_EndStageLoop:
 			}
 		}
 
+		// the trace is complete, so there is nothing left to resume
+		if ( !CheckpointFile.empty() )
+			Checkpoint.Remove();
+
 		return true;
 	}
 	catch( const std::exception &e )
@@ -53,6 +53,9 @@
 #include "stapi.h"
 #include "mtrand.h"
 
+#include <algorithm>
+#include <chrono>
+
 #define SYSTEM(p,r) TSystem *sys = reinterpret_cast<TSystem*>(p); if(!sys) return r;
 #define SYSTEM_NR(p) TSystem *sys = reinterpret_cast<TSystem*>(p); if(!sys) return;
 
@@ -205,6 +208,41 @@ STCORE_API int st_optic(st_context_t pcxt, st_uint_t idx, int fb, /* 1=front,2=b
 	return 1;
 }
 
+STCORE_API int st_optic_spectral(st_context_t pcxt, st_uint_t idx, int fb,
+				int npoints, double *wavelengths, double *refls, double *tras )
+{
+	SYSTEM(pcxt,-1);
+
+	TOpticalPropertySet *set = NULL;
+	if (idx >= 0 && idx < sys->OpticsList.size())
+		set = sys->OpticsList[idx];
+
+	if (!set) return -1;
+
+	TOpticalProperties *topt = (fb==2) ? &set->Back : &set->Front;
+	topt->SpectralTable.clear();
+
+	if (npoints <= 0) return 1;
+	if (!wavelengths || !refls || !tras) return -1;
+
+	topt->SpectralTable.resize( npoints );
+	for (int i=0;i<npoints;i++)
+	{
+		if (i > 0 && wavelengths[i] <= wavelengths[i-1])
+		{
+			sys->errlog("optic %d spectral table wavelengths must increase", (int)idx);
+			topt->SpectralTable.clear();
+			return -1;
+		}
+
+		topt->SpectralTable[i].wavelength = wavelengths[i];
+		topt->SpectralTable[i].refl = refls[i];
+		topt->SpectralTable[i].trans = tras[i];
+	}
+
+	return 1;
+}
+
 
 
 #define STAGE(i) ((i>=0&&i<sys->StageList.size())?sys->StageList[i]:NULL)
@@ -511,6 +549,8 @@ STCORE_API int st_sun_userdata( st_context_t pcxt, st_uint_t npoints, double ang
 			sys->Sun.SunShapeAngle[i] = -angle[npoints-i-1];
 			sys->Sun.SunShapeIntensity[i] = intensity[npoints-i-1];
 		}
+
+		sys->Sun.SetupShapeCDF();
 		
 		return npoints;
 	}
@@ -606,6 +646,34 @@ STCORE_API int st_raynumbers(st_context_t pcxt, int *ray_numbers)
 }
 
 
+STCORE_API int st_weights(st_context_t pcxt, double *weights)
+{
+	SYSTEM(pcxt,-1);
+	double w;
+	for (st_uint_t i=0;i<sys->AllRayData.Count();i++)
+	{
+		if (sys->AllRayData.Query(i, 0, 0, 0, 0, 0, &w))
+			weights[i] = w;
+		else
+			return -2;
+	}
+	return 1;
+}
+
+STCORE_API int st_absorbed(st_context_t pcxt, double *absorbed)
+{
+	SYSTEM(pcxt,-1);
+	double a;
+	for (st_uint_t i=0;i<sys->AllRayData.Count();i++)
+	{
+		if (sys->AllRayData.Query(i, 0, 0, 0, 0, 0, 0, &a))
+			absorbed[i] = a;
+		else
+			return -2;
+	}
+	return 1;
+}
+
 STCORE_API int st_sun_stats( st_context_t pcxt, double *xmin, double *xmax, double *ymin, double *ymax, int *nsunrays )
 {
 	SYSTEM(pcxt,-1);
@@ -618,7 +686,231 @@ STCORE_API int st_sun_stats( st_context_t pcxt, double *xmin, double *xmax, doub
 }
 
 
+/* functions to accumulate flux maps during the trace */
+STCORE_API int st_clear_flux_targets(st_context_t pcxt)
+{
+	SYSTEM(pcxt,-1);
+	for (st_uint_t i=0;i<sys->FluxTargets.size();i++)
+		delete sys->FluxTargets[i];
+	sys->FluxTargets.clear();
+	return 1;
+}
+
+STCORE_API int st_add_flux_target(st_context_t pcxt, st_uint_t stage, st_uint_t idx,
+				int nbinsx, int nbinsy,
+				double xmin, double xmax, double ymin, double ymax,
+				int absorbed_only)
+{
+	SYSTEM(pcxt,-1);
+	if (nbinsx < 1 || nbinsy < 1)
+		return -1;
+
+	TFluxTarget *ft = new TFluxTarget;
+	ft->StageIdx = (int)stage;
+	ft->ElementIdx = (int)idx;
+	ft->NBinsX = nbinsx;
+	ft->NBinsY = nbinsy;
+	ft->MinX = xmin;
+	ft->MaxX = xmax;
+	ft->MinY = ymin;
+	ft->MaxY = ymax;
+	ft->AbsorbedOnly = absorbed_only?true:false;
+	ft->Reset();
+
+	sys->FluxTargets.push_back( ft );
+	return sys->FluxTargets.size()-1;
+}
+
+STCORE_API int st_num_flux_targets(st_context_t pcxt)
+{
+	SYSTEM(pcxt,-1);
+	return sys->FluxTargets.size();
+}
+
+STCORE_API int st_flux_target_grid(st_context_t pcxt, st_uint_t target, double *grid)
+{
+	SYSTEM(pcxt,-1);
+	if (target >= sys->FluxTargets.size())
+		return -1;
+
+	TFluxTarget *ft = sys->FluxTargets[target];
+	for (int ix=0;ix<ft->NBinsX;ix++)
+		for (int iy=0;iy<ft->NBinsY;iy++)
+			grid[ix*ft->NBinsY+iy] = ft->Grid.at(ix,iy);
+
+	return ft->NBinsX*ft->NBinsY;
+}
+
+STCORE_API int st_flux_target_hits(st_context_t pcxt, st_uint_t target, double *hits)
+{
+	SYSTEM(pcxt,-1);
+	if (target >= sys->FluxTargets.size())
+		return -1;
+
+	TFluxTarget *ft = sys->FluxTargets[target];
+	for (int ix=0;ix<ft->NBinsX;ix++)
+		for (int iy=0;iy<ft->NBinsY;iy++)
+			hits[ix*ft->NBinsY+iy] = ft->Hits.at(ix,iy);
+
+	return ft->NBinsX*ft->NBinsY;
+}
+
+STCORE_API int st_flux_target_stats(st_context_t pcxt, st_uint_t target, int *nbinned, double centroid_sum[3], int *ncentroid)
+{
+	SYSTEM(pcxt,-1);
+	if (target >= sys->FluxTargets.size())
+		return -1;
+
+	TFluxTarget *ft = sys->FluxTargets[target];
+	if (nbinned) *nbinned = (int)ft->RayCount;
+	if (centroid_sum)
+	{
+		centroid_sum[0] = ft->CentroidSum[0];
+		centroid_sum[1] = ft->CentroidSum[1];
+		centroid_sum[2] = ft->CentroidSum[2];
+	}
+	if (ncentroid) *ncentroid = (int)ft->CentroidCount;
+	return 1;
+}
+
+STCORE_API int st_element_counts(st_context_t pcxt, st_uint_t stage, st_uint_t idx, st_uint_t *hits, st_uint_t *absorbed, st_uint_t *passed)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	GETELEMENT(idx);
+	if (hits) *hits = e->HitCount;
+	if (absorbed) *absorbed = e->AbsorbedCount;
+	if (passed) *passed = e->HitCount - e->AbsorbedCount;
+	return 1;
+}
+
+STCORE_API int st_stage_counts(st_context_t pcxt, st_uint_t stage, st_uint_t *hits, st_uint_t *absorbed, st_uint_t *passed, st_uint_t *missed)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	st_uint_t nhit = 0, nabs = 0;
+	for (st_uint_t i=0;i<s->ElementList.size();i++)
+	{
+		nhit += s->ElementList[i]->HitCount;
+		nabs += s->ElementList[i]->AbsorbedCount;
+	}
+	if (hits) *hits = nhit;
+	if (absorbed) *absorbed = nabs;
+	if (passed) *passed = nhit - nabs;
+	if (missed) *missed = s->MissCount;
+	return 1;
+}
+
+STCORE_API int st_stage_bound_counts(st_context_t pcxt, st_uint_t stage, double *tested, double *rejected)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	if (tested) *tested = (double)s->BoundTests;
+	if (rejected) *rejected = (double)s->BoundRejects;
+	return 1;
+}
+
+STCORE_API int st_element_newton_counts(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *calls, double *steps, double *failures)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	GETELEMENT(idx);
+	if (calls) *calls = (double)e->NewtonCalls;
+	if (steps) *steps = (double)e->NewtonSteps;
+	if (failures) *failures = (double)e->NewtonFailures;
+	return 1;
+}
+
+STCORE_API int st_element_roulette_count(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *ended)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	GETELEMENT(idx);
+	if (ended) *ended = (double)e->RouletteCount;
+	return 1;
+}
+
+STCORE_API int st_element_absorbed_power(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *power)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	GETELEMENT(idx);
+	if (power) *power = e->AbsorbedPower;
+	return 1;
+}
+
+STCORE_API int st_element_spectral_absorbed(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *counts)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	GETELEMENT(idx);
+	if (!counts) return -1;
+	for (int i=0;i<sys->Spectrum.Bins();i++)
+		counts[i] = i < (int)e->SpectralAbsorbed.size() ? e->SpectralAbsorbed[i] : 0.0;
+	return 1;
+}
+
+STCORE_API int st_ray_retention(st_context_t pcxt, int mode, int sample_every)
+{
+	SYSTEM(pcxt,-1);
+	if (mode < ST_RETAIN_ALL || mode > ST_RETAIN_NONE)
+	{
+		sys->errlog("invalid ray retention mode %d", mode);
+		return -1;
+	}
+
+	sys->sim_retention = mode;
+	sys->sim_retain_every = sample_every > 1 ? sample_every : 1;
+	return 1;
+}
+
+STCORE_API int st_clear_ray_selection(st_context_t pcxt)
+{
+	SYSTEM(pcxt,-1);
+	for (st_uint_t i=0;i<sys->StageList.size();i++)
+	{
+		TStage *s = sys->StageList[i];
+		s->RetainRays = false;
+		for (st_uint_t j=0;j<s->ElementList.size();j++)
+			s->ElementList[j]->RetainRays = false;
+	}
+	return 1;
+}
+
+STCORE_API int st_select_rays(st_context_t pcxt, st_uint_t stage, int idx)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	if (idx < 0)
+	{
+		s->RetainRays = true;
+		return 1;
+	}
+
+	GETELEMENT((st_uint_t)idx);
+	e->RetainRays = true;
+	return 1;
+}
+
+
 /* functions to control simulation */
+STCORE_API int st_sim_memory(st_context_t pcxt, int huge_pages)
+{
+	SYSTEM(pcxt,-1);
+	sys->RayBlocks.HugePages = huge_pages?true:false;
+	return 1;
+}
+
+STCORE_API int st_sim_release_memory(st_context_t pcxt)
+{
+	SYSTEM(pcxt,-1);
+	sys->AllRayData.Clear();
+	for (st_uint_t i=0;i<sys->StageList.size();i++)
+		sys->StageList[i]->RayData.Clear();
+	sys->RayBlocks.Purge();
+	return 1;
+}
+
 STCORE_API int st_sim_params(st_context_t pcxt, int raycount, int maxcount)
 {
 	SYSTEM(pcxt,-1);
@@ -627,6 +919,18 @@ STCORE_API int st_sim_params(st_context_t pcxt, int raycount, int maxcount)
 	return 1;
 }
 
+STCORE_API int st_sim_sampling(st_context_t pcxt, int mode)
+{
+	SYSTEM(pcxt,-1);
+	if (mode != ST_SAMPLE_RANDOM && mode != ST_SAMPLE_SOBOL && mode != ST_SAMPLE_STRATIFIED)
+	{
+		sys->errlog("invalid sampling mode %d", mode);
+		return -1;
+	}
+	sys->sim_sampling = mode;
+	return 1;
+}
+
 STCORE_API int st_sim_errors(st_context_t pcxt, int include_sun_shape, int include_optics)
 {
 	SYSTEM(pcxt,-1);
@@ -635,43 +939,100 @@ STCORE_API int st_sim_errors(st_context_t pcxt, int include_sun_shape, int inclu
 	return 1;
 }
 
-STCORE_API int st_sim_run_data( st_context_t pcxt, unsigned int seed, 
-                            bool AsPowerTower,
-                            std::vector<std::vector< double > > *data_s1, 
-                            std::vector<std::vector< double > > *data_s2, 
-                            bool save_st_data,
-						    int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *cbdata
-                            )
+STCORE_API int st_sim_weighted(st_context_t pcxt, int enable, double roulette_weight)
+{
+	SYSTEM(pcxt,-1);
+	if (roulette_weight < 0 || roulette_weight >= 1)
+	{
+		sys->errlog("invalid roulette weight %g, must be at least 0 and less than 1", roulette_weight);
+		return -1;
+	}
+	sys->sim_weighted = enable?true:false;
+	sys->sim_roulette_weight = roulette_weight;
+	return 1;
+}
+
+STCORE_API int st_sim_spectrum(st_context_t pcxt, int npoints, double *wavelengths, double *irradiance)
+{
+	SYSTEM(pcxt,-1);
+	if (npoints <= 0)
+	{
+		sys->Spectrum.Clear();
+		return 1;
+	}
+
+	if (!wavelengths || !irradiance
+		|| !sys->Spectrum.Setup( npoints, wavelengths, irradiance ))
+	{
+		sys->errlog("invalid spectrum: wavelengths must increase and irradiance be non-negative with a positive total");
+		return -1;
+	}
+
+	return 1;
+}
+
+STCORE_API int st_sim_checkpoint(st_context_t pcxt, const char *file, st_uint_t every_rays)
 {
-    /* 
-    Run a simulation and save the stage 1-2 ray data for future use. Return this data in the data_s1, data_s2 structures.
-    data_s1 will be formatted each vector entry:
+	SYSTEM(pcxt,-1);
+	sys->sim_checkpoint_file = file ? file : "";
+	sys->sim_checkpoint_every = every_rays;
+	return 1;
+}
+
+STCORE_API int st_sim_replay_file(st_context_t pcxt, const char *file)
+{
+	SYSTEM(pcxt,-1);
+	sys->sim_replay_file = file ? file : "";
+	return 1;
+}
 
-    PosRayGlobal[0],PosRayGlobal[1],PosRayGlobal[2],CosRayGlobal[0],CosRayGlobal[1],CosRayGlobal[2],ElementNum,RayNum
+// the most intersection records set aside before a trace, about 1.2 GB
+static const st_uint_t MaxReservedRays = 1 << 24;
 
-    data_s2 will be formatted each vector entry:
-    PosRayGlobal[0],PosRayGlobal[1],PosRayGlobal[2],CosRayGlobal[0],CosRayGlobal[1],CosRayGlobal[2],RayNum
-    
-    */
-    SYSTEM(pcxt,-1);
+static bool PrepareTrace( TSystem *sys )
+{
+	// the first stage is saved for the later ones to be traced again from it
+	if ( !sys->sim_replay_file.empty() && sys->StageList.size() < 2 )
+	{
+		sys->errlog("saving the first stage for replay needs a system with more than one stage");
+		return false;
+	}
 
+	// hand the blocks from the last run back to the pool, so that this
+	// run reuses them.  all of the ray data in the context shares one pool
+	// so that merging the stages below only moves blocks around
+	sys->AllRayData.SetPool( &sys->RayBlocks );
 	sys->AllRayData.Clear();
+	for (st_uint_t i=0;i<sys->StageList.size();i++)
+	{
+		sys->StageList[i]->RayData.SetPool( &sys->RayBlocks );
+		sys->StageList[i]->RayData.Clear();
+	}
 
 	if ( !InitGeometries(sys) )
-		return -1;
+		return false;
 
-    int rayct = sys->sim_raycount;
-    if(data_s2 != 0)
-        if(data_s2->size() > 0)
-            rayct = data_s2->size();
+	if ( !InitFluxTargets(sys) )
+		return false;
 
-	if ( !Trace(sys, seed,
-		rayct, sys->sim_raymax,
-		sys->sim_errors_sunshape, sys->sim_errors_optical, AsPowerTower,
-		callback, cbdata, data_s1, data_s2, save_st_data) )
-		return -1;
+	// each stage records at least one intersection per ray when everything
+	// is kept.  that much is set aside up front, up to a cap beyond which the
+	// pool grows as the records come in
+	if (sys->sim_retention == ST_RETAIN_ALL)
+	{
+		st_uint_t nrays = std::min( (st_uint_t)sys->sim_raycount * sys->StageList.size(), MaxReservedRays );
+		if ( !sys->RayBlocks.Reserve( nrays ) )
+		{
+			sys->errlog("out of memory reserving ray data for %llu intersections", (unsigned long long)nrays);
+			return false;
+		}
+	}
 
+	return true;
+}
 
+static int MergeStages( TSystem *sys )
+{
 	try
 	{
 		for (st_uint_t i=0;i<sys->StageList.size();i++)
@@ -686,10 +1047,364 @@ STCORE_API int st_sim_run_data( st_context_t pcxt, unsigned int seed,
 	}
 }
 
+static int RunTrace( TSystem *sys, unsigned int seed, bool AsPowerTower,
+                     const char *resume_file, const char *replay_file,
+                     int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *cbdata )
+{
+	if ( !PrepareTrace(sys) )
+		return -1;
+
+	if ( !Trace(sys, seed,
+		sys->sim_raycount, sys->sim_raymax,
+		sys->sim_errors_sunshape, sys->sim_errors_optical, AsPowerTower,
+		callback, cbdata, resume_file, replay_file) )
+		return -1;
+
+	return MergeStages(sys);
+}
+
 STCORE_API int st_sim_run( st_context_t pcxt, unsigned int seed, bool AsPowerTower,
 						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *cbdata)
 {
-    return st_sim_run_data( pcxt, seed, AsPowerTower, 0, 0, false, callback, cbdata);
+	SYSTEM(pcxt,-1);
+	return RunTrace( sys, seed, AsPowerTower, 0, 0, callback, cbdata );
+}
+
+STCORE_API int st_sim_resume( st_context_t pcxt, const char *file,
+						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *cbdata)
+{
+	SYSTEM(pcxt,-1);
+
+	if ( !file || !*file )
+	{
+		sys->errlog("no checkpoint file given to resume from");
+		return -1;
+	}
+
+	// the seed and the trace settings come from the checkpoint
+	return RunTrace( sys, 0, false, file, 0, callback, cbdata );
+}
+
+STCORE_API int st_sim_replay( st_context_t pcxt, unsigned int seed, const char *file,
+						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *cbdata)
+{
+	SYSTEM(pcxt,-1);
+
+	if ( !file || !*file )
+	{
+		sys->errlog("no replay file given to trace from");
+		return -1;
+	}
+
+	// the first stage isn't traced, so running as a power tower changes nothing
+	return RunTrace( sys, seed, false, 0, file, callback, cbdata );
+}
+
+
+STCORE_API int st_sim_converge(st_context_t pcxt, int metrics, double rel_tol, double max_seconds, int max_batches)
+{
+	SYSTEM(pcxt,-1);
+	if (metrics == 0
+		|| (metrics & ~(ST_CONVERGE_INTERCEPT|ST_CONVERGE_ABSORBED|ST_CONVERGE_PEAK_FLUX)) != 0)
+	{
+		sys->errlog("invalid convergence metrics %d", metrics);
+		return -1;
+	}
+	if (rel_tol <= 0 || max_seconds < 0 || max_batches < 0)
+	{
+		sys->errlog("invalid convergence limits: tolerance %g, %g seconds, %d batches", rel_tol, max_seconds, max_batches);
+		return -1;
+	}
+	sys->sim_converge_metrics = metrics;
+	sys->sim_converge_tol = rel_tol;
+	sys->sim_converge_seconds = max_seconds;
+	sys->sim_converge_batches = max_batches;
+	return 1;
+}
+
+STCORE_API int st_converge_element(st_context_t pcxt, st_uint_t stage, st_uint_t idx)
+{
+	SYSTEM(pcxt,-1);
+	GETSTAGE(stage);
+	GETELEMENT(idx);
+	sys->sim_converge_elements.push_back( std::make_pair(stage, idx) );
+	return sys->sim_converge_elements.size()-1;
+}
+
+STCORE_API int st_clear_converge_elements(st_context_t pcxt)
+{
+	SYSTEM(pcxt,-1);
+	sys->sim_converge_elements.clear();
+	return 1;
+}
+
+// the progress of each batch goes to the caller's callback, and canceling
+// one batch cancels the whole run
+struct ConvergeCallback
+{
+	int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data);
+	void *data;
+	bool canceled;
+};
+
+static int ConvergeProgress( st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data )
+{
+	ConvergeCallback *cc = reinterpret_cast<ConvergeCallback*>(data);
+	if ( !(*cc->callback)( ntracedtotal, ntraced, ntotrace, curstage, nstages, cc->data ) )
+		cc->canceled = true;
+	return cc->canceled ? 0 : 1;
+}
+
+static unsigned int BatchSeed( unsigned int seed, st_uint_t batch )
+{
+	// the first batch traces what st_sim_run would, the others
+	// get well separated seeds (splitmix64 finalizer)
+	if (batch == 0)
+		return seed;
+	unsigned long long z = seed + (unsigned long long)batch * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return (unsigned int)(z ^ (z >> 31));
+}
+
+// running mean and variance of the batch values of a metric
+struct BatchStats
+{
+	BatchStats() : n(0), mean(0), m2(0) { }
+
+	void Add( double x )
+	{
+		n++;
+		double d = x - mean;
+		mean += d/n;
+		m2 += d*(x - mean);
+	}
+
+	double RelError()
+	{
+		if (n < 2)
+			return HUGE_VAL;
+		double se = sqrt( m2/(n-1)/n );
+		if (se == 0)
+			return 0;
+		return mean != 0 ? se/fabs(mean) : HUGE_VAL;
+	}
+
+	st_uint_t n;
+	double mean, m2;
+};
+
+STCORE_API int st_sim_run_converged( st_context_t pcxt, unsigned int seed, bool AsPowerTower,
+						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *cbdata)
+{
+	SYSTEM(pcxt,-1);
+
+	if ( !sys->sim_checkpoint_file.empty() || !sys->sim_replay_file.empty() )
+	{
+		sys->errlog("converged runs can't be checkpointed or saved for replay");
+		return -1;
+	}
+
+	int metrics = sys->sim_converge_metrics;
+	std::vector<TElement*> selected;
+	if (metrics & ST_CONVERGE_ABSORBED)
+	{
+		for (size_t i=0;i<sys->sim_converge_elements.size();i++)
+		{
+			st_uint_t stage = sys->sim_converge_elements[i].first;
+			st_uint_t idx = sys->sim_converge_elements[i].second;
+			if (stage >= sys->StageList.size() || idx >= sys->StageList[stage]->ElementList.size())
+			{
+				sys->errlog("convergence element %d refers to invalid stage %d element %d", (int)i+1, (int)stage+1, (int)idx+1);
+				return -1;
+			}
+			selected.push_back( sys->StageList[stage]->ElementList[idx] );
+		}
+
+		if (selected.size() == 0)
+		{
+			sys->errlog("no elements selected for the absorbed power to converge");
+			return -1;
+		}
+	}
+
+	if ( (metrics & ST_CONVERGE_PEAK_FLUX) && sys->FluxTargets.size() == 0 )
+	{
+		sys->errlog("no flux targets for the peak flux to converge");
+		return -1;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if ( !PrepareTrace(sys) )
+		return -1;
+
+	// Trace resets the counters for every batch, so they are added up
+	// here and handed back once the run is done.  the flux targets are
+	// only reset by PrepareTrace and add up by themselves
+	std::vector<TStage*> &stages = sys->StageList;
+	std::vector<TElement*> elements;
+	for (size_t i=0;i<stages.size();i++)
+		elements.insert( elements.end(), stages[i]->ElementList.begin(), stages[i]->ElementList.end() );
+
+	std::vector<st_uint_t> miss( stages.size(), 0 ), tests( stages.size(), 0 ), rejects( stages.size(), 0 );
+	std::vector<st_uint_t> hits( elements.size(), 0 ), absorbed( elements.size(), 0 ), ended( elements.size(), 0 );
+	std::vector<double> power( elements.size(), 0 );
+	std::vector< std::vector<double> > spectral( elements.size() );
+
+	ConvergeCallback cc;
+	cc.callback = callback;
+	cc.data = cbdata;
+	cc.canceled = false;
+
+	BatchStats intercept, absorbed_power;
+	double peak = 0, peak_error = HUGE_VAL;
+	st_uint_t batch = 0, nsunrays = 0;
+	unsigned int first_ray = 0;
+	for (;;)
+	{
+		if ( !Trace(sys, BatchSeed(seed, batch),
+			sys->sim_raycount, sys->sim_raymax,
+			sys->sim_errors_sunshape, sys->sim_errors_optical, AsPowerTower,
+			callback ? ConvergeProgress : 0, &cc, 0, 0) )
+			return -1;
+
+		// number the rays on from the previous batches
+		if (first_ray > 0)
+			for (size_t i=0;i<stages.size();i++)
+				for (st_uint_t j=0;j<stages[i]->RayData.Count();j++)
+					stages[i]->RayData.Index( j, true )->raynum += first_ray;
+		first_ray += (unsigned int)sys->sim_raycount;
+
+		if ( MergeStages(sys) < 0 )
+			return -1;
+
+		for (size_t i=0;i<stages.size();i++)
+		{
+			miss[i] += stages[i]->MissCount;
+			tests[i] += stages[i]->BoundTests;
+			rejects[i] += stages[i]->BoundRejects;
+		}
+
+		double batch_power = 0;
+		for (size_t i=0;i<elements.size();i++)
+		{
+			TElement *e = elements[i];
+			hits[i] += e->HitCount;
+			absorbed[i] += e->AbsorbedCount;
+			ended[i] += e->RouletteCount;
+			power[i] += e->AbsorbedPower;
+			spectral[i].resize( e->SpectralAbsorbed.size(), 0 );
+			for (size_t j=0;j<e->SpectralAbsorbed.size();j++)
+				spectral[i][j] += e->SpectralAbsorbed[j];
+		}
+		for (size_t i=0;i<selected.size();i++)
+			batch_power += selected[i]->AbsorbedPower;
+
+		nsunrays += sys->SunRayCount;
+		batch++;
+
+		// a canceled batch is kept, but doesn't count towards the metrics
+		if (cc.canceled)
+			break;
+
+		intercept.Add( (double)sys->sim_raycount / (double)sys->SunRayCount );
+		absorbed_power.Add( batch_power / (double)sys->SunRayCount );
+
+		// the peak bins are taken from the sum of the batches so far, and
+		// the worst of them decides
+		if (sys->FluxTargets.size() > 0)
+		{
+			peak_error = 0;
+			for (size_t i=0;i<sys->FluxTargets.size();i++)
+			{
+				// the bins hold the power of their rays, so the counting
+				// error comes from the number of rays in the peak bin
+				TFluxTarget *ft = sys->FluxTargets[i];
+				double max = 0, nhits = 0;
+				for (int ix=0;ix<ft->NBinsX;ix++)
+					for (int iy=0;iy<ft->NBinsY;iy++)
+						if (ft->Grid.at(ix,iy) > max)
+						{
+							max = ft->Grid.at(ix,iy);
+							nhits = ft->Hits.at(ix,iy);
+						}
+
+				double err = nhits > 0 ? 1.0/sqrt(nhits) : HUGE_VAL;
+				if (i == 0 || err > peak_error)
+				{
+					peak = max / (double)nsunrays;
+					peak_error = err;
+				}
+			}
+		}
+
+		double tol = sys->sim_converge_tol;
+		bool converged = batch >= ST_CONVERGE_MIN_BATCHES
+			&& ( !(metrics & ST_CONVERGE_INTERCEPT) || intercept.RelError() <= tol )
+			&& ( !(metrics & ST_CONVERGE_ABSORBED) || absorbed_power.RelError() <= tol )
+			&& ( !(metrics & ST_CONVERGE_PEAK_FLUX) || peak_error <= tol );
+		if (converged)
+			break;
+
+		if (sys->sim_converge_batches > 0 && batch >= (st_uint_t)sys->sim_converge_batches)
+			break;
+
+		// don't start a batch that would end after the time budget
+		double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		if (sys->sim_converge_seconds > 0
+			&& seconds + seconds/batch > sys->sim_converge_seconds)
+			break;
+
+		// nor one that would keep more records than the cap
+		st_uint_t nrecords = sys->AllRayData.Count();
+		if (nrecords + nrecords/batch > ST_CONVERGE_MAX_RECORDS)
+			break;
+	}
+
+	for (size_t i=0;i<stages.size();i++)
+	{
+		stages[i]->MissCount = miss[i];
+		stages[i]->BoundTests = tests[i];
+		stages[i]->BoundRejects = rejects[i];
+	}
+	for (size_t i=0;i<elements.size();i++)
+	{
+		elements[i]->HitCount = hits[i];
+		elements[i]->AbsorbedCount = absorbed[i];
+		elements[i]->RouletteCount = ended[i];
+		elements[i]->AbsorbedPower = power[i];
+		elements[i]->SpectralAbsorbed = spectral[i];
+	}
+	sys->SunRayCount = nsunrays;
+
+	sys->ConvergeBatches = batch;
+	sys->ConvergeValue[0] = intercept.mean;
+	sys->ConvergeError[0] = intercept.RelError();
+	sys->ConvergeValue[1] = absorbed_power.mean;
+	sys->ConvergeError[1] = absorbed_power.RelError();
+	sys->ConvergeValue[2] = peak;
+	sys->ConvergeError[2] = peak_error;
+
+	return sys->AllRayData.Count();
+}
+
+STCORE_API int st_sim_convergence(st_context_t pcxt, int metric, double *value, double *rel_error)
+{
+	SYSTEM(pcxt,-1);
+	int i;
+	switch (metric)
+	{
+	case ST_CONVERGE_INTERCEPT: i = 0; break;
+	case ST_CONVERGE_ABSORBED: i = 1; break;
+	case ST_CONVERGE_PEAK_FLUX: i = 2; break;
+	default:
+		sys->errlog("invalid convergence metric %d", metric);
+		return -1;
+	}
+	if (value) *value = sys->ConvergeValue[i];
+	if (rel_error) *rel_error = sys->ConvergeError[i];
+	return (int)sys->ConvergeBatches;
 }
 
 
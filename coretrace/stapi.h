@@ -101,6 +101,11 @@ STCORE_API int st_optic(st_context_t pcxt, st_uint_t idx, int fb, /* 1=front,2=b
 				double rmsslope, double rmsspec,
 				int userefltable, int npoints,
 				double *angles, double *refls );
+/* wavelength-dependent reflectivity and transmissivity (nm, increasing),
+   interpolated linearly in place of ref/tra when a spectrum is traced.
+   npoints=0 removes the table */
+STCORE_API int st_optic_spectral(st_context_t pcxt, st_uint_t idx, int fb,
+				int npoints, double *wavelengths, double *refls, double *tras );
 
 /* functions to add/remove stages */
 STCORE_API int st_num_stages(st_context_t pcxt);
@@ -145,18 +150,139 @@ STCORE_API int st_cosines(st_context_t pcxt, double *cos_x, double *cos_y, doubl
 STCORE_API int st_elementmap(st_context_t pcxt, int *element_map);
 STCORE_API int st_stagemap(st_context_t pcxt, int *stage_map);
 STCORE_API int st_raynumbers(st_context_t pcxt, int *ray_numbers);
+STCORE_API int st_weights(st_context_t pcxt, double *weights); /* power carried by the ray at each intersection, 1 unless weighted */
+STCORE_API int st_absorbed(st_context_t pcxt, double *absorbed); /* power the ray left at each intersection, its weight if absorbed and 0 otherwise unless weighted */
 STCORE_API int st_sun_stats(st_context_t pcxt, double *xmin, double *xmax, double *ymin, double *ymax, int *nsunrays );
+
+/* functions to accumulate flux maps on elements during the trace.
+   bins are in element coordinates; grid is returned as grid[ix*nbinsy+iy] */
+STCORE_API int st_clear_flux_targets(st_context_t pcxt);
+STCORE_API int st_add_flux_target(st_context_t pcxt, st_uint_t stage, st_uint_t idx,
+				int nbinsx, int nbinsy,
+				double xmin, double xmax, double ymin, double ymax,
+				int absorbed_only);
+STCORE_API int st_num_flux_targets(st_context_t pcxt);
+STCORE_API int st_flux_target_grid(st_context_t pcxt, st_uint_t target, double *grid);
+STCORE_API int st_flux_target_hits(st_context_t pcxt, st_uint_t target, double *hits); /* number of rays in each bin, as grid */
+STCORE_API int st_flux_target_stats(st_context_t pcxt, st_uint_t target, int *nbinned, double centroid_sum[3], int *ncentroid);
+
+/* functions to retrieve per-element ray counts from the last trace.
+   passed = hits that were not absorbed; missed counts rays that hit no element in the stage */
+STCORE_API int st_element_counts(st_context_t pcxt, st_uint_t stage, st_uint_t idx, st_uint_t *hits, st_uint_t *absorbed, st_uint_t *passed);
+STCORE_API int st_stage_counts(st_context_t pcxt, st_uint_t stage, st_uint_t *hits, st_uint_t *absorbed, st_uint_t *passed, st_uint_t *missed);
+/* candidate elements tested against their bounds in the stage during the last
+   trace, and how many of them were rejected without a full intersection */
+STCORE_API int st_stage_bound_counts(st_context_t pcxt, st_uint_t stage, double *tested, double *rejected);
+/* iterative (Newton-Raphson) intersections with an element during the last trace,
+   the surface evaluations they took in total, and how many failed to converge */
+STCORE_API int st_element_newton_counts(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *calls, double *steps, double *failures);
+/* ray weight absorbed on an element in total, and in each band of the traced
+   spectrum (one value per spectrum point), during the last trace.  without
+   weighted rays these are absorbed ray counts.  multiplied by the power per
+   ray they give the absorbed power.  weighted rays leave part of their weight
+   at every hit, so they only count as absorbed where they keep none of it,
+   and the ones ended by the roulette on an element are counted apart */
+STCORE_API int st_element_roulette_count(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *ended);
+STCORE_API int st_element_absorbed_power(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *power);
+STCORE_API int st_element_spectral_absorbed(st_context_t pcxt, st_uint_t stage, st_uint_t idx, double *counts);
 	
+/* functions to control which ray intersection records are stored by the trace.
+   records that are not retained are never written, but still count towards
+   st_element_counts and flux targets */
+#define ST_RETAIN_ALL       0  /* every intersection (default) */
+#define ST_RETAIN_FINAL     1  /* absorbed rays only, i.e. negative element numbers, and with weighted rays every intersection that left power */
+#define ST_RETAIN_SELECTED  2  /* stages/elements marked with st_select_rays */
+#define ST_RETAIN_SAMPLED   3  /* every intersection of one in every N rays */
+#define ST_RETAIN_NONE      4  /* nothing */
+STCORE_API int st_ray_retention(st_context_t pcxt, int mode, int sample_every);
+STCORE_API int st_clear_ray_selection(st_context_t pcxt);
+STCORE_API int st_select_rays(st_context_t pcxt, st_uint_t stage, int idx); /* idx < 0 selects the whole stage, including misses */
+
 /* functions to control simulation */
 STCORE_API int st_sim_params(st_context_t pcxt, int raycount, int maxcount);
+/* how the sun rays are sampled.  with ST_SAMPLE_SOBOL their positions in the
+   sun plane, their sunshape deviation and the slope error at their first
+   intersection are drawn from scrambled Sobol points (scrambled from the
+   seed, so each thread gets its own) rather than pseudo-random numbers, and
+   flux maps and intercept factors converge faster in the number of rays.
+   with ST_SAMPLE_STRATIFIED the sun rays are only generated in the zones of
+   the sun plane that have first stage elements in reach, one ray per equal
+   area cell of those zones in turn, jittered within the cell.  the sun ray
+   count is scaled to the whole sun box, so power per ray is unchanged.  this
+   applies where the trace hashes the sun plane: at least 10 elements in the
+   first stage and more stages after it */
+#define ST_SAMPLE_RANDOM     0  /* pseudo-random (default) */
+#define ST_SAMPLE_SOBOL      1  /* low-discrepancy */
+#define ST_SAMPLE_STRATIFIED 2  /* jittered over the zones with elements */
+STCORE_API int st_sim_sampling(st_context_t pcxt, int mode);
+/* ray data memory is kept by the context for reuse by later runs until
+   st_sim_release_memory or st_free_context.  huge_pages requests
+   transparent huge pages for it where the OS supports them */
+STCORE_API int st_sim_memory(st_context_t pcxt, int huge_pages);
+STCORE_API int st_sim_release_memory(st_context_t pcxt);
 STCORE_API int st_sim_errors(st_context_t pcxt, int include_sun_shape, int include_optics);
+/* trace a spectrum: each ray is given a wavelength drawn from the spectral
+   irradiance (e.g. AM1.5) tabulated at npoints increasing wavelengths (nm),
+   which sets the optical properties it sees.  npoints=0 traces a single
+   wavelength as before */
+/* weighted rays: each ray starts with a weight of 1 and carries on through
+   every interaction with the reflected or transmitted share of it, leaving
+   the rest absorbed on the element.  a ray whose weight drops below
+   roulette_weight survives with probability weight/roulette_weight, at that
+   weight, and ends there otherwise.  absorbed power then converges with far
+   fewer rays on poorly reflecting or multi-bounce receivers */
+STCORE_API int st_sim_weighted(st_context_t pcxt, int enable, double roulette_weight);
+STCORE_API int st_sim_spectrum(st_context_t pcxt, int npoints, double *wavelengths, double *irradiance);
 STCORE_API int st_sim_run( st_context_t pcxt, unsigned int seed, bool AsPowerTower,
 						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *data);
 
-/*
-STCORE_API int st_sim_run_data( st_context_t pcxt, unsigned int seed, std::vector<std::vector< double > > *data_s1, std::vector<std::vector< double > > *data_s2, bool save_stage_data,
+/* functions to checkpoint long runs.  with a file set, st_sim_run saves the
+   state of the trace to it at each stage boundary and after every
+   'every_rays' rays (0 for stage boundaries only), with the ray records in
+   <file>.rays.  the files are removed when the run completes.
+   st_sim_resume continues an interrupted run from its checkpoint, in a
+   context set up with the same system, and keeps checkpointing to the
+   same file unless another one is set */
+STCORE_API int st_sim_checkpoint(st_context_t pcxt, const char *file, st_uint_t every_rays);
+STCORE_API int st_sim_resume( st_context_t pcxt, const char *file,
 						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *data);
-*/
+
+/* functions to trace the later stages again without the first one.  with a
+   file set, st_sim_run saves the rays the first stage passes on to it, along
+   with the first stage's ray records, counters and flux maps.  st_sim_replay
+   traces the remaining stages from such a file, in a context set up with the
+   same first stage, so changes to the later stages only need those traced.
+   the number of rays comes from the file.  both need a system with more
+   than one stage */
+STCORE_API int st_sim_replay_file(st_context_t pcxt, const char *file);
+STCORE_API int st_sim_replay( st_context_t pcxt, unsigned int seed, const char *file,
+						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *data);
+
+/* functions to trace until the results have converged.  st_sim_run_converged
+   traces batches of the st_sim_params ray count, each with its own seed, and
+   adds them up in the context as if they were one run (ray numbers continue
+   from batch to batch), until the standard error of every selected metric
+   relative to its value is at most rel_tol.  the errors are estimated from the
+   spread of the batch values, so at least ST_CONVERGE_MIN_BATCHES are traced.
+   the run also ends before a batch that would take it past max_seconds, or
+   after max_batches (0 for no limit on either).  the intersection records of
+   every batch are kept, so it also ends before a batch that would take them
+   past ST_CONVERGE_MAX_RECORDS; long runs should keep fewer records (see
+   st_ray_retention).  st_sim_convergence gives the value and relative
+   standard error reached for one metric, and returns the number of batches
+   traced.  converged runs can't be checkpointed or saved for replay */
+#define ST_CONVERGE_INTERCEPT   1  /* fraction of the sun rays hitting the first stage */
+#define ST_CONVERGE_ABSORBED    2  /* fraction of the sun ray power absorbed on the st_converge_element elements */
+#define ST_CONVERGE_PEAK_FLUX   4  /* fraction of the sun rays in the peak bin of each flux target, with
+                                      the counting error 1/sqrt(n) of the n rays binned into it */
+#define ST_CONVERGE_MIN_BATCHES 4
+#define ST_CONVERGE_MAX_RECORDS 10000000
+STCORE_API int st_sim_converge(st_context_t pcxt, int metrics, double rel_tol, double max_seconds, int max_batches);
+STCORE_API int st_converge_element(st_context_t pcxt, st_uint_t stage, st_uint_t idx);
+STCORE_API int st_clear_converge_elements(st_context_t pcxt);
+STCORE_API int st_sim_run_converged( st_context_t pcxt, unsigned int seed, bool AsPowerTower,
+						  int (*callback)(st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace, st_uint_t curstage, st_uint_t nstages, void *data), void *data);
+STCORE_API int st_sim_convergence(st_context_t pcxt, int metric, double *value, double *rel_error);
 
 
 /* utility transform/math functions */
@@ -364,10 +364,9 @@ Label_160:
 		}
 		
 		//evaluate z & slopes using cubic spline interpolation
-		if (!splint(Element->CubicSplineXData,
-				Element->CubicSplineYData,
-				Element->CubicSplineY2Data,
-				Element->CubicSplineXData.size(),
+		if (!spleval(Element->CubicSplineXData,
+				Element->CubicSplineCoef,
+				Element->CubicSplineDX,
 				Rho,&ZZ,&dzdRho))
 		{
 			*ErrorFlag = 3;
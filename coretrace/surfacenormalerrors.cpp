@@ -57,7 +57,8 @@
 
 void SurfaceNormalErrors( MTRand &myrng, double CosIn[3],
 						 TOpticalProperties *OptProperties,
-						 double CosOut[3] ) throw(nanexcept)
+						 double CosOut[3],
+						 const double *u ) throw(nanexcept)
 {
 
 /*{Purpose:  To add error terms to the surface normal vector at the surface in question
@@ -67,6 +68,8 @@ void SurfaceNormalErrors( MTRand &myrng, double CosIn[3],
                    Element = Element data record
                    DFXYZ   = surface normal vector at interaction point
 
+                   u       = low-discrepancy point in [0,1)^2 used for theta and phi instead of random numbers, or null
+
            Output - CosOut  = Output direction cosine vector of surface normal after error terms have been included
                    }*/
 
@@ -114,6 +117,12 @@ Label_9:
 
 
 	int nninner = 0;
+	if ( u && (dist == 'g' || dist == 'G' || dist == 'p' || dist == 'P') )
+	{
+		theta = ErrorAngle( dist, delop, 0, u[0] );
+		theta2 = theta*theta;
+	}
+	else
 	switch( dist )
 	{
 	case 'g':
@@ -174,7 +183,7 @@ Label_9:
 	theta = sqrt(theta2);
 
 	//phi = atan2(thetay, thetax); //This function appears to  present irregularities that bias results incorrectly for small values of thetay or thetax
-	phi = RANGEN()*2.0*3.1415926535897932385; // Therefore have chosen to randomize phi rather than calculate from randomized theta components
+	phi = (u ? u[1] : RANGEN())*2.0*3.1415926535897932385; // Therefore have chosen to randomize phi rather than calculate from randomized theta components
                                                       //  obtained from the distribution. The two approaches are equivalent save for this issue with
                                                       //  arctan2.      wendelin 01-12-11 
 
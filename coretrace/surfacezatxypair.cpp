@@ -239,12 +239,14 @@ Label_160:
 		dRhodx = X/Rho;
 		dRhody = Y/Rho;
 		//evaluate z & slopes using cubic spline interpolation
-		splint(Element->CubicSplineXData,
-			Element->CubicSplineYData,
-			Element->CubicSplineY2Data,
-			Element->CubicSplineXData.length(),
-			Rho,
-			&ZZ,&dzdRho);
+		if (!spleval(Element->CubicSplineXData,
+				Element->CubicSplineCoef,
+				Element->CubicSplineDX,
+				Rho,&ZZ,&dzdRho))
+		{
+			*ErrorFlag = 3;
+			return;
+		}
 
 		DFDX = dzdRho*dRhodx;
 		DFDY = dzdRho*dRhody;
@@ -0,0 +1,290 @@
+
+/*******************************************************************************************************
+*  Copyright 2018 Alliance for Sustainable Energy, LLC
+*
+*  NOTICE: This software was developed at least in part by Alliance for Sustainable Energy, LLC
+*  ("Alliance") under Contract No. DE-AC36-08GO28308 with the U.S. Department of Energy and the U.S.
+*  The Government retains for itself and others acting on its behalf a nonexclusive, paid-up,
+*  irrevocable worldwide license in the software to reproduce, prepare derivative works, distribute
+*  copies to the public, perform publicly and display publicly, and to permit others to do so.
+*
+*  Redistribution and use in source and binary forms, with or without modification, are permitted
+*  provided that the following conditions are met:
+*
+*  1. Redistributions of source code must retain the above copyright notice, the above government
+*  rights notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright notice, the above government
+*  rights notice, this list of conditions and the following disclaimer in the documentation and/or
+*  other materials provided with the distribution.
+*
+*  3. The entire corresponding source code of any redistribution, with or without modification, by a
+*  research entity, including but not limited to any contracting manager/operator of a United States
+*  National Laboratory, any institution of higher learning, and any non-profit organization, must be
+*  made publicly available under this license for as long as the redistribution is made available by
+*  the research entity.
+*
+*  4. Redistribution of this software, without modification, must refer to the software by the same
+*  designation. Redistribution of a modified version of this software (i) may not refer to the modified
+*  version by the same designation, or by any confusingly similar designation, and (ii) must refer to
+*  the underlying software originally provided by Alliance as "SolTrace". Except to comply with the 
+*  foregoing, the term "SolTrace", or any confusingly similar designation may not be used to refer to 
+*  any modified version of this software or any modified version of the underlying software originally 
+*  provided by Alliance without the prior written consent of Alliance.
+*
+*  5. The name of the copyright holder, contributors, the United States Government, the United States
+*  Department of Energy, or any of their employees may not be used to endorse or promote products
+*  derived from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+*  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+*  FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER,
+*  CONTRIBUTORS, UNITED STATES GOVERNMENT OR UNITED STATES DEPARTMENT OF ENERGY, NOR ANY OF THEIR
+*  EMPLOYEES, BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+*  IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+*  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************************************/
+
+
+// checkpoint and resume checked against an uninterrupted run.  a two stage
+// tower with sun shape and optical errors is traced in full, then traced
+// again with checkpoints and cancelled part way through each stage in turn,
+// and resumed in a new context from the checkpoint.  returns nonzero unless
+// the resumed run gives the same ray records as the full one, bit for bit
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "stapi.h"
+
+static const char *CheckpointFile = "checkpointtest.ckpt";
+
+// a field of n x n flat heliostats aimed at two flat receivers, one above the other
+static st_context_t MakeTower( int n, int nrays )
+{
+	st_context_t c = st_create_context();
+	st_sun( c, 0, 'p', 4.65 );
+	st_sun_xyz( c, 0.2, -0.3, 1.0 );
+
+	double ab[4] = { 0, 0, 0, 0 };
+	int mirror = st_add_optic( c, "mirror" );
+	st_optic( c, mirror, 1, 'g', 1, 0, 0, 1.0, 1.2, 0.9, 0.0, ab, 0.95, 0.2, 0, 0, 0, 0 );
+	st_optic( c, mirror, 2, 'g', 1, 0, 0, 1.0, 1.2, 0.9, 0.0, ab, 0.95, 0.2, 0, 0, 0, 0 );
+	int recv = st_add_optic( c, "receiver" );
+	st_optic( c, recv, 1, 'g', 1, 0, 0, 1.0, 1.2, 0.1, 0.0, ab, 0.95, 0.2, 0, 0, 0, 0 );
+	st_optic( c, recv, 2, 'g', 1, 0, 0, 1.0, 1.2, 0.1, 0.0, ab, 0.95, 0.2, 0, 0, 0, 0 );
+
+	st_add_stages( c, 2 );
+	for (int s=0;s<2;s++)
+	{
+		st_stage_xyz( c, s, 0, 0, 0 );
+		st_stage_aim( c, s, 0, 0, 1 );
+		st_stage_zrot( c, s, 0 );
+		st_stage_flags( c, s, 0, 1, 0 );
+	}
+
+	double sun[3] = { 0.2, -0.3, 1.0 };
+	double sunlen = sqrt( sun[0]*sun[0] + sun[1]*sun[1] + sun[2]*sun[2] );
+	double sp[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	double helio[8] = { 5, 5, 0, 0, 0, 0, 0, 0 };
+	double target[8] = { 12, 12, 0, 0, 0, 0, 0, 0 };
+
+	st_add_elements( c, 0, n*n );
+	for (int i=0;i<n;i++)
+	{
+		for (int j=0;j<n;j++)
+		{
+			int k = i*n + j;
+			double x = (i - n/2.0)*6 + 3, y = (j - n/2.0)*6 + 40;
+
+			// the normal halfway between the sun and the receiver
+			double t[3] = { -x, -y, 50 };
+			double tlen = sqrt( t[0]*t[0] + t[1]*t[1] + t[2]*t[2] );
+			double nrm[3];
+			for (int m=0;m<3;m++)
+				nrm[m] = sun[m]/sunlen + t[m]/tlen;
+
+			st_element_xyz( c, 0, k, x, y, 0 );
+			st_element_aim( c, 0, k, x + 100*nrm[0], y + 100*nrm[1], 100*nrm[2] );
+			st_element_zrot( c, 0, k, 0 );
+			st_element_aperture( c, 0, k, 'r' );
+			st_element_aperture_params( c, 0, k, helio );
+			st_element_surface( c, 0, k, 'f' );
+			st_element_surface_params( c, 0, k, sp );
+			st_element_interaction( c, 0, k, 2 );
+			st_element_optic( c, 0, k, "mirror" );
+		}
+	}
+
+	st_add_elements( c, 1, 2 );
+	for (int k=0;k<2;k++)
+	{
+		double z = 50 + 8*k;
+		st_element_xyz( c, 1, k, 0, 0, z );
+		st_element_aim( c, 1, k, 0, 40, z );
+		st_element_zrot( c, 1, k, 0 );
+		st_element_aperture( c, 1, k, 'r' );
+		st_element_aperture_params( c, 1, k, target );
+		st_element_surface( c, 1, k, 'f' );
+		st_element_surface_params( c, 1, k, sp );
+		st_element_interaction( c, 1, k, 2 );
+		st_element_optic( c, 1, k, "receiver" );
+	}
+
+	st_sim_params( c, nrays, nrays*100 );
+	st_sim_errors( c, 1, 1 );
+	return c;
+}
+
+struct RayRecords
+{
+	std::vector<double> X, Y, Z, CosX, CosY, CosZ;
+	std::vector<int> Element, Stage, Ray;
+	double Sun[4];
+	int SunRays;
+};
+
+static void GetRecords( st_context_t c, RayRecords &r )
+{
+	int n = st_num_intersections( c );
+	if ( n < 0 ) n = 0;
+
+	r.X.resize( n ); r.Y.resize( n ); r.Z.resize( n );
+	r.CosX.resize( n ); r.CosY.resize( n ); r.CosZ.resize( n );
+	r.Element.resize( n ); r.Stage.resize( n ); r.Ray.resize( n );
+	if ( n > 0 )
+	{
+		st_locations( c, &r.X[0], &r.Y[0], &r.Z[0] );
+		st_cosines( c, &r.CosX[0], &r.CosY[0], &r.CosZ[0] );
+		st_elementmap( c, &r.Element[0] );
+		st_stagemap( c, &r.Stage[0] );
+		st_raynumbers( c, &r.Ray[0] );
+	}
+	st_sun_stats( c, &r.Sun[0], &r.Sun[1], &r.Sun[2], &r.Sun[3], &r.SunRays );
+}
+
+// number of records that differ, or -1 if the record counts do
+static int CompareRecords( const RayRecords &a, const RayRecords &b )
+{
+	if ( a.Ray.size() != b.Ray.size() )
+		return -1;
+
+	int ndiff = 0;
+	for (size_t i=0;i<a.Ray.size();i++)
+	{
+		double pa[6] = { a.X[i], a.Y[i], a.Z[i], a.CosX[i], a.CosY[i], a.CosZ[i] };
+		double pb[6] = { b.X[i], b.Y[i], b.Z[i], b.CosX[i], b.CosY[i], b.CosZ[i] };
+		if ( memcmp( pa, pb, sizeof(pa) ) != 0
+			|| a.Element[i] != b.Element[i]
+			|| a.Stage[i] != b.Stage[i]
+			|| a.Ray[i] != b.Ray[i] )
+			ndiff++;
+	}
+
+	if ( memcmp( a.Sun, b.Sun, sizeof(a.Sun) ) != 0 || a.SunRays != b.SunRays )
+		ndiff++;
+
+	return ndiff;
+}
+
+// where to cancel the interrupted run, as a share of the rays of the stage
+struct StopAt
+{
+	st_uint_t Stage;
+	double Share;
+	st_uint_t Ray; // where it was cancelled
+	bool Stopped;
+	clock_t Start; // of the trace, at the first call back
+};
+
+static int CancelAt( st_uint_t ntracedtotal, st_uint_t ntraced, st_uint_t ntotrace,
+	st_uint_t curstage, st_uint_t nstages, void *data )
+{
+	StopAt *stop = (StopAt*)data;
+
+	// the trace calls back about every 200 ms of cpu time, as measured up to
+	// the call before, so time is spent here to take it to 0.1 ms a ray up to
+	// 2000 rays ahead.  that gives a call every 2000 rays or so however fast
+	// the trace is
+	if ( ntracedtotal <= 1 )
+		stop->Start = clock();
+	while ( clock() - stop->Start < (clock_t)( (ntracedtotal + 2000)*(CLOCKS_PER_SEC/10000.0) ) )
+		;
+
+	if ( curstage == stop->Stage && ntraced >= stop->Share*ntotrace )
+	{
+		stop->Ray = ntraced;
+		stop->Stopped = true;
+		return 0;
+	}
+	return 1;
+}
+
+static bool FileExists( const char *file )
+{
+	FILE *fp = fopen( file, "rb" );
+	if ( fp ) fclose( fp );
+	return fp != 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	int nrays = argc > 1 ? atoi( argv[1] ) : 20000;
+	unsigned int seed = 1234;
+	int nfailed = 0;
+
+	st_context_t full = MakeTower( 10, nrays );
+	if ( st_sim_run( full, seed, true, 0, 0 ) < 0 )
+	{
+		printf("the full run failed\n");
+		return 1;
+	}
+
+	RayRecords ref;
+	GetRecords( full, ref );
+	st_free_context( full );
+	printf("full run: %d records\n", (int)ref.Ray.size());
+
+	// part way through the sun rays, and through the rays the first stage passes on
+	StopAt stops[2] = { { 1, 0.6, 0, false, 0 }, { 2, 0.6, 0, false, 0 } };
+	for (int s=0;s<2;s++)
+	{
+		StopAt &stop = stops[s];
+		st_context_t part = MakeTower( 10, nrays );
+		st_sim_checkpoint( part, CheckpointFile, nrays/7 );
+		st_sim_run( part, seed, true, CancelAt, &stop );
+		int npart = st_num_intersections( part );
+		st_free_context( part );
+
+		if ( !stop.Stopped || !FileExists( CheckpointFile ) )
+		{
+			printf("stage %d: the run wasn't interrupted with a checkpoint\n", (int)stop.Stage);
+			nfailed++;
+			continue;
+		}
+
+		st_context_t resumed = MakeTower( 10, nrays );
+		int ok = st_sim_resume( resumed, CheckpointFile, 0, 0 );
+
+		RayRecords res;
+		GetRecords( resumed, res );
+		st_free_context( resumed );
+
+		int ndiff = ok < 0 ? -1 : CompareRecords( ref, res );
+		bool removed = !FileExists( CheckpointFile );
+		printf("stage %d: cancelled at ray %d with %d records, resumed to %d records, %d differ%s\n",
+			(int)stop.Stage, (int)stop.Ray, npart, (int)res.Ray.size(), ndiff,
+			removed ? "" : ", checkpoint left behind");
+
+		if ( ndiff != 0 || !removed )
+			nfailed++;
+	}
+
+	return nfailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+
+/*******************************************************************************************************
+*  Copyright 2018 Alliance for Sustainable Energy, LLC
+*
+*  NOTICE: This software was developed at least in part by Alliance for Sustainable Energy, LLC
+*  ("Alliance") under Contract No. DE-AC36-08GO28308 with the U.S. Department of Energy and the U.S.
+*  The Government retains for itself and others acting on its behalf a nonexclusive, paid-up,
+*  irrevocable worldwide license in the software to reproduce, prepare derivative works, distribute
+*  copies to the public, perform publicly and display publicly, and to permit others to do so.
+*
+*  Redistribution and use in source and binary forms, with or without modification, are permitted
+*  provided that the following conditions are met:
+*
+*  1. Redistributions of source code must retain the above copyright notice, the above government
+*  rights notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright notice, the above government
+*  rights notice, this list of conditions and the following disclaimer in the documentation and/or
+*  other materials provided with the distribution.
+*
+*  3. The entire corresponding source code of any redistribution, with or without modification, by a
+*  research entity, including but not limited to any contracting manager/operator of a United States
+*  National Laboratory, any institution of higher learning, and any non-profit organization, must be
+*  made publicly available under this license for as long as the redistribution is made available by
+*  the research entity.
+*
+*  4. Redistribution of this software, without modification, must refer to the software by the same
+*  designation. Redistribution of a modified version of this software (i) may not refer to the modified
+*  version by the same designation, or by any confusingly similar designation, and (ii) must refer to
+*  the underlying software originally provided by Alliance as "SolTrace". Except to comply with the 
+*  foregoing, the term "SolTrace", or any confusingly similar designation may not be used to refer to 
+*  any modified version of this software or any modified version of the underlying software originally 
+*  provided by Alliance without the prior written consent of Alliance.
+*
+*  5. The name of the copyright holder, contributors, the United States Government, the United States
+*  Department of Energy, or any of their employees may not be used to endorse or promote products
+*  derived from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+*  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+*  FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER,
+*  CONTRIBUTORS, UNITED STATES GOVERNMENT OR UNITED STATES DEPARTMENT OF ENERGY, NOR ANY OF THEIR
+*  EMPLOYEES, BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+*  IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+*  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************************************/
+
+
+// accuracy check of TorusClosedForm against the Root_432 quartic solver it
+// replaced.  random rays are traced against random tori with both, and the
+// hit points and their residuals (distance from the tube surface) compared.
+// returns nonzero if the closed form misses a hit, finds a false one, or
+// lands off the surface
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "procs.h"
+#include "mtrand.h"
+
+void Root_432(int order, double Coeffs[5][5], double RealRoots[5], double *ImRoot1, double *ImRoot2);
+
+// distance of a point from the tube surface, for a torus with its centre at z=Rs
+static double Residual( double Ra, double Rs, double P[3] )
+{
+	double r = sqrt( P[0]*P[0] + P[1]*P[1] ) - Ra;
+	double z = P[2] - Rs;
+	return fabs( sqrt( r*r + z*z ) - Rs );
+}
+
+// the quartic as TorusClosedForm set it up before, solved by Root_432.  the
+// smallest root ahead of the ray is taken, or false if there is none
+static bool Root432Hit( double Ra, double Rs, double Pos[3], double Cos[3], double *PathLength )
+{
+	double Xo = Pos[0], Yo = Pos[1], Zo = Pos[2];
+	double Epsilon = Cos[0], Eta = Cos[1], Rho = Cos[2];
+	double amatrix[5][5];
+	double rvector[5];
+	double imagroot1 = 0.0, imagroot2 = 0.0;
+	int nn = 4;
+
+	for (int i=0;i<5;i++)
+		for (int j=0;j<5;j++)
+			amatrix[i][j] = 0.0;
+
+	amatrix[nn][4] = pow(Epsilon,4)+2.0*Epsilon*Epsilon*(Eta*Eta+Rho*Rho)+
+						pow(Eta,4)+2.0*Eta*Eta*Rho*Rho+pow(Rho,4);
+
+	amatrix[nn][3] = 4.0*(Epsilon*Epsilon+Eta*Eta+Rho*Rho)*(Epsilon*Xo+Eta*Yo+
+						Rho*Zo-Rho*Rs);
+
+	amatrix[nn][2] = Xo*Xo*(6.0*Epsilon*Epsilon+2.0*Eta*Eta+2.0*Rho*Rho)+
+						8.0*Epsilon*Xo*(Eta*Yo+Rho*Zo-Rho*Rs)+
+						2.0*Yo*Yo*(Epsilon*Epsilon+3.0*Eta*Eta+Rho*Rho)+
+						8.0*Eta*Rho*Yo*(Zo-Rs)+
+						(Epsilon*Epsilon+Eta*Eta+3.0*Rho*Rho)*(2.0*Zo*Zo-4.0*Rs*Zo)-
+						2.0*Ra*Ra*(Epsilon*Epsilon+Eta*Eta-Rho*Rho)+4.0*Rho*Rho*Rs*Rs;
+
+	amatrix[nn][1] = 4.0*(Xo*Xo*(Epsilon*Xo+Eta*Yo+Rho*Zo-Rho*Rs)+Yo*Yo*(Epsilon*Xo+
+						Eta*Yo+Rho*Zo-Rho*Rs)+Zo*Zo*(Epsilon*Xo+Eta*Yo+Rho*Zo-3.0*Rho*Rs)-
+						2.0*Epsilon*Rs*Xo*Zo-Epsilon*Ra*Ra*Xo-2.0*Eta*Rs*Yo*Zo-
+						Eta*Ra*Ra*Yo+Rho*Ra*Ra*(Zo-Rs)+2.0*Rho*Rs*Rs*Zo);
+
+	amatrix[nn][0] = pow(Xo,4)+2.0*Xo*Xo*(Yo*Yo+Zo*Zo-2.0*Rs*Zo-Ra*Ra)+
+						pow(Yo,4)+2.0*Yo*Yo*(Zo*Zo-2.0*Rs*Zo-Ra*Ra)+
+						pow(Zo,4)-4.0*Rs*Zo*Zo*Zo+2.0*Ra*Ra*Zo*Zo+4.0*Rs*Rs*Zo*Zo
+						-4.0*Ra*Ra*Rs*Zo+pow(Ra,4);
+
+	Root_432( nn, amatrix, rvector, &imagroot1, &imagroot2 );
+
+	// the real roots are rvector[1-4], [1-2] or [3-4]
+	int first = 1, last = 4;
+	if (imagroot1 == 0.0 && imagroot2 != 0.0)
+		last = 2;
+	else if (imagroot1 != 0.0 && imagroot2 == 0.0)
+		first = 3;
+	else if (imagroot1 != 0.0 && imagroot2 != 0.0)
+		return false;
+
+	bool hit = false;
+	for (int i=first;i<=last;i++)
+	{
+		if (rvector[i] > 0.0 && (!hit || rvector[i] < *PathLength))
+		{
+			*PathLength = rvector[i];
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+int main( int argc, char *argv[] )
+{
+	int nrays = argc > 1 ? atoi( argv[1] ) : 200000;
+	MTRand rng( 3141 );
+
+	TElement elm;
+	int nhits = 0, nrefhits = 0, nmissed = 0, nfalse = 0, noffsurface = 0, nrefoff = 0;
+	double sumres = 0, maxres = 0, sumrefres = 0, maxrefres = 0, maxdiff = 0;
+
+	for (int n=0;n<nrays;n++)
+	{
+		double Ra = 0.5 + 9.5*rng();
+		double Rs = Ra*(0.05 + 0.9*rng());
+		elm.AnnularRadius = Ra;
+		elm.CrossSectionRadius = Rs;
+
+		// from a random direction at 5-500 units, aimed at a random point
+		// around the torus so that about half of the rays hit
+		double dist = 5.0 + 495.0*rng();
+		double u = 2.0*rng() - 1.0, phi = 2.0*M_PI*rng();
+		double Pos[3] = { dist*sqrt(1-u*u)*cos(phi), dist*sqrt(1-u*u)*sin(phi), Rs + dist*u };
+		double Aim[3];
+		for (int k=0;k<3;k++)
+			Aim[k] = (2.0*rng() - 1.0)*(Ra + Rs)*1.2;
+		Aim[2] += Rs;
+
+		double Cos[3], len = 0;
+		for (int k=0;k<3;k++)
+		{
+			Cos[k] = Aim[k] - Pos[k];
+			len += Cos[k]*Cos[k];
+		}
+		for (int k=0;k<3;k++)
+			Cos[k] /= sqrt(len);
+
+		double PosXYZ[3], DFXYZ[3], PathLength = 0;
+		int ErrorFlag = 0;
+		TorusClosedForm( &elm, Pos, Cos, PosXYZ, DFXYZ, &PathLength, &ErrorFlag );
+		bool hit = ErrorFlag == 0;
+
+		double RefLength = 0, RefXYZ[3] = { 0, 0, 0 };
+		bool refhit = Root432Hit( Ra, Rs, Pos, Cos, &RefLength );
+		for (int k=0;k<3;k++)
+			RefXYZ[k] = Pos[k] + RefLength*Cos[k];
+
+		// Root_432 converges to about 1e-6, so its hits are only counted
+		// where they are on the surface to within that
+		double scale = Ra + Rs;
+		double refres = refhit ? Residual( Ra, Rs, RefXYZ )/scale : 0;
+		bool refvalid = refhit && refres < 1e-5;
+		if (refhit)
+		{
+			nrefhits++;
+			sumrefres += refres;
+			if (refres > maxrefres) maxrefres = refres;
+			if (!refvalid) nrefoff++;
+		}
+
+		if (hit)
+		{
+			nhits++;
+			double res = Residual( Ra, Rs, PosXYZ )/scale;
+			sumres += res;
+			if (res > maxres) maxres = res;
+			if (res > 1e-10) noffsurface++;
+
+			if (refvalid)
+			{
+				double diff = 0;
+				for (int k=0;k<3;k++)
+					diff += (PosXYZ[k] - RefXYZ[k])*(PosXYZ[k] - RefXYZ[k]);
+				diff = sqrt( diff )/scale;
+				if (diff > maxdiff) maxdiff = diff;
+
+				// a valid reference hit nearer along the ray is one the closed form skipped
+				if (diff > 1e-4 && RefLength < PathLength)
+					nmissed++;
+			}
+		}
+		else if (refvalid)
+			nmissed++;
+
+		if (hit && !refhit)
+			nfalse++;
+	}
+
+	printf("%d rays: %d hits, %d with Root_432 (%d of them off the surface)\n", nrays, nhits, nrefhits, nrefoff);
+	printf("relative residual: mean %.3g max %.3g, Root_432 mean %.3g max %.3g\n",
+		nhits > 0 ? sumres/nhits : 0.0, maxres, nrefhits > 0 ? sumrefres/nrefhits : 0.0, maxrefres);
+	printf("largest hit point difference to valid Root_432 hits: %.3g\n", maxdiff);
+	printf("missed hits %d, hits Root_432 doesn't find %d, off the surface %d\n", nmissed, nfalse, noffsurface);
+
+	return nmissed > 0 || noffsurface > 0 ? 1 : 0;
+}
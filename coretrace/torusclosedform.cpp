@@ -53,6 +53,107 @@
 #include "types.h"
 #include "procs.h"
 
+//real roots of x^2 + b*x + c = 0, appended to roots[]
+static void QuadraticRoots(double b, double c, double roots[4], int *nroots)
+{
+	double disc = b*b - 4.0*c;
+	if (disc < 0.0)
+		return;
+	
+	//avoid cancellation by taking the larger root first
+	double q = -0.5*(b + (b < 0.0 ? -sqrt(disc) : sqrt(disc)));
+	if (q == 0.0)
+	{
+		roots[(*nroots)++] = 0.0;
+		roots[(*nroots)++] = 0.0;
+		return;
+	}
+	roots[(*nroots)++] = q;
+	roots[(*nroots)++] = c/q;
+}
+
+//largest real root of x^3 + a*x^2 + b*x + c = 0
+static double LargestCubicRoot(double a, double b, double c)
+{
+	double Q = (a*a - 3.0*b)/9.0;
+	double R = (2.0*a*a*a - 9.0*a*b + 27.0*c)/54.0;
+	double x = 0.0;
+
+	if (R*R < Q*Q*Q)
+	{
+		//three real roots, trigonometric form
+		double sq = sqrt(Q);
+		double theta = acos(R/(sq*sq*sq));
+		double x1 = -2.0*sq*cos(theta/3.0) - a/3.0;
+		double x2 = -2.0*sq*cos((theta + 2.0*M_PI)/3.0) - a/3.0;
+		double x3 = -2.0*sq*cos((theta - 2.0*M_PI)/3.0) - a/3.0;
+		x = x1;
+		if (x2 > x) x = x2;
+		if (x3 > x) x = x3;
+	}
+	else
+	{
+		double A = -(R < 0.0 ? -1.0 : 1.0)*cbrt(fabs(R) + sqrt(R*R - Q*Q*Q));
+		x = A + ((A != 0.0) ? Q/A : 0.0) - a/3.0;
+	}
+
+	//polish against round-off in the closed form
+	for (int i=0;i<2;i++)
+	{
+		double f = ((x + a)*x + b)*x + c;
+		double df = (3.0*x + 2.0*a)*x + b;
+		if (df == 0.0) break;
+		x -= f/df;
+	}
+	return x;
+}
+
+//real roots of c[4]*t^4 + c[3]*t^3 + c[2]*t^2 + c[1]*t + c[0] = 0 by Ferrari's method.
+//returns the number of roots placed in roots[]
+static int QuarticRoots(double c[5], double roots[4])
+{
+	int nroots = 0;
+	if (c[4] == 0.0)
+		return 0;
+
+	double a = c[3]/c[4], b = c[2]/c[4], cc = c[1]/c[4], d = c[0]/c[4];
+	
+	//depressed quartic y^4 + p*y^2 + q*y + r = 0 with t = y - a/4
+	double a2 = a*a;
+	double p = b - 3.0*a2/8.0;
+	double q = cc - a*b/2.0 + a2*a/8.0;
+	double r = d - a*cc/4.0 + a2*b/16.0 - 3.0*a2*a2/256.0;
+
+	double m = 0.0;
+	if (q != 0.0)
+		m = LargestCubicRoot(p, p*p/4.0 - r, -q*q/8.0);
+
+	if (m <= 0.0)
+	{
+		//biquadratic, solve for y^2
+		double z[4];
+		int nz = 0;
+		QuadraticRoots(p, r, z, &nz);
+		for (int i=0;i<nz;i++)
+		{
+			if (z[i] < 0.0) continue;
+			roots[nroots++] = sqrt(z[i]);
+			roots[nroots++] = -sqrt(z[i]);
+		}
+	}
+	else
+	{
+		//factor into two quadratics in y
+		double s = sqrt(2.0*m);
+		QuadraticRoots(-s, p/2.0 + m + q/(2.0*s), roots, &nroots);
+		QuadraticRoots(s, p/2.0 + m - q/(2.0*s), roots, &nroots);
+	}
+
+	for (int i=0;i<nroots;i++)
+		roots[i] -= a/4.0;
+
+	return nroots;
+}
 
 void TorusClosedForm(
 			TElement *Element,
@@ -64,118 +165,99 @@ void TorusClosedForm(
 			int *ErrorFlag)
 {
 	double Xo=0.0,Yo=0.0,Zo=0.0,Epsilon=0.0,Eta=0.0,Rho=0.0,Rs=0.0,Ra=0.0,X=0.0,Y=0.0,Z=0.0,Fx=0.0,Fy=0.0,Fz=0.0;
-	double amatrix[5][5];
-	double rvector[5];
-	double imagroot1=0.0,imagroot2=0.0;
-	int nn = 0;
+	double Rb=0.0,S0=0.0,DD=0.0,B=0.0,C=0.0,Disc=0.0,G=0.0,H=0.0,K=0.0;
+	double coeffs[5];
+	double roots[4];
+	int nroots = 0;
 
 	Rs = Element->CrossSectionRadius;
 	Ra = Element->AnnularRadius;
-	Xo = PosLoc[0];
-	Yo = PosLoc[1];
-	Zo = PosLoc[2];
 	Epsilon = CosLoc[0];
 	Eta = CosLoc[1];
 	Rho = CosLoc[2];
-	nn = 4;
 	*ErrorFlag = 0;
+	*PathLength = 0.0;
+
+	//torus (sqrt(x^2+y^2)-Ra)^2 + (z-Rs)^2 = Rs^2, relative to its centre at z=Rs
+	Xo = PosLoc[0];
+	Yo = PosLoc[1];
+	Zo = PosLoc[2] - Rs;
 
-	for (int i=0;i<5;i++)
+	//the torus lies within a sphere of radius Ra+Rs about its centre.  a ray that misses
+	//the sphere misses the torus, and otherwise the quartic is set up from the point where
+	//the ray enters it, which keeps the coefficients well scaled for distant rays
+	Rb = Ra + Rs;
+	DD = Epsilon*Epsilon + Eta*Eta + Rho*Rho;
+	B = (Xo*Epsilon + Yo*Eta + Zo*Rho)/DD;
+	C = (Xo*Xo + Yo*Yo + Zo*Zo - Rb*Rb)/DD;
+	Disc = B*B - C;
+	if (Disc < 0.0 || -B + sqrt(Disc) <= 0.0)
 	{
-		rvector[i] = 0.0;
-		for (int j=0;j<5;j++)
-			amatrix[i][j] = 0.0;
+		*ErrorFlag = 1;    //ray missed torus completely
+		return;
 	}
 
-	amatrix[nn][4] = pow(Epsilon,4)+2.0*Epsilon*Epsilon*(Eta*Eta+Rho*Rho)+
-						pow(Eta,4)+2.0*Eta*Eta*Rho*Rho+pow(Rho,4);
+	S0 = -B - sqrt(Disc);
+	if (S0 < 0.0) S0 = 0.0;
+	Xo += S0*Epsilon;
+	Yo += S0*Eta;
+	Zo += S0*Rho;
 
-	amatrix[nn][3] = 4.0*(Epsilon*Epsilon+Eta*Eta+Rho*Rho)*(Epsilon*Xo+Eta*Yo+
-						Rho*Zo-Rho*Rs);
-	
-	amatrix[nn][2] = Xo*Xo*(6.0*Epsilon*Epsilon+2.0*Eta*Eta+2.0*Rho*Rho)+
-						8.0*Epsilon*Xo*(Eta*Yo+Rho*Zo-Rho*Rs)+
-						2.0*Yo*Yo*(Epsilon*Epsilon+3.0*Eta*Eta+Rho*Rho)+
-						8.0*Eta*Rho*Yo*(Zo-Rs)+
-						(Epsilon*Epsilon+Eta*Eta+3.0*Rho*Rho)*(2.0*Zo*Zo-4.0*Rs*Zo)-
-						2.0*Ra*Ra*(Epsilon*Epsilon+Eta*Eta-Rho*Rho)+4.0*Rho*Rho*Rs*Rs;
-
-	amatrix[nn][1] = 4.0*(Xo*Xo*(Epsilon*Xo+Eta*Yo+Rho*Zo-Rho*Rs)+Yo*Yo*(Epsilon*Xo+
-						Eta*Yo+Rho*Zo-Rho*Rs)+Zo*Zo*(Epsilon*Xo+Eta*Yo+Rho*Zo-3.0*Rho*Rs)-
-						2.0*Epsilon*Rs*Xo*Zo-Epsilon*Ra*Ra*Xo-2.0*Eta*Rs*Yo*Zo-
-						Eta*Ra*Ra*Yo+Rho*Ra*Ra*(Zo-Rs)+2.0*Rho*Rs*Rs*Zo);
-
-	amatrix[nn][0] = pow(Xo,4)+2.0*Xo*Xo*(Yo*Yo+Zo*Zo-2.0*Rs*Zo-Ra*Ra)+
-						pow(Yo,4)+2.0*Yo*Yo*(Zo*Zo-2.0*Rs*Zo-Ra*Ra)+
-						pow(Zo,4)-4.0*Rs*Zo*Zo*Zo+2.0*Ra*Ra*Zo*Zo+4.0*Rs*Rs*Zo*Zo
-						-4.0*Ra*Ra*Rs*Zo+pow(Ra,4);
-
-    Root_432(nn,amatrix,rvector,&imagroot1,&imagroot2);
-
- // {pass results}
-    if (imagroot1==0.0 && imagroot2==0.0)
-    {
-      //four real roots rvector[1-4] which are the pathlengths
-		piksrt(4,rvector); //sort them
-		if (rvector[4] <= 0.0)  //ray heading away from surface
-		{
-			*PathLength = rvector[4];
-			*ErrorFlag = 1;
-			return;
-		}
-		*PathLength = rvector[4];
-		if (rvector[3] <= 0.0 )
-			goto Label_10;
-		else
-			*PathLength = rvector[3];
-			
-		if (rvector[2] <= 0.0 )
-			goto Label_10;
-		else
-			*PathLength = rvector[2];
-			
-		if (rvector[1] <= 0.0 )
-			goto Label_10;
-		else
-			*PathLength = rvector[1];
-			
-		goto Label_10;
-	}
+	//(d.d t^2 + 2 o.d t + o.o + Ra^2 - Rs^2)^2 = 4 Ra^2 ((xo + t dx)^2 + (yo + t dy)^2)
+	G = DD;
+	H = 2.0*(Xo*Epsilon + Yo*Eta + Zo*Rho);
+	K = Xo*Xo + Yo*Yo + Zo*Zo + Ra*Ra - Rs*Rs;
+	coeffs[4] = G*G;
+	coeffs[3] = 2.0*G*H;
+	coeffs[2] = H*H + 2.0*G*K - 4.0*Ra*Ra*(Epsilon*Epsilon + Eta*Eta);
+	coeffs[1] = 2.0*H*K - 8.0*Ra*Ra*(Xo*Epsilon + Yo*Eta);
+	coeffs[0] = K*K - 4.0*Ra*Ra*(Xo*Xo + Yo*Yo);
+
+	nroots = QuarticRoots(coeffs, roots);
 
+	//smallest root ahead of the ray's starting point
+	int ibest = -1;
+	for (int i=0;i<nroots;i++)
+		if (S0 + roots[i] > 0.0 && (ibest < 0 || roots[i] < roots[ibest]))
+			ibest = i;
 
-	if (imagroot1==0.0 && imagroot2!=0.0)
+	if (ibest < 0)
+	{
+		*ErrorFlag = 1;    //ray missed torus completely
+		return;
+	}
+
+	//polish with Newton steps, kept between the neighbouring roots so that it cannot
+	//move onto a different intersection
+	double t = roots[ibest];
+	double lo = -S0, hi = t + fabs(t) + Rb;
+	for (int i=0;i<nroots;i++)
+	{
+		if (i == ibest) continue;
+		if (roots[i] <= t && roots[i] > 2.0*lo - t) lo = 0.5*(roots[i] + t);
+		if (roots[i] >= t && roots[i] < 2.0*hi - t) hi = 0.5*(roots[i] + t);
+	}
+	for (int i=0;i<3;i++)
 	{
-		//two real roots rvector[1-2] which are the pathlengths
-		if (rvector[1] <= rvector[2])
-			*PathLength = rvector[1];
-		else
-			*PathLength = rvector[2];
-		goto Label_10;
+		double f = (((coeffs[4]*t + coeffs[3])*t + coeffs[2])*t + coeffs[1])*t + coeffs[0];
+		double df = ((4.0*coeffs[4]*t + 3.0*coeffs[3])*t + 2.0*coeffs[2])*t + coeffs[1];
+		if (df == 0.0) break;
+		double tn = t - f/df;
+		if (tn <= lo || tn >= hi) break;
+		if (tn == t) break;
+		t = tn;
 	}
 
-    if (imagroot1!=0.0 && imagroot2==0.0)
-    {
-      //two real roots rvector[3-4] which are the pathlengths
-      if (rvector[3] <= rvector[4])
-		*PathLength = rvector[3];
-      else
-		*PathLength = rvector[4];
-		
-      goto Label_10;
-    }
-
-    *PathLength = 0.0;        
-    
-Label_10:
-	if (*PathLength==0.0)   //ray missed torus completely
+	*PathLength = S0 + t;
+	if (*PathLength <= 0.0)
 	{
 		*ErrorFlag = 1;
 		return;
 	}
 	
-	X = Xo+*PathLength*Epsilon;
-	Y = Yo+*PathLength*Eta;
-	Z = Zo+*PathLength*Rho;
+	X = PosLoc[0]+*PathLength*Epsilon;
+	Y = PosLoc[1]+*PathLength*Eta;
+	Z = PosLoc[2]+*PathLength*Rho;
 	Fx = -2.0*X*(Ra-sqrt(X*X+Y*Y))/sqrt(X*X+Y*Y);
 	Fy = -2.0*Y*(Ra-sqrt(X*X+Y*Y))/sqrt(X*X+Y*Y);
 	Fz = 2.0*(Z-Rs);
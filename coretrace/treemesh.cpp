@@ -51,6 +51,7 @@
 #include "treemesh.h"
 #include <math.h>
 #include <algorithm>
+#include <limits>
 
 #include <unordered_map>
 #include <set>
@@ -53,6 +53,16 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <math.h>
+
+#include <algorithm>
+#include <new>
+
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #include "types.h"
 #include "procs.h"
@@ -97,9 +107,354 @@ TOpticalProperties &TOpticalProperties::operator=(const TOpticalProperties &rhs)
 		ReflectivityTable[i].refl = rhs.ReflectivityTable[i].refl;
 	}
 
+	SpectralTable = rhs.SpectralTable;
+
 	return *this;
 }
 
+TFluxTarget::TFluxTarget()
+{
+	StageIdx = ElementIdx = 0;
+	NBinsX = NBinsY = 0;
+	MinX = MaxX = MinY = MaxY = 0;
+	AbsorbedOnly = false;
+	BinSzX = BinSzY = 0;
+	Radius = 0;
+	Reset();
+}
+
+void TFluxTarget::Reset()
+{
+	if ( NBinsX > 0 && NBinsY > 0 )
+	{
+		Grid.resize( NBinsX, NBinsY );
+		Hits.resize( NBinsX, NBinsY );
+	}
+	Grid.fill( 0.0 );
+	Hits.fill( 0.0 );
+
+	RayCount = NotBinned = 0;
+	CentroidSum[0] = CentroidSum[1] = CentroidSum[2] = 0;
+	CentroidCount = 0;
+
+	m_pending = false;
+	m_pendingRay = 0;
+	m_pendingWeight = 0;
+	m_pendingPos[0] = m_pendingPos[1] = m_pendingPos[2] = 0;
+}
+
+void TFluxTarget::Tally( unsigned int raynum, double PosElement[3], double weight, double absorbed )
+{
+	// power is absorbed where each hit deposits it
+	if ( AbsorbedOnly )
+	{
+		if ( absorbed > 0 )
+			Bin( PosElement, absorbed );
+		return;
+	}
+
+	if ( m_pending && m_pendingRay != raynum )
+		Flush();
+
+	m_pending = true;
+	m_pendingRay = raynum;
+	m_pendingWeight = weight;
+	m_pendingPos[0] = PosElement[0];
+	m_pendingPos[1] = PosElement[1];
+	m_pendingPos[2] = PosElement[2];
+}
+
+void TFluxTarget::Flush()
+{
+	if ( !m_pending )
+		return;
+
+	m_pending = false;
+	Bin( m_pendingPos, m_pendingWeight );
+}
+
+void TFluxTarget::Bin( double pos[3], double weight )
+{
+	double x = pos[0];
+	double y = pos[1];
+	double z = pos[2];
+
+	CentroidSum[0] += x;
+	CentroidSum[1] += y;
+	CentroidSum[2] += z;
+	CentroidCount++;
+
+	if ( Radius > 0 )
+	{
+		// unroll the cylinder circumference
+		if ( z <= Radius )
+			x = Radius*asin(x/Radius);
+		else if ( x < 0 )
+			x = -(M_PI*Radius/2.0 + Radius*acos(fabs(x)/Radius));
+		else
+			x = M_PI*Radius/2.0 + Radius*acos(x/Radius);
+	}
+
+	// a bin is open at its lower edge and closed at its upper edge
+	int ix = (int)ceil( (x - MinX)/BinSzX ) - 1;
+	int iy = (int)ceil( (y - MinY)/BinSzY ) - 1;
+
+	if ( ix >= 0 && ix < NBinsX
+		&& iy >= 0 && iy < NBinsY )
+	{
+		Grid.at( ix, iy ) += weight;
+		Hits.at( ix, iy ) += 1;
+		RayCount++;
+	}
+	else
+		NotBinned++;
+}
+
+TSpectrum::TSpectrum()
+{
+}
+
+void TSpectrum::Clear()
+{
+	Wavelength.clear();
+	Irradiance.clear();
+	BandLo.clear();
+	BandHi.clear();
+	AliasProb.clear();
+	Alias.clear();
+}
+
+bool TSpectrum::Setup( int npoints, double *wavelengths, double *irradiance )
+{
+	Clear();
+	if ( npoints < 1 ) return false;
+
+	for (int i=0;i<npoints;i++)
+	{
+		if ( irradiance[i] < 0
+			|| (i > 0 && wavelengths[i] <= wavelengths[i-1]) )
+			return false;
+	}
+
+	int n = npoints;
+	Wavelength.assign( wavelengths, wavelengths+n );
+	Irradiance.assign( irradiance, irradiance+n );
+	BandLo.resize( n );
+	BandHi.resize( n );
+
+	for (int i=0;i<n;i++)
+	{
+		BandLo[i] = i > 0 ? 0.5*(Wavelength[i-1] + Wavelength[i]) : Wavelength[i];
+		BandHi[i] = i < n-1 ? 0.5*(Wavelength[i] + Wavelength[i+1]) : Wavelength[i];
+	}
+
+	// the end bands extend as far outward as they do inward
+	if ( n > 1 )
+	{
+		BandLo[0] = Wavelength[0] - (BandHi[0] - Wavelength[0]);
+		BandHi[n-1] = Wavelength[n-1] + (Wavelength[n-1] - BandLo[n-1]);
+	}
+
+	std::vector<double> w( n );
+	double total = 0;
+	for (int i=0;i<n;i++)
+	{
+		w[i] = n > 1 ? Irradiance[i]*(BandHi[i] - BandLo[i]) : Irradiance[i];
+		total += w[i];
+	}
+
+	if ( total <= 0 )
+	{
+		Clear();
+		return false;
+	}
+
+	// Vose's alias method: each slot keeps its own band with probability
+	// AliasProb and otherwise hands over to Alias, so a draw is O(1)
+	AliasProb.resize( n );
+	Alias.resize( n );
+	std::vector<int> small, large;
+	for (int i=0;i<n;i++)
+	{
+		w[i] *= n/total;
+		Alias[i] = i;
+		if ( w[i] < 1.0 ) small.push_back( i );
+		else large.push_back( i );
+	}
+
+	while ( !small.empty() && !large.empty() )
+	{
+		int s = small.back(); small.pop_back();
+		int l = large.back();
+		AliasProb[s] = w[s];
+		Alias[s] = l;
+		w[l] -= 1.0 - w[s];
+		if ( w[l] < 1.0 )
+		{
+			large.pop_back();
+			small.push_back( l );
+		}
+	}
+
+	// whatever is left over is full up to rounding
+	for (size_t i=0;i<small.size();i++) AliasProb[ small[i] ] = 1.0;
+	for (size_t i=0;i<large.size();i++) AliasProb[ large[i] ] = 1.0;
+
+	return true;
+}
+
+double TSpectrum::Sample( double u1, double u2, int *bin ) const
+{
+	int n = (int)AliasProb.size();
+	double x = u1*n;
+	int i = (int)x;
+	if ( i >= n ) i = n-1;
+
+	int b = ( x - i < AliasProb[i] ) ? i : Alias[i];
+	if ( bin ) *bin = b;
+
+	return BandLo[b] + u2*(BandHi[b] - BandLo[b]);
+}
+
+TAperture::TAperture()
+{
+	Shape = ' ';
+	Ro = Ri = XL = 0;
+	XMin = XMax = YMin = YMax = 0;
+	Limited = false;
+	HalfAngle = 0;
+	for (int i=0;i<4;i++) V[i][0] = V[i][1] = 0;
+}
+
+void TAperture::Setup( TElement *elm )
+{
+	Shape = elm->ShapeIndex;
+	Ro = Ri = XL = 0;
+	XMin = XMax = YMin = YMax = 0;
+	Limited = false;
+	HalfAngle = 0;
+
+	switch( Shape )
+	{
+	case 'c': case 'C':
+		Ro = elm->ParameterA/2.0;
+		break;
+	case 'h': case 'H':
+		Ro = elm->ParameterA/2.0;
+		Ri = Ro*cos(30.0*(ACOSM1O180));
+		XL = sqrt(Ro*Ro - Ri*Ri);
+		break;
+	case 't': case 'T':
+		Ro = elm->ParameterA/2.0;
+		Ri = Ro*sin(30.0*(ACOSM1O180));
+		XL = Ri/cos(30.0*(ACOSM1O180));
+		break;
+	case 'r': case 'R':
+		XMax = elm->ParameterA/2.0;
+		XMin = -XMax;
+		YMax = elm->ParameterB/2.0;
+		YMin = -YMax;
+		break;
+	case 'a': case 'A': // A=B=0 is the torus contour, limited by angle only
+		Limited = !(elm->ParameterA == 0.0 && elm->ParameterB == 0.0);
+		Ri = elm->ParameterA;
+		Ro = elm->ParameterB;
+		HalfAngle = elm->ParameterC*(ACOSM1O180)/2.0;
+		break;
+	case 'l': case 'L': // A=B=0 is the cylinder, limited in y only
+		Limited = !(elm->ParameterA == 0.0 && elm->ParameterB == 0.0);
+		XMin = elm->ParameterA;
+		XMax = elm->ParameterB;
+		YMax = elm->ParameterC/2.0;
+		YMin = -YMax;
+		break;
+	case 'i': case 'I':
+	case 'q': case 'Q':
+		V[0][0] = elm->ParameterA; V[0][1] = elm->ParameterB;
+		V[1][0] = elm->ParameterC; V[1][1] = elm->ParameterD;
+		V[2][0] = elm->ParameterE; V[2][1] = elm->ParameterF;
+		V[3][0] = elm->ParameterG; V[3][1] = elm->ParameterH;
+		break;
+	}
+}
+
+bool TAperture::Contains( double x, double y ) const
+{
+	const double SLOP60 = 1.7320508075688767; // tan(60.0*(ACOSM1O180))
+	double r, Y1;
+
+	switch( Shape )
+	{
+	case 'c': case 'C':
+		r = sqrt(x*x + y*y);
+		return !(r > Ro);
+
+	case 'h': case 'H':
+		r = sqrt(x*x + y*y);
+		if (r > Ro) return false; // outside circumscribed circle
+		if (r <= Ri) return true; // inside inscribed circle
+
+		// otherwise break hexagon into 3 sections
+		if (x <= Ro && x > XL)
+		{
+			Y1 = SLOP60*(x-Ro);
+			return (y >= Y1 && y <= -Y1);
+		}
+		if (x <= XL && x >= -XL)
+			return (y >= -Ri && y <= Ri);
+		if (x < -XL && x >= -Ro)
+		{
+			Y1 = SLOP60*(x+Ro);
+			return (y >= -Y1 && y <= Y1);
+		}
+		return false;
+
+	case 't': case 'T':
+		r = sqrt(x*x + y*y);
+		if (r > Ro) return false;
+		if (r <= Ri) return true;
+
+		if (x <= Ro && x > 0.0)
+			return (y <= -SLOP60*(x-XL) && y >= -Ri);
+		if (x >= -Ro && x <= 0.0)
+			return (y >= -Ri && y <= SLOP60*(x+XL));
+		return false;
+
+	case 'r': case 'R':
+		return !(x > XMax || x < XMin || y > YMax || y < YMin);
+
+	case 'a': case 'A':
+		r = sqrt(x*x + y*y);
+		if (Limited && (r < Ri || r > Ro))
+			return false;
+
+		if (x >= 0.0)
+			return !( asin(y/r) > HalfAngle || asin(y/r) < -HalfAngle );
+		if (x < 0.0)
+		{
+			if ( (y >= 0) && ((acos(y/r)+M_PI/2.0) > HalfAngle) )
+				return false;
+			if ( (y < 0) && ((-acos(-y/r)-M_PI/2.0) < -HalfAngle) )
+				return false;
+			return true;
+		}
+		return false;
+
+	case 'l': case 'L':
+		if (Limited && (x < XMin || x > XMax))
+			return false;
+		return !(y < YMin || y > YMax);
+
+	case 'i': case 'I':
+		return intri( V[0][0], V[0][1], V[1][0], V[1][1], V[2][0], V[2][1], x, y ) != 0;
+
+	case 'q': case 'Q':
+		return inquad( V[0][0], V[0][1], V[1][0], V[1][1], V[2][0], V[2][1], V[3][0], V[3][1], x, y ) != 0;
+	}
+
+	return false;
+}
+
 TElement::TElement()
 {
 	int i, j;
@@ -113,6 +468,13 @@ TElement::TElement()
 	ParameterA=ParameterB=ParameterC=ParameterD=0;
 	ParameterE=ParameterF=ParameterG=ParameterH=0;
 	ApertureArea = 0;
+	NewtonSeed = false;
+	for (i=0;i<5;i++) SeedCoef[i] = 0;
+	for (i=0;i<2;i++)
+	{
+		Bounded[i] = false;
+		BoundMin[i] = BoundMax[i] = 0;
+	}
 	Kappa = 0;
 	VertexCurvX = 0;
 	VertexCurvY = 0;
@@ -127,6 +489,7 @@ TElement::TElement()
 	
 	CubicSplineDYDXbc1 = 0;
 	CubicSplineDYDXbcN = 0;
+	CubicSplineDX = 0;
 	
 	VSHOTRMSSlope = 0;
 	VSHOTRMSScale = 0;
@@ -140,6 +503,14 @@ TElement::TElement()
 
 	Optics = NULL;	
     element_number = -1;        //mjw nonsense
+
+	HitCount = 0;
+	AbsorbedCount = 0;
+	RouletteCount = 0;
+	AbsorbedPower = 0;
+	NewtonCalls = NewtonSteps = NewtonFailures = 0;
+
+	RetainRays = false;
 }
 
 
@@ -170,6 +541,98 @@ void TSun::Reset()
 	MinYSun = 0;
 }
 
+void TSun::SetupShapeCDF()
+{
+	SunShapeCDF.clear();
+	if ( MaxAngle <= 0 || SunShapeAngle.size() < 2 )
+		return;
+
+	// the density of the angle from the sun centre is theta*I(theta), with
+	// the intensity interpolated as the rejection sampling in Errors does
+	const int n = 2000;
+	SunShapeCDF.resize( n+1 );
+	SunShapeCDF[0] = 0;
+	double last = 0;
+	for (int j=1;j<=n;j++)
+	{
+		double theta = MaxAngle*j/n;
+		size_t i = 0;
+		while ( i < SunShapeAngle.size()-1 && SunShapeAngle[i] < theta )
+			i++;
+
+		double intensity = SunShapeIntensity[i];
+		if ( i > 0 )
+			intensity = SunShapeIntensity[i-1] + (SunShapeIntensity[i] - SunShapeIntensity[i-1])
+				*(theta - SunShapeAngle[i-1])/(SunShapeAngle[i] - SunShapeAngle[i-1]);
+
+		double density = theta*std::max( intensity, 0.0 );
+		SunShapeCDF[j] = SunShapeCDF[j-1] + 0.5*(last + density);
+		last = density;
+	}
+
+	if ( SunShapeCDF[n] <= 0 )
+	{
+		SunShapeCDF.clear();
+		return;
+	}
+
+	for (int j=1;j<=n;j++)
+		SunShapeCDF[j] /= SunShapeCDF[n];
+}
+
+static inline unsigned int ReverseBits( unsigned int x )
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// a random permutation of the bits of x where each bit only depends on the
+// bits below it (Laine and Karras), applied to the reversed bits so that it
+// scrambles from the most significant digit down, as Owen scrambling does
+static inline unsigned int OwenScramble( unsigned int x, unsigned int seed )
+{
+	x = ReverseBits( x );
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return ReverseBits( x );
+}
+
+static inline unsigned int HashCombine( unsigned int seed, unsigned int v )
+{
+	return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+TSobolSampler::TSobolSampler( unsigned int seed )
+{
+	Seed = seed;
+}
+
+void TSobolSampler::Point( st_uint_t index, unsigned int pair, double u[2] ) const
+{
+	unsigned int seed = HashCombine( Seed, 0x9e3779b9u*(pair+1) );
+	unsigned int i = OwenScramble( (unsigned int)index, seed );
+
+	// the first Sobol dimension is the bit reversed index, and the second
+	// has direction numbers v(k+1) = v(k) ^ v(k)>>1 from the top bit down
+	unsigned int x = ReverseBits( i );
+	unsigned int y = 0;
+	for (unsigned int v=0x80000000u; i; i >>= 1, v ^= v >> 1)
+		if ( i & 1 )
+			y ^= v;
+
+	x = OwenScramble( x, HashCombine( seed, 1 ) );
+	y = OwenScramble( y, HashCombine( seed, 2 ) );
+
+	u[0] = x*(1.0/4294967296.0);
+	u[1] = y*(1.0/4294967296.0);
+}
+
 
 /*
  // Small program to test TRayData memory block allocation scheme
@@ -216,10 +679,108 @@ int main(int argc, char *argv[])
 
 
 
+TRayData::BlockPool::BlockPool()
+{
+	HugePages = false;
+}
+
+TRayData::BlockPool::~BlockPool()
+{
+	Purge();
+}
+
+bool TRayData::BlockPool::AllocSlab( size_t nblocks )
+{
+	size_t bytes = nblocks * sizeof(block_t);
+	void *p = 0;
+
+#ifdef WIN32
+	p = _aligned_malloc( bytes, 64 );
+#else
+	// huge pages are 2MB, so align the slab to that and round it up
+	size_t align = 64;
+	if (HugePages)
+	{
+		align = 2*1024*1024;
+		bytes = (bytes + align - 1) / align * align;
+	}
+
+	if ( posix_memalign( &p, align, bytes ) != 0 )
+		p = 0;
+
+#ifdef MADV_HUGEPAGE
+	if ( p != 0 && HugePages )
+		madvise( p, bytes, MADV_HUGEPAGE );
+#endif
+#endif
+
+	if (p == 0)
+		return false;
+
+	m_slabs.push_back( p );
+	block_t *blocks = (block_t*)p;
+	m_free.reserve( m_free.size() + nblocks );
+	for (size_t i=nblocks;i>0;i--)
+		m_free.push_back( &blocks[i-1] );
+
+	return true;
+}
+
+TRayData::block_t *TRayData::BlockPool::Acquire()
+{
+	if (m_free.size() == 0)
+	{
+		// grow by a few blocks at a time, enough to fill a huge page
+		if ( !AllocSlab( HugePages ? 16 : 4 ) )
+			throw std::bad_alloc();
+	}
+
+	block_t *b = m_free.back();
+	m_free.pop_back();
+	b->count = 0;
+	return b;
+}
+
+void TRayData::BlockPool::Release( block_t *b )
+{
+	m_free.push_back( b );
+}
+
+bool TRayData::BlockPool::Reserve( st_uint_t nrays )
+{
+	// a large reservation is made of several slabs rather than one
+	// allocation that has to be contiguous
+	st_uint_t nblocks = (nrays + block_size - 1) / block_size;
+	while (nblocks > m_free.size())
+	{
+		size_t n = (size_t)std::min( nblocks - m_free.size(), (st_uint_t)max_slab_blocks );
+		if ( !AllocSlab( n ) )
+			return false;
+	}
+	return true;
+}
+
+void TRayData::BlockPool::Purge()
+{
+	for (size_t i=0;i<m_slabs.size();i++)
+	{
+#ifdef WIN32
+		_aligned_free( m_slabs[i] );
+#else
+		free( m_slabs[i] );
+#endif
+	}
+	m_slabs.clear();
+	m_free.clear();
+}
+
 TRayData::TRayData()
 {
+	m_pool = 0;
 	m_dataCount = 0;
 	m_dataCapacity = 0;
+	m_packed = true;
+	m_lastBlock = 0;
 }
 
 TRayData::~TRayData()
@@ -231,15 +792,17 @@ TRayData::ray_t *TRayData::Append( double pos[3],
 				 double cos[3],
 				 int element,
 				 int stage,
-				 unsigned int raynum )
+				 unsigned int raynum,
+				 double weight,
+				 double absorbed )
 {
 	if (m_dataCount == m_dataCapacity)
 	{
 		// need to allocate more blocks
-		block_t *b = new block_t;
-		b->count = 0;
+		block_t *b = NewBlock();
 		m_blockList.push_back( b );
-		m_dataCapacity += block_size;
+		m_blockStart.push_back( m_dataCount );
+		m_dataCapacity = m_dataCount + block_size;
 	}
 
 	ray_t *r = Index( m_dataCount, true );
@@ -250,6 +813,8 @@ TRayData::ray_t *TRayData::Append( double pos[3],
 		r->element = element;
 		r->stage = stage;
 		r->raynum = raynum;
+		r->weight = (float)weight;
+		r->absorbed = (float)absorbed;
 		m_dataCount++;
 		return r;
 	}
@@ -282,7 +847,9 @@ bool TRayData::Query( unsigned int idx,
 				double cos[3],
 				int *element,
 				int *stage,
-				unsigned int *raynum)
+				unsigned int *raynum,
+				double *weight,
+				double *absorbed)
 {
 	ray_t *r = Index( idx, false );
 	if ( r != 0 )
@@ -292,6 +859,8 @@ bool TRayData::Query( unsigned int idx,
 		if (element) *element = r->element;
 		if (stage) *stage = r->stage;
 		if (raynum) *raynum = r->raynum;
+		if (weight) *weight = r->weight;
+		if (absorbed) *absorbed = r->absorbed;
 		return true;
 	}
 	else
@@ -301,57 +870,84 @@ bool TRayData::Query( unsigned int idx,
 
 void TRayData::Merge( TRayData &src )
 {
-	std::vector<block_t*> list, partial_blocks;
-	size_t i;
-
-	list.reserve( m_blockList.size() + src.m_blockList.size() );
-
-	for (i=0;i<m_blockList.size();i++)
+	// take over the source blocks rather than copying the records,
+	// so merging is independent of the number of records.  partially
+	// filled blocks can end up in the middle of the list, after which
+	// records are located via the block start indices
+	if (src.m_pool != m_pool)
 	{
-		if (m_blockList[i]->count == block_size)
-			list.push_back( m_blockList[i] );
-		else
-			partial_blocks.push_back( m_blockList[i] );
+		// blocks can only change hands within the same pool
+		for (st_uint_t i=0;i<src.Count();i++)
+		{
+			ray_t *r = src.Index( i, false );
+			Append( r->pos, r->cos, r->element, r->stage, r->raynum, r->weight, r->absorbed );
+		}
+		src.Clear();
+		return;
 	}
 
-	for (i=0;i<src.m_blockList.size();i++)
+	for (size_t i=0;i<src.m_blockList.size();i++)
 	{
-		if (src.m_blockList[i]->count == block_size)
-			list.push_back( src.m_blockList[i] );
-		else
-			partial_blocks.push_back( src.m_blockList[i] );
+		block_t *b = src.m_blockList[i];
+		if (b->count == 0)
+		{
+			FreeBlock( b );
+			continue;
+		}
+
+		if (m_blockList.size() > 0 && m_blockList.back()->count < block_size)
+			m_packed = false;
+
+		m_blockList.push_back( b );
+		m_blockStart.push_back( m_dataCount );
+		m_dataCount += b->count;
 	}
 
+	if (m_blockList.size() > 0)
+		m_dataCapacity = m_blockStart.back() + block_size;
+
 	src.m_blockList.clear();
+	src.m_blockStart.clear();
 	src.m_dataCount = 0;
 	src.m_dataCapacity = 0;
+	src.m_packed = true;
+	src.m_lastBlock = 0;
+}
 
-	m_blockList = list;
-	m_dataCapacity = m_dataCount = m_blockList.size() * block_size;
+void TRayData::SetPool( BlockPool *pool )
+{
+	if (pool == m_pool)
+		return;
 
-	// append all the data in the partial blocks
+	Clear();
+	m_pool = pool;
+}
 
-	for (i=0;i<partial_blocks.size();i++)
-	{
-		block_t *b = partial_blocks[i];
-		for (size_t j=0;j<b->count;j++)
-		{
-			ray_t &r = b->data[j];
-			Append( r.pos, r.cos, r.element, r.stage, r.raynum );
-		}
+TRayData::block_t *TRayData::NewBlock()
+{
+	block_t *b = m_pool ? m_pool->Acquire() : new block_t;
+	b->count = 0;
+	return b;
+}
 
+void TRayData::FreeBlock( block_t *b )
+{
+	if (m_pool)
+		m_pool->Release( b );
+	else
 		delete b;
-	}
-	partial_blocks.clear();
 }
 
 void TRayData::Clear()
 {
 	for (size_t i=0;i<m_blockList.size();i++)
-		delete m_blockList[i];
+		FreeBlock( m_blockList[i] );
 	m_blockList.clear();
+	m_blockStart.clear();
 	m_dataCount = 0;
 	m_dataCapacity = 0;
+	m_packed = true;
+	m_lastBlock = 0;
 }
 
 st_uint_t TRayData::Count()
@@ -364,13 +960,41 @@ TRayData::ray_t *TRayData::Index(st_uint_t i, bool write_access)
 	if (i >= m_dataCapacity)
 		return 0;
 
-	size_t block_num = i / block_size;
-	size_t block_idx = i % block_size;
+	size_t block_num, block_idx;
+	if (m_packed)
+	{
+		block_num = i / block_size;
+		block_idx = i % block_size;
+	}
+	else
+	{
+		// sequential access stays in the last accessed block
+		// or moves on to the next one, otherwise search for it
+		block_num = m_lastBlock < m_blockList.size() ? m_lastBlock : 0;
+		size_t nblocks = m_blockStart.size();
+		if ( i < m_blockStart[block_num]
+			|| (block_num+1 < nblocks && i >= m_blockStart[block_num+1]) )
+		{
+			if ( block_num+1 < nblocks && i >= m_blockStart[block_num+1]
+				&& (block_num+2 >= nblocks || i < m_blockStart[block_num+2]) )
+				block_num++;
+			else
+				block_num = (std::upper_bound( m_blockStart.begin(), m_blockStart.end(), i ) - m_blockStart.begin()) - 1;
+		}
+
+		m_lastBlock = block_num;
+		block_idx = i - m_blockStart[block_num];
+	}
 
 	if (block_num >= m_blockList.size()
 		 || block_idx >= block_size )
 		return 0;
 
+	// only the last block can grow
+	if (write_access && block_num+1 < m_blockList.size()
+		&& block_idx >= m_blockList[block_num]->count)
+		return 0;
+
 	// update block.count to highest accessed index
 	block_t *b = m_blockList[block_num];
 
@@ -418,6 +1042,9 @@ TStage::TStage()
 	MultiHitsPerRay = true;
 	Virtual = false;
 	TraceThrough = false;
+	MissCount = 0;
+	BoundTests = BoundRejects = 0;
+	RetainRays = false;
 }
 
 TStage::~TStage()
@@ -435,6 +1062,20 @@ TSystem::TSystem()
 	sim_raymax=100000;
 	sim_errors_sunshape=true;
 	sim_errors_optical=true;
+	sim_weighted=false;
+	sim_roulette_weight=0.1;
+	sim_sampling=ST_SAMPLE_RANDOM;
+	sim_retention=ST_RETAIN_ALL;
+	sim_retain_every=1;
+	sim_checkpoint_every=0;
+	sim_converge_metrics=ST_CONVERGE_INTERCEPT;
+	sim_converge_tol=0.01;
+	sim_converge_seconds=0;
+	sim_converge_batches=0;
+
+	ConvergeBatches = 0;
+	for (int i=0;i<3;i++)
+		ConvergeValue[i] = ConvergeError[i] = 0;
 }
 
 TSystem::~TSystem()
@@ -442,6 +1083,10 @@ TSystem::~TSystem()
 	for (st_uint_t i=0;i<StageList.size();i++)
 		delete StageList[i];
 	StageList.clear();
+
+	for (st_uint_t i=0;i<FluxTargets.size();i++)
+		delete FluxTargets[i];
+	FluxTargets.clear();
 }
 
 void TSystem::ClearAll()
@@ -453,6 +1098,10 @@ void TSystem::ClearAll()
 	for (st_uint_t i=0;i<StageList.size();i++)
 		delete StageList[i];
 	StageList.clear();
+
+	for (st_uint_t i=0;i<FluxTargets.size();i++)
+		delete FluxTargets[i];
+	FluxTargets.clear();
 }
 
 void TSystem::errlog(const char *fmt, ...)
@@ -95,6 +95,11 @@ public:
 	bool UseReflectivityTable;
 	struct refldat { double angle; double refl; };
 	std::vector<refldat> ReflectivityTable;
+
+	// wavelength-dependent reflectivity and transmissivity, used in
+	// place of the scalars above when the system traces a spectrum
+	struct specdat { double wavelength; double refl; double trans; };
+	std::vector<specdat> SpectralTable;
 };
 
 class TOpticalPropertySet
@@ -105,6 +110,87 @@ public:
 	TOpticalProperties Back;	
 };
 
+struct TFluxTarget
+{
+	TFluxTarget();
+
+	void Reset();
+	void Tally( unsigned int raynum, double PosElement[3], double weight, double absorbed );
+	void Flush();
+
+	int StageIdx;
+	int ElementIdx;
+	int NBinsX;
+	int NBinsY;
+	double MinX, MaxX;
+	double MinY, MaxY;
+	bool AbsorbedOnly;
+
+	// calculated
+	double BinSzX, BinSzY;
+	double Radius; // cylinder radius, if binned around the circumference
+
+	// accumulated during the trace.  bins sum the ray weights (the absorbed
+	// share of them for AbsorbedOnly), which are 1 unless rays are weighted,
+	// and Hits counts the rays binned into each
+	HPM2D Grid;
+	HPM2D Hits;
+	st_uint_t RayCount;
+	st_uint_t NotBinned;
+	double CentroidSum[3];
+	st_uint_t CentroidCount;
+
+private:
+	// only the last intersection of a ray with the element is binned,
+	// so a hit is held here until the ray has moved on
+	void Bin( double pos[3], double weight );
+	bool m_pending;
+	unsigned int m_pendingRay;
+	double m_pendingWeight;
+	double m_pendingPos[3];
+};
+
+struct TSpectrum
+{
+	TSpectrum();
+
+	bool Setup( int npoints, double *wavelengths, double *irradiance );
+	void Clear();
+	int Bins() const { return (int)Wavelength.size(); }
+	double Sample( double u1, double u2, int *bin ) const;
+
+	std::vector<double> Wavelength; // table points in increasing order, nm
+	std::vector<double> Irradiance; // spectral irradiance at each point
+
+	// calculated - each point owns the band out to the midpoints of its
+	// neighbours, and bands are drawn from an alias table weighted by
+	// their share of the total irradiance
+	std::vector<double> BandLo, BandHi;
+	std::vector<double> AliasProb;
+	std::vector<int> Alias;
+};
+
+struct TElement;
+
+// aperture shape of an element with its derived constants, so that the
+// aperture plane test in Intersect and the hit point test after it share
+// one containment check
+struct TAperture
+{
+	TAperture();
+
+	void Setup( TElement *elm );
+	bool Contains( double x, double y ) const;
+
+	char Shape;
+	double Ro, Ri; // circumscribed and inscribed radius, or annulus outer and inner radius
+	double XL; // hexagon section boundary, or triangle apex offset
+	double XMin, XMax, YMin, YMax;
+	bool Limited; // annulus radii or trough x-limits apply (not for torus and cylinder)
+	double HalfAngle; // annulus half angle, radians
+	double V[4][2]; // irregular triangle and quadrilateral vertices
+};
+
 struct TElement
 {
 	TElement();
@@ -133,7 +219,16 @@ struct TElement
 	
 	double ApertureArea; // calculated
 	double ZAperture; // calculated 
-	
+
+	// calculated - extent of the aperture along the element x and y axes.
+	// every hit lies inside it whatever the surface, so together they bound
+	// the element by a box that is open along its z axis
+	bool Bounded[2];
+	double BoundMin[2];
+	double BoundMax[2];
+
+	TAperture Aperture; // calculated
+
 	/////////// SURFACE PARAMETERS ///////////////
 	char SurfaceIndex;
 	int SurfaceType; // calculated
@@ -149,6 +244,12 @@ struct TElement
 	double CurvOfRev;
 		
 	int FitOrder;
+
+	// calculated - least squares paraboloid z = c0 + c1*x + c2*y + (c3*x^2 + c4*y^2)/2
+	// through a measured or polynomial surface.  its closed form hit with the
+	// ray is the starting point for the Newton-Raphson intersection
+	bool NewtonSeed;
+	double SeedCoef[5];
 	
 
 	// Zernike (*.mon) monomial coeffs
@@ -162,6 +263,8 @@ struct TElement
 	std::vector< double > CubicSplineXData;
 	std::vector< double > CubicSplineYData; 
 	std::vector< double > CubicSplineY2Data;   
+	std::vector< double > CubicSplineCoef; // calculated - segment cubics from SplineCoeffs
+	double CubicSplineDX; // calculated - knot spacing if uniform, else 0
 	double CubicSplineDYDXbc1;
 	double CubicSplineDYDXbcN;
 	
@@ -183,12 +286,26 @@ struct TElement
 
 	std::string Comment;	
     int element_number;     //mjw element number in the stage - unique ID in order of addition to element list
+
+	std::vector<TFluxTarget*> FluxTargets; // calculated - targets binning hits on this element
+
+	st_uint_t HitCount; // calculated - intersections recorded on this element in the last trace
+	st_uint_t AbsorbedCount; // calculated - intersections where the ray was absorbed
+	st_uint_t RouletteCount; // calculated - weighted rays ended by the roulette here, not absorbed
+	st_uint_t NewtonCalls; // calculated - iterative intersections attempted in the last trace
+	st_uint_t NewtonSteps; // calculated - surface evaluations taken by them
+	st_uint_t NewtonFailures; // calculated - iterative intersections that did not converge
+	double AbsorbedPower; // calculated - ray weight absorbed on this element (one per absorbed ray unless weighted)
+	std::vector<double> SpectralAbsorbed; // calculated - absorbed ray weight per spectrum band
+
+	bool RetainRays; // keep ray records on this element when retention is ST_RETAIN_SELECTED
 };
 
 struct TSun
 {
 	TSun();
 	void Reset();
+	void SetupShapeCDF();
 	
 	char ShapeIndex;	
 	double Sigma;
@@ -214,14 +331,28 @@ struct TSun
 	double MaxXSun;
 	double MinYSun;
 	double MaxYSun;
+
+	// radial distribution of the data sunshape, cumulative on a uniform
+	// grid from 0 to MaxAngle, for drawing angles by inversion
+	std::vector<double> SunShapeCDF;
+};
+
+// scrambled Sobol points for low-discrepancy sampling of the sun rays.  each
+// pair of dimensions is the first two Sobol dimensions with the point index
+// shuffled, which keeps the pairs independent of each other, and every
+// coordinate is Owen scrambled with a hash keyed by the seed (Burley,
+// "Practical Hash-based Owen Scrambling", JCGT 2020)
+struct TSobolSampler
+{
+	TSobolSampler( unsigned int seed );
+	void Point( st_uint_t index, unsigned int pair, double u[2] ) const;
+
+	unsigned int Seed;
 };
 
 class TRayData
 {
 public:
-	TRayData();
-	~TRayData();
-
 	struct ray_t
 	{
 		double pos[3];
@@ -229,13 +360,59 @@ public:
 		int element;
 		int stage;
 		unsigned int raynum;
+		float weight; // power carried by the ray on arrival
+		float absorbed; // power the ray left on the element, all of its weight if it was absorbed
 	};
 
+private:
+	static const unsigned int block_size = 8192;
+
+	struct block_t
+	{
+		ray_t data[block_size];
+		st_uint_t count;
+	};
+
+public:
+	// keeps ray data blocks for reuse instead of returning them to the
+	// system, so repeated runs in one context work in memory that is
+	// already mapped.  blocks are carved out of larger slabs, which can
+	// optionally be backed by transparent huge pages.  one pool is shared
+	// by all the ray data of a context (see TSystem::RayBlocks)
+	class BlockPool
+	{
+	public:
+		BlockPool();
+		~BlockPool();
+
+		block_t *Acquire();
+		void Release( block_t *b );
+		bool Reserve( st_uint_t nrays ); // make sure at least this many records fit in the free blocks, false if out of memory
+		void Purge(); // free all memory, only when no ray data holds blocks from this pool
+
+		bool HugePages;
+
+	private:
+		static const size_t max_slab_blocks = 64; // slabs grow the pool by at most this much at a time
+
+		bool AllocSlab( size_t nblocks );
+
+		std::vector<block_t*> m_free;
+		std::vector<void*> m_slabs;
+	};
+
+	TRayData();
+	~TRayData();
+
+	void SetPool( BlockPool *pool );
+
 	ray_t *Append( double pos[3],
 					 double cos[3],
 					 int element,
 					 int stage,
-					 unsigned int raynum );
+					 unsigned int raynum,
+					 double weight = 1.0,
+					 double absorbed = 0.0 );
 
 	bool Overwrite( unsigned int idx,
 					double pos[3],
@@ -249,9 +426,11 @@ public:
 					double cos[3],
 					int *element,
 					int *stage,
-					unsigned int *raynum);
+					unsigned int *raynum,
+					double *weight = 0,
+					double *absorbed = 0);
 
-	void Merge( TRayData &dest );
+	void Merge( TRayData &src );
 
 	void Clear();
 
@@ -262,18 +441,16 @@ public:
 	ray_t *Index(st_uint_t i, bool write_access);
 
 private:
-	static const unsigned int block_size = 8192;
-
-
-	struct block_t
-	{
-		ray_t data[block_size];
-		st_uint_t count;
-	};
+	block_t *NewBlock();
+	void FreeBlock( block_t *b );
 
+	BlockPool *m_pool;
 	std::vector<block_t*> m_blockList;
+	std::vector<st_uint_t> m_blockStart; // index of the first record in each block
 	st_uint_t m_dataCount;
 	st_uint_t m_dataCapacity;
+	bool m_packed; // all blocks but the last are full, so blocks can be found by division
+	size_t m_lastBlock; // last block accessed, for sequential access after a merge
 };
 
 
@@ -298,6 +475,11 @@ struct TStage
 	double RLocToRef[3][3];
 	
 	TRayData RayData;
+	st_uint_t MissCount; // calculated - rays recorded as missing all elements in the last trace
+	st_uint_t BoundTests; // calculated - ray/element bound tests in the last trace
+	st_uint_t BoundRejects; // calculated - tests that ruled out a hit without intersecting
+
+	bool RetainRays; // keep all ray records on this stage when retention is ST_RETAIN_SELECTED
 };
 
 struct TSystem
@@ -310,6 +492,8 @@ struct TSystem
 	TSun Sun;
 	std::vector<TOpticalPropertySet*> OpticsList;
 	std::vector<TStage*> StageList;
+	std::vector<TFluxTarget*> FluxTargets;
+	TSpectrum Spectrum; // empty unless tracing a spectrum
 
 
 	// system simulation context data
@@ -317,10 +501,27 @@ struct TSystem
 	int sim_raymax;
 	bool sim_errors_sunshape;
 	bool sim_errors_optical;
+	bool sim_weighted; // rays carry power, attenuated at each interaction
+	double sim_roulette_weight; // weighted rays below this play Russian roulette
+	int sim_sampling; // ST_SAMPLE_RANDOM, ST_SAMPLE_SOBOL or ST_SAMPLE_STRATIFIED
+	int sim_retention;
+	st_uint_t sim_retain_every;
+	std::string sim_checkpoint_file;
+	st_uint_t sim_checkpoint_every;
+	std::string sim_replay_file; // first stage saved here for st_sim_replay
+	int sim_converge_metrics; // ST_CONVERGE_* flags st_sim_run_converged waits for
+	double sim_converge_tol; // relative standard error to reach
+	double sim_converge_seconds; // time budget, 0 for none
+	int sim_converge_batches; // most batches to trace, 0 for no limit
+	std::vector< std::pair<st_uint_t,st_uint_t> > sim_converge_elements; // stage/element indices for ST_CONVERGE_ABSORBED
 
 	// simulation outputs
+	TRayData::BlockPool RayBlocks; // must outlive the ray data using it
 	TRayData AllRayData;
 	st_uint_t SunRayCount;
+	st_uint_t ConvergeBatches; // batches traced by the last st_sim_run_converged
+	double ConvergeValue[3]; // the metrics it reached, in the order of the ST_CONVERGE_* flags
+	double ConvergeError[3]; // and their relative standard errors
 
 	std::vector<std::string> messages;
 